@@ -46,6 +46,12 @@ extern "C" {
 #include "common/sendpacket.h"
 #include "common/interface.h"
 #include "common/flows.h"
+#include "common/capfile.h"
+#include "common/directio.h"
+#include "common/capindex.h"
+#include "common/uring.h"
+#include "common/vnet.h"
+#include "common/txstamp.h"
 
 const char *git_version(void); /* git_version.c */
 
@@ -0,0 +1,1089 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2016 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Native reader for pcap and pcapng capture files, so that tcpreplay
+ * doesn't depend on the pcapng support of the installed libpcap, and
+ * can see the capture interface and the full resolution timestamp of
+ * each packet.
+ *
+ * Regular files are mapped a window at a time, and packets are handed
+ * out where they lie. The mapping is private, so packets may be edited
+ * without changing the file, and it moves on through the file so pages
+ * which were edited don't pile up. Pipes are read into a buffer which
+ * grows to hold the largest block.
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include "capfile.h"
+#include "decompress.h"
+#include "directio.h"
+
+#if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H
+#define CAPFILE_MMAP
+#endif
+
+/* how much of a file to map at a time */
+#define CAPFILE_MAP_WINDOW      (64 * 1024 * 1024)
+
+/* initial size of the buffer used for pipes */
+#define CAPFILE_BUF_SIZE        (1024 * 1024)
+
+/* refuse records larger than this rather than trying to buffer them */
+#define CAPFILE_MAX_RECORD      (64 * 1024 * 1024)
+
+/* classic pcap */
+#define PCAP_MAGIC_USEC         0xa1b2c3d4
+#define PCAP_MAGIC_NSEC         0xa1b23c4d
+#define PCAP_FILE_HDR_LEN       24
+#define PCAP_REC_HDR_LEN        16
+
+/* pcapng block types */
+#define PCAPNG_SHB              0x0a0d0d0a
+#define PCAPNG_IDB              0x00000001
+#define PCAPNG_OPB              0x00000002
+#define PCAPNG_SPB              0x00000003
+#define PCAPNG_EPB              0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+
+/* interface description block options */
+#define PCAPNG_OPT_END          0
+#define PCAPNG_OPT_TSRESOL      9
+#define PCAPNG_OPT_TSOFFSET     14
+
+/* snaplen which libpcap reports for "unlimited" */
+#define CAPFILE_MAX_SNAPLEN     262144
+
+typedef struct capfile_intf_s {
+    int linktype;
+    uint32_t snaplen;
+    uint8_t ts_exp;                 /* resolution is 10^-ts_exp or 2^-ts_exp */
+    bool ts_binary;
+    int64_t ts_offset;              /* seconds added to timestamps */
+} capfile_intf_t;
+
+struct capfile_s {
+    char *path;
+    capfile_format_t format;
+    int fd;
+    off_t off;                      /* file offset of the next record */
+    bool swapped;
+    bool nsec;                      /* classic pcap with nanoseconds */
+    int linktype;
+    uint32_t snaplen;
+
+    /* pcapng interfaces of the current section */
+    capfile_intf_t *intfs;
+    uint32_t intf_cnt;
+    uint32_t intf_alloc;
+    COUNTER skipped;                /* packets with another link type */
+    COUNTER late_headers;           /* section/interface blocks after the first packet */
+
+#ifdef CAPFILE_MMAP
+    /* mapped window of a regular file */
+    bool mapped;
+    off_t size;
+    u_char *map;
+    off_t map_off;
+    size_t map_len;
+#endif
+
+    decompress_t *dc;               /* compressed file */
+    directio_t *dio;                /* read with O_DIRECT */
+    int dio_depth;
+
+    /* read buffer, holds the bytes from 'off' at buf + pos */
+    u_char *buf;
+    size_t buf_size;
+    size_t pos;
+    size_t end;
+    bool eof;
+
+    pcap_t *pcap;                   /* CAPFILE_LIBPCAP */
+    char errbuf[PCAP_ERRBUF_SIZE];
+};
+
+static const uint64_t pow10_tbl[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+};
+
+static inline uint16_t
+cf_u16(const capfile_t *cf, const u_char *p)
+{
+    uint16_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return cf->swapped ? SWAPSHORT(v) : v;
+}
+
+static inline uint32_t
+cf_u32(const capfile_t *cf, const u_char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return cf->swapped ? SWAPLONG(v) : v;
+}
+
+static inline uint64_t
+cf_u64(const capfile_t *cf, const u_char *p)
+{
+    uint32_t w[2];
+
+    memcpy(w, p, sizeof(w));
+    if (cf->swapped)
+        return ((uint64_t)SWAPLONG(w[0]) << 32) | SWAPLONG(w[1]);
+
+#ifdef WORDS_BIGENDIAN
+    return ((uint64_t)w[0] << 32) | w[1];
+#else
+    return ((uint64_t)w[1] << 32) | w[0];
+#endif
+}
+
+#ifdef CAPFILE_MMAP
+/**
+ * maps the window of the file holding 'len' bytes at cf->off
+ */
+static u_char *
+map_window(capfile_t *cf, size_t len)
+{
+    static long page_size;
+    off_t base;
+    size_t want;
+    void *map;
+
+    if (page_size == 0)
+        page_size = sysconf(_SC_PAGESIZE);
+
+    if (cf->map != NULL)
+        munmap(cf->map, cf->map_len);
+    cf->map = NULL;
+
+    base = cf->off & ~(off_t)(page_size - 1);
+    want = (size_t)(cf->off - base) + len;
+    if (want < CAPFILE_MAP_WINDOW)
+        want = CAPFILE_MAP_WINDOW;
+    if ((off_t)want > cf->size - base)
+        want = (size_t)(cf->size - base);
+
+    map = mmap(NULL, want, PROT_READ | PROT_WRITE, MAP_PRIVATE, cf->fd, base);
+    if (map == MAP_FAILED) {
+        snprintf(cf->errbuf, sizeof(cf->errbuf), "unable to map %s: %s",
+                cf->path, strerror(errno));
+        return NULL;
+    }
+
+#ifdef MADV_SEQUENTIAL
+    madvise(map, want, MADV_SEQUENTIAL);
+#endif
+
+    cf->map = map;
+    cf->map_off = base;
+    cf->map_len = want;
+    return cf->map + (cf->off - base);
+}
+#endif
+
+/**
+ * returns 'len' bytes from the current position, or NULL at the end
+ * of the file. Sets the error if the file ends part way.
+ */
+static u_char *
+cf_peek(capfile_t *cf, size_t len)
+{
+    ssize_t ret;
+
+#ifdef CAPFILE_MMAP
+    if (cf->mapped) {
+        if (cf->off + (off_t)len > cf->size) {
+            if (cf->off < cf->size)
+                snprintf(cf->errbuf, sizeof(cf->errbuf), "%s is truncated", cf->path);
+            return NULL;
+        }
+
+        if (cf->map == NULL || cf->off < cf->map_off ||
+                cf->off + (off_t)len > cf->map_off + (off_t)cf->map_len)
+            return map_window(cf, len);
+
+        return cf->map + (cf->off - cf->map_off);
+    }
+#endif
+
+    if (cf->end - cf->pos >= len)
+        return cf->buf + cf->pos;
+
+    /* move what's left to the front and fill up the rest */
+    if (cf->pos) {
+        memmove(cf->buf, cf->buf + cf->pos, cf->end - cf->pos);
+        cf->end -= cf->pos;
+        cf->pos = 0;
+    }
+
+    if (len > cf->buf_size) {
+        cf->buf_size = len;
+        cf->buf = safe_realloc(cf->buf, cf->buf_size);
+    }
+
+    while (cf->end < len && !cf->eof) {
+        if (cf->dc != NULL)
+            ret = decompress_read(cf->dc, cf->buf + cf->end, cf->buf_size - cf->end);
+        else if (cf->dio != NULL)
+            ret = directio_read(cf->dio, cf->buf + cf->end, cf->buf_size - cf->end);
+        else
+            ret = read(cf->fd, cf->buf + cf->end, cf->buf_size - cf->end);
+        if (ret < 0 && errno == EINTR && cf->dc == NULL && cf->dio == NULL)
+            continue;
+
+        if (ret < 0) {
+            snprintf(cf->errbuf, sizeof(cf->errbuf), "error reading %s: %s", cf->path,
+                    cf->dc != NULL ? decompress_geterr(cf->dc) :
+                    cf->dio != NULL ? directio_geterr(cf->dio) : strerror(errno));
+            cf->eof = true;
+        } else if (ret == 0) {
+            cf->eof = true;
+        } else {
+            cf->end += (size_t)ret;
+        }
+    }
+
+    if (cf->end < len) {
+        if (cf->end > 0 && cf->errbuf[0] == '\0')
+            snprintf(cf->errbuf, sizeof(cf->errbuf), "%s is truncated", cf->path);
+        return NULL;
+    }
+
+    return cf->buf;
+}
+
+/**
+ * moves past 'len' bytes returned by cf_peek()
+ */
+static inline void
+cf_skip(capfile_t *cf, size_t len)
+{
+    cf->off += len;
+#ifdef CAPFILE_MMAP
+    if (cf->mapped)
+        return;
+#endif
+    cf->pos += len;
+}
+
+/**
+ * converts a pcapng timestamp to nanoseconds
+ */
+static uint64_t
+pcapng_ts_ns(const capfile_intf_t *ci, uint64_t ts)
+{
+    uint64_t ns;
+    uint8_t e = ci->ts_exp;
+
+    if (ci->ts_binary) {
+        if (e > 32) {
+            ts >>= e - 32;
+            e = 32;
+        }
+        ns = (ts >> e) * 1000000000ULL +
+                (((ts & ((1ULL << e) - 1)) * 1000000000ULL) >> e);
+    } else if (e <= 9) {
+        ns = ts * pow10_tbl[9 - e];
+    } else if (e - 9 < (int)(sizeof(pow10_tbl) / sizeof(pow10_tbl[0]))) {
+        ns = ts / pow10_tbl[e - 9];
+    } else {
+        ns = 0;
+    }
+
+    return ns + (uint64_t)(ci->ts_offset * 1000000000LL);
+}
+
+/**
+ * reads a section header block, which sets the byte order of the
+ * section and forgets the interfaces of the previous one
+ */
+static int
+pcapng_section(capfile_t *cf, const u_char *blk, uint32_t len)
+{
+    uint32_t bom;
+
+    memcpy(&bom, blk + 8, sizeof(bom));
+    if (bom == PCAPNG_BYTE_ORDER_MAGIC)
+        cf->swapped = false;
+    else if (bom == SWAPLONG(PCAPNG_BYTE_ORDER_MAGIC))
+        cf->swapped = true;
+    else {
+        snprintf(cf->errbuf, sizeof(cf->errbuf), "%s: bad pcapng byte order magic", cf->path);
+        return -1;
+    }
+
+    if (len < 28 || cf_u16(cf, blk + 12) != 1) {
+        snprintf(cf->errbuf, sizeof(cf->errbuf), "%s: unsupported pcapng version", cf->path);
+        return -1;
+    }
+
+    cf->intf_cnt = 0;
+    return 0;
+}
+
+/**
+ * reads an interface description block
+ */
+static int
+pcapng_interface(capfile_t *cf, const u_char *blk, uint32_t len)
+{
+    capfile_intf_t *ci;
+    const u_char *opt, *end;
+
+    if (len < 20) {
+        snprintf(cf->errbuf, sizeof(cf->errbuf), "%s: bad pcapng interface block", cf->path);
+        return -1;
+    }
+
+    if (cf->intf_cnt == cf->intf_alloc) {
+        cf->intf_alloc = cf->intf_alloc ? cf->intf_alloc * 2 : 4;
+        cf->intfs = safe_realloc(cf->intfs, sizeof(capfile_intf_t) * cf->intf_alloc);
+    }
+
+    ci = &cf->intfs[cf->intf_cnt++];
+    memset(ci, 0, sizeof(*ci));
+    ci->linktype = cf_u16(cf, blk + 8);
+    ci->snaplen = cf_u32(cf, blk + 12);
+    ci->ts_exp = 6;
+
+    /* options run up to the trailing block length */
+    opt = blk + 16;
+    end = blk + len - 4;
+    while (opt + 4 <= end) {
+        uint16_t code = cf_u16(cf, opt);
+        uint16_t olen = cf_u16(cf, opt + 2);
+
+        if (code == PCAPNG_OPT_END || opt + 4 + olen > end)
+            break;
+
+        if (code == PCAPNG_OPT_TSRESOL && olen >= 1) {
+            ci->ts_binary = (opt[4] & 0x80) != 0;
+            ci->ts_exp = opt[4] & 0x7f;
+        } else if (code == PCAPNG_OPT_TSOFFSET && olen >= 8) {
+            ci->ts_offset = (int64_t)cf_u64(cf, opt + 4);
+        }
+
+        opt += 4 + ((olen + 3) & ~3);
+    }
+
+    /* the first interface stands for the whole file */
+    if (cf->linktype < 0) {
+        cf->linktype = ci->linktype;
+        cf->snaplen = ci->snaplen ? ci->snaplen : CAPFILE_MAX_SNAPLEN;
+    }
+
+    return 0;
+}
+
+/**
+ * reads the section and interface blocks at the current position, up
+ * to the first block of another type
+ */
+static int
+pcapng_headers(capfile_t *cf)
+{
+    u_char *hdr;
+    uint32_t type, len;
+    uint32_t bom;
+
+    while ((hdr = cf_peek(cf, 12)) != NULL) {
+        type = cf_u32(cf, hdr);
+        if (type != PCAPNG_SHB && type != PCAPNG_IDB)
+            break;
+
+        /* the byte order may change at each section */
+        if (type == PCAPNG_SHB) {
+            memcpy(&bom, hdr + 8, sizeof(bom));
+            cf->swapped = (bom == SWAPLONG(PCAPNG_BYTE_ORDER_MAGIC));
+        }
+
+        len = cf_u32(cf, hdr + 4);
+        if (len < 12 || (len & 3) || len > CAPFILE_MAX_RECORD) {
+            snprintf(cf->errbuf, sizeof(cf->errbuf), "%s: bad pcapng block length %u",
+                    cf->path, len);
+            return -1;
+        }
+
+        if ((hdr = cf_peek(cf, len)) == NULL)
+            return -1;
+
+        if ((type == PCAPNG_SHB ? pcapng_section(cf, hdr, len) :
+                    pcapng_interface(cf, hdr, len)) < 0)
+            return -1;
+
+        cf_skip(cf, len);
+    }
+
+    return cf->errbuf[0] ? -1 : 0;
+}
+
+/**
+ * returns the next packet of a pcapng file
+ */
+static u_char *
+pcapng_next(capfile_t *cf, struct pcap_pkthdr *pkthdr, capfile_pkt_t *pkt)
+{
+    const capfile_intf_t *ci;
+    u_char *hdr, *blk, *data;
+    uint32_t type, len, intf, caplen, origlen;
+    uint64_t ts, ns;
+
+    while ((hdr = cf_peek(cf, 12)) != NULL) {
+        type = cf_u32(cf, hdr);
+
+        /* the byte order may change at each section */
+        if (type == PCAPNG_SHB) {
+            uint32_t bom;
+
+            memcpy(&bom, hdr + 8, sizeof(bom));
+            cf->swapped = (bom == SWAPLONG(PCAPNG_BYTE_ORDER_MAGIC));
+        }
+
+        len = cf_u32(cf, hdr + 4);
+        if (len < 12 || (len & 3) || len > CAPFILE_MAX_RECORD) {
+            snprintf(cf->errbuf, sizeof(cf->errbuf), "%s: bad pcapng block length %u",
+                    cf->path, len);
+            return NULL;
+        }
+
+        if ((blk = cf_peek(cf, len)) == NULL)
+            return NULL;
+
+        intf = 0;
+        data = NULL;
+        ts = 0;
+        switch (type) {
+        case PCAPNG_SHB:
+            if (pcapng_section(cf, blk, len) < 0)
+                return NULL;
+            cf->late_headers++;
+            break;
+
+        case PCAPNG_IDB:
+            if (pcapng_interface(cf, blk, len) < 0)
+                return NULL;
+            cf->late_headers++;
+            break;
+
+        case PCAPNG_EPB:
+            if (len < 32)
+                break;
+            intf = cf_u32(cf, blk + 8);
+            ts = ((uint64_t)cf_u32(cf, blk + 12) << 32) | cf_u32(cf, blk + 16);
+            caplen = cf_u32(cf, blk + 20);
+            origlen = cf_u32(cf, blk + 24);
+            if (caplen <= len - 32)
+                data = blk + 28;
+            break;
+
+        case PCAPNG_OPB:
+            if (len < 32)
+                break;
+            intf = cf_u16(cf, blk + 8);
+            ts = ((uint64_t)cf_u32(cf, blk + 12) << 32) | cf_u32(cf, blk + 16);
+            caplen = cf_u32(cf, blk + 20);
+            origlen = cf_u32(cf, blk + 24);
+            if (caplen <= len - 32)
+                data = blk + 28;
+            break;
+
+        case PCAPNG_SPB:
+            if (len < 16 || cf->intf_cnt == 0)
+                break;
+            origlen = cf_u32(cf, blk + 8);
+            caplen = len - 16;
+            if (origlen < caplen)
+                caplen = origlen;
+            if (cf->intfs[0].snaplen && caplen > cf->intfs[0].snaplen)
+                caplen = cf->intfs[0].snaplen;
+            data = blk + 12;
+            break;
+
+        default:
+            /* blocks we don't need */
+            break;
+        }
+
+        cf_skip(cf, len);
+
+        if (data == NULL)
+            continue;
+
+        if (intf >= cf->intf_cnt) {
+            snprintf(cf->errbuf, sizeof(cf->errbuf), "%s: packet for unknown interface %u",
+                    cf->path, intf);
+            return NULL;
+        }
+
+        /* a file has one link type, leave out packets with another */
+        ci = &cf->intfs[intf];
+        if (ci->linktype != cf->linktype) {
+            if (cf->skipped++ == 0)
+                warnx("%s: skipping packets of interface %u which has link type %d, not %d",
+                        cf->path, intf, ci->linktype, cf->linktype);
+            continue;
+        }
+
+        ns = type == PCAPNG_SPB ? 0 : pcapng_ts_ns(ci, ts);
+        pkthdr->ts.tv_sec = (time_t)(ns / 1000000000ULL);
+        pkthdr->ts.tv_usec = (suseconds_t)((ns % 1000000000ULL) / 1000);
+        pkthdr->caplen = caplen;
+        pkthdr->len = origlen;
+
+        if (pkt != NULL) {
+            pkt->intf_id = intf;
+            pkt->ts_ns = ns;
+        }
+
+        return data;
+    }
+
+    return NULL;
+}
+
+/**
+ * returns the next packet of a classic pcap file
+ */
+static u_char *
+pcap_file_next(capfile_t *cf, struct pcap_pkthdr *pkthdr, capfile_pkt_t *pkt)
+{
+    u_char *rec;
+    uint32_t sec, frac, caplen;
+    uint64_t ns;
+
+    if ((rec = cf_peek(cf, PCAP_REC_HDR_LEN)) == NULL)
+        return NULL;
+
+    caplen = cf_u32(cf, rec + 8);
+    if (caplen > CAPFILE_MAX_RECORD) {
+        snprintf(cf->errbuf, sizeof(cf->errbuf), "%s: bad packet length %u", cf->path, caplen);
+        return NULL;
+    }
+
+    if ((rec = cf_peek(cf, PCAP_REC_HDR_LEN + caplen)) == NULL)
+        return NULL;
+
+    sec = cf_u32(cf, rec);
+    frac = cf_u32(cf, rec + 4);
+    ns = (uint64_t)sec * 1000000000ULL + (cf->nsec ? frac : (uint64_t)frac * 1000);
+
+    pkthdr->ts.tv_sec = (time_t)sec;
+    pkthdr->ts.tv_usec = (suseconds_t)(cf->nsec ? frac / 1000 : frac);
+    pkthdr->caplen = caplen;
+    pkthdr->len = cf_u32(cf, rec + 12);
+
+    if (pkt != NULL) {
+        pkt->intf_id = 0;
+        pkt->ts_ns = ns;
+    }
+
+    cf_skip(cf, PCAP_REC_HDR_LEN + caplen);
+    return rec + PCAP_REC_HDR_LEN;
+}
+
+/**
+ * \brief Open a pcap or pcapng file, "-" for stdin
+ *
+ * Files in other formats are opened with libpcap. Returns NULL and
+ * fills in 'errbuf', which must be PCAP_ERRBUF_SIZE bytes, on error.
+ */
+capfile_t *
+capfile_open(const char *path, char *errbuf)
+{
+    capfile_t *cf;
+    u_char *hdr;
+    uint32_t magic;
+    u_char head[DECOMPRESS_MAGIC_LEN];
+    size_t head_len = 0;
+    decompress_type_t comp;
+    ssize_t ret;
+#ifdef CAPFILE_MMAP
+    struct stat st;
+#endif
+
+    assert(path);
+    assert(errbuf);
+
+    cf = safe_malloc(sizeof(capfile_t));
+    cf->path = safe_strdup(path);
+    cf->linktype = -1;
+
+    if (strcmp(path, "-") == 0) {
+        cf->fd = STDIN_FILENO;
+    } else if ((cf->fd = open(path, O_RDONLY)) < 0) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s: %s", path, strerror(errno));
+        goto fail;
+    }
+
+    /* read enough to tell whether the file is compressed */
+    while (head_len < sizeof(head)) {
+        ret = read(cf->fd, head + head_len, sizeof(head) - head_len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        head_len += (size_t)ret;
+    }
+
+    comp = decompress_detect(head, head_len);
+    if (comp != DECOMPRESS_NONE) {
+        if ((cf->dc = decompress_open(cf->fd, comp, head, head_len, errbuf)) == NULL)
+            goto fail;
+    }
+
+#ifdef CAPFILE_MMAP
+    if (cf->dc == NULL && fstat(cf->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        cf->mapped = true;
+        cf->size = st.st_size;
+    } else
+#endif
+    {
+        cf->buf_size = CAPFILE_BUF_SIZE;
+        cf->buf = safe_malloc(cf->buf_size);
+
+        /* the decompressor has the bytes read so far, otherwise keep them */
+        if (cf->dc == NULL) {
+            memcpy(cf->buf, head, head_len);
+            cf->end = head_len;
+        }
+    }
+
+    if ((hdr = cf_peek(cf, 4)) == NULL)
+        goto unknown;
+
+    memcpy(&magic, hdr, sizeof(magic));
+    if (magic == PCAPNG_SHB) {
+        cf->format = CAPFILE_PCAPNG;
+
+        /* the interfaces come before the packets which refer to them */
+        if (pcapng_headers(cf) < 0 || cf->linktype < 0) {
+            snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s",
+                    cf->errbuf[0] ? cf->errbuf : "no pcapng interface found");
+            goto fail;
+        }
+
+        return cf;
+    }
+
+    if (magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC ||
+            magic == SWAPLONG(PCAP_MAGIC_USEC) || magic == SWAPLONG(PCAP_MAGIC_NSEC)) {
+        cf->format = CAPFILE_PCAP;
+        cf->swapped = (magic == SWAPLONG(PCAP_MAGIC_USEC) || magic == SWAPLONG(PCAP_MAGIC_NSEC));
+        cf->nsec = (magic == PCAP_MAGIC_NSEC || magic == SWAPLONG(PCAP_MAGIC_NSEC));
+
+        if ((hdr = cf_peek(cf, PCAP_FILE_HDR_LEN)) == NULL) {
+            snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s: file too short", path);
+            goto fail;
+        }
+
+        cf->snaplen = cf_u32(cf, hdr + 16);
+        cf->linktype = (int)(cf_u32(cf, hdr + 20) & 0x03ffffff);
+        cf_skip(cf, PCAP_FILE_HDR_LEN);
+        return cf;
+    }
+
+unknown:
+    /* let libpcap have a go at other formats, except on a pipe */
+    if (cf->dc != NULL) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s: %s", path,
+                cf->errbuf[0] ? cf->errbuf : "unsupported capture file format");
+        goto fail;
+    }
+
+    if (cf->fd == STDIN_FILENO) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "unsupported capture file format on stdin");
+        goto fail;
+    }
+
+    close(cf->fd);
+    cf->fd = -1;
+    safe_free(cf->buf);
+#ifdef CAPFILE_MMAP
+    if (cf->map != NULL)
+        munmap(cf->map, cf->map_len);
+    cf->map = NULL;
+    cf->mapped = false;
+#endif
+
+    if ((cf->pcap = pcap_open_offline(path, errbuf)) == NULL)
+        goto fail;
+
+    cf->format = CAPFILE_LIBPCAP;
+    cf->linktype = pcap_datalink(cf->pcap);
+#ifdef HAVE_PCAP_SNAPSHOT
+    cf->snaplen = pcap_snapshot(cf->pcap);
+#else
+    cf->snaplen = CAPFILE_MAX_SNAPLEN;
+#endif
+    return cf;
+
+fail:
+    capfile_close(cf);
+    return NULL;
+}
+
+/**
+ * \brief Close a capture file
+ */
+void
+capfile_close(capfile_t *cf)
+{
+    if (cf == NULL)
+        return;
+
+    if (cf->pcap != NULL)
+        pcap_close(cf->pcap);
+
+    decompress_close(cf->dc);
+    directio_close(cf->dio);
+
+#ifdef CAPFILE_MMAP
+    if (cf->map != NULL)
+        munmap(cf->map, cf->map_len);
+#endif
+
+    if (cf->fd > STDIN_FILENO)
+        close(cf->fd);
+
+    safe_free(cf->buf);
+    safe_free(cf->intfs);
+    safe_free(cf->path);
+    safe_free(cf);
+}
+
+/**
+ * \brief Returns the next packet, or NULL at the end of the file
+ *
+ * The packet stays valid until the next call. 'pkt' may be NULL, or
+ * is filled in with the capture interface and timestamp in full.
+ * If NULL is returned because of an error, capfile_geterr() says why.
+ */
+u_char *
+capfile_next(capfile_t *cf, struct pcap_pkthdr *pkthdr, capfile_pkt_t *pkt)
+{
+    u_char *pktdata;
+
+    assert(cf);
+    assert(pkthdr);
+
+    switch (cf->format) {
+    case CAPFILE_PCAP:
+        return pcap_file_next(cf, pkthdr, pkt);
+
+    case CAPFILE_PCAPNG:
+        return pcapng_next(cf, pkthdr, pkt);
+
+    case CAPFILE_LIBPCAP:
+        pktdata = (u_char *)pcap_next(cf->pcap, pkthdr);
+        if (pktdata != NULL && pkt != NULL) {
+            pkt->intf_id = 0;
+            pkt->ts_ns = (uint64_t)pkthdr->ts.tv_sec * 1000000000ULL +
+                    (uint64_t)pkthdr->ts.tv_usec * 1000;
+        }
+        return pktdata;
+    }
+
+    return NULL;
+}
+
+/**
+ * \brief Returns the DLT of the file, for pcapng that of the first interface
+ */
+int
+capfile_datalink(const capfile_t *cf)
+{
+    return cf->linktype;
+}
+
+/**
+ * \brief Returns the snaplen of the file
+ */
+int
+capfile_snapshot(const capfile_t *cf)
+{
+    return (int)cf->snaplen;
+}
+
+capfile_format_t
+capfile_format(const capfile_t *cf)
+{
+    return cf->format;
+}
+
+/**
+ * \brief Returns the number of pcapng interfaces seen in the current section
+ */
+uint32_t
+capfile_intf_count(const capfile_t *cf)
+{
+    return cf->format == CAPFILE_PCAPNG ? cf->intf_cnt : 1;
+}
+
+/**
+ * \brief Returns the file offset of the next packet
+ */
+off_t
+capfile_tell(const capfile_t *cf)
+{
+    if (cf->format == CAPFILE_LIBPCAP)
+        return ftello(pcap_file(cf->pcap));
+
+    return cf->off;
+}
+
+/**
+ * \brief Returns the file descriptor the file is read from, -1 if compressed
+ */
+int
+capfile_fileno(const capfile_t *cf)
+{
+    if (cf->dc != NULL)
+        return -1;
+
+    if (cf->format == CAPFILE_LIBPCAP)
+        return fileno(pcap_file(cf->pcap));
+
+    return cf->fd;
+}
+
+/**
+ * moves to a file offset. Compressed files can only move forwards.
+ */
+static int
+cf_seek(capfile_t *cf, off_t offset)
+{
+    size_t len;
+
+#ifdef CAPFILE_MMAP
+    if (cf->mapped) {
+        cf->off = offset;
+        return 0;
+    }
+#endif
+
+    if (cf->dio != NULL) {
+        directio_close(cf->dio);
+        if ((cf->dio = directio_open(cf->path, offset, cf->dio_depth, cf->errbuf)) == NULL)
+            return -1;
+
+        cf->off = offset;
+        cf->pos = cf->end = 0;
+        cf->eof = false;
+        return 0;
+    }
+
+    if (cf->dc != NULL) {
+        if (offset < cf->off) {
+            snprintf(cf->errbuf, sizeof(cf->errbuf), "unable to seek backwards in compressed %s",
+                    cf->path);
+            return -1;
+        }
+
+        /* decompress and drop everything up to the offset */
+        while (cf->off < offset) {
+            len = offset - cf->off > (off_t)cf->buf_size ? cf->buf_size : (size_t)(offset - cf->off);
+            if (cf_peek(cf, len) == NULL) {
+                snprintf(cf->errbuf, sizeof(cf->errbuf), "unable to seek in %s to %lld",
+                        cf->path, (long long)offset);
+                return -1;
+            }
+            cf_skip(cf, len);
+        }
+        return 0;
+    }
+
+    if (lseek(cf->fd, offset, SEEK_SET) < 0) {
+        snprintf(cf->errbuf, sizeof(cf->errbuf), "unable to seek in %s: %s",
+                cf->path, strerror(errno));
+        return -1;
+    }
+
+    cf->off = offset;
+    cf->pos = cf->end = 0;
+    cf->eof = false;
+    return 0;
+}
+
+/**
+ * \brief Moves to an offset returned by capfile_tell()
+ *
+ * In a pcapng file the blocks up to the offset are scanned for section
+ * and interface blocks, since packets refer to them. Only works on
+ * files, not on pipes, and compressed files are decompressed up to the
+ * offset so can only move forwards.
+ */
+int
+capfile_seek(capfile_t *cf, off_t offset)
+{
+    u_char *hdr;
+    uint32_t type, len;
+
+    if (cf->format == CAPFILE_LIBPCAP) {
+        if (fseeko(pcap_file(cf->pcap), offset, SEEK_SET) < 0) {
+            snprintf(cf->errbuf, sizeof(cf->errbuf), "unable to seek in %s: %s",
+                    cf->path, strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+    if (cf->format != CAPFILE_PCAPNG)
+        return cf_seek(cf, offset);
+
+    /* start over if going backwards, picking up the interfaces on the way */
+    if (offset < cf->off) {
+        if (cf_seek(cf, 0) < 0)
+            return -1;
+        cf->intf_cnt = 0;
+    }
+
+    while (cf->off < offset && (hdr = cf_peek(cf, 12)) != NULL) {
+        type = cf_u32(cf, hdr);
+        if (type == PCAPNG_SHB || type == PCAPNG_IDB) {
+            if (pcapng_headers(cf) < 0)
+                return -1;
+            continue;
+        }
+
+        len = cf_u32(cf, hdr + 4);
+        if (len < 12 || (len & 3) || len > CAPFILE_MAX_RECORD)
+            break;
+
+        if (cf_peek(cf, len) == NULL)
+            break;
+        cf_skip(cf, len);
+    }
+
+    if (cf->off != offset) {
+        snprintf(cf->errbuf, sizeof(cf->errbuf), "unable to seek in %s to %lld",
+                cf->path, (long long)offset);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * \brief Moves to an offset returned by capfile_tell() without rescanning
+ *
+ * Unlike capfile_seek(), the pcapng interfaces read when the file was
+ * opened are kept, so this is only right for files which
+ * capfile_single_section() said have no other section or interface
+ * blocks, such as when seeking with an index.
+ */
+int
+capfile_jump(capfile_t *cf, off_t offset)
+{
+    if (cf->format != CAPFILE_PCAPNG)
+        return capfile_seek(cf, offset);
+
+    return cf_seek(cf, offset);
+}
+
+/**
+ * \brief Returns false if section or interface blocks came after the first packet
+ *
+ * Only meaningful once the whole file has been read.
+ */
+bool
+capfile_single_section(const capfile_t *cf)
+{
+    return cf->late_headers == 0;
+}
+
+/**
+ * \brief Reads the rest of the file with O_DIRECT, through 'depth' buffers
+ *
+ * Bypasses the page cache, and keeps depth - 1 large reads queued
+ * ahead of the packets being parsed. Only works for uncompressed
+ * regular files. On error 'errbuf', which must be PCAP_ERRBUF_SIZE
+ * bytes, says why and the file is still readable as before.
+ */
+int
+capfile_direct_io(capfile_t *cf, int depth, char *errbuf)
+{
+    struct stat st;
+
+    assert(cf);
+
+    if (cf->dio != NULL)
+        return 0;
+
+    if (cf->dc != NULL || cf->format == CAPFILE_LIBPCAP ||
+            fstat(cf->fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE,
+                "%s: direct I/O needs an uncompressed pcap or pcapng file", cf->path);
+        return -1;
+    }
+
+    if (depth < DIRECTIO_MIN_DEPTH || depth > DIRECTIO_MAX_DEPTH) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "direct I/O depth must be %d to %d",
+                DIRECTIO_MIN_DEPTH, DIRECTIO_MAX_DEPTH);
+        return -1;
+    }
+
+    if ((cf->dio = directio_open(cf->path, cf->off, depth, errbuf)) == NULL)
+        return -1;
+
+    cf->dio_depth = depth;
+#ifdef CAPFILE_MMAP
+    if (cf->map != NULL)
+        munmap(cf->map, cf->map_len);
+    cf->map = NULL;
+    cf->mapped = false;
+#endif
+
+    if (cf->buf == NULL) {
+        cf->buf_size = CAPFILE_BUF_SIZE;
+        cf->buf = safe_malloc(cf->buf_size);
+    }
+    cf->pos = cf->end = 0;
+    cf->eof = false;
+    return 0;
+}
+
+/**
+ * \brief Returns why capfile_next() returned NULL, or NULL at the end of the file
+ */
+const char *
+capfile_geterr(const capfile_t *cf)
+{
+    return cf->errbuf[0] ? cf->errbuf : NULL;
+}
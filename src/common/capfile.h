@@ -0,0 +1,64 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2016 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CAPFILE_H__
+#define __CAPFILE_H__
+
+#include "defines.h"
+
+/*
+ * Native reader for pcap and pcapng capture files.
+ *
+ * Packets are returned in place, from a window of the file mapped
+ * into memory or from a read buffer for pipes, and stay valid until
+ * the next call to capfile_next(). The memory is writable so that
+ * packets can be edited before they are sent. gzip, zstd and lz4
+ * compressed files are decompressed on the fly. Other formats are
+ * handed to libpcap.
+ */
+
+typedef enum {
+    CAPFILE_PCAP,                   /* classic pcap, usec or nsec */
+    CAPFILE_PCAPNG,
+    CAPFILE_LIBPCAP,                /* anything else libpcap can read */
+} capfile_format_t;
+
+/* details of a packet which don't fit in a struct pcap_pkthdr */
+typedef struct capfile_pkt_s {
+    uint32_t intf_id;               /* pcapng interface, 0 for pcap */
+    uint64_t ts_ns;                 /* timestamp in nanoseconds */
+} capfile_pkt_t;
+
+typedef struct capfile_s capfile_t;
+
+capfile_t *capfile_open(const char *path, char *errbuf);
+void capfile_close(capfile_t *cf);
+u_char *capfile_next(capfile_t *cf, struct pcap_pkthdr *pkthdr, capfile_pkt_t *pkt);
+int capfile_datalink(const capfile_t *cf);
+int capfile_snapshot(const capfile_t *cf);
+capfile_format_t capfile_format(const capfile_t *cf);
+uint32_t capfile_intf_count(const capfile_t *cf);
+int capfile_fileno(const capfile_t *cf);
+off_t capfile_tell(const capfile_t *cf);
+int capfile_seek(capfile_t *cf, off_t offset);
+int capfile_jump(capfile_t *cf, off_t offset);
+bool capfile_single_section(const capfile_t *cf);
+int capfile_direct_io(capfile_t *cf, int depth, char *errbuf);
+const char *capfile_geterr(const capfile_t *cf);
+
+#endif /* __CAPFILE_H__ */
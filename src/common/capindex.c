@@ -0,0 +1,355 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2016 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The index is a text file: a few "key value" header lines, then one
+ * "packetnum sec.nsec offset" line per entry, in file order. It is
+ * only trusted if the capture file still has the size and modification
+ * time it had when it was indexed.
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "capindex.h"
+
+#define CAPINDEX_MAGIC          "# tcpreplay capture index"
+#define CAPINDEX_VERSION        2
+
+/**
+ * \brief Returns the path of the index of a capture file, to be freed
+ */
+char *
+capindex_path(const char *capfile)
+{
+    char *path;
+    size_t len = strlen(capfile);
+
+    path = safe_malloc(len + sizeof(CAPINDEX_SUFFIX));
+    memcpy(path, capfile, len);
+    memcpy(path + len, CAPINDEX_SUFFIX, sizeof(CAPINDEX_SUFFIX));
+    return path;
+}
+
+static void
+capindex_append(capindex_t *ci, COUNTER *alloc, COUNTER packetnum, uint64_t ts_ns, off_t offset)
+{
+    capindex_entry_t *e;
+
+    if (ci->entry_cnt == *alloc) {
+        *alloc = *alloc ? *alloc * 2 : 256;
+        ci->entries = safe_realloc(ci->entries, sizeof(capindex_entry_t) * *alloc);
+    }
+
+    e = &ci->entries[ci->entry_cnt++];
+    e->packetnum = packetnum;
+    e->ts_ns = ts_ns;
+    e->offset = offset;
+}
+
+/**
+ * \brief Reads a capture file and indexes every 'interval' packets
+ *
+ * Returns NULL and fills in 'errbuf', which must be PCAP_ERRBUF_SIZE
+ * bytes, on error.
+ */
+capindex_t *
+capindex_build(const char *capfile, COUNTER interval, char *errbuf)
+{
+    capindex_t *ci;
+    capfile_t *cf;
+    struct stat st;
+    struct pcap_pkthdr pkthdr;
+    capfile_pkt_t info;
+    COUNTER alloc = 0;
+    off_t offset;
+
+    assert(capfile);
+    assert(interval > 0);
+
+    if (strcmp(capfile, "-") == 0 || stat(capfile, &st) < 0 || !S_ISREG(st.st_mode)) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s: only regular files can be indexed", capfile);
+        return NULL;
+    }
+
+    if ((cf = capfile_open(capfile, errbuf)) == NULL)
+        return NULL;
+
+    ci = safe_malloc(sizeof(capindex_t));
+    ci->file_size = (uint64_t)st.st_size;
+    ci->file_mtime = (int64_t)st.st_mtime;
+    ci->interval = interval;
+
+    offset = capfile_tell(cf);
+    while (capfile_next(cf, &pkthdr, &info) != NULL) {
+        if (ci->packets++ == 0)
+            ci->first_ts_ns = info.ts_ns;
+
+        if ((ci->packets - 1) % interval == 0)
+            capindex_append(ci, &alloc, ci->packets, info.ts_ns, offset);
+
+        offset = capfile_tell(cf);
+    }
+
+    if (capfile_geterr(cf) != NULL) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s", capfile_geterr(cf));
+        capfile_close(cf);
+        capindex_free(ci);
+        return NULL;
+    }
+
+    ci->single_section = capfile_single_section(cf);
+    capfile_close(cf);
+    return ci;
+}
+
+/**
+ * \brief Writes an index to 'path'
+ *
+ * Returns 0, or -1 and fills in 'errbuf' on error.
+ */
+int
+capindex_write(const capindex_t *ci, const char *path, char *errbuf)
+{
+    FILE *fp;
+    COUNTER i;
+    const capindex_entry_t *e;
+
+    if ((fp = fopen(path, "w")) == NULL) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "unable to create %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    fprintf(fp, "%s\n", CAPINDEX_MAGIC);
+    fprintf(fp, "version %d\n", CAPINDEX_VERSION);
+    fprintf(fp, "file_size %" PRIu64 "\n", ci->file_size);
+    fprintf(fp, "file_mtime %" PRId64 "\n", ci->file_mtime);
+    fprintf(fp, "packets " COUNTER_SPEC "\n", ci->packets);
+    fprintf(fp, "first_ts %" PRIu64 ".%09" PRIu64 "\n",
+            ci->first_ts_ns / 1000000000, ci->first_ts_ns % 1000000000);
+    fprintf(fp, "interval " COUNTER_SPEC "\n", ci->interval);
+    fprintf(fp, "single_section %d\n", ci->single_section ? 1 : 0);
+
+    for (i = 0; i < ci->entry_cnt; i++) {
+        e = &ci->entries[i];
+        fprintf(fp, COUNTER_SPEC " %" PRIu64 ".%09" PRIu64 " %lld\n", e->packetnum,
+                e->ts_ns / 1000000000, e->ts_ns % 1000000000, (long long)e->offset);
+    }
+
+    if (ferror(fp) | fclose(fp)) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "unable to write %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * parses a "sec.nsec" timestamp, returning a pointer past it or NULL
+ */
+static char *
+parse_ts(char *s, uint64_t *ts_ns)
+{
+    char *end, *frac;
+    uint64_t sec, ns = 0;
+    int digits = 0;
+
+    sec = strtoull(s, &end, 10);
+    if (end == s)
+        return NULL;
+
+    if (*end == '.') {
+        for (frac = end + 1; *frac >= '0' && *frac <= '9'; frac++) {
+            if (digits++ < 9)
+                ns = ns * 10 + (uint64_t)(*frac - '0');
+        }
+        for (; digits < 9; digits++)
+            ns *= 10;
+        end = frac;
+    }
+
+    *ts_ns = sec * 1000000000ULL + ns;
+    return end;
+}
+
+/**
+ * \brief Reads the index at 'path'
+ *
+ * Returns NULL and fills in 'errbuf' if the index can't be read or
+ * isn't one.
+ */
+capindex_t *
+capindex_read(const char *path, char *errbuf)
+{
+    FILE *fp;
+    capindex_t *ci;
+    char line[256];
+    char *p, *end;
+    COUNTER alloc = 0;
+    COUNTER packetnum;
+    uint64_t ts_ns;
+    long long offset;
+    int lineno = 0;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "unable to open %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    ci = safe_malloc(sizeof(capindex_t));
+    ci->single_section = true;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+
+        if (lineno == 1) {
+            if (strncmp(line, CAPINDEX_MAGIC, strlen(CAPINDEX_MAGIC)) != 0)
+                goto bad;
+            continue;
+        }
+
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+
+        if (line[0] >= '0' && line[0] <= '9') {
+            packetnum = strtoull(line, &p, 10);
+            if ((p = parse_ts(p, &ts_ns)) == NULL)
+                goto bad;
+            offset = strtoll(p, &end, 10);
+            if (end == p || packetnum == 0 || offset < 0)
+                goto bad;
+            capindex_append(ci, &alloc, packetnum, ts_ns, (off_t)offset);
+            continue;
+        }
+
+        if ((p = strchr(line, ' ')) == NULL)
+            goto bad;
+        *p++ = '\0';
+
+        if (strcmp(line, "version") == 0) {
+            if (atoi(p) != CAPINDEX_VERSION) {
+                snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s: unsupported index version %d",
+                        path, atoi(p));
+                goto fail;
+            }
+        } else if (strcmp(line, "file_size") == 0) {
+            ci->file_size = strtoull(p, NULL, 10);
+        } else if (strcmp(line, "file_mtime") == 0) {
+            ci->file_mtime = strtoll(p, NULL, 10);
+        } else if (strcmp(line, "packets") == 0) {
+            ci->packets = strtoull(p, NULL, 10);
+        } else if (strcmp(line, "first_ts") == 0) {
+            if (parse_ts(p, &ci->first_ts_ns) == NULL)
+                goto bad;
+        } else if (strcmp(line, "interval") == 0) {
+            ci->interval = strtoull(p, NULL, 10);
+        } else if (strcmp(line, "single_section") == 0) {
+            ci->single_section = atoi(p) != 0;
+        }
+        /* other keys are left for later versions */
+    }
+
+    if (lineno == 0)
+        goto bad;
+
+    fclose(fp);
+    return ci;
+
+bad:
+    snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s: not a capture index (line %d)", path, lineno);
+fail:
+    fclose(fp);
+    capindex_free(ci);
+    return NULL;
+}
+
+/**
+ * \brief Returns whether 'capfile' is still the file 'ci' was built from
+ */
+bool
+capindex_current(const capindex_t *ci, const char *capfile)
+{
+    struct stat st;
+
+    if (stat(capfile, &st) < 0)
+        return false;
+
+    return (uint64_t)st.st_size == ci->file_size && (int64_t)st.st_mtime == ci->file_mtime;
+}
+
+/**
+ * \brief Returns the entry to start from to reach 'rel_ns' nanoseconds
+ * after the first packet, or NULL to start from the beginning
+ *
+ * Stops at the first entry past the time, so a file whose timestamps
+ * go backwards at times starts early rather than late.
+ */
+const capindex_entry_t *
+capindex_find_time(const capindex_t *ci, uint64_t rel_ns)
+{
+    const capindex_entry_t *found = NULL;
+    COUNTER i;
+
+    for (i = 0; i < ci->entry_cnt; i++) {
+        if (ci->entries[i].ts_ns < ci->first_ts_ns ||
+                ci->entries[i].ts_ns - ci->first_ts_ns > rel_ns)
+            break;
+        found = &ci->entries[i];
+    }
+
+    return found;
+}
+
+/**
+ * \brief Returns the last entry at or before packet 'packetnum', or NULL
+ */
+const capindex_entry_t *
+capindex_find_packet(const capindex_t *ci, COUNTER packetnum)
+{
+    COUNTER lo = 0, hi = ci->entry_cnt, mid;
+
+    /* entries are in packet order */
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (ci->entries[mid].packetnum <= packetnum)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo > 0 ? &ci->entries[lo - 1] : NULL;
+}
+
+/**
+ * \brief Frees an index
+ */
+void
+capindex_free(capindex_t *ci)
+{
+    if (ci == NULL)
+        return;
+
+    safe_free(ci->entries);
+    safe_free(ci);
+}
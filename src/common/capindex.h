@@ -0,0 +1,60 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2016 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CAPINDEX_H__
+#define __CAPINDEX_H__
+
+#include "defines.h"
+
+/*
+ * Sidecar index of a capture file, written next to it as <file>.idx,
+ * which lets a replay start part way through the file without reading
+ * the packets before it. Every 'interval' packets the index records
+ * the packet number, its timestamp and the offset of its record.
+ */
+
+#define CAPINDEX_SUFFIX         ".idx"
+#define CAPINDEX_DEFAULT_INTERVAL 1000
+
+typedef struct capindex_entry_s {
+    COUNTER packetnum;              /* 1 for the first packet */
+    uint64_t ts_ns;
+    off_t offset;                   /* as returned by capfile_tell() */
+} capindex_entry_t;
+
+typedef struct capindex_s {
+    uint64_t file_size;             /* of the capture file when indexed */
+    int64_t file_mtime;
+    COUNTER packets;
+    uint64_t first_ts_ns;
+    COUNTER interval;
+    bool single_section;            /* entries can be jumped to directly */
+    capindex_entry_t *entries;
+    COUNTER entry_cnt;
+} capindex_t;
+
+char *capindex_path(const char *capfile);
+capindex_t *capindex_build(const char *capfile, COUNTER interval, char *errbuf);
+int capindex_write(const capindex_t *ci, const char *path, char *errbuf);
+capindex_t *capindex_read(const char *path, char *errbuf);
+bool capindex_current(const capindex_t *ci, const char *capfile);
+const capindex_entry_t *capindex_find_time(const capindex_t *ci, uint64_t rel_ns);
+const capindex_entry_t *capindex_find_packet(const capindex_t *ci, COUNTER packetnum);
+void capindex_free(capindex_t *ci);
+
+#endif /* __CAPINDEX_H__ */
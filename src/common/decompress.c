@@ -0,0 +1,486 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2016 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The decompression thread writes straight into the free part of the
+ * ring and the reader copies out of the filled part, so each only
+ * takes the lock to move the head or tail. Concatenated gzip members,
+ * zstd frames and lz4 frames are read one after the other.
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LIBLZ4
+#include <lz4frame.h>
+#endif
+
+#include "decompress.h"
+
+/* decompressed data buffered ahead of the reader */
+#define DECOMPRESS_RING_SIZE    (16 * 1024 * 1024)
+
+/* compressed data read from the file at a time */
+#define DECOMPRESS_READ_SIZE    (1024 * 1024)
+
+/**
+ * \brief Returns the compression of a file from its first bytes
+ */
+decompress_type_t
+decompress_detect(const u_char *data, size_t len)
+{
+    if (len >= 2 && data[0] == 0x1f && data[1] == 0x8b)
+        return DECOMPRESS_GZIP;
+
+    if (len >= 4 && data[0] == 0x28 && data[1] == 0xb5 && data[2] == 0x2f && data[3] == 0xfd)
+        return DECOMPRESS_ZSTD;
+
+    if (len >= 4 && data[0] == 0x04 && data[1] == 0x22 && data[2] == 0x4d && data[3] == 0x18)
+        return DECOMPRESS_LZ4;
+
+    return DECOMPRESS_NONE;
+}
+
+const char *
+decompress_name(decompress_type_t type)
+{
+    switch (type) {
+    case DECOMPRESS_GZIP:
+        return "gzip";
+    case DECOMPRESS_ZSTD:
+        return "zstd";
+    case DECOMPRESS_LZ4:
+        return "lz4";
+    default:
+        return "uncompressed";
+    }
+}
+
+#if defined HAVE_PTHREAD && (defined HAVE_LIBZ || defined HAVE_LIBZSTD || defined HAVE_LIBLZ4)
+
+struct decompress_s {
+    int fd;
+    decompress_type_t type;
+    pthread_t thread;
+
+#ifdef HAVE_LIBZ
+    z_stream zs;
+#endif
+#ifdef HAVE_LIBZSTD
+    ZSTD_DStream *zstd;
+#endif
+#ifdef HAVE_LIBLZ4
+    LZ4F_dctx *lz4;
+#endif
+    bool in_frame;                  /* stopped part way through a frame */
+
+    /* compressed data */
+    u_char *in;
+    size_t in_pos;
+    size_t in_len;
+
+    /* decompressed data from 'tail' up to 'head' */
+    u_char *ring;
+    size_t ring_size;
+    uint64_t head;
+    uint64_t tail;
+
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t drained;
+    bool started;
+    bool done;                      /* thread has finished */
+    bool closing;                   /* reader has gone */
+    char errbuf[PCAP_ERRBUF_SIZE];
+};
+
+/**
+ * decompresses what it can of 'in' into 'out', setting how much of
+ * each was used. Returns -1 on error.
+ */
+static int
+decompress_step(decompress_t *dc, const u_char *in, size_t in_len, size_t *consumed,
+        u_char *out, size_t out_len, size_t *produced)
+{
+    switch (dc->type) {
+#ifdef HAVE_LIBZ
+    case DECOMPRESS_GZIP: {
+        int ret;
+
+        dc->zs.next_in = (Bytef *)in;
+        dc->zs.avail_in = (uInt)in_len;
+        dc->zs.next_out = out;
+        dc->zs.avail_out = (uInt)out_len;
+        ret = inflate(&dc->zs, Z_NO_FLUSH);
+        *consumed = in_len - dc->zs.avail_in;
+        *produced = out_len - dc->zs.avail_out;
+
+        if (ret == Z_STREAM_END) {
+            inflateReset(&dc->zs);
+            dc->in_frame = false;
+        } else if (ret == Z_OK) {
+            dc->in_frame = true;
+        } else if (ret != Z_BUF_ERROR) {
+            snprintf(dc->errbuf, sizeof(dc->errbuf), "gzip: %s",
+                    dc->zs.msg ? dc->zs.msg : "corrupt data");
+            return -1;
+        }
+        return 0;
+    }
+#endif
+
+#ifdef HAVE_LIBZSTD
+    case DECOMPRESS_ZSTD: {
+        ZSTD_inBuffer zin = { in, in_len, 0 };
+        ZSTD_outBuffer zout = { out, out_len, 0 };
+        size_t ret;
+
+        ret = ZSTD_decompressStream(dc->zstd, &zout, &zin);
+        if (ZSTD_isError(ret)) {
+            snprintf(dc->errbuf, sizeof(dc->errbuf), "zstd: %s", ZSTD_getErrorName(ret));
+            return -1;
+        }
+        *consumed = zin.pos;
+        *produced = zout.pos;
+        dc->in_frame = (ret != 0);
+        return 0;
+    }
+#endif
+
+#ifdef HAVE_LIBLZ4
+    case DECOMPRESS_LZ4: {
+        size_t src_len = in_len;
+        size_t dst_len = out_len;
+        size_t ret;
+
+        ret = LZ4F_decompress(dc->lz4, out, &dst_len, in, &src_len, NULL);
+        if (LZ4F_isError(ret)) {
+            snprintf(dc->errbuf, sizeof(dc->errbuf), "lz4: %s", LZ4F_getErrorName(ret));
+            return -1;
+        }
+        *consumed = src_len;
+        *produced = dst_len;
+        dc->in_frame = (ret != 0);
+        return 0;
+    }
+#endif
+
+    default:
+        snprintf(dc->errbuf, sizeof(dc->errbuf), "%s decompression not supported",
+                decompress_name(dc->type));
+        return -1;
+    }
+}
+
+/**
+ * reads and decompresses the file into the ring until the end of the
+ * file, an error or the reader closes it
+ */
+static void *
+decompress_thread(void *arg)
+{
+    decompress_t *dc = arg;
+    size_t consumed, produced, room, off;
+    bool eof = false;
+    bool closing;
+    ssize_t ret;
+
+    tcpreplay_pin_helper();
+
+    for (;;) {
+        if (dc->in_pos == dc->in_len && !eof) {
+            ret = read(dc->fd, dc->in, DECOMPRESS_READ_SIZE);
+            if (ret < 0 && errno == EINTR)
+                continue;
+
+            if (ret < 0) {
+                snprintf(dc->errbuf, sizeof(dc->errbuf), "read error: %s", strerror(errno));
+                break;
+            }
+
+            dc->in_pos = 0;
+            dc->in_len = (size_t)ret;
+            eof = (ret == 0);
+        }
+
+        /* wait for room, then fill up to the end of the ring */
+        pthread_mutex_lock(&dc->lock);
+        while (!dc->closing && dc->head - dc->tail == dc->ring_size)
+            pthread_cond_wait(&dc->drained, &dc->lock);
+        room = dc->ring_size - (size_t)(dc->head - dc->tail);
+        closing = dc->closing;
+        pthread_mutex_unlock(&dc->lock);
+
+        if (closing)
+            break;
+
+        off = (size_t)(dc->head % dc->ring_size);
+        if (room > dc->ring_size - off)
+            room = dc->ring_size - off;
+
+        if (decompress_step(dc, dc->in + dc->in_pos, dc->in_len - dc->in_pos, &consumed,
+                dc->ring + off, room, &produced) < 0)
+            break;
+
+        dc->in_pos += consumed;
+        if (produced) {
+            pthread_mutex_lock(&dc->lock);
+            dc->head += produced;
+            pthread_cond_signal(&dc->filled);
+            pthread_mutex_unlock(&dc->lock);
+        } else if (!consumed) {
+            if (dc->in_pos < dc->in_len) {
+                snprintf(dc->errbuf, sizeof(dc->errbuf), "%s: corrupt data",
+                        decompress_name(dc->type));
+                break;
+            }
+
+            if (eof) {
+                if (dc->in_frame)
+                    snprintf(dc->errbuf, sizeof(dc->errbuf), "%s: file is truncated",
+                            decompress_name(dc->type));
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&dc->lock);
+    dc->done = true;
+    pthread_cond_signal(&dc->filled);
+    pthread_mutex_unlock(&dc->lock);
+
+    return NULL;
+}
+
+/**
+ * \brief Starts decompressing a file in a thread
+ *
+ * 'head' holds the first bytes of the file which have already been
+ * read from 'fd'. The caller keeps ownership of 'fd'. Returns NULL and
+ * fills in 'errbuf', which must be PCAP_ERRBUF_SIZE bytes, on error.
+ */
+decompress_t *
+decompress_open(int fd, decompress_type_t type, const u_char *head, size_t head_len,
+        char *errbuf)
+{
+    decompress_t *dc;
+    int err = 0;
+
+    assert(errbuf);
+    assert(head_len <= DECOMPRESS_READ_SIZE);
+
+    dc = safe_malloc(sizeof(decompress_t));
+    dc->fd = fd;
+    dc->type = type;
+
+    switch (type) {
+#ifdef HAVE_LIBZ
+    case DECOMPRESS_GZIP:
+        /* 32 accepts a gzip or zlib header */
+        err = inflateInit2(&dc->zs, 15 + 32) != Z_OK;
+        break;
+#endif
+#ifdef HAVE_LIBZSTD
+    case DECOMPRESS_ZSTD:
+        dc->zstd = ZSTD_createDStream();
+        err = dc->zstd == NULL || ZSTD_isError(ZSTD_initDStream(dc->zstd));
+        break;
+#endif
+#ifdef HAVE_LIBLZ4
+    case DECOMPRESS_LZ4:
+        err = LZ4F_isError(LZ4F_createDecompressionContext(&dc->lz4, LZ4F_VERSION));
+        break;
+#endif
+    default:
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s compressed files are not supported by this build",
+                decompress_name(type));
+        safe_free(dc);
+        return NULL;
+    }
+
+    if (err) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "unable to start %s decompression",
+                decompress_name(type));
+        decompress_close(dc);
+        return NULL;
+    }
+
+    dc->in = safe_malloc(DECOMPRESS_READ_SIZE);
+    memcpy(dc->in, head, head_len);
+    dc->in_len = head_len;
+    dc->ring_size = DECOMPRESS_RING_SIZE;
+    dc->ring = safe_malloc(dc->ring_size);
+
+    pthread_mutex_init(&dc->lock, NULL);
+    pthread_cond_init(&dc->filled, NULL);
+    pthread_cond_init(&dc->drained, NULL);
+
+    if ((err = pthread_create(&dc->thread, NULL, decompress_thread, dc)) != 0) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "unable to start decompression thread: %s",
+                strerror(err));
+        decompress_close(dc);
+        return NULL;
+    }
+
+    dc->started = true;
+    return dc;
+}
+
+/**
+ * \brief Copies up to 'len' decompressed bytes into 'buf'
+ *
+ * Waits for the thread if nothing is buffered. Returns the number of
+ * bytes copied, 0 at the end of the file or -1 on error.
+ */
+ssize_t
+decompress_read(decompress_t *dc, u_char *buf, size_t len)
+{
+    size_t avail, off, first;
+
+    pthread_mutex_lock(&dc->lock);
+    while (dc->head == dc->tail && !dc->done)
+        pthread_cond_wait(&dc->filled, &dc->lock);
+    avail = (size_t)(dc->head - dc->tail);
+    pthread_mutex_unlock(&dc->lock);
+
+    if (avail == 0)
+        return dc->errbuf[0] ? -1 : 0;
+
+    if (len > avail)
+        len = avail;
+
+    off = (size_t)(dc->tail % dc->ring_size);
+    first = dc->ring_size - off;
+    if (first > len)
+        first = len;
+    memcpy(buf, dc->ring + off, first);
+    memcpy(buf + first, dc->ring, len - first);
+
+    pthread_mutex_lock(&dc->lock);
+    dc->tail += len;
+    pthread_cond_signal(&dc->drained);
+    pthread_mutex_unlock(&dc->lock);
+
+    return (ssize_t)len;
+}
+
+/**
+ * \brief Returns why decompress_read() failed
+ */
+const char *
+decompress_geterr(const decompress_t *dc)
+{
+    return dc->errbuf;
+}
+
+/**
+ * \brief Stops the decompression thread and frees everything
+ */
+void
+decompress_close(decompress_t *dc)
+{
+    if (dc == NULL)
+        return;
+
+    if (dc->ring != NULL) {
+        pthread_mutex_lock(&dc->lock);
+        dc->closing = true;
+        pthread_cond_signal(&dc->drained);
+        pthread_mutex_unlock(&dc->lock);
+
+        if (dc->started)
+            pthread_join(dc->thread, NULL);
+
+        pthread_mutex_destroy(&dc->lock);
+        pthread_cond_destroy(&dc->filled);
+        pthread_cond_destroy(&dc->drained);
+    }
+
+    switch (dc->type) {
+#ifdef HAVE_LIBZ
+    case DECOMPRESS_GZIP:
+        inflateEnd(&dc->zs);
+        break;
+#endif
+#ifdef HAVE_LIBZSTD
+    case DECOMPRESS_ZSTD:
+        ZSTD_freeDStream(dc->zstd);
+        break;
+#endif
+#ifdef HAVE_LIBLZ4
+    case DECOMPRESS_LZ4:
+        LZ4F_freeDecompressionContext(dc->lz4);
+        break;
+#endif
+    default:
+        break;
+    }
+
+    safe_free(dc->in);
+    safe_free(dc->ring);
+    safe_free(dc);
+}
+
+#else /* no decompression support */
+
+struct decompress_s {
+    int unused;
+};
+
+decompress_t *
+decompress_open(int fd _U_, decompress_type_t type, const u_char *head _U_,
+        size_t head_len _U_, char *errbuf)
+{
+    snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s compressed files are not supported by this build",
+            decompress_name(type));
+    return NULL;
+}
+
+ssize_t
+decompress_read(decompress_t *dc _U_, u_char *buf _U_, size_t len _U_)
+{
+    return -1;
+}
+
+const char *
+decompress_geterr(const decompress_t *dc _U_)
+{
+    return "decompression not supported";
+}
+
+void
+decompress_close(decompress_t *dc _U_)
+{
+}
+
+#endif
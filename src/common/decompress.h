@@ -0,0 +1,50 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2016 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DECOMPRESS_H__
+#define __DECOMPRESS_H__
+
+#include "defines.h"
+
+/*
+ * Streaming decompression of gzip, zstd and lz4 files. A thread reads
+ * and decompresses the file into a ring buffer ahead of the reader, so
+ * that decompression overlaps with sending.
+ */
+
+/* bytes needed to recognise a compressed file */
+#define DECOMPRESS_MAGIC_LEN    4
+
+typedef enum {
+    DECOMPRESS_NONE,
+    DECOMPRESS_GZIP,
+    DECOMPRESS_ZSTD,
+    DECOMPRESS_LZ4,
+} decompress_type_t;
+
+typedef struct decompress_s decompress_t;
+
+decompress_type_t decompress_detect(const u_char *data, size_t len);
+const char *decompress_name(decompress_type_t type);
+decompress_t *decompress_open(int fd, decompress_type_t type, const u_char *head,
+        size_t head_len, char *errbuf);
+ssize_t decompress_read(decompress_t *dc, u_char *buf, size_t len);
+const char *decompress_geterr(const decompress_t *dc);
+void decompress_close(decompress_t *dc);
+
+#endif /* __DECOMPRESS_H__ */
@@ -0,0 +1,312 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2016 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The buffers are used in turn: the thread fills the next empty one
+ * while the reader drains the oldest full one, so with N buffers up
+ * to N - 1 reads are queued ahead of the reader. Reads start from the
+ * aligned block holding the requested offset and the bytes before it
+ * are dropped.
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "directio.h"
+
+/* O_DIRECT offsets, sizes and buffers must be aligned to the block size */
+#define DIRECTIO_ALIGN          4096
+
+#if defined HAVE_PTHREAD && defined O_DIRECT
+
+typedef struct directio_buf_s {
+    u_char *data;
+    size_t len;
+    bool full;
+} directio_buf_t;
+
+struct directio_s {
+    int fd;
+    pthread_t thread;
+    bool started;
+
+    directio_buf_t *bufs;
+    int depth;
+    int fill;                       /* next buffer to fill, thread only */
+    int drain;                      /* buffer being read, reader only */
+    size_t pos;                     /* read position in bufs[drain] */
+    off_t next_off;                 /* file offset of the next read */
+
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t drained;
+    bool done;                      /* thread has finished */
+    bool closing;                   /* reader has gone */
+    char errbuf[PCAP_ERRBUF_SIZE];
+};
+
+/**
+ * fills the buffers in turn until the end of the file, an error or
+ * the reader closes the file
+ */
+static void *
+directio_thread(void *arg)
+{
+    directio_t *dio = arg;
+    directio_buf_t *b;
+    bool closing;
+    ssize_t ret;
+
+    tcpreplay_pin_helper();
+
+    for (;;) {
+        b = &dio->bufs[dio->fill];
+
+        pthread_mutex_lock(&dio->lock);
+        while (!dio->closing && b->full)
+            pthread_cond_wait(&dio->drained, &dio->lock);
+        closing = dio->closing;
+        pthread_mutex_unlock(&dio->lock);
+
+        if (closing)
+            break;
+
+        ret = pread(dio->fd, b->data, DIRECTIO_BUF_SIZE, dio->next_off);
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret < 0) {
+            snprintf(dio->errbuf, sizeof(dio->errbuf), "read error: %s", strerror(errno));
+            break;
+        }
+
+        dio->next_off += ret;
+        b->len = (size_t)ret;
+
+        pthread_mutex_lock(&dio->lock);
+        b->full = true;
+        pthread_cond_signal(&dio->filled);
+        pthread_mutex_unlock(&dio->lock);
+
+        /* only the last read of a file comes up short */
+        if (ret < DIRECTIO_BUF_SIZE)
+            break;
+
+        dio->fill = (dio->fill + 1) % dio->depth;
+    }
+
+    pthread_mutex_lock(&dio->lock);
+    dio->done = true;
+    pthread_cond_signal(&dio->filled);
+    pthread_mutex_unlock(&dio->lock);
+
+    return NULL;
+}
+
+/**
+ * \brief Opens a file for reading with O_DIRECT from the given offset
+ *
+ * 'depth' buffers of DIRECTIO_BUF_SIZE bytes are allocated. Returns
+ * NULL and fills in 'errbuf', which must be PCAP_ERRBUF_SIZE bytes, on
+ * error, for instance if the file system doesn't support O_DIRECT.
+ */
+directio_t *
+directio_open(const char *path, off_t offset, int depth, char *errbuf)
+{
+    directio_t *dio;
+    int i, err;
+
+    assert(path);
+    assert(errbuf);
+    assert(depth >= DIRECTIO_MIN_DEPTH && depth <= DIRECTIO_MAX_DEPTH);
+
+    dio = safe_malloc(sizeof(directio_t));
+    dio->depth = depth;
+    dio->next_off = offset & ~(off_t)(DIRECTIO_ALIGN - 1);
+    dio->pos = (size_t)(offset - dio->next_off);
+
+    if ((dio->fd = open(path, O_RDONLY | O_DIRECT)) < 0) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "unable to open %s for direct I/O: %s",
+                path, strerror(errno));
+        safe_free(dio);
+        return NULL;
+    }
+
+    dio->bufs = safe_malloc(sizeof(directio_buf_t) * depth);
+    for (i = 0; i < depth; i++) {
+        if ((err = posix_memalign((void **)&dio->bufs[i].data, DIRECTIO_ALIGN,
+                DIRECTIO_BUF_SIZE)) != 0) {
+            snprintf(errbuf, PCAP_ERRBUF_SIZE, "unable to allocate direct I/O buffers: %s",
+                    strerror(err));
+            directio_close(dio);
+            return NULL;
+        }
+    }
+
+    pthread_mutex_init(&dio->lock, NULL);
+    pthread_cond_init(&dio->filled, NULL);
+    pthread_cond_init(&dio->drained, NULL);
+
+    if ((err = pthread_create(&dio->thread, NULL, directio_thread, dio)) != 0) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "unable to start direct I/O thread: %s",
+                strerror(err));
+        pthread_mutex_destroy(&dio->lock);
+        pthread_cond_destroy(&dio->filled);
+        pthread_cond_destroy(&dio->drained);
+        directio_close(dio);
+        return NULL;
+    }
+
+    dio->started = true;
+    return dio;
+}
+
+/**
+ * \brief Copies up to 'len' bytes of the file into 'buf'
+ *
+ * Waits for the thread if the next buffer isn't full yet. Returns the
+ * number of bytes copied, 0 at the end of the file or -1 on error.
+ */
+ssize_t
+directio_read(directio_t *dio, u_char *buf, size_t len)
+{
+    directio_buf_t *b;
+    bool full, last;
+    size_t n = 0;
+
+    for (;;) {
+        b = &dio->bufs[dio->drain];
+
+        pthread_mutex_lock(&dio->lock);
+        while (!b->full && !dio->done)
+            pthread_cond_wait(&dio->filled, &dio->lock);
+        full = b->full;
+        pthread_mutex_unlock(&dio->lock);
+
+        if (!full)
+            return dio->errbuf[0] ? -1 : 0;
+
+        if (dio->pos < b->len) {
+            n = b->len - dio->pos;
+            if (n > len)
+                n = len;
+            memcpy(buf, b->data + dio->pos, n);
+            dio->pos += n;
+            if (dio->pos < b->len)
+                return (ssize_t)n;
+        }
+
+        /* hand the drained buffer back to the thread */
+        last = b->len < DIRECTIO_BUF_SIZE;
+        dio->pos = 0;
+        dio->drain = (dio->drain + 1) % dio->depth;
+        pthread_mutex_lock(&dio->lock);
+        b->full = false;
+        pthread_cond_signal(&dio->drained);
+        pthread_mutex_unlock(&dio->lock);
+
+        if (n > 0 || last)
+            return (ssize_t)n;
+    }
+}
+
+/**
+ * \brief Returns why directio_read() failed
+ */
+const char *
+directio_geterr(const directio_t *dio)
+{
+    return dio->errbuf;
+}
+
+/**
+ * \brief Stops the read ahead thread and closes the file
+ */
+void
+directio_close(directio_t *dio)
+{
+    int i;
+
+    if (dio == NULL)
+        return;
+
+    if (dio->started) {
+        pthread_mutex_lock(&dio->lock);
+        dio->closing = true;
+        pthread_cond_signal(&dio->drained);
+        pthread_mutex_unlock(&dio->lock);
+
+        pthread_join(dio->thread, NULL);
+
+        pthread_mutex_destroy(&dio->lock);
+        pthread_cond_destroy(&dio->filled);
+        pthread_cond_destroy(&dio->drained);
+    }
+
+    if (dio->bufs != NULL) {
+        for (i = 0; i < dio->depth; i++)
+            free(dio->bufs[i].data);
+        safe_free(dio->bufs);
+    }
+
+    close(dio->fd);
+    safe_free(dio);
+}
+
+#else /* no direct I/O support */
+
+struct directio_s {
+    int unused;
+};
+
+directio_t *
+directio_open(const char *path _U_, off_t offset _U_, int depth _U_, char *errbuf)
+{
+    snprintf(errbuf, PCAP_ERRBUF_SIZE, "direct I/O is not supported on this platform");
+    return NULL;
+}
+
+ssize_t
+directio_read(directio_t *dio _U_, u_char *buf _U_, size_t len _U_)
+{
+    return -1;
+}
+
+const char *
+directio_geterr(const directio_t *dio _U_)
+{
+    return "direct I/O not supported";
+}
+
+void
+directio_close(directio_t *dio _U_)
+{
+}
+
+#endif
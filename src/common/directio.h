@@ -0,0 +1,43 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2016 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DIRECTIO_H__
+#define __DIRECTIO_H__
+
+#include "defines.h"
+
+/*
+ * Sequential reads of a file with O_DIRECT, bypassing the page cache.
+ * A thread keeps a number of large aligned buffers filled ahead of
+ * the reader, so that several reads are always in flight.
+ */
+
+/* size of each read ahead buffer */
+#define DIRECTIO_BUF_SIZE       (8 * 1024 * 1024)
+
+#define DIRECTIO_MIN_DEPTH      2
+#define DIRECTIO_MAX_DEPTH      64
+
+typedef struct directio_s directio_t;
+
+directio_t *directio_open(const char *path, off_t offset, int depth, char *errbuf);
+ssize_t directio_read(directio_t *dio, u_char *buf, size_t len);
+const char *directio_geterr(const directio_t *dio);
+void directio_close(directio_t *dio);
+
+#endif /* __DIRECTIO_H__ */
@@ -23,7 +23,12 @@
 #include <string.h>
 #include "../../lib/sll.h"
 
-/* 5-tuple plus VLAN ID */
+/*
+ * 5-tuple plus VLAN ID
+ *
+ * The key is kept compact and a multiple of 32 bits wide so that it
+ * can be hashed and compared a word at a time.
+ */
 typedef struct flow_entry_data {
     union {
         struct in_addr in;
@@ -38,173 +43,484 @@ typedef struct flow_entry_data {
     uint16_t dst_port;
     uint16_t vlan;
     uint8_t protocol;
+    uint8_t unused;
 } flow_entry_data_t;
 
+#define FLOW_ENTRY_WORDS    (sizeof(flow_entry_data_t) / sizeof(uint32_t))
+
+/*
+ * A slot in the open addressing table, free if the key (hash) is
+ * FLOW_KEY_EMPTY. Entries are stored inline, padded to a cache line
+ * and the table is cache line aligned, so that a lookup which hits
+ * on its first probe touches a single cache line.
+ *
+ * Flows reclaimed by the timing wheel leave a FLOW_KEY_DELETED
+ * tombstone, which probes continue past and new flows reuse.
+ */
 typedef struct flow_hash_entry {
     uint32_t key;
+    uint32_t ts_last_seen;      /* seconds, only maintained if expiry set */
+    uint32_t wheel_next;        /* next entry in timing wheel slot + 1 */
+    uint32_t tag;               /* caller's data, see flow_decode_tag() */
     flow_entry_data_t data;
-    struct timeval ts_last_seen;
-    struct flow_hash_entry *next;
+    uint32_t unused[2];
 } flow_hash_entry_t;
 
+#define FLOW_CACHE_LINE         64
+
+#define FLOW_KEY_EMPTY          0
+#define FLOW_KEY_DELETED        1
+
+/*
+ * Timing wheel with one slot per second of packet time. Each flow
+ * sits in the slot for the second it will expire in. Slots are
+ * only revisited when the wheel turns, so a flow that was seen
+ * again since it was linked is simply moved to a later slot.
+ */
+#define FLOW_WHEEL_SLOTS        1024        /* must be a power of two */
+
+/*
+ * Keys of recently reclaimed flows, indexed by the low bits of the
+ * key, so that a flow which resumes is reported as expired rather
+ * than new without keeping every flow ever seen. A reclaimed flow
+ * whose key is overwritten by a later one counts as new.
+ */
+#define FLOW_RECLAIMED_SLOTS    (1 << 18)   /* must be a power of two */
+
 struct flow_hash_table {
     size_t num_buckets;
-    flow_hash_entry_t **buckets;
+    size_t num_entries;         /* active flows */
+    size_t num_deleted;         /* tombstones of reclaimed flows */
+    flow_hash_entry_t *buckets;
+    uint32_t *wheel;            /* slot heads, entry index + 1 */
+    uint32_t *reclaimed_keys;   /* FLOW_RECLAIMED_SLOTS keys */
+    int64_t wheel_now;          /* last second the wheel was turned to */
+    int64_t time_offset;        /* keeps the wheel moving across loops */
+    COUNTER reclaimed;
 };
 
+/* rebuild the table once it becomes 3/4 full, counting tombstones */
+#define FLOW_HASH_MAX_LOAD(n)   (((n) >> 1) + ((n) >> 2))
+
 static bool is_power_of_2(size_t n)
 {
     return (n != 0 && ((n & (n - 1)) == 0));
 }
 
 /*
- * Perl's hash function
+ * allocate 'n' empty slots, aligned to a cache line
+ */
+static flow_hash_entry_t *buckets_alloc(size_t n)
+{
+    void *buckets;
+    int err;
+
+    if ((err = posix_memalign(&buckets, FLOW_CACHE_LINE, sizeof(flow_hash_entry_t) * n)) != 0)
+        errx(-1, "unable to allocate %zu flow table slots: %s", n, strerror(err));
+
+    memset(buckets, 0, sizeof(flow_hash_entry_t) * n);
+    return buckets;
+}
+
+/*
+ * Hash the flow key a 32-bit word at a time.
  *
- * We do extensive hashing to prevent hash table collisions.
- * It will save time in the long run.
+ * Use the CRC32C instruction when the compiler tells us it is
+ * available, otherwise fall back to a multiply/rotate mix with a
+ * MurmurHash3 style finalizer. Never returns the empty or deleted slot
+ * markers.
+ */
+static inline uint32_t hash_func(const flow_entry_data_t *entry)
+{
+    const uint32_t *w = (const uint32_t *)entry;
+    uint32_t hv = 0;
+    size_t i;
+
+#if defined(__SSE4_2__)
+    for (i = 0; i < FLOW_ENTRY_WORDS; i++)
+        hv = __builtin_ia32_crc32si(hv, w[i]);
+#elif defined(__ARM_FEATURE_CRC32)
+    for (i = 0; i < FLOW_ENTRY_WORDS; i++)
+        hv = __builtin_arm_crc32cw(hv, w[i]);
+#else
+    for (i = 0; i < FLOW_ENTRY_WORDS; i++) {
+        hv ^= w[i] * 0xcc9e2d51;
+        hv = (hv << 13) | (hv >> 19);
+        hv = hv * 5 + 0xe6546b64;
+    }
+    hv ^= hv >> 16;
+    hv *= 0x85ebca6b;
+    hv ^= hv >> 13;
+    hv *= 0xc2b2ae35;
+    hv ^= hv >> 16;
+#endif
+
+    return hv > FLOW_KEY_DELETED ? hv : hv + 2;
+}
+
+/*
+ * compare two keys a word at a time
+ */
+static inline bool flow_entry_equal(const flow_entry_data_t *a,
+        const flow_entry_data_t *b)
+{
+    const uint32_t *wa = (const uint32_t *)a;
+    const uint32_t *wb = (const uint32_t *)b;
+    uint32_t diff = 0;
+    size_t i;
+
+    for (i = 0; i < FLOW_ENTRY_WORDS; i++)
+        diff |= wa[i] ^ wb[i];
+
+    return diff == 0;
+}
+
+/*
+ * Find the slot for this key using linear probing. Returns either
+ * the matching entry or the slot where it should be inserted, the
+ * first tombstone on the way if there is one.
+ */
+static inline flow_hash_entry_t *hash_find_slot(flow_hash_entry_t *buckets,
+        const size_t num_buckets, const uint32_t key,
+        const flow_entry_data_t *hash_entry)
+{
+    size_t mask = num_buckets - 1;
+    size_t i = key & mask;
+    flow_hash_entry_t *he;
+    flow_hash_entry_t *deleted = NULL;
+
+    while (1) {
+        he = &buckets[i];
+        /*
+         * compare the full hash before the key so that
+         * collisions rarely need a key compare
+         */
+        if (he->key == key && flow_entry_equal(&he->data, hash_entry))
+            return he;
+
+        if (he->key == FLOW_KEY_EMPTY)
+            return deleted != NULL ? deleted : he;
+
+        if (he->key == FLOW_KEY_DELETED && deleted == NULL)
+            deleted = he;
+
+        i = (i + 1) & mask;
+    }
+}
+
+/*
+ * link an entry into the wheel slot for the second it expires in
  */
-static inline uint32_t hash_func(const void *key, size_t length)
+static inline void wheel_link(flow_hash_table_t *fht, flow_hash_entry_t *he,
+        const int expiry)
 {
-    register size_t i = length;
-    register uint32_t hv = 0;
-    register const u_char *s = (u_char *)key;
-    while (i--) {
-        hv += *s++;
-        hv += (hv << 10);
-        hv ^= (hv >> 6);
+    uint32_t slot = (he->ts_last_seen + expiry + 1) & (FLOW_WHEEL_SLOTS - 1);
+
+    he->wheel_next = fht->wheel[slot];
+    fht->wheel[slot] = (uint32_t)(he - fht->buckets) + 1;
+}
+
+/*
+ * Rebuild the table without the tombstones of reclaimed flows. The
+ * table only doubles in size if at least half of its load is active
+ * flows, so tables whose flows keep being reclaimed stay the same size.
+ */
+static void hash_rebuild(flow_hash_table_t *fht, const int expiry)
+{
+    flow_hash_entry_t *old_buckets = fht->buckets;
+    size_t old_size = fht->num_buckets;
+    size_t new_size = old_size;
+    flow_hash_entry_t *he;
+    size_t i;
+
+    if (fht->num_entries >= FLOW_HASH_MAX_LOAD(old_size) / 2)
+        new_size <<= 1;
+
+    dbgx(1, "rebuilding flow hash table from %zu to %zu buckets",
+            old_size, new_size);
+
+    fht->buckets = buckets_alloc(new_size);
+    fht->num_buckets = new_size;
+    fht->num_deleted = 0;
+    if (fht->wheel)
+        memset(fht->wheel, 0, sizeof(uint32_t) * FLOW_WHEEL_SLOTS);
+
+    for (i = 0; i < old_size; i++) {
+        flow_hash_entry_t *new_he;
+
+        he = &old_buckets[i];
+        if (he->key == FLOW_KEY_EMPTY || he->key == FLOW_KEY_DELETED)
+            continue;
+
+        new_he = hash_find_slot(fht->buckets, new_size, he->key, &he->data);
+        memcpy(new_he, he, sizeof(*he));
+        if (fht->wheel)
+            wheel_link(fht, new_he, expiry);
     }
-    hv += (hv << 3);
-    hv ^= (hv >> 11);
-    hv += (hv << 15);
 
-    return hv;
+    safe_free(old_buckets);
 }
 
 /*
- * add hash value to hash table bucket
+ * Reclaim all idle flows linked to a wheel slot, remembering their
+ * keys, and move flows which have been seen since to their new slot.
  */
-static inline flow_hash_entry_t *hash_add_entry(flow_hash_table_t *fht, const uint32_t hv,
-        const uint32_t key, const flow_entry_data_t *hash_entry)
+static void wheel_expire_slot(flow_hash_table_t *fht, const uint32_t slot,
+        const int64_t now, const int expiry)
 {
+    uint32_t idx = fht->wheel[slot];
     flow_hash_entry_t *he;
 
-    assert(hv < fht->num_buckets);
+    fht->wheel[slot] = 0;
+    while (idx) {
+        he = &fht->buckets[idx - 1];
+        idx = he->wheel_next;
+
+        if (now > (int64_t)he->ts_last_seen + expiry) {
+            if (fht->reclaimed_keys == NULL)
+                fht->reclaimed_keys = safe_malloc(sizeof(uint32_t) * FLOW_RECLAIMED_SLOTS);
+            fht->reclaimed_keys[he->key & (FLOW_RECLAIMED_SLOTS - 1)] = he->key;
+
+            he->key = FLOW_KEY_DELETED;
+            --fht->num_entries;
+            ++fht->num_deleted;
+            ++fht->reclaimed;
+        } else {
+            wheel_link(fht, he, expiry);
+        }
+    }
+}
 
-    he = malloc(sizeof (*he));
-    if (!he) {
-        warn("out of memory");
-        return NULL;
+/*
+ * Turn the wheel to the packet time and return the time in
+ * wheel seconds.
+ *
+ * If time jumps backwards by more than the expiry period we
+ * assume we have started a new loop or file and carry on from
+ * where we left off, so that flows continue to age.
+ */
+static int64_t wheel_advance(flow_hash_table_t *fht, const struct timeval *tv,
+        const int expiry)
+{
+    int64_t now = (int64_t)tv->tv_sec + fht->time_offset;
+    int64_t ticks;
+
+    if (!fht->wheel) {
+        fht->wheel = safe_malloc(sizeof(uint32_t) * FLOW_WHEEL_SLOTS);
+        fht->time_offset = -(int64_t)tv->tv_sec;
+        return 0;
+    }
+
+    if (now + expiry < fht->wheel_now) {
+        fht->time_offset += fht->wheel_now - now;
+        now = fht->wheel_now;
     }
 
-    he->key = key;
-    he->next = fht->buckets[hv];
-    fht->buckets[hv] = he;
-    memcpy(&he->data, hash_entry, sizeof(he->data));
+    ticks = now - fht->wheel_now;
+    if (ticks <= 0)
+        return fht->wheel_now;
+
+    if (ticks > FLOW_WHEEL_SLOTS)
+        ticks = FLOW_WHEEL_SLOTS;
+
+    while (ticks--)
+        wheel_expire_slot(fht, (uint32_t)(now - ticks) & (FLOW_WHEEL_SLOTS - 1),
+                now, expiry);
 
-    return he;
+    fht->wheel_now = now;
+    return now;
 }
 
 /*
  * Search for this entry in the hash table and
  * insert it if not found. Report whether this
- * is a new, existing or expired flow.
+ * is a new or existing flow.
  *
- * Only check for expiry if 'expiry' is set
+ * If 'expiry' is set, idle flows are reclaimed by the timing
+ * wheel before the lookup, so a flow that resumes after being
+ * idle for longer than 'expiry' seconds is reported as expired,
+ * as long as its key is still in reclaimed_keys.
+ *
+ * The entry of the flow is returned in 'found'.
  */
 static inline flow_entry_type_t hash_put_data(flow_hash_table_t *fht, const uint32_t key,
-        const flow_entry_data_t *hash_entry, const struct timeval *tv, const int expiry)
+        const flow_entry_data_t *hash_entry, const struct timeval *tv, const int expiry,
+        flow_hash_entry_t **found)
 {
-    uint32_t hash_value = key & (fht->num_buckets - 1);
     flow_hash_entry_t *he;
-    flow_entry_type_t res = FLOW_ENTRY_INVALID;
+    flow_entry_type_t res;
+    int64_t now = 0;
 
-    for (he = fht->buckets[hash_value]; he; he = he->next) {
-        /*
-         * found an existing entry with similar hash. double
-         * check to see if it is our flow or just a collision
-         */
-        if (he->key == key && !memcmp(&he->data, hash_entry, sizeof(he->data)))
-            break;
-    }
+    if (expiry)
+        now = wheel_advance(fht, tv, expiry);
 
-    if (he) {
-        /* this is not a new flow */
-        if (expiry && tv->tv_sec > (expiry + he->ts_last_seen.tv_sec))
-            res = FLOW_ENTRY_EXPIRED;
-        else
-            res = FLOW_ENTRY_EXISTING;
+    he = hash_find_slot(fht->buckets, fht->num_buckets, key, hash_entry);
 
-        if (expiry)
-            memcpy(&he->ts_last_seen, tv, sizeof(he->ts_last_seen));
+    if (he->key == key) {
+        /* this is not a new flow */
+        res = FLOW_ENTRY_EXISTING;
+        if (expiry && now > he->ts_last_seen)
+            he->ts_last_seen = (uint32_t)now;
     } else {
         /* this is a new flow */
-        if ((he = hash_add_entry(fht, hash_value, key, hash_entry)) != NULL) {
-            res = FLOW_ENTRY_NEW;
+        if (fht->num_entries + fht->num_deleted >= FLOW_HASH_MAX_LOAD(fht->num_buckets)) {
+            hash_rebuild(fht, expiry);
+            he = hash_find_slot(fht->buckets, fht->num_buckets, key, hash_entry);
+        }
 
-            if (expiry)
-                memcpy(&he->ts_last_seen, tv, sizeof(he->ts_last_seen));
-        } else
-            res = FLOW_ENTRY_INVALID;
+        if (he->key == FLOW_KEY_DELETED)
+            --fht->num_deleted;
+
+        he->key = key;
+        he->tag = 0;
+        memcpy(&he->data, hash_entry, sizeof(he->data));
+        ++fht->num_entries;
+        res = FLOW_ENTRY_NEW;
+
+        if (fht->reclaimed_keys != NULL &&
+                fht->reclaimed_keys[key & (FLOW_RECLAIMED_SLOTS - 1)] == key) {
+            /* the flow was reclaimed by the wheel and has resumed */
+            fht->reclaimed_keys[key & (FLOW_RECLAIMED_SLOTS - 1)] = FLOW_KEY_EMPTY;
+            res = FLOW_ENTRY_EXPIRED;
+        }
+
+        if (expiry) {
+            he->ts_last_seen = (uint32_t)now;
+            wheel_link(fht, he, expiry);
+        }
     }
 
     dbgx(2, "flow type=%d\n", (int)res);
+    *found = he;
     return res;
 }
 
 /*
- * Decode the packet, study it's flow status and report
+ * Extract the 5-tuple plus VLAN of a decoded packet.
+ * Returns false if the packet is not part of a flow.
  */
-flow_entry_type_t flow_decode(flow_hash_table_t *fht, const struct pcap_pkthdr *pkthdr,
-        const u_char *pktdata, const int datalink, const int expiry)
+static bool flow_entry_extract(flow_entry_data_t *entry,
+        const struct pcap_pkthdr *pkthdr, const u_char *pktdata,
+        const packet_meta_t *meta)
 {
-    uint16_t ether_type = 0;
-    vlan_hdr_t *vlan_hdr;
-    ipv4_hdr_t *ip_hdr = NULL;
-    ipv6_hdr_t *ip6_hdr = NULL;
+    ipv4_hdr_t *ip_hdr;
+    ipv6_hdr_t *ip6_hdr;
     tcp_hdr_t *tcp_hdr;
     udp_hdr_t *udp_hdr;
     icmpv4_hdr_t *icmp_hdr;
+    const u_char *l4 = pktdata + meta->l4_offset;
+
+    if (!meta->l4_offset)
+        return false;
+
+    memset(entry, 0, sizeof(*entry));
+    entry->vlan = htons(meta->vlan);
+    entry->protocol = meta->protocol;
+
+    if (meta->ether_type == ETHERTYPE_IP) {
+        ip_hdr = (ipv4_hdr_t *)(pktdata + meta->l2_len);
+        entry->src_ip.in = ip_hdr->ip_src;
+        entry->dst_ip.in = ip_hdr->ip_dst;
+    } else {
+        ip6_hdr = (ipv6_hdr_t *)(pktdata + meta->l2_len);
+        memcpy(&entry->src_ip.in6, &ip6_hdr->ip_src, sizeof(entry->src_ip.in6));
+        memcpy(&entry->dst_ip.in6, &ip6_hdr->ip_dst, sizeof(entry->dst_ip.in6));
+    }
+
+    switch (meta->protocol) {
+    case IPPROTO_UDP:
+        if (pkthdr->caplen < meta->l4_offset + TCPR_UDP_H)
+            break;
+
+        udp_hdr = (udp_hdr_t*)l4;
+        entry->src_port = udp_hdr->uh_sport;
+        entry->dst_port = udp_hdr->uh_dport;
+        break;
+
+    case IPPROTO_TCP:
+        if (pkthdr->caplen < meta->l4_offset + 4)
+            break;
+
+        tcp_hdr = (tcp_hdr_t*)l4;
+        entry->src_port = tcp_hdr->th_sport;
+        entry->dst_port = tcp_hdr->th_dport;
+        break;
+
+    case IPPROTO_ICMP:
+    case IPPROTO_ICMPV6:
+        if (pkthdr->caplen < meta->l4_offset + 2)
+            break;
+
+        icmp_hdr = (icmpv4_hdr_t*)l4;
+        entry->src_port = icmp_hdr->icmp_type;
+        entry->dst_port = icmp_hdr->icmp_code;
+    }
+
+    return true;
+}
+
+/*
+ * Decode the link and network layer headers of a packet into 'meta'.
+ *
+ * Packets that are not IPv4 or IPv6, or are too short, have an
+ * ether_type of zero or an l4_offset of zero. Returns -1 if the
+ * datalink type is not supported.
+ */
+int packet_meta_decode(packet_meta_t *meta, const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata, const int datalink)
+{
+    uint32_t caplen = pkthdr->caplen;
+    uint32_t l2_len = 0;
+    uint32_t l3_len;
+    uint16_t ether_type = 0;
+    vlan_hdr_t *vlan_hdr;
+    ipv4_hdr_t *ip_hdr;
+    ipv6_hdr_t *ip6_hdr;
     hdlc_hdr_t *hdlc_hdr;
     sll_hdr_t *sll_hdr;
     struct tcpr_pppserial_hdr *ppp;
     flow_entry_data_t entry;
-    int l2_len = 0;
-    int ip_len;
-    uint8_t protocol;
-    uint32_t hash;
 
-    assert(fht);
+    assert(meta);
     assert(pktdata);
 
-    /*
-     * extract the 5-tuple and populate the entry data
-     */
-
-    memset(&entry, 0, sizeof(entry));
+    memset(meta, 0, sizeof(*meta));
 
     switch (datalink) {
     case DLT_LINUX_SLL:
         l2_len = 16;
+        if (caplen < l2_len)
+            return 0;
+
         sll_hdr = (sll_hdr_t *)pktdata;
-        ether_type = sll_hdr->sll_protocol;
+        ether_type = ntohs(sll_hdr->sll_protocol);
         break;
 
     case DLT_PPP_SERIAL:
         l2_len = 4;
+        if (caplen < l2_len)
+            return 0;
+
         ppp = (struct tcpr_pppserial_hdr *)pktdata;
         if (ntohs(ppp->protocol) == 0x0021)
-            ether_type = htons(ETHERTYPE_IP);
+            ether_type = ETHERTYPE_IP;
         else
-            ether_type = ppp->protocol;
+            ether_type = ntohs(ppp->protocol);
         break;
 
     case DLT_C_HDLC:
         l2_len = 4;
+        if (caplen < l2_len)
+            return 0;
+
         hdlc_hdr = (hdlc_hdr_t *)pktdata;
-        ether_type = hdlc_hdr->protocol;
+        ether_type = ntohs(hdlc_hdr->protocol);
         break;
 
     case DLT_RAW:
+        if (caplen < 1)
+            return 0;
+
         if ((pktdata[0] >> 4) == 4)
             ether_type = ETHERTYPE_IP;
         else if ((pktdata[0] >> 4) == 6)
@@ -212,6 +528,9 @@ flow_entry_type_t flow_decode(flow_hash_table_t *fht, const struct pcap_pkthdr *
         break;
 
     case DLT_JUNIPER_ETHER:
+        if (caplen < 6)
+            return 0;
+
         if (memcmp(pktdata, "MGC", 3))
             warnx("No Magic Number found: %s (0x%x)",
                  pcap_datalink_val_to_description(datalink), datalink);
@@ -223,11 +542,17 @@ flow_entry_type_t flow_decode(flow_hash_table_t *fht, const struct pcap_pkthdr *
             l2_len = 4; /* no header extensions */
         /* fall through */
     case DLT_EN10MB:
+        if (caplen < l2_len + sizeof(eth_hdr_t))
+            return 0;
+
         ether_type = ntohs(((eth_hdr_t*)(pktdata + l2_len))->ether_type);
 
         while (ether_type == ETHERTYPE_VLAN) {
+            if (caplen < l2_len + 4 + sizeof(eth_hdr_t))
+                return 0;
+
             vlan_hdr = (vlan_hdr_t *)(pktdata + l2_len);
-            entry.vlan = vlan_hdr->vlan_priority_c_vid & htons(0xfff);
+            meta->vlan = ntohs(vlan_hdr->vlan_priority_c_vid) & 0xfff;
             ether_type = ntohs(vlan_hdr->vlan_len);
             l2_len += 4;
         }
@@ -238,85 +563,128 @@ flow_entry_type_t flow_decode(flow_hash_table_t *fht, const struct pcap_pkthdr *
     default:
         warnx("Unable to process unsupported DLT type: %s (0x%x)",
              pcap_datalink_val_to_description(datalink), datalink);
-        return FLOW_ENTRY_INVALID;
+        meta->flags |= PACKET_META_INVALID;
+        return -1;
     }
 
+    meta->l2_len = (uint16_t)l2_len;
+
     if (ether_type == ETHERTYPE_IP) {
-        ip_hdr = (ipv4_hdr_t *)(pktdata + l2_len);
+        if (caplen < l2_len + TCPR_IPV4_H)
+            return 0;
 
-        if (ip_hdr->ip_v != 4)
-            return FLOW_ENTRY_NON_IP;
+        ip_hdr = (ipv4_hdr_t *)(pktdata + l2_len);
+        l3_len = ip_hdr->ip_hl * 4;
+        if (ip_hdr->ip_v != 4 || l3_len < TCPR_IPV4_H)
+            return 0;
 
-        ip_len = ip_hdr->ip_hl * 4;
-        protocol = ip_hdr->ip_p;
-        entry.src_ip.in = ip_hdr->ip_src;
-        entry.dst_ip.in = ip_hdr->ip_dst;
+        meta->protocol = ip_hdr->ip_p;
     } else if (ether_type == ETHERTYPE_IP6) {
-
-        if ((pktdata[0] >> 4) != 6)
-            return FLOW_ENTRY_NON_IP;
+        if (caplen < l2_len + TCPR_IPV6_H)
+            return 0;
 
         ip6_hdr = (ipv6_hdr_t *)(pktdata + l2_len);
-        ip_len = sizeof(*ip6_hdr);
-        protocol = ip6_hdr->ip_nh;
+        if ((pktdata[l2_len] >> 4) != 6)
+            return 0;
+
+        l3_len = TCPR_IPV6_H;
+        meta->protocol = ip6_hdr->ip_nh;
 
-        if (protocol == 0) {
-            struct tcpr_ipv6_ext_hdr_base *ext = (struct tcpr_ipv6_ext_hdr_base *)(ip6_hdr + 1);
-            ip_len += (ext->ip_len + 1) * 8;
-            protocol = ext->ip_nh;
+        if (meta->protocol == 0) {
+            struct tcpr_ipv6_ext_hdr_base *ext;
+
+            if (caplen < l2_len + l3_len + sizeof(*ext))
+                return 0;
+
+            ext = (struct tcpr_ipv6_ext_hdr_base *)(ip6_hdr + 1);
+            l3_len += (ext->ip_len + 1) * 8;
+            meta->protocol = ext->ip_nh;
         }
-        memcpy(&entry.src_ip.in6, &ip6_hdr->ip_src, sizeof(entry.src_ip.in6));
-        memcpy(&entry.dst_ip.in6, &ip6_hdr->ip_dst, sizeof(entry.dst_ip.in6));
     } else {
-        return FLOW_ENTRY_NON_IP;
+        return 0;
     }
 
-    entry.protocol = protocol;
+    meta->ether_type = ether_type;
+    meta->l4_offset = (uint16_t)(l2_len + l3_len);
 
-    switch (protocol) {
-    case IPPROTO_UDP:
-        udp_hdr = (udp_hdr_t*)(pktdata + ip_len + l2_len);
-        entry.src_port = udp_hdr->uh_sport;
-        entry.dst_port = udp_hdr->uh_dport;
-        break;
+    if (flow_entry_extract(&entry, pkthdr, pktdata, meta))
+        meta->flow_id = hash_func(&entry);
 
-    case IPPROTO_TCP:
-        tcp_hdr = (tcp_hdr_t*)(pktdata + ip_len + l2_len);
-        entry.src_port = tcp_hdr->th_sport;
-        entry.dst_port = tcp_hdr->th_dport;
-        break;
+    return 0;
+}
 
-    case IPPROTO_ICMP:
-    case IPPROTO_ICMPV6:
-        icmp_hdr = (icmpv4_hdr_t*)(pktdata + ip_len + l2_len);
-        entry.src_port = icmp_hdr->icmp_type;
-        entry.dst_port = icmp_hdr->icmp_code;
-    }
+/*
+ * Study the flow status of a packet that has already been
+ * decoded by packet_meta_decode() and report
+ */
+flow_entry_type_t flow_decode_meta(flow_hash_table_t *fht, const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata, const packet_meta_t *meta, const int expiry)
+{
+    flow_entry_data_t entry;
+    flow_hash_entry_t *he;
 
-    /* hash the 5-tuple */
-    hash = hash_func(&entry, sizeof(entry));
+    assert(fht);
+    assert(pktdata);
+    assert(meta);
+
+    if (meta->flags & PACKET_META_INVALID)
+        return FLOW_ENTRY_INVALID;
+
+    if (!meta->flow_id || !flow_entry_extract(&entry, pkthdr, pktdata, meta))
+        return FLOW_ENTRY_NON_IP;
 
-    return hash_put_data(fht, hash, &entry, &pkthdr->ts, expiry);
+    return hash_put_data(fht, meta->flow_id, &entry, &pkthdr->ts, expiry, &he);
 }
 
-static void flow_cache_clear(flow_hash_table_t *fht)
+/*
+ * Like flow_decode_meta() without expiry, also swapping '*tag' with
+ * the tag kept for the flow. The tag of a new flow is 0, so callers
+ * can find the previous packet of each flow by tagging its packets.
+ */
+flow_entry_type_t flow_decode_tag(flow_hash_table_t *fht, const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata, const packet_meta_t *meta, uint32_t *tag)
 {
-    flow_hash_entry_t *fhe = NULL;
-    flow_hash_entry_t *fhe_tmp = NULL;
-    size_t i;
+    flow_entry_data_t entry;
+    flow_hash_entry_t *he;
+    flow_entry_type_t res;
+    uint32_t prev;
 
-    for (i = 0; i < fht->num_buckets; i++) {
-        if ( (fhe = fht->buckets[i]) ) {
-            while (fhe) {
-                fhe_tmp = fhe;
-                fhe = fhe->next;
-                free(fhe_tmp);
-            }
-            fht->buckets[i] = NULL;
-        }
-    }
+    assert(fht);
+    assert(pktdata);
+    assert(meta);
+    assert(tag);
+
+    if (meta->flags & PACKET_META_INVALID)
+        return FLOW_ENTRY_INVALID;
+
+    if (!meta->flow_id || !flow_entry_extract(&entry, pkthdr, pktdata, meta))
+        return FLOW_ENTRY_NON_IP;
+
+    res = hash_put_data(fht, meta->flow_id, &entry, &pkthdr->ts, 0, &he);
+    prev = he->tag;
+    he->tag = *tag;
+    *tag = prev;
+
+    return res;
+}
+
+/*
+ * Decode the packet, study it's flow status and report
+ */
+flow_entry_type_t flow_decode(flow_hash_table_t *fht, const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata, const int datalink, const int expiry)
+{
+    packet_meta_t meta;
+
+    packet_meta_decode(&meta, pkthdr, pktdata, datalink);
+
+    return flow_decode_meta(fht, pkthdr, pktdata, &meta, expiry);
 }
 
+/*
+ * Preallocate a table of 'n' slots. The table grows as
+ * required so 'n' is only a hint of the expected flow count.
+ */
 flow_hash_table_t *flow_hash_table_init(size_t n)
 {
     flow_hash_table_t *fht;
@@ -325,17 +693,34 @@ flow_hash_table_t *flow_hash_table_init(size_t n)
 
     fht = safe_malloc(sizeof(*fht));
     fht->num_buckets = n;
-    fht->buckets = safe_malloc(sizeof(flow_hash_entry_t) * n);
+    fht->buckets = buckets_alloc(n);
 
     return fht;
 }
 
+/*
+ * number of flows currently tracked
+ */
+size_t flow_hash_table_active(const flow_hash_table_t *fht)
+{
+    return fht->num_entries;
+}
+
+/*
+ * number of times the timing wheel has reclaimed an idle flow
+ */
+COUNTER flow_hash_table_reclaimed(const flow_hash_table_t *fht)
+{
+    return fht->reclaimed;
+}
+
 void flow_hash_table_release(flow_hash_table_t *fht)
 {
     if (!fht)
         return;
 
-    flow_cache_clear(fht);
-    free(fht->buckets);
-    free(fht);
+    safe_free(fht->wheel);
+    safe_free(fht->reclaimed_keys);
+    safe_free(fht->buckets);
+    safe_free(fht);
 }
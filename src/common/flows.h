@@ -21,7 +21,7 @@
 #include "defines.h"
 #include "common.h"
 
-#define DEFAULT_FLOW_HASH_BUCKET_SIZE (1 << 16)       /* 64K - must be a power of two */
+#define DEFAULT_FLOW_HASH_BUCKET_SIZE (1 << 16)       /* 64K initial slots - must be a power of two */
 
 typedef enum flow_entry_type_e {
     FLOW_ENTRY_INVALID,     /* unknown packet type */
@@ -33,9 +33,36 @@ typedef enum flow_entry_type_e {
 
 typedef struct flow_hash_table flow_hash_table_t;
 
+/*
+ * Link and network layer details of a packet, decoded once when
+ * the packet is preloaded so that they don't need to be decoded
+ * again every time it is sent.
+ */
+typedef struct packet_meta_s {
+    uint16_t l2_len;        /* link layer length, aka offset of L3 header */
+    uint16_t l4_offset;     /* offset of L4 header, 0 if not IP */
+    uint16_t ether_type;    /* L3 protocol, host byte order */
+    uint16_t vlan;          /* innermost VLAN ID */
+    uint8_t protocol;       /* L4 protocol */
+    int8_t dir;             /* tcpr_dir_t from tcpprep cache file */
+    uint8_t flags;
+    uint8_t intf_id;        /* pcapng capture interface, modulo 256 */
+    uint32_t flow_id;       /* hash of the flow key, 0 if not a flow */
+} packet_meta_t;
+
+#define PACKET_META_INVALID     0x01    /* unsupported DLT */
+
 flow_hash_table_t *flow_hash_table_init(size_t n);
 void flow_hash_table_release(flow_hash_table_t * table);
+size_t flow_hash_table_active(const flow_hash_table_t *fht);
+COUNTER flow_hash_table_reclaimed(const flow_hash_table_t *fht);
+int packet_meta_decode(packet_meta_t *meta, const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata, const int datalink);
 flow_entry_type_t flow_decode(flow_hash_table_t *fht, const struct pcap_pkthdr *pkthdr,
         const u_char *pktdata, const int datalink, const int expiry);
+flow_entry_type_t flow_decode_meta(flow_hash_table_t *fht, const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata, const packet_meta_t *meta, const int expiry);
+flow_entry_type_t flow_decode_tag(flow_hash_table_t *fht, const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata, const packet_meta_t *meta, uint32_t *tag);
 
 #endif /* FLOWS_H_ */
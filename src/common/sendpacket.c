@@ -144,6 +144,15 @@
 #include <net/if_arp.h>
 #include <netpacket/packet.h>
 
+#if defined HAVE_SO_TXTIME || defined HAVE_TX_TIMESTAMPING
+#include <linux/net_tstamp.h>
+#endif
+
+#ifdef HAVE_TX_TIMESTAMPING
+#include <linux/filter.h>
+#include <linux/sockios.h>
+#endif
+
 #ifdef HAVE_TX_RING
 #include "txring.h"
 #endif
@@ -151,9 +160,17 @@
 static sendpacket_t *sendpacket_open_pf(const char *, char *);
 static struct tcpr_ether_addr *sendpacket_get_hwaddr_pf(sendpacket_t *);
 static int get_iface_index(int fd, const char *device, char *);
+static int sendpacket_open_send_sock(sendpacket_t *) _U_;
+static int sendpacket_sendmsg(sendpacket_t *, const u_char *, size_t);
+static uint64_t sendpacket_sched_time(sendpacket_t *);
 
 #endif /* HAVE_PF_PACKET */
 
+static int get_iface_numa_node(const char *device);
+#ifdef HAVE_LINUX_VIRTIO_NET_H
+static int get_iface_mtu(const char *device);
+#endif
+
 #ifdef HAVE_TUNTAP
 #ifdef HAVE_LINUX
 #include <net/if.h>
@@ -162,6 +179,11 @@ static int get_iface_index(int fd, const char *device, char *);
 #define TUNTAP_DEVICE_PREFIX "/dev/"
 #endif
 static sendpacket_t *sendpacket_open_tuntap(const char *, char *);
+static void sendpacket_close_queues(sendpacket_t *);
+#ifdef HAVE_LINUX
+static int tuntap_open_queue(const char *, short, char *);
+static int tuntap_reopen(sendpacket_t *, int, int);
+#endif
 #endif
 
 #if defined HAVE_BPF && ! defined INJECT_METHOD
@@ -220,6 +242,148 @@ static sendpacket_t * sendpacket_open_quick_tx(const char *, char *) _U_;
 static void sendpacket_close_quick_tx(sendpacket_t *sp);
 #endif /* HAVE_QUICK_TX */
 
+/**
+ * bytes sent in front of each packet
+ */
+static inline size_t
+sendpacket_hdr_len(sendpacket_t *sp _U_)
+{
+#ifdef HAVE_LINUX_VIRTIO_NET_H
+    if (sp->vnet != NULL)
+        return sizeof(sp->vnet->vh);
+#endif
+    return 0;
+}
+
+#ifdef HAVE_IO_URING
+/**
+ * io_uring completion callback, does the accounting at the end of
+ * sendpacket() for each packet sent through the ring
+ */
+static bool
+sendpacket_uring_done(void *arg, size_t len, int res)
+{
+    sendpacket_t *sp = arg;
+
+    /* out of buffers, or hit max PHY speed, silently retry */
+    if (res == -EAGAIN && !sp->abort) {
+        sp->retry_eagain ++;
+        return true;
+    } else if (res == -ENOBUFS && !sp->abort) {
+        sp->retry_enobufs ++;
+        return true;
+    }
+
+    if (res < 0) {
+        sendpacket_seterr(sp, "Error with io_uring [" COUNTER_SPEC "]: %s (errno = %d)",
+                sp->sent + sp->failed + 1, strerror(-res), -res);
+        sp->failed ++;
+        return false;
+    }
+
+    /* leave out the virtio-net header */
+    res -= sendpacket_hdr_len(sp);
+    len -= sendpacket_hdr_len(sp);
+    if ((size_t)res != len) {
+        sendpacket_seterr(sp, "Only able to write %d bytes out of %u bytes total",
+                res, len);
+        sp->trunc_packets ++;
+    } else {
+        sp->bytes_sent += len;
+        sp->sent ++;
+    }
+    return false;
+}
+#endif /* HAVE_IO_URING */
+
+/**
+ * points 'iov' at the packet, behind a virtio-net header and patched
+ * copy of its headers if the kernel is doing offloads. Returns the
+ * number of iovecs used
+ */
+static int
+sendpacket_iov(sendpacket_t *sp, const u_char *data, size_t len, struct iovec *iov)
+{
+#ifdef HAVE_LINUX_VIRTIO_NET_H
+    size_t hdr_len;
+
+    if (sp->vnet != NULL) {
+        hdr_len = vnet_hdr_fill(sp->vnet, data, len, sp->offload, sp->mtu);
+        iov[0].iov_base = sp->vnet;
+        iov[0].iov_len = sizeof(sp->vnet->vh) + hdr_len;
+        iov[1].iov_base = (void *)(data + hdr_len);
+        iov[1].iov_len = len - hdr_len;
+        return 2;
+    }
+#endif
+
+    iov[0].iov_base = (void *)data;
+    iov[0].iov_len = len;
+    return 1;
+}
+
+/**
+ * picks the tuntap queue for a packet from its IP addresses and ports,
+ * so that both directions of a flow use the same queue
+ */
+static int
+sendpacket_queue(sendpacket_t *sp, const u_char *data, size_t len)
+{
+    uint32_t hash = 0, word;
+    uint16_t ether_type, port;
+    size_t l2_len, l4_off, addr_off, addr_len, i;
+    uint8_t proto;
+
+    if (sp->queues < 2 || len < TCPR_ETH_H)
+        return 0;
+
+    l2_len = get_l2len(data, len, DLT_EN10MB);
+    if (len < l2_len + TCPR_IPV4_H)
+        return 0;
+    memcpy(&ether_type, data + l2_len - 2, sizeof(ether_type));
+
+    switch (ntohs(ether_type)) {
+    case ETHERTYPE_IP:
+        addr_off = l2_len + 12;
+        addr_len = 8;
+        proto = data[l2_len + 9];
+        l4_off = l2_len + ((data[l2_len] & 0x0f) << 2);
+        /* only first fragments have ports */
+        if ((data[l2_len + 6] & 0x1f) != 0 || data[l2_len + 7] != 0)
+            proto = 0;
+        break;
+
+    case ETHERTYPE_IP6:
+        if (len < l2_len + TCPR_IPV6_H)
+            return 0;
+        addr_off = l2_len + 8;
+        addr_len = 32;
+        proto = data[l2_len + 6];
+        l4_off = l2_len + TCPR_IPV6_H;
+        break;
+
+    default:
+        return 0;
+    }
+
+    for (i = 0; i < addr_len; i += sizeof(word)) {
+        memcpy(&word, data + addr_off + i, sizeof(word));
+        hash ^= word;
+    }
+
+    if ((proto == IPPROTO_TCP || proto == IPPROTO_UDP) && len >= l4_off + 4) {
+        memcpy(&port, data + l4_off, sizeof(port));
+        hash ^= port;
+        memcpy(&port, data + l4_off + 2, sizeof(port));
+        hash ^= port;
+    }
+
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3b;
+    hash ^= hash >> 16;
+    return (int)(hash % (uint32_t)sp->queues);
+}
+
 /**
  * returns number of bytes sent on success or -1 on error
  * Note: it is theoretically possible to get a return code >0 and < len
@@ -233,7 +397,11 @@ static void sendpacket_close_quick_tx(sendpacket_t *sp);
 int
 sendpacket(sendpacket_t *sp, const u_char *data, size_t len, struct pcap_pkthdr *pkthdr)
 {
-    int retcode = 0, val;
+    struct iovec iov[2];
+    int retcode = 0, val, iovcnt, queue;
+#ifdef HAVE_PF_PACKET
+    uint64_t sched_ns = 0;
+#endif
     static u_char buffer[10000]; /* 10K bytes, enough for jumbo frames + pkthdr
                                   * larger than page size so made static to
                                   * prevent page misses on stack
@@ -246,6 +414,21 @@ sendpacket(sendpacket_t *sp, const u_char *data, size_t len, struct pcap_pkthdr
     if (len <= 0)
         return -1;
 
+#ifdef HAVE_IO_URING
+    /* queued packets are counted by sendpacket_uring_done() when they finish */
+    if (sp->uring != NULL) {
+        sp->attempt ++;
+        iovcnt = sendpacket_iov(sp, data, len, iov);
+        if (uring_put(sp->uring, sendpacket_queue(sp, data, len), iov, iovcnt) < 0) {
+            sendpacket_seterr(sp, "Error with io_uring [" COUNTER_SPEC "]: %s (errno = %d)",
+                    sp->sent + sp->failed + 1, strerror(errno), errno);
+            sp->failed ++;
+            return -1;
+        }
+        return (int)len;
+    }
+#endif
+
 TRY_SEND_AGAIN:
     sp->attempt ++;
 
@@ -296,18 +479,34 @@ TRY_SEND_AGAIN:
             break;
 
         case SP_TYPE_TUNTAP:
-            retcode = write(sp->handle.fd, (void *)data, len);
+            iovcnt = sendpacket_iov(sp, data, len, iov);
+            queue = sendpacket_queue(sp, data, len);
+            retcode = writev(sp->queue_fds != NULL ? sp->queue_fds[queue] : sp->handle.fd,
+                    iov, iovcnt);
+            if (retcode > 0)
+                retcode -= sendpacket_hdr_len(sp);
             break;
 
             /* Linux PF_PACKET and TX_RING */
         case SP_TYPE_PF_PACKET:
         case SP_TYPE_TX_RING:
 #if defined HAVE_PF_PACKET
+            if (sp->txstamp != NULL)
+                sched_ns = sendpacket_sched_time(sp);
+
+            if (sp->txtime_on || sp->txstamp != NULL || sendpacket_hdr_len(sp) > 0) {
+                retcode = sendpacket_sendmsg(sp, data, len);
+            } else {
 #ifdef HAVE_TX_RING
-            retcode = (int)txring_put(sp->tx_ring, data, len);
+                retcode = (int)txring_put(sp->tx_ring, data, len);
 #else
-            retcode = (int)send(sp->handle.fd, (void *)data, len, 0);
+                retcode = (int)send(sp->handle.fd, (void *)data, len, 0);
 #endif
+            }
+
+            /* the kernel numbers packets it drops as well */
+            if (sp->txstamp != NULL && (retcode >= 0 || errno == ENOBUFS))
+                txstamp_sent(sp->txstamp, retcode >= 0 ? sched_ns : 0);
 
             /* out of buffers, or hit max PHY speed, silently retry
              * as long as we're not told to abort
@@ -552,6 +751,7 @@ sendpacket_open(const char *device, char *errbuf, tcpr_dir_t direction,
     if (sp) {
         sp->open = 1;
         sp->cache_dir = direction;
+        sp->numa_node = get_iface_numa_node(device);
     } else {
         errx(-1, "failed to open device %s: %s", device, errbuf);
     }
@@ -587,10 +787,24 @@ sendpacket_getstat(sendpacket_t *sp, char *buf, size_t buf_size)
                 "\tFlow packets:              " COUNTER_SPEC "\n"
                 "\tNon-flow packets:          " COUNTER_SPEC "\n"
                 "\tInvalid flow packets:      " COUNTER_SPEC "\n",
-                sp->flows, sp->flows_expired, sp->flows_expired, sp->flow_packets,
+                sp->flows, sp->flows_unique, sp->flows_expired, sp->flow_packets,
                 sp->flow_non_flow_packets, sp->flows_invalid_packets);
     }
 
+    if (sp->txstamp != NULL && offset > 0) {
+        txstamp_stats_t st;
+
+        txstamp_get_stats(sp->txstamp, &st, SENDPACKET_TXSTAMP_WAIT_MS);
+        offset += snprintf(&buf[offset], buf_size - offset,
+                "\tTX timestamps:             " COUNTER_SPEC " of " COUNTER_SPEC "\n",
+                st.stamps, st.packets);
+        if (st.stamps > 0)
+            offset += snprintf(&buf[offset], buf_size - offset,
+                    "\tDeparture error (usec):    min %.3f avg %.3f max %.3f stddev %.3f\n",
+                    st.min_ns / 1000.0, st.avg_ns / 1000.0, st.max_ns / 1000.0,
+                    st.stddev_ns / 1000.0);
+    }
+
     return offset;
 }
 
@@ -601,6 +815,15 @@ int
 sendpacket_close(sendpacket_t *sp)
 {
     assert(sp);
+
+    if (sp->uring != NULL) {
+        uring_drain(sp->uring);
+        uring_close(sp->uring);
+    }
+
+    /* before its socket goes away */
+    txstamp_close(sp->txstamp);
+
     switch(sp->handle_type) {
         case SP_TYPE_KHIAL:
             close(sp->handle.fd);
@@ -615,6 +838,8 @@ sendpacket_close(sendpacket_t *sp)
         case SP_TYPE_PF_PACKET:
         case SP_TYPE_TX_RING:
 #ifdef HAVE_PF_PACKET
+            if (sp->send_sock >= 0)
+                close(sp->send_sock);
             close(sp->handle.fd);
 #endif
             break;
@@ -649,13 +874,16 @@ sendpacket_close(sendpacket_t *sp)
 
         case SP_TYPE_TUNTAP:
 #ifdef HAVE_TUNTAP
-            close(sp->handle.fd);
+            sendpacket_close_queues(sp);
 #endif
             break;
         case SP_TYPE_NONE:
             err(-1, "no injector selected!");
             break;
     }
+#ifdef HAVE_LINUX_VIRTIO_NET_H
+    safe_free(sp->vnet);
+#endif
     safe_free(sp);
     return 0;
 }
@@ -827,25 +1055,14 @@ static sendpacket_t *
 sendpacket_open_tuntap(const char *device, char *errbuf)
 {
     sendpacket_t *sp;
-    struct ifreq ifr;
     int tapfd;
 
     assert(device);
     assert(errbuf);
 
 #if defined HAVE_LINUX
-    if ((tapfd = open("/dev/net/tun", O_RDWR)) < 0) {
-        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Could not open /dev/net/tun control file: %s", strerror(errno));
+    if ((tapfd = tuntap_open_queue(device, IFF_TAP | IFF_NO_PI, errbuf)) < 0)
         return NULL;
-    }
-    memset(&ifr, 0, sizeof(ifr));
-    ifr.ifr_flags = (IFF_TAP | IFF_NO_PI);
-    strncpy(ifr.ifr_name, device, strlen(device));
-
-    if (ioctl(tapfd, TUNSETIFF, (void *) &ifr) < 0) {
-        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to create tuntap interface: %s", device);
-        return NULL;
-    }
 #elif defined(HAVE_FREEBSD)
     if (*device == '/') {
         if ((tapfd = open(device, O_RDWR)) < 0) {
@@ -875,9 +1092,105 @@ sendpacket_open_tuntap(const char *device, char *errbuf)
     strlcpy(sp->device, device, sizeof(sp->device));
     sp->handle.fd = tapfd;
     sp->handle_type = SP_TYPE_TUNTAP;
+    sp->queues = 1;
     return sp;
 }
-#endif
+
+#ifdef HAVE_LINUX
+/**
+ * opens a queue of a Linux tuntap device, creating the device if needed
+ */
+static int
+tuntap_open_queue(const char *device, short flags, char *errbuf)
+{
+    struct ifreq ifr;
+    int tapfd;
+
+    if ((tapfd = open("/dev/net/tun", O_RDWR)) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Could not open /dev/net/tun control file: %s", strerror(errno));
+        return -1;
+    }
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = flags;
+    strlcpy(ifr.ifr_name, device, sizeof(ifr.ifr_name));
+
+    if (ioctl(tapfd, TUNSETIFF, (void *) &ifr) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to create tuntap interface %s: %s",
+                device, strerror(errno));
+        close(tapfd);
+        return -1;
+    }
+
+    return tapfd;
+}
+
+/**
+ * reopens a tuntap device with the given number of queues and, if the
+ * kernel is to do offloads, a virtio-net header in front of each packet
+ */
+static int
+tuntap_reopen(sendpacket_t *sp, int queues, int offload)
+{
+    short flags = IFF_TAP | IFF_NO_PI;
+    int *fds, i;
+
+    if (queues == sp->queues && !offload == !sp->offload)
+        return 0;
+
+    if (sp->uring != NULL) {
+        sendpacket_seterr(sp, "%s", "tuntap queues and offloads must be set before io_uring");
+        return -1;
+    }
+
+    if (queues > 1)
+        flags |= IFF_MULTI_QUEUE;
+    if (offload)
+        flags |= IFF_VNET_HDR;
+
+    /* a device can't switch between one and several queues while it is open */
+    sendpacket_close_queues(sp);
+    sp->handle.fd = -1;
+
+    fds = safe_malloc(sizeof(int) * queues);
+    for (i = 0; i < queues; i++) {
+        if ((fds[i] = tuntap_open_queue(sp->device, flags, sp->errbuf)) < 0) {
+            while (i-- > 0)
+                close(fds[i]);
+            safe_free(fds);
+            return -1;
+        }
+    }
+
+    sp->handle.fd = fds[0];
+    sp->queues = queues;
+    if (queues > 1)
+        sp->queue_fds = fds;
+    else
+        safe_free(fds);
+
+    return 0;
+}
+#endif /* HAVE_LINUX */
+
+/**
+ * closes every queue of a tuntap device
+ */
+static void
+sendpacket_close_queues(sendpacket_t *sp)
+{
+    int i;
+
+    if (sp->queue_fds == NULL) {
+        close(sp->handle.fd);
+        return;
+    }
+
+    for (i = 0; i < sp->queues; i++)
+        close(sp->queue_fds[i]);
+    safe_free(sp->queue_fds);
+    sp->queue_fds = NULL;
+}
+#endif /* HAVE_TUNTAP */
 
 #if defined HAVE_PF_PACKET
 /**
@@ -977,6 +1290,7 @@ sendpacket_open_pf(const char *device, char *errbuf)
     sp = (sendpacket_t *)safe_malloc(sizeof(sendpacket_t));
     strlcpy(sp->device, device, sizeof(sp->device));
     sp->handle.fd = mysocket;
+    sp->send_sock = -1;
 
 #ifdef HAVE_TX_RING
     /* Look up for MTU */
@@ -1021,6 +1335,102 @@ get_iface_index(int fd, const char *device, char *errbuf) {
     return ifr.ifr_ifindex;
 }
 
+/**
+ * opens a second PF_PACKET socket on the device for sends that bypass
+ * a TX_RING, since sends on the ring's socket ignore their data and the
+ * ring has no room for a virtio-net header. Returns the socket, which
+ * is kept until sendpacket_close(), or -1 on error
+ */
+static int
+sendpacket_open_send_sock(sendpacket_t *sp)
+{
+    struct sockaddr_ll sa;
+    int fd;
+
+    if (sp->send_sock >= 0)
+        return sp->send_sock;
+
+    /* protocol 0 so that the socket doesn't receive anything */
+    if ((fd = socket(PF_PACKET, SOCK_RAW, 0)) < 0) {
+        sendpacket_seterr(sp, "socket: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sll_family = AF_PACKET;
+    if ((sa.sll_ifindex = get_iface_index(fd, sp->device, sp->errbuf)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        sendpacket_seterr(sp, "bind error: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    sp->send_sock = fd;
+    return fd;
+}
+
+/**
+ * sends a packet with sendmsg(), behind a virtio-net header for
+ * offloads and with its SO_TXTIME send time, which the TX_RING can't
+ * carry. Returns the number of packet bytes sent, or -1 on error
+ */
+static int
+sendpacket_sendmsg(sendpacket_t *sp, const u_char *data, size_t len)
+{
+    struct iovec iov[2];
+    struct msghdr msg;
+#ifdef HAVE_SO_TXTIME
+    union {
+        char buf[CMSG_SPACE(sizeof(uint64_t))];
+        struct cmsghdr align;
+    } ctl;
+    struct cmsghdr *cmsg;
+#endif
+    int retcode;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = sendpacket_iov(sp, data, len, iov);
+
+#ifdef HAVE_SO_TXTIME
+    if (sp->txtime_on) {
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_TXTIME;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+        memcpy(CMSG_DATA(cmsg), &sp->txtime, sizeof(uint64_t));
+    }
+#endif
+
+    retcode = (int)sendmsg(sp->send_sock >= 0 ? sp->send_sock : sp->handle.fd, &msg, 0);
+    if (retcode > 0)
+        retcode -= sendpacket_hdr_len(sp);
+
+    return retcode;
+}
+
+/**
+ * when the packet about to be sent is meant to leave, in the clock of
+ * the transmit timestamps: its SO_TXTIME time, or else now
+ */
+static uint64_t
+sendpacket_sched_time(sendpacket_t *sp)
+{
+    struct timespec now;
+
+    if (sp->txtime_on)
+        return sp->txtime + sp->txstamp_offset;
+
+    clock_gettime(sp->txstamp_clock, &now);
+    return TIMESPEC_TO_NANOSEC(&now);
+}
+
 /**
  * get's the hardware address via Linux's PF packet interface
  */
@@ -1451,6 +1861,464 @@ sendpacket_get_hwaddr_khial(sendpacket_t *sp)
     return NULL;
 }
 
+/**
+ * Look up the NUMA node the NIC behind the given interface is attached
+ * to. Returns -1 if unknown, e.g. for virtual interfaces.
+ */
+static int
+get_iface_numa_node(const char *device)
+{
+    int node = -1;
+#ifdef HAVE_LINUX
+    char path[256];
+    FILE *f;
+
+    /* khial devices are paths, not interfaces */
+    if (strchr(device, '/') != NULL)
+        return -1;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", device);
+    if ((f = fopen(path, "r")) == NULL)
+        return -1;
+
+    if (fscanf(f, "%d", &node) != 1)
+        node = -1;
+    fclose(f);
+
+    dbgx(1, "%s is on NUMA node %d", device, node);
+#endif
+    return node;
+}
+
+#ifdef HAVE_LINUX_VIRTIO_NET_H
+/**
+ * Look up the MTU of the given interface. Returns -1 on error
+ */
+static int
+get_iface_mtu(const char *device)
+{
+    struct ifreq ifr;
+    int fd, mtu = -1;
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+        return -1;
+
+    memset(&ifr, 0, sizeof(ifr));
+    strlcpy(ifr.ifr_name, device, sizeof(ifr.ifr_name));
+    if (ioctl(fd, SIOCGIFMTU, &ifr) == 0)
+        mtu = ifr.ifr_mtu;
+
+    close(fd);
+    return mtu;
+}
+#endif
+
+/**
+ * \brief Get the NUMA node of the device, or -1 if unknown
+ */
+int
+sendpacket_get_numa_node(sendpacket_t *sp)
+{
+    assert(sp);
+    return sp->numa_node;
+}
+
+/**
+ * \brief Pin any helper threads the injection method uses to CPUs
+ *
+ * 'cpuset' is a cpu_set_t of 'cpusetsize' bytes, as for
+ * pthread_setaffinity_np(). Methods without helper threads
+ * ignore it. Returns 0 on success, -1 on error.
+ */
+int
+sendpacket_set_affinity(sendpacket_t *sp, size_t cpusetsize, const void *cpuset)
+{
+    assert(sp);
+    assert(cpuset);
+
+#if defined HAVE_PF_PACKET && defined HAVE_TX_RING
+    if (sp->tx_ring != NULL &&
+            txring_set_affinity(sp->tx_ring, cpusetsize, cpuset) < 0) {
+        sendpacket_seterr(sp, "Unable to set TX_RING thread affinity: %s",
+                strerror(errno));
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+/**
+ * \brief Spread packets over several queues of a tuntap device
+ *
+ * The device is reopened with IFF_MULTI_QUEUE and each packet goes to
+ * a queue picked by its flow, so that a VM behind the device receives
+ * the flows on as many virtio queues. A persistent device must have
+ * been created as multiqueue. Must be called before
+ * sendpacket_set_uring(). Returns 0 on success, -1 on error
+ */
+int
+sendpacket_set_queues(sendpacket_t *sp, int queues)
+{
+    assert(sp);
+
+    if (queues < 1 || queues > SENDPACKET_MAX_QUEUES) {
+        sendpacket_seterr(sp, "tuntap queues must be 1 to %d", SENDPACKET_MAX_QUEUES);
+        return -1;
+    }
+
+    if (sp->handle_type != SP_TYPE_TUNTAP) {
+        sendpacket_seterr(sp, "%s isn't a tuntap device, it can't have several queues",
+                sp->device);
+        return -1;
+    }
+
+#if defined HAVE_TUNTAP && defined HAVE_LINUX
+    return tuntap_reopen(sp, queues, sp->offload);
+#else
+    sendpacket_seterr(sp, "%s", "Multiqueue tuntap devices are not supported on this platform");
+    return -1;
+#endif
+}
+
+/**
+ * \brief Have the kernel fill in checksums and segment large TCP packets
+ *
+ * 'offload' is a mask of VNET_OFFLOAD_*. Packets are sent behind a
+ * virtio-net header asking for the offloads, which the kernel may in
+ * turn leave to the NIC, or to the VM behind a tuntap device. On
+ * PF_PACKET this uses PACKET_VNET_HDR; TX_RING devices then send
+ * through a second socket. Must be called before
+ * sendpacket_set_uring(). Returns 0 on success, -1 on error
+ */
+int
+sendpacket_set_offload(sendpacket_t *sp, int offload)
+{
+#ifdef HAVE_LINUX_VIRTIO_NET_H
+#ifdef HAVE_PF_PACKET
+    struct ifreq ifr;
+    int fd, val;
+#endif
+    int mtu = 0;
+
+    assert(sp);
+
+    if (offload != 0 && (mtu = get_iface_mtu(sp->device)) <= 0) {
+        sendpacket_seterr(sp, "Unable to get the MTU of %s: %s", sp->device,
+                strerror(errno));
+        return -1;
+    }
+
+    switch (sp->handle_type) {
+#ifdef HAVE_TUNTAP
+        case SP_TYPE_TUNTAP:
+            if (tuntap_reopen(sp, sp->queues, offload) < 0)
+                return -1;
+            break;
+#endif
+
+#ifdef HAVE_PF_PACKET
+        case SP_TYPE_PF_PACKET:
+        case SP_TYPE_TX_RING:
+            fd = sp->handle_type == SP_TYPE_TX_RING ?
+                    sendpacket_open_send_sock(sp) : sp->handle.fd;
+            if (fd < 0)
+                return -1;
+
+            /* the headers are parsed as Ethernet */
+            memset(&ifr, 0, sizeof(ifr));
+            strlcpy(ifr.ifr_name, sp->device, sizeof(ifr.ifr_name));
+            if (offload != 0 && ioctl(fd, SIOCGIFHWADDR, &ifr) == 0 &&
+                    ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER) {
+                sendpacket_seterr(sp, "Offloads need an Ethernet device, %s isn't one",
+                        sp->device);
+                return -1;
+            }
+
+            val = offload != 0;
+            if (setsockopt(fd, SOL_PACKET, PACKET_VNET_HDR, &val, sizeof(val)) < 0) {
+                sendpacket_seterr(sp, "Unable to set PACKET_VNET_HDR on %s: %s",
+                        sp->device, strerror(errno));
+                return -1;
+            }
+            break;
+#endif
+
+        default:
+            sendpacket_seterr(sp, "Offloads aren't supported on %s", sp->device);
+            return -1;
+    }
+
+    sp->offload = offload;
+    sp->mtu = (unsigned int)mtu;
+    if (offload == 0) {
+        safe_free(sp->vnet);
+        sp->vnet = NULL;
+    } else if (sp->vnet == NULL) {
+        sp->vnet = safe_malloc(sizeof(vnet_frame_t));
+    }
+
+    return 0;
+#else
+    assert(sp);
+
+    sendpacket_seterr(sp, "%s", "Offloads are not supported on this platform");
+    return -1;
+#endif
+}
+
+/**
+ * \brief Have the kernel send each packet at the time in sp->txtime
+ *
+ * Sets SO_TXTIME with the given clock, which must be CLOCK_MONOTONIC
+ * for the fq qdisc or the clock the etf qdisc was set up with, usually
+ * CLOCK_TAI. Without either qdisc on the interface packets leave
+ * straight away. TX_RING devices send through a second socket, since
+ * the ring gives all packets of a flush the same time. Can't be used
+ * with io_uring. Returns 0 on success, -1 on error
+ */
+int
+sendpacket_set_txtime(sendpacket_t *sp, clockid_t clock)
+{
+#if defined HAVE_SO_TXTIME && defined HAVE_PF_PACKET
+    struct sock_txtime st;
+    int fd;
+
+    assert(sp);
+
+    if (sp->uring != NULL) {
+        sendpacket_seterr(sp, "%s", "SO_TXTIME can't be used with io_uring");
+        return -1;
+    }
+
+    switch (sp->handle_type) {
+        case SP_TYPE_PF_PACKET:
+            fd = sp->handle.fd;
+            break;
+
+        case SP_TYPE_TX_RING:
+            if ((fd = sendpacket_open_send_sock(sp)) < 0)
+                return -1;
+            break;
+
+        default:
+            sendpacket_seterr(sp, "SO_TXTIME isn't supported on %s", sp->device);
+            return -1;
+    }
+
+    memset(&st, 0, sizeof(st));
+    st.clockid = clock;
+    if (setsockopt(fd, SOL_SOCKET, SO_TXTIME, &st, sizeof(st)) < 0) {
+        sendpacket_seterr(sp, "Unable to set SO_TXTIME on %s: %s", sp->device,
+                strerror(errno));
+        return -1;
+    }
+
+    sp->txtime_on = true;
+    sp->txtime_clock = clock;
+    return 0;
+#else
+    assert(sp);
+
+    sendpacket_seterr(sp, "%s", "SO_TXTIME is not supported on this platform");
+    return -1;
+#endif
+}
+
+/**
+ * \brief Send packets through io_uring instead of a syscall per packet
+ *
+ * Packets are copied into 'depth' buffers and handed to the kernel in
+ * batches, or with 'sqpoll' picked up by a kernel thread. Only works
+ * with tuntap and PF_PACKET devices; TX_RING devices send through a
+ * second PF_PACKET socket since sends on the ring's socket ignore
+ * their data.
+ * The counters are updated as packets finish, see sendpacket_flush().
+ * Returns 0 on success, -1 on error
+ */
+int
+sendpacket_set_uring(sendpacket_t *sp, unsigned int depth, bool sqpoll)
+{
+#ifdef HAVE_IO_URING
+    bool sock = true;
+    int fd, nfds = 1;
+
+    assert(sp);
+
+    if (sp->uring != NULL)
+        return 0;
+
+    if (sp->txtime_on) {
+        sendpacket_seterr(sp, "%s", "io_uring can't be used with SO_TXTIME");
+        return -1;
+    }
+
+    if (sp->txstamp != NULL) {
+        sendpacket_seterr(sp, "%s", "io_uring can't be used with transmit timestamps");
+        return -1;
+    }
+
+    if (depth < URING_MIN_DEPTH || depth > URING_MAX_DEPTH) {
+        sendpacket_seterr(sp, "io_uring depth must be %d to %d", URING_MIN_DEPTH,
+                URING_MAX_DEPTH);
+        return -1;
+    }
+
+    switch (sp->handle_type) {
+        case SP_TYPE_TUNTAP:
+            sock = false;
+            fd = sp->handle.fd;
+            if (sp->queue_fds != NULL)
+                nfds = sp->queues;
+            break;
+
+#ifdef HAVE_PF_PACKET
+        case SP_TYPE_PF_PACKET:
+            fd = sp->handle.fd;
+            break;
+
+        case SP_TYPE_TX_RING:
+            if ((fd = sendpacket_open_send_sock(sp)) < 0)
+                return -1;
+            break;
+#endif
+
+        default:
+            sendpacket_seterr(sp, "io_uring isn't supported on %s", sp->device);
+            return -1;
+    }
+
+    if ((sp->uring = uring_open(sp->queue_fds != NULL ? sp->queue_fds : &fd, nfds, sock,
+            depth, sqpoll, sendpacket_uring_done, sp)) == NULL) {
+        sendpacket_seterr(sp, "Unable to set up io_uring on %s: %s", sp->device,
+                strerror(errno));
+        return -1;
+    }
+
+    return 0;
+#else
+    assert(sp);
+
+    sendpacket_seterr(sp, "io_uring is not supported on this platform");
+    return -1;
+#endif
+}
+
+/**
+ * \brief Compare when packets left with when they were meant to leave
+ *
+ * Turns on transmit timestamps, taken by the kernel as the packet is
+ * handed to the driver or with 'hw' by the NIC, whose clock must be
+ * kept on CLOCK_TAI by ptp4l/phc2sys. A packet is meant to leave at its
+ * SO_TXTIME time, or else when sendpacket() is called, so call this
+ * after sendpacket_set_txtime(). TX_RING devices send through a second
+ * socket. Can't be used with io_uring.
+ * Returns 0 on success, -1 on error
+ */
+int
+sendpacket_set_txstamp(sendpacket_t *sp, bool hw)
+{
+#if defined HAVE_TX_TIMESTAMPING && defined HAVE_PF_PACKET
+    struct sock_filter drop = BPF_STMT(BPF_RET | BPF_K, 0);
+    struct sock_fprog prog = { 1, &drop };
+    struct hwtstamp_config hwc;
+    struct ifreq ifr;
+    struct timespec a, b;
+    int fd;
+
+    assert(sp);
+
+    if (sp->txstamp != NULL)
+        return 0;
+
+    if (sp->uring != NULL) {
+        sendpacket_seterr(sp, "%s", "transmit timestamps can't be used with io_uring");
+        return -1;
+    }
+
+    switch (sp->handle_type) {
+        case SP_TYPE_PF_PACKET:
+            fd = sp->send_sock >= 0 ? sp->send_sock : sp->handle.fd;
+            break;
+
+        case SP_TYPE_TX_RING:
+            if ((fd = sendpacket_open_send_sock(sp)) < 0)
+                return -1;
+            break;
+
+        default:
+            sendpacket_seterr(sp, "Transmit timestamps aren't supported on %s", sp->device);
+            return -1;
+    }
+
+    /* packets it receives would crowd the timestamps out of the buffer */
+    if (fd == sp->handle.fd &&
+            setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+        sendpacket_seterr(sp, "Unable to attach filter on %s: %s", sp->device,
+                strerror(errno));
+        return -1;
+    }
+
+    if (hw) {
+        memset(&ifr, 0, sizeof(ifr));
+        strlcpy(ifr.ifr_name, sp->device, sizeof(ifr.ifr_name));
+        ifr.ifr_data = (void *)&hwc;
+
+        /* leave receive timestamps as they are */
+        if (ioctl(fd, SIOCGHWTSTAMP, &ifr) < 0)
+            memset(&hwc, 0, sizeof(hwc));
+
+        hwc.tx_type = HWTSTAMP_TX_ON;
+        if (ioctl(fd, SIOCSHWTSTAMP, &ifr) < 0) {
+            sendpacket_seterr(sp, "Unable to turn on hardware timestamps on %s: %s",
+                    sp->device, strerror(errno));
+            return -1;
+        }
+    }
+
+    sp->txstamp_clock = hw ? CLOCK_TAI : CLOCK_REALTIME;
+    if (sp->txtime_on) {
+        clock_gettime(sp->txstamp_clock, &a);
+        clock_gettime(sp->txtime_clock, &b);
+        sp->txstamp_offset = (int64_t)(TIMESPEC_TO_NANOSEC(&a) - TIMESPEC_TO_NANOSEC(&b));
+    }
+
+    if ((sp->txstamp = txstamp_open(fd, hw, sp->errbuf)) == NULL)
+        return -1;
+
+    return 0;
+#else
+    assert(sp);
+
+    sendpacket_seterr(sp, "%s", "Transmit timestamps are not supported on this platform");
+    return -1;
+#endif
+}
+
+/**
+ * \brief Hand packets queued by io_uring to the kernel
+ *
+ * With 'wait' this also waits until they have been sent, so that the
+ * counters are up to date. Does nothing without io_uring.
+ * Returns 0 on success, -1 on error
+ */
+int
+sendpacket_flush(sendpacket_t *sp, bool wait)
+{
+    int ret;
+
+    assert(sp);
+
+    if (sp->uring == NULL)
+        return 0;
+
+    ret = wait ? uring_drain(sp->uring) : uring_submit(sp->uring);
+    if (ret < 0)
+        sendpacket_seterr(sp, "Error with io_uring: %s", strerror(errno));
+
+    return ret;
+}
+
 /**
  * \brief Cause the currently running sendpacket() call to stop
  */
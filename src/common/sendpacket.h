@@ -51,6 +51,10 @@
 #include "txring.h"
 #endif
 
+#include "uring.h"
+#include "vnet.h"
+#include "txstamp.h"
+
 #ifdef HAVE_LIBDNET
 /* need to undef these which are pulled in via defines.h, prior to importing dnet.h */
 #undef icmp_id
@@ -102,6 +106,8 @@ union sendpacket_handle {
 };
 
 #define SENDPACKET_ERRBUF_SIZE 1024
+#define SENDPACKET_MAX_QUEUES  256   /* tuntap queues */
+#define SENDPACKET_TXSTAMP_WAIT_MS 100 /* for the last timestamps before stats */
 #define MAX_IFNAMELEN   64
 
 struct sendpacket_s {
@@ -125,6 +131,7 @@ struct sendpacket_s {
     sendpacket_type_t handle_type;
     union sendpacket_handle handle;
     struct tcpr_ether_addr ether;
+    int numa_node;              /* NUMA node of the device, -1 if unknown */
 #if defined HAVE_QUICK_TX || defined HAVE_NETMAP
     int first_packet;
 #endif
@@ -157,7 +164,22 @@ struct sendpacket_s {
 #ifdef HAVE_TX_RING
     txring_t * tx_ring;
 #endif
+    int send_sock;              /* socket for sends that bypass the TX_RING, or -1 */
+#endif
+    int *queue_fds;             /* tuntap queues, NULL for a single queue */
+    int queues;
+    int offload;                /* VNET_OFFLOAD_* done by the kernel */
+    unsigned int mtu;           /* segment size for VNET_OFFLOAD_GSO */
+#ifdef HAVE_LINUX_VIRTIO_NET_H
+    vnet_frame_t *vnet;         /* virtio-net header sent before each packet */
 #endif
+    uring_t *uring;             /* io_uring sends, NULL for a syscall per packet */
+    bool txtime_on;             /* SO_TXTIME is set */
+    clockid_t txtime_clock;
+    uint64_t txtime;            /* when the next packet leaves, in ns of the SO_TXTIME clock */
+    txstamp_t *txstamp;         /* transmit timestamps, NULL if off */
+    clockid_t txstamp_clock;    /* clock the timestamps are taken in */
+    int64_t txstamp_offset;     /* txstamp_clock minus txtime_clock */
     bool abort;
 };
 
@@ -172,6 +194,14 @@ struct tcpr_ether_addr *sendpacket_get_hwaddr(sendpacket_t *);
 int sendpacket_get_dlt(sendpacket_t *);
 const char *sendpacket_get_method(sendpacket_t *);
 void sendpacket_abort(sendpacket_t *);
+int sendpacket_get_numa_node(sendpacket_t *);
+int sendpacket_set_affinity(sendpacket_t *, size_t, const void *);
+int sendpacket_set_queues(sendpacket_t *, int);
+int sendpacket_set_offload(sendpacket_t *, int);
+int sendpacket_set_txtime(sendpacket_t *, clockid_t);
+int sendpacket_set_uring(sendpacket_t *, unsigned int, bool);
+int sendpacket_set_txstamp(sendpacket_t *, bool);
+int sendpacket_flush(sendpacket_t *, bool);
 
 #endif /* _SENDPACKET_H_ */
 
@@ -31,6 +31,10 @@
  * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* pthread_setaffinity_np() */
+#endif
+
 #ifdef HAVE_TX_RING
 
 #include "err.h"
@@ -238,4 +242,29 @@ txring_init(int fd, unsigned int mtu)
     return txp;
 }
 
+/**
+ * \brief Pin the TX ring sending thread to the given CPUs
+ *
+ * 'cpuset' is a cpu_set_t of 'cpusetsize' bytes. Returns 0 on
+ * success or -1 with errno set.
+ */
+int
+txring_set_affinity(txring_t *txp, size_t cpusetsize, const void *cpuset)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    int err;
+
+    if ((err = pthread_setaffinity_np(txp->tx_send, cpusetsize,
+                    (const cpu_set_t *)cpuset)) != 0) {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
 #endif /* HAVE_TX_RING */
@@ -62,6 +62,7 @@ typedef struct txring_s txring_t;
 
 int txring_put(txring_t *txp, const void * data, size_t length);
 txring_t* txring_init(int fd, unsigned int mtu);
+int txring_set_affinity(txring_t *txp, size_t cpusetsize, const void *cpuset);
 #endif /* HAVE_TX_RING */
 
 #endif /*COMMON_TXRING_H */
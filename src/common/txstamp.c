@@ -0,0 +1,344 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2016 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * With SOF_TIMESTAMPING_OPT_ID the kernel numbers the packets of a
+ * socket from 0 and hands the number back with each timestamp. The
+ * sender notes the scheduled time of packet N in slot N of a ring,
+ * and the thread looks it up when the timestamp of packet N arrives.
+ * Packets which took a number but were never sent have no scheduled
+ * time, so that the numbers stay in step.
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "txstamp.h"
+
+/* how often the thread checks whether it should stop */
+#define TXSTAMP_POLL_MS         100
+
+/* times to yield to the sender for the scheduled time of a packet */
+#define TXSTAMP_SENDER_TRIES    10000
+
+/* bytes of receive buffer to ask for */
+#define TXSTAMP_RCVBUF          (8 * 1024 * 1024)
+
+#if defined HAVE_PTHREAD && defined HAVE_TX_TIMESTAMPING
+
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <netpacket/packet.h>
+
+struct txstamp_s {
+    int fd;
+    bool hw;
+    pthread_t thread;
+    bool started;
+    volatile bool closing;
+
+    uint64_t *sched;                /* scheduled time by packet number, 0 if none */
+    uint32_t next_key;              /* number of the next packet, sender only */
+    uint32_t done_key;              /* one past the last timestamp, thread only */
+    COUNTER packets;                /* sender only */
+
+    pthread_mutex_t lock;
+    COUNTER stamps;
+    int64_t min_ns;
+    int64_t max_ns;
+    double sum;
+    double sum_sq;
+};
+
+/**
+ * compares a timestamp with the scheduled time of its packet
+ */
+static void
+txstamp_add(txstamp_t *ts, uint32_t key, uint64_t stamp_ns)
+{
+    uint32_t next;
+    uint64_t sched_ns;
+    int64_t diff;
+    int tries = 0;
+
+    /* the timestamp can be queued before sendmsg() has even returned */
+    while ((int32_t)(key - (next = __atomic_load_n(&ts->next_key, __ATOMIC_ACQUIRE))) >= 0) {
+        if (++tries > TXSTAMP_SENDER_TRIES || ts->closing)
+            return;
+        sched_yield();
+    }
+
+    /* the sender is so far ahead that the slot has been reused */
+    if (next - key > TXSTAMP_RING_SIZE)
+        return;
+
+    sched_ns = ts->sched[key % TXSTAMP_RING_SIZE];
+    __atomic_store_n(&ts->done_key, key + 1, __ATOMIC_RELEASE);
+    if (sched_ns == 0)
+        return;
+
+    diff = (int64_t)(stamp_ns - sched_ns);
+
+    pthread_mutex_lock(&ts->lock);
+    if (ts->stamps == 0 || diff < ts->min_ns)
+        ts->min_ns = diff;
+    if (ts->stamps == 0 || diff > ts->max_ns)
+        ts->max_ns = diff;
+    ts->stamps++;
+    ts->sum += (double)diff;
+    ts->sum_sq += (double)diff * (double)diff;
+    pthread_mutex_unlock(&ts->lock);
+}
+
+/**
+ * reads a message from the socket's error queue. Returns -1 once the
+ * queue is empty
+ */
+static int
+txstamp_read(txstamp_t *ts)
+{
+    union {
+        char buf[512];
+        struct cmsghdr align;
+    } ctl;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct scm_timestamping tss;
+    struct sock_extended_err ee;
+    struct timespec *stamp;
+    bool have_tss = false, have_ee = false;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    if (recvmsg(ts->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        return -1;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+            have_tss = true;
+        } else if (cmsg->cmsg_level == SOL_PACKET && cmsg->cmsg_type == PACKET_TX_TIMESTAMP) {
+            memcpy(&ee, CMSG_DATA(cmsg), sizeof(ee));
+            have_ee = ee.ee_origin == SO_EE_ORIGIN_TIMESTAMPING;
+        }
+    }
+
+    if (!have_tss || !have_ee)
+        return 0;
+
+    /* software and hardware timestamps come in separate messages */
+    stamp = &tss.ts[ts->hw ? 2 : 0];
+    if (stamp->tv_sec != 0 || stamp->tv_nsec != 0)
+        txstamp_add(ts, ee.ee_data, TIMESPEC_TO_NANOSEC(stamp));
+
+    return 0;
+}
+
+/**
+ * waits for timestamps on the socket's error queue until told to stop
+ */
+static void *
+txstamp_thread(void *arg)
+{
+    txstamp_t *ts = arg;
+    struct pollfd pfd;
+    int n;
+
+    tcpreplay_pin_helper();
+
+    while (!ts->closing) {
+        pfd.fd = ts->fd;
+        pfd.events = 0;             /* POLLERR is always reported */
+        pfd.revents = 0;
+        if (poll(&pfd, 1, TXSTAMP_POLL_MS) <= 0)
+            continue;
+
+        for (n = 0; txstamp_read(ts) == 0; n++)
+            ;
+
+        /* a socket error rather than a timestamp, don't spin on it */
+        if (n == 0)
+            usleep(TXSTAMP_POLL_MS * 1000);
+    }
+
+    return NULL;
+}
+
+/**
+ * \brief Turns on transmit timestamps for a socket
+ *
+ * Uses the NIC's timestamps with 'hw', which must already be enabled
+ * on the device, or else the kernel's. Returns NULL and fills in
+ * 'errbuf', which must be PCAP_ERRBUF_SIZE bytes, on error.
+ */
+txstamp_t *
+txstamp_open(int fd, bool hw, char *errbuf)
+{
+    txstamp_t *ts;
+    int flags, err, rcvbuf = TXSTAMP_RCVBUF;
+
+    assert(errbuf);
+
+    flags = SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    if (hw)
+        flags |= SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+    else
+        flags |= SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "unable to set SO_TIMESTAMPING: %s",
+                strerror(errno));
+        return NULL;
+    }
+
+    /* the timestamps of a burst of packets queue up in the receive buffer */
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0)
+        (void)setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    ts = safe_malloc(sizeof(txstamp_t));
+    ts->fd = fd;
+    ts->hw = hw;
+    ts->sched = safe_malloc(sizeof(uint64_t) * TXSTAMP_RING_SIZE);
+    pthread_mutex_init(&ts->lock, NULL);
+
+    if ((err = pthread_create(&ts->thread, NULL, txstamp_thread, ts)) != 0) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "unable to start timestamp thread: %s",
+                strerror(err));
+        txstamp_close(ts);
+        return NULL;
+    }
+
+    ts->started = true;
+    return ts;
+}
+
+/**
+ * \brief Notes the scheduled time of the packet just sent
+ *
+ * 'sched_ns' is in CLOCK_REALTIME, or the NIC's clock with hardware
+ * timestamps. 0 stands for a packet which the kernel numbered but
+ * dropped.
+ */
+void
+txstamp_sent(txstamp_t *ts, uint64_t sched_ns)
+{
+    uint32_t key = ts->next_key;
+
+    ts->sched[key % TXSTAMP_RING_SIZE] = sched_ns;
+    if (sched_ns != 0)
+        ts->packets++;
+    __atomic_store_n(&ts->next_key, key + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * \brief Fills in the departure error statistics
+ *
+ * First waits up to 'wait_ms' for the timestamps of the last packets.
+ */
+void
+txstamp_get_stats(txstamp_t *ts, txstamp_stats_t *stats, int wait_ms)
+{
+    double var;
+
+    assert(ts);
+    assert(stats);
+
+    while (wait_ms-- > 0 &&
+            __atomic_load_n(&ts->done_key, __ATOMIC_ACQUIRE) != ts->next_key)
+        usleep(1000);
+
+    memset(stats, 0, sizeof(*stats));
+    stats->packets = ts->packets;
+
+    pthread_mutex_lock(&ts->lock);
+    stats->stamps = ts->stamps;
+    if (ts->stamps > 0) {
+        stats->min_ns = ts->min_ns;
+        stats->max_ns = ts->max_ns;
+        stats->avg_ns = ts->sum / (double)ts->stamps;
+        var = ts->sum_sq / (double)ts->stamps - stats->avg_ns * stats->avg_ns;
+        stats->stddev_ns = var > 0 ? sqrt(var) : 0;
+    }
+    pthread_mutex_unlock(&ts->lock);
+}
+
+/**
+ * \brief Stops the timestamp thread
+ */
+void
+txstamp_close(txstamp_t *ts)
+{
+    if (ts == NULL)
+        return;
+
+    if (ts->started) {
+        ts->closing = true;
+        pthread_join(ts->thread, NULL);
+    }
+
+    pthread_mutex_destroy(&ts->lock);
+    safe_free(ts->sched);
+    safe_free(ts);
+}
+
+#else /* no transmit timestamp support */
+
+struct txstamp_s {
+    int unused;
+};
+
+txstamp_t *
+txstamp_open(int fd _U_, bool hw _U_, char *errbuf)
+{
+    snprintf(errbuf, PCAP_ERRBUF_SIZE, "transmit timestamps are not supported on this platform");
+    return NULL;
+}
+
+void
+txstamp_sent(txstamp_t *ts _U_, uint64_t sched_ns _U_)
+{
+}
+
+void
+txstamp_get_stats(txstamp_t *ts _U_, txstamp_stats_t *stats, int wait_ms _U_)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+void
+txstamp_close(txstamp_t *ts _U_)
+{
+}
+
+#endif
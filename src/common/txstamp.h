@@ -0,0 +1,50 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2016 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TXSTAMP_H__
+#define __TXSTAMP_H__
+
+#include "defines.h"
+
+/*
+ * Transmit timestamps of the packets sent on a socket. The kernel, or
+ * the NIC, notes when each packet left and queues the time on the
+ * socket's error queue, where a thread picks it up and compares it
+ * with the time the packet was meant to leave.
+ */
+
+/* scheduled times kept for timestamps which haven't come back yet */
+#define TXSTAMP_RING_SIZE       65536
+
+typedef struct txstamp_s txstamp_t;
+
+typedef struct txstamp_stats_s {
+    COUNTER packets;            /* packets sent with a scheduled time */
+    COUNTER stamps;             /* timestamps matched to one of them */
+    int64_t min_ns;             /* departure minus scheduled time */
+    int64_t max_ns;
+    double avg_ns;
+    double stddev_ns;
+} txstamp_stats_t;
+
+txstamp_t *txstamp_open(int fd, bool hw, char *errbuf);
+void txstamp_sent(txstamp_t *ts, uint64_t sched_ns);
+void txstamp_get_stats(txstamp_t *ts, txstamp_stats_t *stats, int wait_ms);
+void txstamp_close(txstamp_t *ts);
+
+#endif /* __TXSTAMP_H__ */
@@ -0,0 +1,420 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2016 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Slots are handed out from a free list and come back when the kernel
+ * posts their completion. There are as many submission queue entries
+ * as slots and twice as many completion queue entries, so neither
+ * queue can overflow. The files are registered with the ring to save
+ * looking them up on every send, which also lets a polling thread use
+ * them on kernels before 5.11.
+ *
+ * Sends which are held up, for instance by a full socket buffer, are
+ * completed by kernel workers and may go out of order.
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* slot buffers start this big and grow for larger packets */
+#define URING_SLOT_SIZE         2048
+
+typedef struct uring_slot_s {
+    u_char *data;
+    size_t size;
+    size_t len;
+    int file;                       /* index into the registered files */
+} uring_slot_t;
+
+struct uring_s {
+    int ring_fd;
+    uint8_t opcode;
+    bool sqpoll;
+    unsigned int batch;             /* submit once this many are queued */
+    unsigned int queued;            /* in the submission queue, not submitted */
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_flags;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    uring_slot_t *slots;
+    unsigned int depth;
+    unsigned int *free;
+    unsigned int free_cnt;
+
+    uring_done_t done;
+    void *arg;
+};
+
+/**
+ * adds a send of the given slot to the submission queue
+ */
+static void
+uring_queue(uring_t *ur, unsigned int idx)
+{
+    unsigned tail = *ur->sq_tail;
+    unsigned pos = tail & *ur->sq_mask;
+    struct io_uring_sqe *sqe = &ur->sqes[pos];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = ur->opcode;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = ur->slots[idx].file;  /* index of the registered file */
+    sqe->addr = (uintptr_t)ur->slots[idx].data;
+    sqe->len = ur->slots[idx].len;
+    if (ur->opcode == IORING_OP_WRITE)
+        sqe->off = (uint64_t)-1;    /* current file position */
+    sqe->user_data = idx;
+
+    ur->sq_array[pos] = pos;
+    __atomic_store_n(ur->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ur->queued++;
+}
+
+/**
+ * hands the queued sends to the kernel and, if 'wait' is set, waits
+ * for at least one completion. Returns 0 or -1 on error
+ */
+static int
+uring_enter(uring_t *ur, unsigned int wait)
+{
+    unsigned int flags = 0;
+    int ret;
+
+    if (ur->sqpoll) {
+        /* the kernel thread picks up new entries unless it went to sleep */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(ur->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        ur->queued = 0;
+        if (!flags && !wait)
+            return 0;
+    }
+
+    if (wait)
+        flags |= IORING_ENTER_GETEVENTS;
+
+    ret = syscall(__NR_io_uring_enter, ur->ring_fd, ur->queued, wait, flags, NULL, 0);
+    if (ret < 0) {
+        /* interrupted, or short of memory: the caller reaps and comes back */
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            return 0;
+        return -1;
+    }
+
+    if (!ur->sqpoll)
+        ur->queued -= (unsigned int)ret;
+
+    return 0;
+}
+
+/**
+ * passes the finished sends to the done callback and frees their slots,
+ * or queues them again if asked to
+ */
+static void
+uring_reap(uring_t *ur)
+{
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+    unsigned int idx;
+
+    head = *ur->cq_head;
+    tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        cqe = &ur->cqes[head & *ur->cq_mask];
+        idx = (unsigned int)cqe->user_data;
+        head++;
+
+        if (ur->done(ur->arg, ur->slots[idx].len, cqe->res))
+            uring_queue(ur, idx);
+        else
+            ur->free[ur->free_cnt++] = idx;
+    }
+
+    __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * \brief Sets up a ring of 'depth' sends to the given file descriptors
+ *
+ * Sends pick one of the 'nfds' files by its index. 'sock' selects
+ * send() over write(). With 'sqpoll' a kernel thread
+ * submits the sends. 'done' is called from uring_put(), uring_submit()
+ * and uring_drain() as sends finish. Returns NULL and sets errno on
+ * error, for instance on kernels without io_uring.
+ */
+uring_t *
+uring_open(const int *fds, int nfds, bool sock, unsigned int depth,
+        bool sqpoll, uring_done_t done, void *arg)
+{
+    struct io_uring_params p;
+    uring_t *ur;
+    unsigned int i;
+    int err;
+
+    assert(fds);
+    assert(nfds > 0);
+    assert(done);
+    assert(depth >= URING_MIN_DEPTH && depth <= URING_MAX_DEPTH);
+
+    ur = safe_malloc(sizeof(uring_t));
+    ur->opcode = sock ? IORING_OP_SEND : IORING_OP_WRITE;
+    ur->sqpoll = sqpoll;
+    ur->batch = sqpoll ? 1 : depth / 2;
+    ur->done = done;
+    ur->arg = arg;
+    ur->sq_ring = ur->cq_ring = ur->sqes = MAP_FAILED;
+
+    memset(&p, 0, sizeof(p));
+    if (sqpoll) {
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = URING_SQPOLL_IDLE;
+    }
+
+    if ((ur->ring_fd = syscall(__NR_io_uring_setup, depth, &p)) < 0)
+        goto fail;
+
+    ur->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ur->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && ur->cq_ring_size > ur->sq_ring_size)
+        ur->sq_ring_size = ur->cq_ring_size;
+
+    ur->sq_ring = mmap(NULL, ur->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_SQ_RING);
+    if (ur->sq_ring == MAP_FAILED)
+        goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ur->cq_ring = ur->sq_ring;
+    } else {
+        ur->cq_ring = mmap(NULL, ur->cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_CQ_RING);
+        if (ur->cq_ring == MAP_FAILED)
+            goto fail;
+    }
+
+    ur->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ur->sqes = mmap(NULL, ur->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_SQES);
+    if (ur->sqes == MAP_FAILED)
+        goto fail;
+
+    ur->sq_head = (unsigned *)((char *)ur->sq_ring + p.sq_off.head);
+    ur->sq_tail = (unsigned *)((char *)ur->sq_ring + p.sq_off.tail);
+    ur->sq_mask = (unsigned *)((char *)ur->sq_ring + p.sq_off.ring_mask);
+    ur->sq_flags = (unsigned *)((char *)ur->sq_ring + p.sq_off.flags);
+    ur->sq_array = (unsigned *)((char *)ur->sq_ring + p.sq_off.array);
+    ur->cq_head = (unsigned *)((char *)ur->cq_ring + p.cq_off.head);
+    ur->cq_tail = (unsigned *)((char *)ur->cq_ring + p.cq_off.tail);
+    ur->cq_mask = (unsigned *)((char *)ur->cq_ring + p.cq_off.ring_mask);
+    ur->cqes = (struct io_uring_cqe *)((char *)ur->cq_ring + p.cq_off.cqes);
+
+    if (syscall(__NR_io_uring_register, ur->ring_fd, IORING_REGISTER_FILES, fds, nfds) < 0)
+        goto fail;
+
+    ur->depth = depth;
+    ur->slots = safe_malloc(sizeof(uring_slot_t) * depth);
+    ur->free = safe_malloc(sizeof(unsigned int) * depth);
+    for (i = 0; i < depth; i++) {
+        ur->slots[i].data = safe_malloc(URING_SLOT_SIZE);
+        ur->slots[i].size = URING_SLOT_SIZE;
+        ur->free[ur->free_cnt++] = depth - 1 - i;
+    }
+
+    return ur;
+
+fail:
+    err = errno;
+    uring_close(ur);
+    errno = err;
+    return NULL;
+}
+
+/**
+ * \brief Queues a copy of the packet in 'iov' for the given file
+ *
+ * Waits for a slot if they are all in use and submits the queue once
+ * it holds a batch. Returns 0 or -1 and sets errno on error.
+ */
+int
+uring_put(uring_t *ur, int file, const struct iovec *iov, int iovcnt)
+{
+    uring_slot_t *slot;
+    unsigned int idx;
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    uring_reap(ur);
+    while (ur->free_cnt == 0) {
+        if (uring_enter(ur, 1) < 0)
+            return -1;
+        uring_reap(ur);
+    }
+
+    idx = ur->free[--ur->free_cnt];
+    slot = &ur->slots[idx];
+    if (len > slot->size) {
+        slot->data = safe_realloc(slot->data, len);
+        slot->size = len;
+    }
+    for (i = 0, len = 0; i < iovcnt; i++) {
+        memcpy(slot->data + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    slot->len = len;
+    slot->file = file;
+    uring_queue(ur, idx);
+
+    if (ur->queued >= ur->batch)
+        return uring_enter(ur, 0);
+
+    return 0;
+}
+
+/**
+ * \brief Hands any queued sends to the kernel without waiting for them
+ */
+int
+uring_submit(uring_t *ur)
+{
+    uring_reap(ur);
+    if (ur->queued == 0)
+        return 0;
+
+    return uring_enter(ur, 0);
+}
+
+/**
+ * \brief Submits the queue and waits until every send has finished
+ */
+int
+uring_drain(uring_t *ur)
+{
+    uring_reap(ur);
+    while (ur->free_cnt < ur->depth) {
+        if (uring_enter(ur, 1) < 0)
+            return -1;
+        uring_reap(ur);
+    }
+
+    return 0;
+}
+
+/**
+ * \brief Frees the ring, dropping any sends which haven't finished
+ *
+ * The file descriptor isn't closed.
+ */
+void
+uring_close(uring_t *ur)
+{
+    unsigned int i;
+
+    if (ur == NULL)
+        return;
+
+    if (ur->sqes != MAP_FAILED)
+        munmap(ur->sqes, ur->sqes_size);
+    if (ur->cq_ring != MAP_FAILED && ur->cq_ring != ur->sq_ring)
+        munmap(ur->cq_ring, ur->cq_ring_size);
+    if (ur->sq_ring != MAP_FAILED)
+        munmap(ur->sq_ring, ur->sq_ring_size);
+    if (ur->ring_fd >= 0)
+        close(ur->ring_fd);
+
+    if (ur->slots != NULL) {
+        for (i = 0; i < ur->depth; i++)
+            safe_free(ur->slots[i].data);
+        safe_free(ur->slots);
+    }
+    safe_free(ur->free);
+    safe_free(ur);
+}
+
+#else /* no io_uring support */
+
+struct uring_s {
+    int unused;
+};
+
+uring_t *
+uring_open(const int *fds _U_, int nfds _U_, bool sock _U_, unsigned int depth _U_,
+        bool sqpoll _U_, uring_done_t done _U_, void *arg _U_)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+int
+uring_put(uring_t *ur _U_, int file _U_, const struct iovec *iov _U_, int iovcnt _U_)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int
+uring_submit(uring_t *ur _U_)
+{
+    return 0;
+}
+
+int
+uring_drain(uring_t *ur _U_)
+{
+    return 0;
+}
+
+void
+uring_close(uring_t *ur _U_)
+{
+}
+
+#endif
@@ -0,0 +1,56 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2016 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include "defines.h"
+
+#include <sys/uio.h>
+
+/*
+ * Batched packet sends through io_uring. Each packet is copied into a
+ * slot and queued, and a whole batch is handed to the kernel with one
+ * io_uring_enter(), or without any system call when a kernel thread
+ * polls the submission queue.
+ */
+
+#define URING_MIN_DEPTH         8
+#define URING_MAX_DEPTH         4096
+
+/* ms the submission queue thread spins before going to sleep */
+#define URING_SQPOLL_IDLE       1000
+
+typedef struct uring_s uring_t;
+
+/*
+ * Called for each finished send with its length and the result of the
+ * write() or send(), a negative errno on error. Returning true sends
+ * the packet again.
+ */
+typedef bool (*uring_done_t)(void *arg, size_t len, int res);
+
+uring_t *uring_open(const int *fds, int nfds, bool sock, unsigned int depth,
+        bool sqpoll, uring_done_t done, void *arg);
+int uring_put(uring_t *ur, int file, const struct iovec *iov, int iovcnt);
+int uring_submit(uring_t *ur);
+int uring_drain(uring_t *ur);
+void uring_close(uring_t *ur);
+
+#endif /* __URING_H__ */
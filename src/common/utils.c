@@ -18,6 +18,10 @@
  *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* pthread_setaffinity_np() */
+#endif
+
 #include "config.h"
 #include "defines.h"
 #include "common.h"
@@ -26,11 +30,22 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <ctype.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#include <sched.h>
+#endif
 
 #ifdef DEBUG
 extern int debug;
 #endif
 
+#if defined HAVE_PTHREAD && defined HAVE_PTHREAD_SETAFFINITY_NP
+static cpu_set_t helper_cpus;
+static bool helper_cpus_set;
+#endif
+
 /**
  * this is wrapped up in a #define safe_malloc
  * This function, detects failures to malloc memory and zeros out the
@@ -114,6 +129,49 @@ _our_safe_free(void *ptr, const char *funcname, const int line, const char *file
     ptr = NULL;
 }
 
+/**
+ * \brief Set the CPUs helper threads are pinned to
+ *
+ * 'cpuset' is a cpu_set_t of 'cpusetsize' bytes. Threads started
+ * afterwards pin themselves with tcpreplay_pin_helper(), so that
+ * they stay off the CPU which sends the packets.
+ */
+void
+tcpreplay_set_helper_cpus(size_t cpusetsize, const void *cpuset)
+{
+#if defined HAVE_PTHREAD && defined HAVE_PTHREAD_SETAFFINITY_NP
+    assert(cpuset);
+
+    CPU_ZERO(&helper_cpus);
+    memcpy(&helper_cpus, cpuset,
+            cpusetsize < sizeof(helper_cpus) ? cpusetsize : sizeof(helper_cpus));
+    helper_cpus_set = true;
+#else
+    (void)cpusetsize;
+    (void)cpuset;
+#endif
+}
+
+/**
+ * \brief Pin the calling helper thread to the helper CPUs
+ *
+ * Does nothing unless tcpreplay_set_helper_cpus() was called.
+ */
+void
+tcpreplay_pin_helper(void)
+{
+#if defined HAVE_PTHREAD && defined HAVE_PTHREAD_SETAFFINITY_NP
+    int err;
+
+    if (!helper_cpus_set)
+        return;
+
+    if ((err = pthread_setaffinity_np(pthread_self(), sizeof(helper_cpus),
+                    &helper_cpus)) != 0)
+        dbgx(1, "Unable to pin helper thread: %s", strerror(err));
+#endif
+}
+
 /**
  * Print various packet statistics
  */
@@ -175,6 +233,10 @@ packet_stats(const tcpreplay_stats_t *stats)
     if (stats->failed)
         printf(COUNTER_SPEC " write attempts failed from full buffers and were repeated\n",
                 stats->failed);
+
+    if (stats->minor_faults || stats->major_faults)
+        printf("Page faults: " COUNTER_SPEC " minor, " COUNTER_SPEC " major\n",
+                stats->minor_faults, stats->major_faults);
 }
 
 /**
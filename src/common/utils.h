@@ -40,12 +40,18 @@ typedef struct {
     COUNTER flows_unique;
     COUNTER flow_packets;
     COUNTER flows_expired;
+    COUNTER flows_active;
+    COUNTER flows_reclaimed;    /* idle flows dropped from the active set */
     COUNTER flows_invalid_packets;
+    COUNTER minor_faults;
+    COUNTER major_faults;
 } tcpreplay_stats_t;
 
 
 int read_hexstring(const char *l2string, u_char *hex, const int hexlen);
 void packet_stats(const tcpreplay_stats_t *stats);
+void tcpreplay_set_helper_cpus(size_t cpusetsize, const void *cpuset);
+void tcpreplay_pin_helper(void);
 
 /* our "safe" implimentations of functions which allocate memory */
 #define safe_malloc(x) _our_safe_malloc(x, __FUNCTION__, __LINE__, __FILE__)
@@ -0,0 +1,215 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2016 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * With VIRTIO_NET_HDR_F_NEEDS_CSUM the checksum field holds the sum of
+ * the pseudo header, and whoever sends the frame adds the sum of the
+ * TCP/UDP header and payload from csum_start on. Segmentation needs
+ * the same, so GSO packets are always marked for checksumming.
+ *
+ * Only plain IPv4 and IPv6 without extension headers, optionally
+ * behind VLAN tags, are offloaded. Everything else, including
+ * fragments and packets cut short by the snaplen, is sent as it is.
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+
+#include "vnet.h"
+
+#ifdef HAVE_LINUX_VIRTIO_NET_H
+
+/**
+ * returns the folded one's complement sum of 'len' bytes
+ */
+static uint32_t
+vnet_sum(const u_char *data, size_t len, uint32_t sum)
+{
+    uint16_t word;
+
+    while (len > 1) {
+        memcpy(&word, data, sizeof(word));
+        sum += word;
+        data += 2;
+        len -= 2;
+    }
+
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return sum;
+}
+
+/**
+ * \brief Fills in the virtio-net header for an Ethernet frame
+ *
+ * 'offload' is a mask of VNET_OFFLOAD_* and 'mtu' that of the device,
+ * for GSO. Returns the number of header bytes copied into vf->hdrs,
+ * with the pseudo header sum in place of the checksum, which are sent
+ * in place of the start of the frame. Returns 0 and clears vf->vh if
+ * the frame is sent as it is.
+ */
+size_t
+vnet_hdr_fill(vnet_frame_t *vf, const u_char *pkt, size_t len, int offload,
+        unsigned int mtu)
+{
+    const ipv4_hdr_t *ip_hdr = NULL;
+    const ipv6_hdr_t *ip6_hdr = NULL;
+    const tcp_hdr_t *tcp_hdr;
+    uint16_t ether_type, l4_len, field;
+    size_t l2_len, l3_len, l4_hdr_len, hdr_len;
+    uint32_t sum;
+    uint8_t proto;
+    bool gso;
+
+    assert(vf);
+    assert(pkt);
+
+    memset(&vf->vh, 0, sizeof(vf->vh));
+    vf->vh.gso_type = VIRTIO_NET_HDR_GSO_NONE;
+
+    if (offload == 0 || len < TCPR_ETH_H)
+        return 0;
+
+    l2_len = get_l2len(pkt, len, DLT_EN10MB);
+    if (len < l2_len + TCPR_IPV4_H)
+        return 0;
+    memcpy(&ether_type, pkt + l2_len - 2, sizeof(ether_type));
+
+    switch (ntohs(ether_type)) {
+    case ETHERTYPE_IP:
+        ip_hdr = (const ipv4_hdr_t *)(pkt + l2_len);
+        l3_len = ip_hdr->ip_hl << 2;
+        if (ip_hdr->ip_v != 4 || l3_len < TCPR_IPV4_H ||
+                (ntohs(ip_hdr->ip_off) & (IP_MF | IP_OFFMASK)) != 0 ||
+                ntohs(ip_hdr->ip_len) < l3_len)
+            return 0;
+        proto = ip_hdr->ip_p;
+        l4_len = ntohs(ip_hdr->ip_len) - l3_len;
+        sum = vnet_sum((const u_char *)&ip_hdr->ip_src, 8, 0);
+        break;
+
+    case ETHERTYPE_IP6:
+        if (len < l2_len + TCPR_IPV6_H)
+            return 0;
+        ip6_hdr = (const ipv6_hdr_t *)(pkt + l2_len);
+        l3_len = TCPR_IPV6_H;
+        proto = ip6_hdr->ip_nh;
+        l4_len = ntohs(ip6_hdr->ip_len);
+        sum = vnet_sum((const u_char *)&ip6_hdr->ip_src, 32, 0);
+        break;
+
+    default:
+        return 0;
+    }
+
+    /* only whole packets can be checksummed */
+    if (l2_len + l3_len + l4_len > len)
+        return 0;
+
+    switch (proto) {
+    case IPPROTO_TCP:
+        if (l4_len < TCPR_TCP_H)
+            return 0;
+        tcp_hdr = (const tcp_hdr_t *)(pkt + l2_len + l3_len);
+        l4_hdr_len = tcp_hdr->th_off << 2;
+        if (l4_hdr_len < TCPR_TCP_H || l4_hdr_len > l4_len)
+            return 0;
+        vf->vh.csum_offset = offsetof(tcp_hdr_t, th_sum);
+        break;
+
+    case IPPROTO_UDP:
+        /* a zero UDP checksum over IPv4 means there is none */
+        if (l4_len < TCPR_UDP_H || (ip_hdr != NULL &&
+                ((const udp_hdr_t *)(pkt + l2_len + l3_len))->uh_sum == 0))
+            return 0;
+        l4_hdr_len = TCPR_UDP_H;
+        vf->vh.csum_offset = offsetof(udp_hdr_t, uh_sum);
+        break;
+
+    default:
+        return 0;
+    }
+
+    gso = (offload & VNET_OFFLOAD_GSO) && proto == IPPROTO_TCP &&
+            mtu > l3_len + l4_hdr_len && l3_len + l4_len > mtu;
+    if (!gso && !(offload & VNET_OFFLOAD_CSUM))
+        return 0;
+
+    hdr_len = l2_len + l3_len + l4_hdr_len;
+    if (hdr_len > VNET_MAX_HDR_LEN)
+        return 0;
+
+    /* replace the checksum with the sum of the pseudo header */
+    sum += htons(proto) + htons(l4_len);
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    field = (uint16_t)sum;
+    memcpy(vf->hdrs, pkt, hdr_len);
+    memcpy(vf->hdrs + l2_len + l3_len + vf->vh.csum_offset, &field, sizeof(field));
+
+    vf->vh.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    vf->vh.csum_start = l2_len + l3_len;
+
+    if (gso) {
+        vf->vh.gso_type = ip6_hdr != NULL ? VIRTIO_NET_HDR_GSO_TCPV6 :
+                VIRTIO_NET_HDR_GSO_TCPV4;
+        vf->vh.hdr_len = hdr_len;
+        vf->vh.gso_size = mtu - l3_len - l4_hdr_len;
+    }
+
+    return hdr_len;
+}
+
+#endif /* HAVE_LINUX_VIRTIO_NET_H */
+
+/**
+ * \brief Parses a comma separated list of offloads, e.g. "csum,gso"
+ *
+ * Returns a mask of VNET_OFFLOAD_* or -1 on error
+ */
+int
+vnet_parse_offload(const char *list)
+{
+    char *copy, *token, *save = NULL;
+    int offload = 0;
+
+    assert(list);
+
+    copy = safe_strdup(list);
+    for (token = strtok_r(copy, ",", &save); token != NULL;
+            token = strtok_r(NULL, ",", &save)) {
+        if (strcasecmp(token, "csum") == 0) {
+            offload |= VNET_OFFLOAD_CSUM;
+        } else if (strcasecmp(token, "gso") == 0) {
+            offload |= VNET_OFFLOAD_GSO;
+        } else {
+            offload = -1;
+            break;
+        }
+    }
+    safe_free(copy);
+
+    return offload ? offload : -1;
+}
@@ -0,0 +1,53 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2016 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __VNET_H__
+#define __VNET_H__
+
+#include "defines.h"
+
+/*
+ * virtio-net headers, which tuntap devices and PF_PACKET sockets accept
+ * in front of each frame to have the kernel, or the NIC or VM behind
+ * it, fill in TCP/UDP checksums and cut large TCP packets into
+ * segments.
+ */
+
+/* offloads asked for */
+#define VNET_OFFLOAD_CSUM       0x1     /* TCP/UDP checksums */
+#define VNET_OFFLOAD_GSO        0x2     /* TCP packets larger than the MTU */
+
+/* longest Ethernet to TCP header that is copied to be patched */
+#define VNET_MAX_HDR_LEN        256
+
+#ifdef HAVE_LINUX_VIRTIO_NET_H
+#include <linux/virtio_net.h>
+
+typedef struct vnet_frame_s {
+    struct virtio_net_hdr vh;
+    u_char hdrs[VNET_MAX_HDR_LEN];  /* patched copy of the frame's headers */
+} vnet_frame_t;
+
+size_t vnet_hdr_fill(vnet_frame_t *vf, const u_char *pkt, size_t len, int offload,
+        unsigned int mtu);
+#endif
+
+int vnet_parse_offload(const char *list);
+
+#endif /* __VNET_H__ */
@@ -0,0 +1,1619 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2016 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Storage for the preload (--preload-pcap) packet cache, and replay
+ * images which save a fully preloaded cache to disk so that it can be
+ * mapped straight back into memory on the next run. The same image
+ * format is used for caches shared between processes.
+ */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_FLOCK
+#include <sys/file.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "tcpreplay_api.h"
+#include "send_packets.h"
+#include "preload.h"
+
+#define PRELOAD_IMAGE_MAGIC     "TCPRIMG"
+#define PRELOAD_IMAGE_VERSION   6
+#define PRELOAD_IMAGE_ALIGN     4096
+
+/* how far to read ahead of a partially preloaded file */
+#define PRELOAD_READ_AHEAD      (64 * 1024 * 1024)
+
+#if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H && defined MAP_ANONYMOUS
+#define PRELOAD_HUGE_PAGES
+#endif
+
+/* per pcap file section of a replay image */
+typedef struct preload_image_file_s {
+    uint64_t src_dev;           /* identity of the source pcap */
+    uint64_t src_ino;
+    uint64_t src_size;
+    int64_t src_mtime;
+    int32_t dlt;
+    uint32_t flags;
+    uint64_t packet_count;
+    uint64_t stream_offset;     /* first packet not cached, 0 if all are */
+    uint64_t cache_offset;      /* packet records */
+    uint64_t cache_len;
+    uint64_t meta_offset;       /* packet metadata */
+} preload_image_file_t;
+
+#define PRELOAD_IMAGE_DEDUP     0x01    /* packets share data */
+
+/*
+ * Table of the packet data and payloads already in a cache, used to
+ * find duplicates while preloading. Entries hold byte offsets into
+ * the cache so they survive it being reallocated.
+ */
+typedef struct dedup_entry_s {
+    uint64_t hash;
+    uint64_t offset;
+    uint32_t len;               /* 0 if the slot is free */
+} dedup_entry_t;
+
+struct preload_dedup_s {
+    dedup_entry_t *entries;
+    size_t size;                /* power of two */
+    size_t count;
+    COUNTER shared;             /* packets which reference others */
+};
+
+/*
+ * Replay image header. Images hold raw in memory structures so
+ * they can only be used on the host type that created them.
+ */
+typedef struct preload_image_hdr_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;       /* sizeof(packet_cache_t) */
+    uint32_t meta_size;         /* sizeof(packet_meta_t) */
+    uint32_t source_cnt;
+    uint32_t use_pkthdr_len;
+    uint32_t flow_stats;
+    int32_t flow_expiry;
+    uint16_t preload_headers;
+    uint16_t payload_fill;
+    uint64_t image_size;
+    uint64_t preload_limit;
+    uint64_t cache_packets;     /* tcpprep cache used for directions */
+    uint64_t cache_hash;
+    /* flow statistics gathered when preloading */
+    uint64_t flows;
+    uint64_t flows_unique;
+    uint64_t flows_expired;
+    uint64_t flows_active;
+    uint64_t flows_reclaimed;
+    uint64_t flow_packets;
+    uint64_t flow_non_flow_packets;
+    uint64_t flows_invalid_packets;
+    preload_image_file_t files[];
+} preload_image_hdr_t;
+
+static inline size_t
+image_align(size_t len, size_t align)
+{
+    return (len + align - 1) & ~(align - 1);
+}
+
+/**
+ * \brief Initialise the cache of a file before preloading it
+ */
+void
+preload_cache_init(tcpreplay_t *ctx, int idx)
+{
+    file_cache_t *fc = &ctx->options->file_cache[idx];
+
+    preload_cache_free(fc);
+    memset(fc, 0, sizeof(*fc));
+    fc->index = idx;
+    fc->huge_page_size = ctx->options->preload_hugepages;
+}
+
+#ifdef PRELOAD_HUGE_PAGES
+/**
+ * Map at least '*len' bytes of anonymous memory from huge pages of
+ * the given size, rounding '*len' up to a whole number of pages.
+ * Falls back to asking for transparent huge pages if none of that
+ * size are reserved.
+ */
+static void *
+cache_map_huge(size_t *len, size_t huge_page_size)
+{
+    static bool warned = false;     /* shared by the preload threads */
+    void *p;
+
+    *len = image_align(*len, huge_page_size);
+
+#ifdef MAP_HUGETLB
+    {
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#ifdef MAP_HUGE_SHIFT
+        flags |= __builtin_ctzl(huge_page_size) << MAP_HUGE_SHIFT;
+#endif
+        p = mmap(NULL, *len, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (p != MAP_FAILED)
+            return p;
+
+        if (!__atomic_exchange_n(&warned, true, __ATOMIC_RELAXED))
+            warnx("Unable to allocate %zu kB huge pages: %s, trying transparent huge pages",
+                    huge_page_size / 1024, strerror(errno));
+    }
+#endif
+
+    p = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        errx(-1, "Unable to allocate %zu bytes for preload cache: %s",
+                *len, strerror(errno));
+
+#ifdef MADV_HUGEPAGE
+    madvise(p, *len, MADV_HUGEPAGE);
+#endif
+    return p;
+}
+#endif
+
+/**
+ * Grow the cache buffer of a file to at least 'size' bytes. Use
+ * it with the size of the pcap file to avoid repeated reallocs.
+ */
+void
+preload_cache_reserve(file_cache_t *fc, size_t size)
+{
+    assert(fc);
+    assert(!fc->mapped);
+
+    if (size <= fc->cache_size)
+        return;
+
+#ifdef PRELOAD_HUGE_PAGES
+    if (fc->huge_page_size) {
+        void *p = cache_map_huge(&size, fc->huge_page_size);
+
+        if (fc->cache_len)
+            memcpy(p, fc->packet_cache, fc->cache_len);
+
+        if (fc->huge)
+            munmap(fc->packet_cache, fc->cache_size);
+        else
+            safe_free(fc->packet_cache);
+
+        fc->packet_cache = p;
+        fc->cache_size = size;
+        fc->huge = true;
+        return;
+    }
+#endif
+
+    fc->packet_cache = safe_realloc(fc->packet_cache, size);
+    fc->cache_size = size;
+}
+
+/**
+ * give back memory reserved for the cache but not used
+ */
+void
+preload_cache_trim(file_cache_t *fc)
+{
+    assert(fc);
+
+    /* huge pages are too coarse to bother */
+    if (fc->mapped || fc->huge || !fc->cache_len || fc->cache_len == fc->cache_size)
+        return;
+
+    fc->packet_cache = safe_realloc(fc->packet_cache, fc->cache_len);
+    fc->cache_size = fc->cache_len;
+}
+
+/**
+ * Append a record for a packet of 'len' bytes of which the first
+ * 'stored' bytes are kept in the record. If 'ref' is not 0, the
+ * rest of the packet is at that offset in the cache.
+ */
+static packet_cache_t *
+cache_append(file_cache_t *fc, const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata, uint32_t len, uint32_t stored, uint64_t ref)
+{
+    size_t reclen = PACKET_CACHE_RECLEN(stored) + (ref ? sizeof(ref) : 0);
+    uint32_t copylen = stored < pkthdr->caplen ? stored : pkthdr->caplen;
+    packet_cache_t *pc;
+
+    assert(fc);
+    assert(pktdata);
+
+    if (fc->cache_len + reclen > fc->cache_size)
+        preload_cache_reserve(fc, fc->cache_size ?
+                (fc->cache_size + reclen) * 2 : reclen * 1024);
+
+    pc = (packet_cache_t *)((u_char *)fc->packet_cache + fc->cache_len);
+    memcpy(&pc->pkthdr, pkthdr, sizeof(pc->pkthdr));
+    pc->data_len = len;
+    pc->stored_len = ref ? stored | PACKET_CACHE_REF : stored;
+    memcpy(packet_cache_data(pc), pktdata, copylen);
+    memset(packet_cache_data(pc) + copylen, 0,
+            reclen - sizeof(*pc) - copylen);
+    if (ref)
+        memcpy((u_char *)pc + reclen - sizeof(ref), &ref, sizeof(ref));
+
+    fc->cache_len += reclen;
+    ++fc->packet_count;
+
+    return pc;
+}
+
+/**
+ * Append a packet to the cache of a file and return the new record.
+ *
+ * 'len' bytes are stored, which may be more than the captured
+ * length when sending the original packet length. Any bytes
+ * that were not captured are zeroed.
+ */
+packet_cache_t *
+preload_cache_add(file_cache_t *fc, const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata, uint32_t len)
+{
+    return cache_append(fc, pkthdr, pktdata, len, len, 0);
+}
+
+/**
+ * FNV-1a hash
+ */
+static uint64_t
+hash_bytes(uint64_t hv, const u_char *p, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hv ^= p[i];
+        hv *= 0x100000001b3ULL;
+    }
+
+    return hv;
+}
+
+#define HASH_INIT   0xcbf29ce484222325ULL
+
+/**
+ * \brief Allocate the table used to deduplicate the packets of a file
+ */
+preload_dedup_t *
+preload_dedup_init(void)
+{
+    preload_dedup_t *dd = safe_malloc(sizeof(*dd));
+
+    dd->size = 4096;
+    dd->entries = safe_malloc(sizeof(dedup_entry_t) * dd->size);
+
+    return dd;
+}
+
+/**
+ * \brief Release a deduplication table, returns how many packets it shared
+ */
+COUNTER
+preload_dedup_free(preload_dedup_t *dd)
+{
+    COUNTER shared;
+
+    if (dd == NULL)
+        return 0;
+
+    shared = dd->shared;
+    safe_free(dd->entries);
+    safe_free(dd);
+
+    return shared;
+}
+
+static const dedup_entry_t *
+dedup_find(const preload_dedup_t *dd, const file_cache_t *fc,
+        const u_char *p, uint32_t len, uint64_t hash)
+{
+    size_t mask = dd->size - 1;
+    size_t i;
+
+    for (i = hash & mask; dd->entries[i].len; i = (i + 1) & mask) {
+        const dedup_entry_t *e = &dd->entries[i];
+
+        if (e->hash == hash && e->len == len &&
+                memcmp((u_char *)fc->packet_cache + e->offset, p, len) == 0)
+            return e;
+    }
+
+    return NULL;
+}
+
+static void
+dedup_insert(preload_dedup_t *dd, uint64_t hash, uint64_t offset, uint32_t len)
+{
+    size_t mask, i;
+
+    /* keep the table at most half full */
+    if ((dd->count + 1) * 2 > dd->size) {
+        dedup_entry_t *old = dd->entries;
+        size_t old_size = dd->size;
+
+        dd->size *= 2;
+        dd->entries = safe_malloc(sizeof(dedup_entry_t) * dd->size);
+        dd->count = 0;
+        for (i = 0; i < old_size; i++) {
+            if (old[i].len)
+                dedup_insert(dd, old[i].hash, old[i].offset, old[i].len);
+        }
+        safe_free(old);
+    }
+
+    mask = dd->size - 1;
+    for (i = hash & mask; dd->entries[i].len; i = (i + 1) & mask)
+        ;
+
+    dd->entries[i].hash = hash;
+    dd->entries[i].offset = offset;
+    dd->entries[i].len = len;
+    ++dd->count;
+}
+
+/*
+ * ones' complement arithmetic for fixing up L4 checksums, over
+ * big endian 16 bit words
+ */
+static uint64_t
+csum_add(const u_char *p, uint32_t len)
+{
+    uint64_t sum = 0;
+    uint32_t i;
+
+    for (i = 0; i + 1 < len; i += 2)
+        sum += (p[i] << 8) | p[i + 1];
+    if (len & 1)
+        sum += p[len - 1] << 8;
+
+    return sum;
+}
+
+static uint16_t
+csum_fold(uint64_t sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return (uint16_t)sum;
+}
+
+/**
+ * Find where the payload of a TCP, UDP or ICMP packet starts. Returns 0
+ * if the payload should be kept, e.g. for fragments and other protocols.
+ * '*csum_off' is set to the offset of the L4 checksum if it can be fixed
+ * up after the payload is replaced, 0 if not, and '*end' to the end of
+ * the L4 payload.
+ */
+static uint32_t
+headers_parse(const packet_meta_t *meta, const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata, uint32_t *csum_off, uint32_t *end)
+{
+    uint32_t caplen = pkthdr->caplen;
+    uint32_t l4 = meta->l4_offset;
+    ipv4_hdr_t *ip_hdr;
+    ipv6_hdr_t *ip6_hdr;
+    uint32_t hlen;
+
+    *csum_off = *end = 0;
+    if (!l4 || (meta->flags & PACKET_META_INVALID))
+        return 0;
+
+    switch (meta->ether_type) {
+    case ETHERTYPE_IP:
+        ip_hdr = (ipv4_hdr_t *)(pktdata + meta->l2_len);
+        /* the checksum covers the payload of every fragment */
+        if (ntohs(ip_hdr->ip_off) & (IP_MF | IP_OFFMASK))
+            return 0;
+
+        *end = meta->l2_len + ntohs(ip_hdr->ip_len);
+        break;
+
+    case ETHERTYPE_IP6:
+        ip6_hdr = (ipv6_hdr_t *)(pktdata + meta->l2_len);
+        *end = meta->l2_len + TCPR_IPV6_H + ntohs(ip6_hdr->ip_len);
+        break;
+
+    default:
+        return 0;
+    }
+
+    switch (meta->protocol) {
+    case IPPROTO_TCP:
+        if (caplen < l4 + TCPR_TCP_H)
+            return 0;
+
+        hlen = l4 + (pktdata[l4 + 12] >> 4) * 4;
+        *csum_off = l4 + 16;
+        break;
+
+    case IPPROTO_UDP:
+        hlen = l4 + TCPR_UDP_H;
+        *csum_off = l4 + 6;
+        break;
+
+    case IPPROTO_ICMP:
+    case IPPROTO_ICMPV6:
+        hlen = l4 + 8;
+        *csum_off = l4 + 2;
+        break;
+
+    default:
+        return 0;
+    }
+
+    if (hlen >= caplen)
+        return 0;
+
+    /* can't fix the checksum if we don't have all of the payload */
+    if (caplen < pkthdr->len || *end < hlen || *end > caplen)
+        *csum_off = 0;
+
+    return hlen;
+}
+
+/**
+ * Update the L4 checksum at 'csum' for the 'len' payload bytes at 'payload'
+ * being replaced by 'fill' bytes, as per RFC 1624
+ */
+static void
+csum_fill_payload(u_char *csum, const u_char *payload, uint32_t len,
+        u_char fill, bool udp)
+{
+    uint16_t old = (csum[0] << 8) | csum[1];
+    uint64_t sum;
+
+    /* UDP over IPv4 may not have a checksum */
+    if (udp && old == 0)
+        return;
+
+    sum = (uint16_t)~old;
+    sum += (uint16_t)~csum_fold(csum_add(payload, len));
+    sum += (uint64_t)(len / 2) * (fill * 0x0101u);
+    if (len & 1)
+        sum += fill << 8;
+
+    old = ~csum_fold(sum);
+    if (udp && old == 0)
+        old = 0xffff;
+
+    csum[0] = old >> 8;
+    csum[1] = old & 0xff;
+}
+
+/**
+ * \brief Number of bytes preload_cache_add_headers() will store for a packet
+ */
+uint32_t
+preload_headers_len(const packet_meta_t *meta, const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata, uint32_t len)
+{
+    uint32_t csum_off, end, hlen;
+
+    hlen = headers_parse(meta, pkthdr, pktdata, &csum_off, &end);
+
+    return hlen && hlen < len ? hlen : len;
+}
+
+/**
+ * \brief Append only the headers of a packet to the cache of a file
+ *
+ * The payload of TCP, UDP and ICMP packets is not stored, it is replaced
+ * by 'fill' bytes when the packet is sent and the L4 checksum is updated
+ * to match. Other packets are stored in full.
+ */
+packet_cache_t *
+preload_cache_add_headers(file_cache_t *fc, const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata, uint32_t len, const packet_meta_t *meta,
+        u_char fill)
+{
+    uint32_t csum_off, end, hlen;
+    packet_cache_t *pc;
+
+    hlen = headers_parse(meta, pkthdr, pktdata, &csum_off, &end);
+    if (!hlen || hlen >= len)
+        return preload_cache_add(fc, pkthdr, pktdata, len);
+
+    pc = cache_append(fc, pkthdr, pktdata, len, hlen, 0);
+    if (csum_off)
+        csum_fill_payload(packet_cache_data(pc) + csum_off, pktdata + hlen,
+                end - hlen, fill, meta->protocol == IPPROTO_UDP);
+
+    return pc;
+}
+
+/**
+ * \brief Append a packet to the cache of a file, sharing data with earlier packets
+ *
+ * A packet identical to one already in the cache just refers to it,
+ * and can still be sent without copying it. Packets which only share
+ * their payload are stored in full: putting them back together would
+ * cost a copy on every send.
+ */
+packet_cache_t *
+preload_cache_add_dedup(file_cache_t *fc, preload_dedup_t *dd,
+        const struct pcap_pkthdr *pkthdr, const u_char *pktdata, uint32_t len)
+{
+    const dedup_entry_t *e;
+    packet_cache_t *pc;
+    uint64_t whole, off;
+
+    /* bytes which weren't captured are zero filled, leave those alone */
+    if (len != pkthdr->caplen)
+        return preload_cache_add(fc, pkthdr, pktdata, len);
+
+    whole = hash_bytes(HASH_INIT, pktdata, len);
+    if ((e = dedup_find(dd, fc, pktdata, len, whole)) != NULL) {
+        ++dd->shared;
+        fc->deduped = true;
+        return cache_append(fc, pkthdr, pktdata, len, 0, e->offset);
+    }
+
+    pc = preload_cache_add(fc, pkthdr, pktdata, len);
+    off = packet_cache_data(pc) - (u_char *)fc->packet_cache;
+    dedup_insert(dd, whole, off, len);
+
+    return pc;
+}
+
+/**
+ * \brief Copy a cached packet to the scratch buffer of its file
+ *
+ * Rebuilds the full packet, with any payload which was not stored
+ * replaced by 'fill' bytes. The buffer is kept filled between packets,
+ * so only the bytes the previous packet used need to be restored.
+ * Set 'edited' if the copy may be changed beyond its stored headers.
+ */
+u_char *
+preload_cache_copy(file_cache_t *fc, const packet_cache_t *pc, u_char fill,
+        bool edited)
+{
+    uint32_t stored = packet_cache_stored(pc);
+    uint32_t len = max(pc->data_len, MAXPACKET);
+    const u_char *ref;
+
+    if (fc->scratch_len < len) {
+        safe_free(fc->scratch);
+        fc->scratch = safe_malloc(len);
+        fc->scratch_len = len;
+        memset(fc->scratch, fill, len);
+        fc->scratch_dirty = 0;
+    }
+
+    memcpy(fc->scratch, (const u_char *)(pc + 1), stored);
+
+    if ((ref = packet_cache_ref(fc, pc)) != NULL) {
+        memcpy(fc->scratch + stored, ref, pc->data_len - stored);
+        fc->scratch_dirty = pc->data_len;
+        return fc->scratch;
+    }
+
+    if (fc->scratch_dirty > stored)
+        memset(fc->scratch + stored, fill, fc->scratch_dirty - stored);
+
+    fc->scratch_dirty = edited ? pc->data_len : stored;
+
+    return fc->scratch;
+}
+
+/**
+ * release the cache of a file
+ */
+void
+preload_cache_free(file_cache_t *fc)
+{
+    assert(fc);
+
+#if defined HAVE_MLOCK && defined HAVE_SYS_MMAN_H
+    if (fc->locked && !fc->mapped) {
+        munlock(fc->packet_cache, fc->cache_size);
+        munlock(fc->packet_meta, fc->packet_count * sizeof(packet_meta_t));
+    }
+#endif
+
+    if (!fc->mapped) {
+#ifdef PRELOAD_HUGE_PAGES
+        if (fc->huge)
+            munmap(fc->packet_cache, fc->cache_size);
+        else
+#endif
+            safe_free(fc->packet_cache);
+        safe_free(fc->packet_meta);
+    }
+    safe_free(fc->scratch);
+    safe_free(fc->idle_gaps);
+
+    fc->packet_cache = NULL;
+    fc->packet_meta = NULL;
+    fc->cache_len = fc->cache_size = 0;
+    fc->packet_count = 0;
+    fc->mapped = false;
+    fc->readonly = false;
+    fc->huge = false;
+    fc->locked = false;
+    fc->partial = false;
+    fc->deduped = false;
+    fc->stream_counted = false;
+    fc->stream_offset = 0;
+    fc->scratch_len = 0;
+    fc->scratch_dirty = 0;
+    fc->idle_gap_cnt = 0;
+    fc->idle_scanned = false;
+    fc->cached = FALSE;
+}
+
+/**
+ * read a byte of every page so that it is faulted in
+ */
+static void
+cache_prefault(const void *addr, size_t len)
+{
+    const volatile u_char *p = addr;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t off;
+
+    if (p == NULL)
+        return;
+
+    for (off = 0; off < len; off += page)
+        (void)p[off];
+}
+
+/**
+ * \brief Fault in, and optionally lock, the preloaded packets
+ *
+ * Called before the clock starts so that the first loop doesn't stall
+ * on page faults, e.g. for packets mapped from a replay image.
+ */
+void
+preload_cache_prefault(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    int i;
+
+    for (i = 0; i < options->source_cnt; i++) {
+        file_cache_t *fc = &options->file_cache[i];
+        size_t meta_len = fc->packet_count * sizeof(packet_meta_t);
+
+        if (!fc->cached || fc->locked)
+            continue;
+
+#if defined HAVE_MLOCK && defined HAVE_SYS_MMAN_H
+        /* mlock() faults the pages in itself */
+        if (options->preload_mlock) {
+            if (mlock(fc->packet_cache, fc->cache_len) == 0 &&
+                    mlock(fc->packet_meta, meta_len) == 0) {
+                fc->locked = true;
+                continue;
+            }
+            warnx("Unable to lock preloaded packets in memory: %s", strerror(errno));
+            options->preload_mlock = false;
+        }
+#endif
+
+        cache_prefault(fc->packet_cache, fc->cache_len);
+        cache_prefault(fc->packet_meta, meta_len);
+    }
+}
+
+#ifdef HAVE_PTHREAD
+/* work shared by the preload threads */
+typedef struct preload_pool_s {
+    tcpreplay_t *ctx;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int next;                   /* next file to read */
+    bool *done;                 /* files which have been read */
+    char (*errs)[PCAP_ERRBUF_SIZE]; /* why a file couldn't be read, "" if it was */
+} preload_pool_t;
+
+static void *
+preload_worker(void *arg)
+{
+    preload_pool_t *pool = arg;
+    tcpreplay_opt_t *options = pool->ctx->options;
+    int idx;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->next < options->source_cnt && pool->done[pool->next])
+            pool->next++;
+        idx = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (idx >= options->source_cnt)
+            break;
+
+        /* errors are reported by the main thread */
+        preload_pcap_read(pool->ctx, idx, pool->errs[idx]);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->done[idx] = true;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+static void *
+preload_thread(void *arg)
+{
+    tcpreplay_pin_helper();
+    return preload_worker(arg);
+}
+#endif
+
+/**
+ * \brief Preload every source which isn't cached yet
+ *
+ * Files are read and decoded by a pool of threads, see
+ * tcpreplay_set_preload_threads(), while this thread finishes each file
+ * in order as soon as it has been read, so that flow statistics and
+ * tcpprep directions are the same as when preloading one at a time.
+ */
+void
+preload_pcap_files(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    int threads = options->preload_threads;
+    int i, todo = 0;
+
+    for (i = 0; i < options->source_cnt; i++) {
+        if (!options->file_cache[i].cached)
+            todo++;
+    }
+
+    /*
+     * share the memory budget out from the first file, so that
+     * later files are the ones which get streamed
+     */
+    if (options->preload_limit) {
+        size_t budget = options->preload_limit;
+
+        for (i = 0; i < options->source_cnt; i++) {
+            file_cache_t *fc = &options->file_cache[i];
+            size_t want = budget;
+            struct stat st;
+
+            if (fc->cached)
+                continue;
+
+            if (stat(options->sources[i].filename, &st) == 0 && S_ISREG(st.st_mode))
+                want = preload_cache_estimate(st.st_size);
+
+            if (want > budget)
+                want = budget;
+            budget -= want;
+
+            /* 0 means unlimited, so cache nothing with a budget of 1 */
+            fc->cache_limit = want ? want : 1;
+        }
+    }
+
+#ifdef HAVE_PTHREAD
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+    }
+    if (threads > todo)
+        threads = todo;
+
+    if (threads > 1) {
+        preload_pool_t pool;
+        pthread_t *tids = safe_malloc(sizeof(pthread_t) * threads);
+        int started = 0;
+
+        memset(&pool, 0, sizeof(pool));
+        pool.ctx = ctx;
+        pool.done = safe_malloc(sizeof(bool) * options->source_cnt);
+        pool.errs = safe_malloc(sizeof(*pool.errs) * options->source_cnt);
+        pthread_mutex_init(&pool.lock, NULL);
+        pthread_cond_init(&pool.cond, NULL);
+
+        for (i = 0; i < options->source_cnt; i++)
+            pool.done[i] = options->file_cache[i].cached;
+
+        for (i = 0; i < threads; i++) {
+            if (pthread_create(&tids[started], NULL, preload_thread, &pool) == 0)
+                started++;
+        }
+        dbgx(1, "Preloading %d files with %d threads", todo, started);
+
+        /* if no thread started, read the files ourselves */
+        if (started == 0)
+            preload_worker(&pool);
+
+        for (i = 0; i < options->source_cnt; i++) {
+            if (options->file_cache[i].cached)
+                continue;
+
+            pthread_mutex_lock(&pool.lock);
+            while (!pool.done[i])
+                pthread_cond_wait(&pool.cond, &pool.lock);
+            pthread_mutex_unlock(&pool.lock);
+
+            if (pool.errs[i][0] != '\0')
+                errx(-1, "%s", pool.errs[i]);
+
+            preload_pcap_account(ctx, i);
+        }
+
+        for (i = 0; i < started; i++)
+            pthread_join(tids[i], NULL);
+
+        pthread_cond_destroy(&pool.cond);
+        pthread_mutex_destroy(&pool.lock);
+        safe_free(pool.errs);
+        safe_free(pool.done);
+        safe_free(tids);
+        return;
+    }
+#endif
+
+    for (i = 0; i < options->source_cnt; i++) {
+        if (!options->file_cache[i].cached)
+            preload_pcap_file(ctx, i);
+    }
+}
+
+/**
+ * \brief Open a partially preloaded file to stream the packets not cached
+ *
+ * The file is positioned at the first packet which isn't in the cache,
+ * and the kernel is asked to start reading it in while the cached
+ * packets are sent. Returns NULL on error.
+ */
+capfile_t *
+preload_stream_open(tcpreplay_t *ctx, int idx)
+{
+    file_cache_t *fc = &ctx->options->file_cache[idx];
+    capfile_t *cf;
+
+    assert(fc->partial);
+
+    if ((cf = source_open(ctx, idx, fc->stream_offset)) == NULL)
+        return NULL;
+
+#ifdef HAVE_POSIX_FADVISE
+    /* offsets in compressed files aren't file offsets */
+    if (!ctx->options->direct_io && capfile_fileno(cf) >= 0) {
+        posix_fadvise(capfile_fileno(cf), fc->stream_offset, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(capfile_fileno(cf), fc->stream_offset, PRELOAD_READ_AHEAD, POSIX_FADV_WILLNEED);
+    }
+#endif
+
+    return cf;
+}
+
+/* per packet flags used by preload_idle_scan() */
+#define IDLE_FLOW               0x01    /* part of a flow */
+#define IDLE_FLOW_START         0x02    /* first packet of its flow */
+#define IDLE_FLOW_CONT          0x04    /* its flow has more packets */
+
+/**
+ * \brief Find the idle periods of a preloaded file for --idle-compress
+ *
+ * A flow is active from its first to its last packet in the cache.
+ * Packets are tagged with their number in the flow table, so each
+ * lookup returns the previous packet of the flow, which is then known
+ * not to be the last. A second pass counts the active flows and
+ * records the gaps between packets where there are none which are
+ * longer than options->idle_compress_us.
+ */
+void
+preload_idle_scan(tcpreplay_t *ctx, int idx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    file_cache_t *fc = &options->file_cache[idx];
+    COUNTER keep_us = options->idle_compress_us;
+    COUNTER shift_us = 0;
+    COUNTER active = 0;
+    COUNTER i, alloc = 0;
+    flow_hash_table_t *fht;
+    packet_cache_t *pc, *prev = NULL;
+    uint8_t *flags;
+
+    fc->idle_scanned = true;
+    if (!fc->cached || fc->packet_count == 0 || fc->packet_count >= UINT32_MAX)
+        return;
+
+    fht = flow_hash_table_init(DEFAULT_FLOW_HASH_BUCKET_SIZE);
+    flags = safe_malloc(fc->packet_count);
+
+    for (pc = packet_cache_first(fc), i = 0; pc != NULL && i < fc->packet_count;
+            pc = packet_cache_next(fc, pc), i++) {
+        /* the headers are always stored at the start of the record */
+        u_char *pktdata = packet_cache_direct(fc, pc);
+        uint32_t tag = (uint32_t)i + 1;
+        flow_entry_type_t type;
+
+        if (pktdata == NULL)
+            pktdata = packet_cache_data(pc);
+
+        type = flow_decode_tag(fht, &pc->pkthdr, pktdata, &fc->packet_meta[i], &tag);
+        if (type != FLOW_ENTRY_NEW && type != FLOW_ENTRY_EXISTING)
+            continue;
+
+        flags[i] |= IDLE_FLOW;
+        if (tag == 0)
+            flags[i] |= IDLE_FLOW_START;
+        else
+            flags[tag - 1] |= IDLE_FLOW_CONT;
+    }
+
+    flow_hash_table_release(fht);
+
+    for (pc = packet_cache_first(fc), i = 0; pc != NULL && i < fc->packet_count;
+            prev = pc, pc = packet_cache_next(fc, pc), i++) {
+        if (prev != NULL && active == 0 &&
+                timercmp(&pc->pkthdr.ts, &prev->pkthdr.ts, >)) {
+            struct timeval gap;
+            COUNTER gap_us;
+
+            timersub(&pc->pkthdr.ts, &prev->pkthdr.ts, &gap);
+            gap_us = TIMEVAL_TO_MICROSEC(&gap);
+            if (gap_us > keep_us) {
+                if (fc->idle_gap_cnt == alloc) {
+                    alloc = alloc ? alloc * 2 : 64;
+                    fc->idle_gaps = safe_realloc(fc->idle_gaps, sizeof(idle_gap_t) * alloc);
+                }
+
+                shift_us += gap_us - keep_us;
+                fc->idle_gaps[fc->idle_gap_cnt].packetnum = i + 1;
+                fc->idle_gaps[fc->idle_gap_cnt].shift_us = shift_us;
+                fc->idle_gap_cnt++;
+            }
+        }
+
+        if (flags[i] & IDLE_FLOW_START)
+            active++;
+        if ((flags[i] & IDLE_FLOW) && !(flags[i] & IDLE_FLOW_CONT))
+            active--;
+    }
+
+    safe_free(flags);
+
+    dbgx(1, "%s: " COUNTER_SPEC " idle periods, " COUNTER_SPEC " usec removed",
+            options->sources[idx].filename, fc->idle_gap_cnt, shift_us);
+}
+
+/**
+ * FNV-1a hash of the tcpprep cache so that directions stored
+ * in an image can be matched to the cache file in use
+ */
+static uint64_t
+image_cache_hash(const tcpreplay_opt_t *options)
+{
+    COUNTER len;
+
+    if (options->cachedata == NULL)
+        return 0;
+
+    len = (options->cache_packets + CACHE_PACKETS_PER_BYTE - 1) / CACHE_PACKETS_PER_BYTE;
+
+    return hash_bytes(HASH_INIT, (const u_char *)options->cachedata, len);
+}
+
+/**
+ * Hash of the options which shape a preloaded cache, so that shared
+ * caches built with different options get different names
+ */
+static uint64_t
+image_options_hash(const tcpreplay_opt_t *options)
+{
+    preload_image_hdr_t key;
+
+    memset(&key, 0, sizeof(key));
+    key.source_cnt = options->source_cnt;
+    key.use_pkthdr_len = options->use_pkthdr_len;
+    key.flow_stats = options->flow_stats;
+    key.flow_expiry = options->flow_expiry;
+    key.preload_limit = options->preload_limit;
+    key.preload_headers = options->preload_headers;
+    key.payload_fill = options->payload_fill;
+    key.cache_packets = options->cache_packets;
+    key.cache_hash = image_cache_hash(options);
+
+    return hash_bytes(HASH_INIT, (const u_char *)&key, sizeof(key));
+}
+
+/**
+ * Get the identity of a source pcap file: the file itself, so that a
+ * copy with the same size and mtime doesn't match, and its size and
+ * mtime. Returns -1 if it can't be put in an image, e.g. it is read
+ * from stdin.
+ */
+static int
+image_source_stat(tcpreplay_t *ctx, int idx, preload_image_file_t *f)
+{
+    const char *path = ctx->options->sources[idx].filename;
+    struct stat st;
+
+    if (strcmp(path, "-") == 0 || stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+        return -1;
+
+    f->src_dev = (uint64_t)st.st_dev;
+    f->src_ino = (uint64_t)st.st_ino;
+    f->src_size = (uint64_t)st.st_size;
+    f->src_mtime = (int64_t)st.st_mtime;
+    return 0;
+}
+
+#if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H
+/**
+ * Check that a mapped image matches our sources and options, and
+ * if so point the file caches at it. 'name' is only used for
+ * messages. Returns 0 on success or -1 if the image can't be used.
+ */
+static int
+image_attach(tcpreplay_t *ctx, u_char *image, size_t len, const char *name,
+        bool readonly)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    preload_image_hdr_t *hdr = (preload_image_hdr_t *)image;
+    size_t hdr_len;
+    int i;
+
+    if (len < sizeof(*hdr)) {
+        warnx("Ignoring invalid replay image %s", name);
+        return -1;
+    }
+
+    hdr_len = sizeof(*hdr) + sizeof(preload_image_file_t) * hdr->source_cnt;
+    if (memcmp(hdr->magic, PRELOAD_IMAGE_MAGIC, sizeof(hdr->magic)) ||
+            hdr->version != PRELOAD_IMAGE_VERSION ||
+            hdr->record_size != sizeof(packet_cache_t) ||
+            hdr->meta_size != sizeof(packet_meta_t) ||
+            hdr->image_size > (uint64_t)len ||
+            hdr_len > len) {
+        warnx("Ignoring invalid replay image %s", name);
+        return -1;
+    }
+
+    if (hdr->source_cnt != (uint32_t)options->source_cnt ||
+            hdr->use_pkthdr_len != (uint32_t)options->use_pkthdr_len ||
+            hdr->flow_stats != (uint32_t)options->flow_stats ||
+            hdr->flow_expiry != options->flow_expiry ||
+            hdr->preload_limit != options->preload_limit ||
+            hdr->preload_headers != (uint16_t)options->preload_headers ||
+            hdr->payload_fill != options->payload_fill ||
+            hdr->cache_packets != options->cache_packets ||
+            hdr->cache_hash != image_cache_hash(options)) {
+        warnx("Replay image %s was saved with different options, ignoring", name);
+        return -1;
+    }
+
+    for (i = 0; i < options->source_cnt; i++) {
+        preload_image_file_t *f = &hdr->files[i];
+        preload_image_file_t src;
+
+        if (image_source_stat(ctx, i, &src) < 0 ||
+                src.src_dev != f->src_dev || src.src_ino != f->src_ino ||
+                src.src_size != f->src_size || src.src_mtime != f->src_mtime) {
+            warnx("Replay image %s is out of date for %s, ignoring", name,
+                    options->sources[i].filename);
+            return -1;
+        }
+
+        if (f->cache_offset + f->cache_len > hdr->image_size ||
+                f->meta_offset + f->packet_count * sizeof(packet_meta_t) > hdr->image_size) {
+            warnx("Ignoring truncated replay image %s", name);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < options->source_cnt; i++) {
+        preload_image_file_t *f = &hdr->files[i];
+        file_cache_t *fc = &options->file_cache[i];
+
+        preload_cache_free(fc);
+        fc->packet_cache = (packet_cache_t *)(image + f->cache_offset);
+        fc->cache_len = fc->cache_size = f->cache_len;
+        fc->packet_count = f->packet_count;
+        fc->packet_meta = (packet_meta_t *)(image + f->meta_offset);
+        fc->dlt = f->dlt;
+        fc->partial = f->stream_offset != 0;
+        fc->stream_offset = f->stream_offset;
+        fc->deduped = (f->flags & PRELOAD_IMAGE_DEDUP) != 0;
+        fc->mapped = true;
+        fc->readonly = readonly;
+        fc->cached = TRUE;
+    }
+
+    ctx->stats.flows = hdr->flows;
+    ctx->stats.flows_unique = hdr->flows_unique;
+    ctx->stats.flows_expired = hdr->flows_expired;
+    ctx->stats.flows_active = hdr->flows_active;
+    ctx->stats.flows_reclaimed = hdr->flows_reclaimed;
+    ctx->stats.flow_packets = hdr->flow_packets;
+    ctx->stats.flow_non_flow_packets = hdr->flow_non_flow_packets;
+    ctx->stats.flows_invalid_packets = hdr->flows_invalid_packets;
+
+    /* start reading the packets in while we get ready to send */
+    madvise(image, len, MADV_WILLNEED);
+
+    ctx->image = image;
+    ctx->image_len = len;
+
+    return 0;
+}
+#endif
+
+/**
+ * \brief Preload every source, from a shared cache or replay image if possible
+ *
+ * The shared cache is attached first, and built if it doesn't exist
+ * yet. Failing that the replay image is mapped, and failing that the
+ * pcaps are preloaded and saved to the replay image for next time.
+ */
+preload_from_t
+preload_sources(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    int i;
+
+    for (i = 0; i < options->source_cnt; i++)
+        preload_cache_init(ctx, i);
+
+    if (options->preload_shared != NULL &&
+            preload_shared_attach(ctx, options->preload_shared, true) == 0)
+        return preload_from_shared;
+
+    if (options->preload_image != NULL &&
+            preload_image_load(ctx, options->preload_image) == 0)
+        return preload_from_image;
+
+    preload_pcap_files(ctx);
+
+    if (options->preload_image != NULL)
+        preload_image_save(ctx, options->preload_image);
+
+    return preload_from_pcaps;
+}
+
+/**
+ * \brief Map the preloaded cache of all sources from a replay image
+ *
+ * The image must have been saved with the same pcap files, tcpprep
+ * cache and options that affect preloading, otherwise it is ignored
+ * and the caller should preload the pcap files as usual.
+ *
+ * The image is mapped copy-on-write, so packets can still be edited
+ * in place. Returns 0 on success or -1 if the image is missing or
+ * can't be used.
+ */
+int
+preload_image_load(tcpreplay_t *ctx, const char *path)
+{
+#if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H
+    struct stat st;
+    u_char *image;
+    int fd;
+
+    assert(path);
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        dbgx(1, "Unable to open replay image %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        warnx("Ignoring invalid replay image %s", path);
+        return -1;
+    }
+
+    image = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        warnx("Unable to map replay image %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    if (image_attach(ctx, image, st.st_size, path, false) < 0) {
+        munmap(image, st.st_size);
+        return -1;
+    }
+
+    dbgx(1, "Mapped %zu byte replay image %s", ctx->image_len, path);
+    return 0;
+#else
+    tcpreplay_seterr(ctx, "%s", "replay images require mmap() support");
+    return -1;
+#endif
+}
+
+/**
+ * Build the header of an image of the preloaded cache and lay out
+ * the packet records and metadata of each file. Returns NULL if
+ * some source is not preloaded from a regular file.
+ */
+static preload_image_hdr_t *
+image_layout(tcpreplay_t *ctx, size_t *hdr_len)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    preload_image_hdr_t *hdr;
+    uint64_t off;
+    int i;
+
+    *hdr_len = sizeof(*hdr) + sizeof(preload_image_file_t) * options->source_cnt;
+    hdr = safe_malloc(*hdr_len);
+    memcpy(hdr->magic, PRELOAD_IMAGE_MAGIC, sizeof(hdr->magic));
+    hdr->version = PRELOAD_IMAGE_VERSION;
+    hdr->record_size = sizeof(packet_cache_t);
+    hdr->meta_size = sizeof(packet_meta_t);
+    hdr->source_cnt = options->source_cnt;
+    hdr->use_pkthdr_len = options->use_pkthdr_len;
+    hdr->flow_stats = options->flow_stats;
+    hdr->flow_expiry = options->flow_expiry;
+    hdr->preload_limit = options->preload_limit;
+    hdr->preload_headers = options->preload_headers;
+    hdr->payload_fill = options->payload_fill;
+    hdr->cache_packets = options->cache_packets;
+    hdr->cache_hash = image_cache_hash(options);
+    hdr->flows = ctx->stats.flows;
+    hdr->flows_unique = ctx->stats.flows_unique;
+    hdr->flows_expired = ctx->stats.flows_expired;
+    hdr->flows_active = ctx->stats.flows_active;
+    hdr->flows_reclaimed = ctx->stats.flows_reclaimed;
+    hdr->flow_packets = ctx->stats.flow_packets;
+    hdr->flow_non_flow_packets = ctx->stats.flow_non_flow_packets;
+    hdr->flows_invalid_packets = ctx->stats.flows_invalid_packets;
+
+    off = image_align(*hdr_len, PRELOAD_IMAGE_ALIGN);
+    for (i = 0; i < options->source_cnt; i++) {
+        preload_image_file_t *f = &hdr->files[i];
+        file_cache_t *fc = &options->file_cache[i];
+
+        if (!fc->cached || image_source_stat(ctx, i, f) < 0) {
+            warnx("Unable to save replay image: %s is not preloaded from a file",
+                    options->sources[i].filename);
+            safe_free(hdr);
+            return NULL;
+        }
+
+        f->dlt = fc->dlt;
+        f->packet_count = fc->packet_count;
+        f->stream_offset = fc->partial ? fc->stream_offset : 0;
+        f->flags = fc->deduped ? PRELOAD_IMAGE_DEDUP : 0;
+        f->cache_offset = off;
+        f->cache_len = fc->cache_len;
+        off = image_align(off + fc->cache_len, PRELOAD_IMAGE_ALIGN);
+        f->meta_offset = off;
+        off = image_align(off + fc->packet_count * sizeof(packet_meta_t),
+                PRELOAD_IMAGE_ALIGN);
+    }
+    hdr->image_size = off;
+
+    return hdr;
+}
+
+/**
+ * Size the open file 'fd' for the image described by 'hdr' and write
+ * the image through a shared mapping, which works on tmpfs and hugetlbfs
+ * as well as regular file systems. The header is written last.
+ * Returns the size of the file or 0 on error.
+ */
+static size_t
+image_write(tcpreplay_t *ctx, int fd, const preload_image_hdr_t *hdr, size_t hdr_len)
+{
+#if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H
+    tcpreplay_opt_t *options = ctx->options;
+    struct stat st;
+    u_char *image;
+    size_t len;
+    int i;
+
+    /* hugetlbfs files must be a multiple of the huge page size */
+    if (fstat(fd, &st) < 0)
+        return 0;
+    len = image_align(hdr->image_size, st.st_blksize > PRELOAD_IMAGE_ALIGN ?
+            (size_t)st.st_blksize : PRELOAD_IMAGE_ALIGN);
+
+    if (ftruncate(fd, len) < 0)
+        return 0;
+
+    image = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED)
+        return 0;
+
+    for (i = 0; i < options->source_cnt; i++) {
+        const preload_image_file_t *f = &hdr->files[i];
+        file_cache_t *fc = &options->file_cache[i];
+
+        memcpy(image + f->cache_offset, fc->packet_cache, f->cache_len);
+        memcpy(image + f->meta_offset, fc->packet_meta,
+                f->packet_count * sizeof(packet_meta_t));
+    }
+    memcpy(image, hdr, hdr_len);
+
+    munmap(image, len);
+    return len;
+#else
+    errno = ENOSYS;
+    return 0;
+#endif
+}
+
+/**
+ * \brief Save the preloaded cache of all sources to a replay image
+ *
+ * The image is written to a temporary file and renamed into place,
+ * so that a concurrent tcpreplay never maps a partial image. Returns
+ * 0 on success or -1 on error.
+ */
+int
+preload_image_save(tcpreplay_t *ctx, const char *path)
+{
+    preload_image_hdr_t *hdr;
+    char *tmp_path;
+    size_t hdr_len, path_len;
+    int fd;
+    int ret = -1;
+
+    assert(path);
+
+    if ((hdr = image_layout(ctx, &hdr_len)) == NULL)
+        return -1;
+
+    path_len = strlen(path) + 16;
+    tmp_path = safe_malloc(path_len);
+    snprintf(tmp_path, path_len, "%s.%u", path, (unsigned int)getpid());
+
+    if ((fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        warnx("Unable to create replay image %s: %s", tmp_path, strerror(errno));
+        goto out;
+    }
+
+    if (image_write(ctx, fd, hdr, hdr_len) == 0) {
+        warnx("Unable to write replay image %s: %s", tmp_path, strerror(errno));
+        close(fd);
+        unlink(tmp_path);
+        goto out;
+    }
+    close(fd);
+
+    if (rename(tmp_path, path) < 0) {
+        warnx("Unable to rename replay image to %s: %s", path, strerror(errno));
+        unlink(tmp_path);
+        goto out;
+    }
+
+    dbgx(1, "Saved " COUNTER_SPEC " byte replay image %s", (COUNTER)hdr->image_size, path);
+    ret = 0;
+
+out:
+    safe_free(tmp_path);
+    safe_free(hdr);
+    return ret;
+}
+
+/*
+ * Shared caches are either POSIX shared memory objects, given by a
+ * plain name, or files on tmpfs/hugetlbfs, given by a path.
+ */
+static bool
+shared_is_path(const char *name)
+{
+    return strchr(name + 1, '/') != NULL || name[0] == '.';
+}
+
+static int
+shared_open(const char *name, int flags)
+{
+    if (shared_is_path(name))
+        return open(name, flags, 0644);
+
+#ifdef HAVE_SHM_OPEN
+    if (name[0] != '/') {
+        char shm_name[NAME_MAX];
+        snprintf(shm_name, sizeof(shm_name), "/%s", name);
+        return shm_open(shm_name, flags, 0644);
+    }
+    return shm_open(name, flags, 0644);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int
+shared_unlink(const char *name)
+{
+    if (shared_is_path(name))
+        return unlink(name);
+
+#ifdef HAVE_SHM_OPEN
+    if (name[0] != '/') {
+        char shm_name[NAME_MAX];
+        snprintf(shm_name, sizeof(shm_name), "/%s", name);
+        return shm_unlink(shm_name);
+    }
+    return shm_unlink(name);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * \brief Attach to a preload cache shared with other processes
+ *
+ * The cache is an image (see preload_image_save()) in shared memory
+ * that every process maps read-only, so the packets are only held in
+ * memory once however many tcpreplays send them. If 'build' is set
+ * and no usable cache exists yet, the pcaps are preloaded and copied
+ * into a new one; other processes block until it is ready.
+ *
+ * The segment name has a hash of the options that shape the cache
+ * appended, so processes with different options get a segment each
+ * rather than replacing each other's. A stale cache (the pcaps have
+ * changed) is unlinked and rebuilt. Processes still using it keep
+ * their mapping. Returns 0 once attached or -1 if the caller should
+ * preload the pcaps privately.
+ */
+int
+preload_shared_attach(tcpreplay_t *ctx, const char *base, bool build)
+{
+#if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H && defined HAVE_FLOCK
+    preload_image_hdr_t *hdr;
+    struct stat st;
+    u_char *image;
+    size_t hdr_len, len;
+    bool writable;
+    char name[PATH_MAX];
+    int fd;
+
+    assert(base);
+
+    snprintf(name, sizeof(name), "%s.%016llx", base,
+            (unsigned long long)image_options_hash(ctx->options));
+
+    for (;;) {
+        writable = build;
+        fd = build ? shared_open(name, O_RDWR | O_CREAT) : -1;
+        if (fd < 0) {
+            writable = false;
+            fd = shared_open(name, O_RDONLY);
+        }
+        if (fd < 0) {
+            if (build || errno != ENOENT)
+                warnx("Unable to open shared cache %s: %s", name, strerror(errno));
+            return -1;
+        }
+
+        /* wait for whoever is building the cache */
+        if (flock(fd, writable ? LOCK_EX : LOCK_SH) < 0 || fstat(fd, &st) < 0) {
+            warnx("Unable to lock shared cache %s: %s", name, strerror(errno));
+            close(fd);
+            return -1;
+        }
+
+        /* replaced while we waited, start over */
+        if (st.st_nlink == 0) {
+            close(fd);
+            continue;
+        }
+
+        if (st.st_size == 0)
+            break;
+
+        image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (image == MAP_FAILED) {
+            warnx("Unable to map shared cache %s: %s", name, strerror(errno));
+            close(fd);
+            return -1;
+        }
+
+        if (image_attach(ctx, image, st.st_size, name, true) == 0) {
+            close(fd);
+            dbgx(1, "Attached to %zu byte shared cache %s", ctx->image_len, name);
+            return 0;
+        }
+        munmap(image, st.st_size);
+
+        if (!writable) {
+            close(fd);
+            return -1;
+        }
+
+        /* stale, replace it with a fresh one */
+        shared_unlink(name);
+        close(fd);
+    }
+
+    if (!writable) {
+        close(fd);
+        return -1;
+    }
+
+    /* we hold the lock on an empty cache, fill it */
+    preload_pcap_files(ctx);
+
+    if ((hdr = image_layout(ctx, &hdr_len)) == NULL) {
+        shared_unlink(name);
+        close(fd);
+        return -1;
+    }
+
+    len = image_write(ctx, fd, hdr, hdr_len);
+    safe_free(hdr);
+    if (len == 0) {
+        warnx("Unable to write shared cache %s: %s", name, strerror(errno));
+        shared_unlink(name);
+        close(fd);
+        return -1;
+    }
+
+    /* swap our private copy for the shared one */
+    image = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+        return 0;
+
+    if (image_attach(ctx, image, len, name, true) < 0) {
+        munmap(image, len);
+        return 0;
+    }
+
+    dbgx(1, "Created %zu byte shared cache %s", len, name);
+    return 0;
+#else
+    warnx("Shared preload caches are not supported on this platform");
+    return -1;
+#endif
+}
+
+/**
+ * unmap the replay image or shared cache, if any
+ */
+void
+preload_image_close(tcpreplay_t *ctx)
+{
+#if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H
+    if (ctx->image != NULL)
+        munmap(ctx->image, ctx->image_len);
+#endif
+    ctx->image = NULL;
+    ctx->image_len = 0;
+}
@@ -0,0 +1,169 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2016 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PRELOAD_H_
+#define _PRELOAD_H_
+
+#include "tcpreplay_api.h"
+
+/*
+ * Packets in the preload cache are stored back to back in one buffer
+ * per file, each record padded to PACKET_CACHE_ALIGN bytes. Records
+ * contain no pointers, so the buffer can be moved, written to disk
+ * and mapped back in.
+ */
+#define PACKET_CACHE_ALIGN      8
+#define PACKET_CACHE_RECLEN(len) \
+    ((sizeof(packet_cache_t) + (len) + PACKET_CACHE_ALIGN - 1) & ~(size_t)(PACKET_CACHE_ALIGN - 1))
+
+/*
+ * Set in stored_len if the bytes stored in a record are followed by the
+ * offset in the cache of the rest of the packet, which is shared with an
+ * earlier packet
+ */
+#define PACKET_CACHE_REF        0x80000000u
+
+typedef struct preload_dedup_s preload_dedup_t;
+
+/* where preload_sources() got the packets from */
+typedef enum {
+    preload_from_pcaps = 0,
+    preload_from_shared,
+    preload_from_image
+} preload_from_t;
+
+/**
+ * returns the packet data of a cache record
+ */
+static inline u_char *
+packet_cache_data(packet_cache_t *pc)
+{
+    return (u_char *)(pc + 1);
+}
+
+/**
+ * returns the number of bytes of packet data held in a cache record
+ */
+static inline uint32_t
+packet_cache_stored(const packet_cache_t *pc)
+{
+    return pc->stored_len & ~PACKET_CACHE_REF;
+}
+
+/**
+ * returns the size of a cache record
+ */
+static inline size_t
+packet_cache_reclen(const packet_cache_t *pc)
+{
+    return PACKET_CACHE_RECLEN(packet_cache_stored(pc)) +
+            (pc->stored_len & PACKET_CACHE_REF ? sizeof(uint64_t) : 0);
+}
+
+/**
+ * returns the shared rest of the packet of a cache record, or NULL
+ */
+static inline u_char *
+packet_cache_ref(const file_cache_t *fc, const packet_cache_t *pc)
+{
+    uint64_t off;
+
+    if (!(pc->stored_len & PACKET_CACHE_REF))
+        return NULL;
+
+    memcpy(&off, (const u_char *)pc + packet_cache_reclen(pc) - sizeof(off), sizeof(off));
+    return (u_char *)fc->packet_cache + off;
+}
+
+/**
+ * returns the whole packet of a cache record if it is stored in one
+ * piece, or NULL if it must be put together by preload_cache_copy()
+ */
+static inline u_char *
+packet_cache_direct(const file_cache_t *fc, packet_cache_t *pc)
+{
+    if (pc->stored_len == pc->data_len)
+        return packet_cache_data(pc);
+
+    if (pc->stored_len == PACKET_CACHE_REF)
+        return packet_cache_ref(fc, pc);
+
+    return NULL;
+}
+
+/**
+ * returns the first record in a file's cache or NULL if empty
+ */
+static inline packet_cache_t *
+packet_cache_first(const file_cache_t *fc)
+{
+    return fc->cache_len ? fc->packet_cache : NULL;
+}
+
+/**
+ * returns the record following 'pc' or NULL at the end of the cache
+ */
+static inline packet_cache_t *
+packet_cache_next(const file_cache_t *fc, packet_cache_t *pc)
+{
+    u_char *next = (u_char *)pc + packet_cache_reclen(pc);
+
+    if (next >= (u_char *)fc->packet_cache + fc->cache_len)
+        return NULL;
+
+    return (packet_cache_t *)next;
+}
+
+/**
+ * memory needed to preload a pcap file of the given size: cache
+ * records are larger than pcap records, plus the packet metadata
+ */
+static inline size_t
+preload_cache_estimate(size_t file_size)
+{
+    return file_size + file_size / 2;
+}
+
+void preload_cache_init(tcpreplay_t *ctx, int idx);
+void preload_cache_reserve(file_cache_t *fc, size_t size);
+void preload_cache_trim(file_cache_t *fc);
+packet_cache_t *preload_cache_add(file_cache_t *fc, const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata, uint32_t len);
+packet_cache_t *preload_cache_add_headers(file_cache_t *fc, const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata, uint32_t len, const packet_meta_t *meta, u_char fill);
+uint32_t preload_headers_len(const packet_meta_t *meta, const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata, uint32_t len);
+packet_cache_t *preload_cache_add_dedup(file_cache_t *fc, preload_dedup_t *dd,
+        const struct pcap_pkthdr *pkthdr, const u_char *pktdata, uint32_t len);
+preload_dedup_t *preload_dedup_init(void);
+COUNTER preload_dedup_free(preload_dedup_t *dd);
+u_char *preload_cache_copy(file_cache_t *fc, const packet_cache_t *pc, u_char fill,
+        bool edited);
+void preload_cache_free(file_cache_t *fc);
+void preload_cache_prefault(tcpreplay_t *ctx);
+void preload_pcap_files(tcpreplay_t *ctx);
+preload_from_t preload_sources(tcpreplay_t *ctx);
+capfile_t *preload_stream_open(tcpreplay_t *ctx, int idx);
+void preload_idle_scan(tcpreplay_t *ctx, int idx);
+
+int preload_image_load(tcpreplay_t *ctx, const char *path);
+int preload_image_save(tcpreplay_t *ctx, const char *path);
+int preload_shared_attach(tcpreplay_t *ctx, const char *name, bool build);
+void preload_image_close(tcpreplay_t *ctx);
+
+#endif /* _PRELOAD_H_ */
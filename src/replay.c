@@ -26,10 +26,12 @@
 #include "common.h"
 #include "tcpreplay_api.h"
 #include "send_packets.h"
+#include "preload.h"
 
 
 static int replay_file(tcpreplay_t *ctx, int idx);
-static int replay_two_files(tcpreplay_t *ctx, int idx1, int idx2);
+static int replay_seek_start(tcpreplay_t *ctx, int idx, capfile_t *cf);
+static int replay_merged_files(tcpreplay_t *ctx, int first, int cnt, int intf_cnt);
 static int replay_cache(tcpreplay_t *ctx, int idx);
 static int replay_two_caches(tcpreplay_t *ctx, int idx1, int idx2);
 static int replay_fd(tcpreplay_t *ctx, int idx);
@@ -49,8 +51,21 @@ tcpr_replay_index(tcpreplay_t *ctx)
 
     init_timestamp(&ctx->stats.last_time);
 
+    /* merged file mode: all files at once, any number of interfaces */
+    if (ctx->options->mergefile) {
+        for (idx = 0; idx < ctx->options->source_cnt; idx++) {
+            if (ctx->options->sources[idx].type != source_filename) {
+                tcpreplay_seterr(ctx, "Source index %d must be a file in merged file mode", idx);
+                return -1;
+            }
+        }
+
+        rcode = replay_merged_files(ctx, 0, ctx->options->source_cnt,
+                ctx->intf2 == NULL ? 1 : 2 + ctx->options->merge_intf_cnt);
+    }
+
     /* only process a single file */
-    if (! ctx->options->dualfile) {
+    else if (! ctx->options->dualfile) {
         /* process each pcap file in order */
         for (idx = 0; idx < ctx->options->source_cnt && !ctx->abort; idx++) {
             /* reset cache markers for each iteration */
@@ -83,7 +98,7 @@ tcpr_replay_index(tcpreplay_t *ctx)
             }
             switch(ctx->options->sources[idx].type) {
                 case source_filename:
-                    rcode = replay_two_files(ctx, idx, (idx+1));
+                    rcode = replay_merged_files(ctx, idx, 2, 2);
                     break;
                 case source_fd:
                     rcode = replay_two_fds(ctx, idx, (idx+1));
@@ -117,8 +132,7 @@ static int
 replay_file(tcpreplay_t *ctx, int idx)
 {
     char *path;
-    pcap_t *pcap = NULL;
-    char ebuf[PCAP_ERRBUF_SIZE];
+    capfile_t *cf = NULL;
 
     assert(ctx);
     assert(ctx->options->sources[idx].type = source_filename);
@@ -131,26 +145,35 @@ replay_file(tcpreplay_t *ctx, int idx)
 
     /* read from pcap file if we haven't cached things yet */
     if (!ctx->options->preload_pcap) {
-        if ((pcap = pcap_open_offline(path, ebuf)) == NULL) {
-            tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
+        if ((cf = source_open(ctx, idx, 0)) == NULL)
             return -1;
-        }
 
-        ctx->options->file_cache[idx].dlt = pcap_datalink(pcap);
+        ctx->options->file_cache[idx].dlt = capfile_datalink(cf);
 
-#ifdef HAVE_PCAP_SNAPSHOT
-        if (pcap_snapshot(pcap) < 65535)
+        if (capfile_snapshot(cf) < 65535)
             warnx("%s was captured using a snaplen of %d bytes.  This may mean you have truncated packets.",
-                    path, pcap_snapshot(pcap));
-#endif
+                    path, capfile_snapshot(cf));
+
+        if (replay_seek_start(ctx, idx, cf) < 0) {
+            capfile_close(cf);
+            return -1;
+        }
+
+        /* open the next file while this one is sent */
+        if (idx + 1 < ctx->options->source_cnt)
+            source_prefetch(ctx, idx + 1);
+        else if (ctx->more_loops)
+            source_prefetch(ctx, 0);
 
     } else {
         if (!ctx->options->file_cache[idx].cached) {
-            if ((pcap = pcap_open_offline(path, ebuf)) == NULL) {
-                tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
+            if ((cf = source_open(ctx, idx, 0)) == NULL)
+                return -1;
+            ctx->options->file_cache[idx].dlt = capfile_datalink(cf);
+        } else if (ctx->options->file_cache[idx].partial) {
+            /* stream what didn't fit in the cache */
+            if ((cf = preload_stream_open(ctx, idx)) == NULL)
                 return -1;
-            }
-            ctx->options->file_cache[idx].dlt = pcap_datalink(pcap);
         }
     }
 
@@ -175,7 +198,7 @@ replay_file(tcpreplay_t *ctx, int idx)
 #endif
 #endif
 
-    if (pcap != NULL) {
+    if (cf != NULL) {
         if (ctx->intf1dlt == -1)
             ctx->intf1dlt = sendpacket_get_dlt(ctx->intf1);
 #if 0
@@ -186,15 +209,18 @@ replay_file(tcpreplay_t *ctx, int idx)
 #endif
         if (ctx->intf1dlt != ctx->options->file_cache[idx].dlt)
             tcpreplay_setwarn(ctx, "%s DLT (%s) does not match that of the outbound interface: %s (%s)",
-                path, pcap_datalink_val_to_name(pcap_datalink(pcap)),
+                path, pcap_datalink_val_to_name(capfile_datalink(cf)),
                 ctx->intf1->device, pcap_datalink_val_to_name(ctx->intf1dlt));
     }
 
     ctx->stats.active_pcap = ctx->options->sources[idx].filename;
-    send_packets(ctx, pcap, idx);
+    send_packets(ctx, cf, idx);
 
-    if (pcap != NULL)
-        pcap_close(pcap);
+    if (cf != NULL) {
+        if (capfile_geterr(cf) != NULL)
+            tcpreplay_setwarn(ctx, "%s", capfile_geterr(cf));
+        capfile_close(cf);
+    }
 
 #if 0
 #ifdef ENABLE_VERBOSE
@@ -206,130 +232,190 @@ replay_file(tcpreplay_t *ctx, int idx)
 
 
 /**
- * \brief replay two pcap files out two interfaces
+ * \brief moves to the first packet to send with --start-time/--start-packet
  *
- * Internal to tcpreplay, does the heavy lifting for --dualfile
+ * Seeks to the last indexed packet before the start if the file has an
+ * up to date index, otherwise send_packets() reads and drops the
+ * packets before the start.
  */
 static int
-replay_two_files(tcpreplay_t *ctx, int idx1, int idx2)
+replay_seek_start(tcpreplay_t *ctx, int idx, capfile_t *cf)
 {
-    char *path1, *path2;
-    pcap_t *pcap1  = NULL, *pcap2 = NULL;
+    tcpreplay_opt_t *options = ctx->options;
+    file_cache_t *fc = &options->file_cache[idx];
+    const char *path = options->sources[idx].filename;
+    const capindex_entry_t *entry;
+    capindex_t *ci;
     char ebuf[PCAP_ERRBUF_SIZE];
+    char *index_path;
+    int ret = 0;
+
+    fc->seek_packetnum = 0;
+    fc->first_ts_us = 0;
+
+    if ((!options->start_packet && !options->start_time_us) || strcmp(path, "-") == 0)
+        return 0;
+
+    /* only warn on the first pass when the index can't be used */
+    index_path = capindex_path(path);
+    if ((ci = capindex_read(index_path, ebuf)) == NULL) {
+        if (!fc->index_warned)
+            warnx("%s, reading %s up to the start", ebuf, path);
+        fc->index_warned = true;
+        goto done;
+    }
+
+    if (!capindex_current(ci, path)) {
+        if (!fc->index_warned)
+            warnx("%s is out of date, reading %s up to the start", index_path, path);
+        fc->index_warned = true;
+        goto done;
+    }
+
+    if (options->start_packet)
+        entry = capindex_find_packet(ci, options->start_packet);
+    else
+        entry = capindex_find_time(ci, (uint64_t)options->start_time_us * 1000);
+
+    if (entry != NULL && entry->packetnum > 1) {
+        dbgx(1, "%s: seeking to packet " COUNTER_SPEC " at offset %lld", path,
+                entry->packetnum, (long long)entry->offset);
+
+        if ((ci->single_section ? capfile_jump(cf, entry->offset) :
+                    capfile_seek(cf, entry->offset)) < 0) {
+            tcpreplay_seterr(ctx, "%s", capfile_geterr(cf));
+            ret = -1;
+            goto done;
+        }
+        fc->seek_packetnum = entry->packetnum - 1;
+        fc->first_ts_us = ci->first_ts_ns / 1000;
+    }
+
+done:
+    capindex_free(ci);
+    safe_free(index_path);
+    return ret;
+}
+
+/**
+ * \brief returns the n'th output interface: intf1, intf2, then --merge-intf
+ */
+static sendpacket_t *
+replay_intf(tcpreplay_t *ctx, int n)
+{
+    if (n == 0)
+        return ctx->intf1;
+    if (n == 1)
+        return ctx->intf2;
+
+    return ctx->merge_intf[n - 2];
+}
+
+/**
+ * \brief replay several pcap files at once, out of several interfaces
+ *
+ * Internal to tcpreplay, does the heavy lifting for --dualfile and
+ * --mergefile. Replays sources 'first' to 'first + cnt - 1', sending
+ * source N out of interface N modulo 'intf_cnt'.
+ */
+static int
+replay_merged_files(tcpreplay_t *ctx, int first, int cnt, int intf_cnt)
+{
+    merge_source_t *sources;
     int rcode = 0;
+    int i, idx, dlt;
 
     assert(ctx);
-    assert(ctx->options->sources[idx1].type = source_filename);
-    assert(ctx->options->sources[idx2].type = source_filename);
 
-    path1 = ctx->options->sources[idx1].filename;
-    path2 = ctx->options->sources[idx2].filename;
+    sources = safe_malloc(sizeof(merge_source_t) * cnt);
 
+    for (i = 0; i < cnt; i++) {
+        char *path;
+        merge_source_t *src = &sources[i];
 
-    /* can't use stdin in dualfile mode */
-    if ((strncmp(path1, "-", strlen(path1)) == 0) || 
-        (strncmp(path2, "-", strlen(path2)) == 0)) {
-        tcpreplay_seterr(ctx, "%s", "Invalid use of STDIN '-' in dual file mode");
-        return -1;
-    }
+        idx = first + i;
+        assert(ctx->options->sources[idx].type == source_filename);
+        path = ctx->options->sources[idx].filename;
 
-    /* read from first pcap file if we haven't cached things yet */
-    if (!ctx->options->preload_pcap) {
-        if ((pcap1 = pcap_open_offline(path1, ebuf)) == NULL) {
-            tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
-            return -1;
-        }
-        ctx->options->file_cache[idx1].dlt = pcap_datalink(pcap1);
-        if ((pcap2 = pcap_open_offline(path2, ebuf)) == NULL) {
-            tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
-            return -1;
-        }
-        ctx->options->file_cache[idx2].dlt = pcap_datalink(pcap2);
-    } else {
-        if (!ctx->options->file_cache[idx1].cached) {
-            if ((pcap1 = pcap_open_offline(path1, ebuf)) == NULL) {
-                tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
-                return -1;
-            }
-            ctx->options->file_cache[idx1].dlt = pcap_datalink(pcap1);
+        src->idx = idx;
+        src->sp = replay_intf(ctx, i % intf_cnt);
+
+        /* can't use stdin when replaying files together */
+        if (strncmp(path, "-", strlen(path)) == 0) {
+            tcpreplay_seterr(ctx, "%s", "Invalid use of STDIN '-' in dual or merged file mode");
+            rcode = -1;
+            goto out;
         }
-        if (!ctx->options->file_cache[idx2].cached) {
-            if ((pcap2 = pcap_open_offline(path2, ebuf)) == NULL) {
-                tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
-                return -1;
-            }
-            ctx->options->file_cache[idx2].dlt = pcap_datalink(pcap2);
+
+        if (merge_source_open(ctx, src) < 0) {
+            rcode = -1;
+            goto out;
         }
-    }
 
-    if (pcap1 != NULL) {
-#ifdef HAVE_PCAP_SNAPSHOT
-        if (pcap_snapshot(pcap1) < 65535) {
-            tcpreplay_setwarn(ctx, "%s was captured using a snaplen of %d bytes.  This may mean you have truncated packets.",
-                    path1, pcap_snapshot(pcap1));
-            rcode = -2;
+        /* the packets are interleaved, so they must all be the same kind */
+        if (ctx->options->file_cache[idx].dlt != ctx->options->file_cache[first].dlt) {
+            tcpreplay_seterr(ctx, "DLT mismatch for %s (%d) and %s (%d)",
+                    ctx->options->sources[first].filename,
+                    ctx->options->file_cache[first].dlt,
+                    path, ctx->options->file_cache[idx].dlt);
+            rcode = -1;
+            goto out;
         }
 
-        if (pcap_snapshot(pcap2) < 65535) {
+        if (src->cf == NULL)
+            continue;
+
+        if (capfile_snapshot(src->cf) < 65535) {
             tcpreplay_setwarn(ctx, "%s was captured using a snaplen of %d bytes.  This may mean you have truncated packets.",
-                    path2, pcap_snapshot(pcap2));
-            rcode = -2;
-        }
-#endif
-        if (ctx->intf1dlt == -1)
-            ctx->intf1dlt = sendpacket_get_dlt(ctx->intf1);
-        if ((ctx->intf1dlt >= 0) && (ctx->intf1dlt != pcap_datalink(pcap1))) {
-            tcpreplay_setwarn(ctx, "%s DLT (%s) does not match that of the outbound interface: %s (%s)", 
-                path1, pcap_datalink_val_to_name(pcap_datalink(pcap1)), 
-                ctx->intf1->device, pcap_datalink_val_to_name(ctx->intf1dlt));
+                    path, capfile_snapshot(src->cf));
             rcode = -2;
         }
 
-        if (ctx->intf2dlt == -1)
-            ctx->intf2dlt = sendpacket_get_dlt(ctx->intf2);
-        if ((ctx->intf2dlt >= 0) && (ctx->intf2dlt != pcap_datalink(pcap2))) {
+        dlt = sendpacket_get_dlt(src->sp);
+        if ((dlt >= 0) && (dlt != capfile_datalink(src->cf))) {
             tcpreplay_setwarn(ctx, "%s DLT (%s) does not match that of the outbound interface: %s (%s)", 
-                path2, pcap_datalink_val_to_name(pcap_datalink(pcap2)), 
-                ctx->intf2->device, pcap_datalink_val_to_name(ctx->intf2dlt));
+                path, pcap_datalink_val_to_name(capfile_datalink(src->cf)), 
+                src->sp->device, pcap_datalink_val_to_name(dlt));
             rcode = -2;
         }
-
-        if (ctx->intf1dlt != ctx->intf2dlt) {
-            tcpreplay_seterr(ctx, "DLT mismatch for %s (%d) and %s (%d)",
-                    path1, ctx->intf1dlt, path2, ctx->intf2dlt);
-            return -1;
-        }
     }
 
 #ifdef ENABLE_VERBOSE
     if (ctx->options->verbose) {
+        pcap_t *pcap;
 
-        /* in cache mode, we may not have opened the file */
-        if (pcap1 == NULL) {
-            if ((pcap1 = pcap_open_offline(path1, ebuf)) == NULL) {
-                tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
-                return -1;
-            }
-            ctx->options->file_cache[idx1].dlt = pcap_datalink(pcap1);
+        /* tcpdump only needs the link type, which is known even in cache mode */
+        if ((pcap = pcap_open_dead(ctx->options->file_cache[first].dlt, 65535)) == NULL) {
+            tcpreplay_seterr(ctx, "%s", "Unable to open pcap handle for tcpdump");
+            rcode = -1;
+            goto out;
         }
         /* init tcpdump */
-        tcpdump_open(ctx->options->tcpdump, pcap1);
+        tcpdump_open(ctx->options->tcpdump, pcap);
+        pcap_close(pcap);
     }
 #endif
 
+    send_merged_packets(ctx, sources, cnt);
 
-    send_dual_packets(ctx, pcap1, idx1, pcap2, idx2);
-
-    if (pcap1 != NULL)
-        pcap_close(pcap1);
-
-    if (pcap2 != NULL)
-        pcap_close(pcap2);
+    for (i = 0; i < cnt; i++) {
+        if (sources[i].cf != NULL && capfile_geterr(sources[i].cf) != NULL) {
+            tcpreplay_setwarn(ctx, "%s", capfile_geterr(sources[i].cf));
+            rcode = -2;
+        }
+    }
 
 #ifdef ENABLE_VERBOSE
     tcpdump_close(ctx->options->tcpdump);
 #endif
 
+out:
+    for (i = 0; i < cnt; i++) {
+        if (sources[i].cf != NULL)
+            capfile_close(sources[i].cf);
+    }
+    safe_free(sources);
+
     return rcode;
 }
 
@@ -27,11 +27,15 @@
 #include <sys/types.h>
 #include <signal.h>
 #include <string.h>
+#include <stddef.h>
 #include <netinet/in.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "tcpreplay_api.h"
 #include "timestamp_trace.h"
@@ -63,6 +67,7 @@ extern tcpedit_t *tcpedit;
 #endif /* TCPREPLAY */
 
 #include "send_packets.h"
+#include "preload.h"
 #include "sleep.h"
 
 #ifdef DEBUG
@@ -76,163 +81,27 @@ static void calc_sleep_time(tcpreplay_t *ctx, struct timeval *pkt_time,
 static void tcpr_sleep(tcpreplay_t *ctx, sendpacket_t *sp _U_,
         struct timespec *nap_this_time, struct timeval *now,
         tcpreplay_accurate accurate);
-static u_char *get_next_packet(tcpreplay_t *ctx, pcap_t *pcap,
+static void txtime_schedule(tcpreplay_t *ctx, sendpacket_t *sp,
+        struct timeval *pkt_time, struct timeval *now);
+static u_char *get_next_packet(tcpreplay_t *ctx, capfile_t *cf,
         struct pcap_pkthdr *pkthdr,
         int file_idx,
-        packet_cache_t **prev_packet);
+        packet_cache_t **prev_packet,
+        capfile_pkt_t *info);
 static uint32_t get_user_count(tcpreplay_t *ctx, sendpacket_t *sp, COUNTER counter);
+static tcpr_dir_t cache_dir(tcpreplay_t *ctx, char *cachedata, COUNTER packet_num);
+static inline sendpacket_t *dir_to_intf(tcpreplay_t *ctx, int dir);
+static inline sendpacket_t *capture_intf(tcpreplay_t *ctx, uint32_t intf_id);
 
-/**
- * Fast flow packet edit
- *
- * Attempts to alter the packet IP addresses without
- * changing CRC, which will avoid overhead of tcpreplay-edit
- *
- * This code is a bit bloated but it is the result of
- * optimizing. Test performance on 10GigE+ networks if
- * modifying.
- */
-static void
-fast_edit_packet_dl(struct pcap_pkthdr *pkthdr, u_char **pktdata,
-        uint32_t iteration, bool cached, int datalink)
+/* will packets be modified before they are sent? */
+static inline bool
+packets_edited(tcpreplay_opt_t *options)
 {
-    int l2_len = 0;
-    ipv4_hdr_t *ip_hdr;
-    ipv6_hdr_t *ip6_hdr;
-    hdlc_hdr_t *hdlc_hdr;
-    sll_hdr_t *sll_hdr;
-    struct tcpr_pppserial_hdr *ppp;
-    uint32_t *src_ptr = NULL, *dst_ptr = NULL;
-    uint32_t src_ip, dst_ip;
-    uint32_t src_ip_orig, dst_ip_orig;
-    uint16_t ether_type = 0;
-
-    if (pkthdr->caplen < (bpf_u_int32)TCPR_IPV6_H) {
-        dbgx(1, "Packet too short for Unique IP feature: %u", pkthdr->caplen);
-        return;
-    }
-
-    switch (datalink) {
-    case DLT_LINUX_SLL:
-        l2_len = 16;
-        sll_hdr = (sll_hdr_t *)*pktdata;
-        ether_type = sll_hdr->sll_protocol;
-        break;
-
-    case DLT_PPP_SERIAL:
-        l2_len = 4;
-        ppp = (struct tcpr_pppserial_hdr *)*pktdata;
-        if (ntohs(ppp->protocol) == 0x0021)
-            ether_type = htons(ETHERTYPE_IP);
-        else
-            ether_type = ppp->protocol;
-        break;
-
-    case DLT_C_HDLC:
-        l2_len = 4;
-        hdlc_hdr = (hdlc_hdr_t *)*pktdata;
-        ether_type = hdlc_hdr->protocol;
-        break;
-
-    case DLT_RAW:
-        if ((*pktdata[0] >> 4) == 4)
-            ether_type = ETHERTYPE_IP;
-        else if ((*pktdata[0] >> 4) == 6)
-            ether_type = ETHERTYPE_IP6;
-        break;
-
-    default:
-        warnx("Unable to process unsupported DLT type: %s (0x%x)",
-             pcap_datalink_val_to_description(datalink), datalink);
-            return;
-    }
-
-    switch (ether_type) {
-    case ETHERTYPE_IP:
-        ip_hdr = (ipv4_hdr_t *)(*pktdata + l2_len);
-
-        if (ip_hdr->ip_v != 4) {
-            dbgx(2, "expected IPv4 but got: %u", ip_hdr->ip_v);
-            return;
-        }
-
-        if (pkthdr->caplen < (bpf_u_int32)sizeof(*ip_hdr)) {
-            dbgx(2, "Packet too short for Unique IP feature: %u", pkthdr->caplen);
-            return;
-        }
-
-        ip_hdr = (ipv4_hdr_t *)(*pktdata + l2_len);
-        src_ip_orig = src_ip = ntohl(ip_hdr->ip_src.s_addr);
-        dst_ip_orig = dst_ip = ntohl(ip_hdr->ip_dst.s_addr);
-        break;
-
-    case ETHERTYPE_IP6:
-
-        if ((*pktdata[0] >> 4) != 6) {
-            dbgx(2, "expected IPv6 but got: %u", *pktdata[0] >> 4);
-            return;
-        }
-
-        if (pkthdr->caplen < (bpf_u_int32)TCPR_IPV6_H) {
-            dbgx(2, "Packet too short for Unique IPv6 feature: %u", pkthdr->caplen);
-            return;
-        }
-
-        ip6_hdr = (ipv6_hdr_t *)(*pktdata + l2_len);
-        src_ip_orig = src_ip = ntohl(ip6_hdr->ip_src.__u6_addr.__u6_addr32[3]);
-        dst_ip_orig = dst_ip = ntohl(ip6_hdr->ip_dst.__u6_addr.__u6_addr32[3]);
-        break;
-
-    default:
-        return; /* non-IP */
-    }
-
-    /* swap src/dst IP's in a manner that does not affect CRC */
-    if ((!cached && dst_ip > src_ip) ||
-            (cached && (dst_ip - iteration) > (src_ip - 1 - iteration))) {
-        if (cached) {
-            --src_ip;
-            ++dst_ip;
-        } else {
-            src_ip -= iteration;
-            dst_ip += iteration;
-        }
-
-        /* CRC compensations  for wrap conditions */
-        if (src_ip > src_ip_orig && dst_ip > dst_ip_orig) {
-            dbgx(1, "dst_ip > src_ip(%u): before(1) src_ip=0x%08x dst_ip=0x%08x", iteration, src_ip, dst_ip);
-            --src_ip;
-            dbgx(1, "dst_ip > src_ip(%u): after(1)  src_ip=0x%08x dst_ip=0x%08x", iteration, src_ip, dst_ip);
-        } else if (dst_ip < dst_ip_orig && src_ip < src_ip_orig) {
-            dbgx(1, "dst_ip > src_ip(%u): before(2) src_ip=0x%08x dst_ip=0x%08x", iteration, src_ip, dst_ip);
-            ++dst_ip;
-            dbgx(1, "dst_ip > src_ip(%u): after(2)  src_ip=0x%08x dst_ip=0x%08x", iteration, src_ip, dst_ip);
-        }
-    } else {
-        if (cached) {
-            ++src_ip;
-            --dst_ip;
-        } else {
-            src_ip += iteration;
-            dst_ip -= iteration;
-        }
-
-        /* CRC compensations  for wrap conditions */
-        if (dst_ip > dst_ip_orig && src_ip > src_ip_orig) {
-            dbgx(1, "src_ip > dst_ip(%u): before(1) dst_ip=0x%08x src_ip=0x%08x", iteration, dst_ip, src_ip);
-            --dst_ip;
-            dbgx(1, "src_ip > dst_ip(%u): after(1)  dst_ip=0x%08x src_ip=0x%08x", iteration, dst_ip, src_ip);
-        } else if (src_ip < src_ip_orig && dst_ip < dst_ip_orig) {
-            dbgx(1, "src_ip > dst_ip(%u): before(2) dst_ip=0x%08x src_ip=0x%08x", iteration, dst_ip, src_ip);
-            ++src_ip;
-            dbgx(1, "src_ip > dst_ip(%u): after(2)  dst_ip=0x%08x src_ip=0x%08x", iteration, dst_ip, src_ip);
-        }
-    }
-
-    dbgx(1, "(%u): final src_ip=0x%08x dst_ip=0x%08x", iteration, src_ip, dst_ip);
-
-    *src_ptr = htonl(src_ip);
-    *dst_ptr = htonl(dst_ip);
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT
+    return true;
+#else
+    return options->unique_ip || options->flow_multiplier > 1;
+#endif
 }
 
 #if defined HAVE_QUICK_TX || defined HAVE_NETMAP
@@ -250,58 +119,82 @@ static inline void wake_send_queues(sendpacket_t *sp, tcpreplay_opt_t *options)
 }
 #endif /* HAVE_QUICK_TX || HAVE_NETMAP */
 
+/**
+ * \brief Hand packets queued with --io-uring on every interface to the kernel
+ *
+ * With 'wait' also waits until they have been sent
+ */
+void
+flush_send_queues(tcpreplay_t *ctx, bool wait)
+{
+    int i;
+
+    if (!ctx->options->io_uring)
+        return;
+
+    if (ctx->intf1 != NULL && sendpacket_flush(ctx->intf1, wait) < 0)
+        warnx("%s", sendpacket_geterr(ctx->intf1));
+
+    if (ctx->intf2 != NULL && sendpacket_flush(ctx->intf2, wait) < 0)
+        warnx("%s", sendpacket_geterr(ctx->intf2));
+
+    for (i = 0; i < ctx->options->merge_intf_cnt; i++) {
+        if (ctx->merge_intf[i] != NULL && sendpacket_flush(ctx->merge_intf[i], wait) < 0)
+            warnx("%s", sendpacket_geterr(ctx->merge_intf[i]));
+    }
+}
+
+/**
+ * Fast flow packet edit
+ *
+ * Attempts to alter the packet IP addresses without
+ * changing CRC, which will avoid overhead of tcpreplay-edit
+ *
+ * Uses the metadata decoded when the packet was preloaded if
+ * available, otherwise decodes the packet here.
+ *
+ * This code is a bit bloated but it is the result of
+ * optimizing. Test performance on 10GigE+ networks if
+ * modifying.
+ */
 static inline void
 fast_edit_packet(struct pcap_pkthdr *pkthdr, u_char **pktdata,
-        uint32_t iteration, bool cached, int datalink)
+        uint32_t iteration, bool cached, int datalink,
+        const packet_meta_t *meta)
 {
+    packet_meta_t decoded;
     uint16_t ether_type;
-    vlan_hdr_t *vlan_hdr;
     ipv4_hdr_t *ip_hdr = NULL;
     ipv6_hdr_t *ip6_hdr = NULL;
     uint32_t src_ip, dst_ip;
     uint32_t src_ip_orig, dst_ip_orig;
-    int l2_len;
     u_char *packet = *pktdata;
 
-    if (datalink != DLT_EN10MB && datalink != DLT_JUNIPER_ETHER)
-        fast_edit_packet_dl(pkthdr, pktdata, iteration, cached, datalink);
-
     if (pkthdr->caplen < (bpf_u_int32)TCPR_IPV6_H) {
         dbgx(2, "Packet too short for Unique IP feature: %u", pkthdr->caplen);
         return;
     }
 
-    l2_len = 0;
-    if (datalink == DLT_JUNIPER_ETHER) {
-        if (memcmp(packet, "MGC", 3))
-            warnx("No Magic Number found: %s (0x%x)",
-                 pcap_datalink_val_to_description(datalink), datalink);
-
-        if ((packet[3] & 0x80) == 0x80) {
-            l2_len = ntohs(*((uint16_t*)&packet[4]));
-            l2_len += 6;
-        } else
-            l2_len = 4; /* no header extensions */
-    }
+    if (meta == NULL) {
+        if (packet_meta_decode(&decoded, pkthdr, packet, datalink) < 0)
+            return;
 
-    /* assume Ethernet, IPv4 for now */
-    ether_type = ntohs(((eth_hdr_t*)(packet + l2_len))->ether_type);
-    while (ether_type == ETHERTYPE_VLAN) {
-        vlan_hdr = (vlan_hdr_t *)(packet + l2_len);
-        ether_type = ntohs(vlan_hdr->vlan_len);
-        l2_len += 4;
+        meta = &decoded;
     }
-    l2_len += sizeof(eth_hdr_t);
 
+    if (!meta->l4_offset)
+        return; /* non-IP */
+
+    ether_type = meta->ether_type;
     switch (ether_type) {
     case ETHERTYPE_IP:
-        ip_hdr = (ipv4_hdr_t *)(packet + l2_len);
+        ip_hdr = (ipv4_hdr_t *)(packet + meta->l2_len);
         src_ip_orig = src_ip = ntohl(ip_hdr->ip_src.s_addr);
         dst_ip_orig = dst_ip = ntohl(ip_hdr->ip_dst.s_addr);
         break;
 
     case ETHERTYPE_IP6:
-        ip6_hdr = (ipv6_hdr_t *)(packet + l2_len);
+        ip6_hdr = (ipv6_hdr_t *)(packet + meta->l2_len);
         src_ip_orig = src_ip = ntohl(ip6_hdr->ip_src.__u6_addr.__u6_addr32[3]);
         dst_ip_orig = dst_ip = ntohl(ip6_hdr->ip_dst.__u6_addr.__u6_addr32[3]);
         break;
@@ -369,16 +262,75 @@ fast_edit_packet(struct pcap_pkthdr *pkthdr, u_char **pktdata,
     }
 }
 
+/*
+ * The address words changed by fast_edit_packet(), saved so that each copy
+ * sent by --flow-multiplier can be edited from the original packet
+ */
+typedef struct flow_addrs_s {
+    u_char *src;
+    u_char *dst;
+    uint32_t src_orig;
+    uint32_t dst_orig;
+} flow_addrs_t;
+
+/**
+ * saves the addresses of a packet before it is copied, returns false
+ * if fast_edit_packet() would leave the packet alone
+ */
+static inline bool
+flow_addrs_save(flow_addrs_t *fa, const struct pcap_pkthdr *pkthdr,
+        u_char *packet, const packet_meta_t *meta)
+{
+    if (pkthdr->caplen < (bpf_u_int32)TCPR_IPV6_H || !meta->l4_offset)
+        return false;
+
+    switch (meta->ether_type) {
+    case ETHERTYPE_IP:
+        fa->src = packet + meta->l2_len + offsetof(ipv4_hdr_t, ip_src);
+        fa->dst = packet + meta->l2_len + offsetof(ipv4_hdr_t, ip_dst);
+        break;
+
+    case ETHERTYPE_IP6:
+        fa->src = packet + meta->l2_len + offsetof(ipv6_hdr_t, ip_src) + 12;
+        fa->dst = packet + meta->l2_len + offsetof(ipv6_hdr_t, ip_dst) + 12;
+        break;
+
+    default:
+        return false;
+    }
+
+    memcpy(&fa->src_orig, fa->src, sizeof(uint32_t));
+    memcpy(&fa->dst_orig, fa->dst, sizeof(uint32_t));
+    return true;
+}
+
+/**
+ * puts back the addresses saved by flow_addrs_save()
+ */
+static inline void
+flow_addrs_restore(const flow_addrs_t *fa)
+{
+    memcpy(fa->src, &fa->src_orig, sizeof(uint32_t));
+    memcpy(fa->dst, &fa->dst_orig, sizeof(uint32_t));
+}
+
 /**
  * \brief Update flow stats
  *
  * Finds out if flow is unique and updates stats.
  */
 static inline void update_flow_stats(tcpreplay_t *ctx, sendpacket_t *sp,
-        const struct pcap_pkthdr *pkthdr, const u_char *pktdata, int datalink)
+        const struct pcap_pkthdr *pkthdr, const u_char *pktdata, int datalink,
+        const packet_meta_t *meta)
 {
-    flow_entry_type_t res = flow_decode(ctx->flow_hash_table,
-            pkthdr, pktdata, datalink, ctx->options->flow_expiry);
+    flow_entry_type_t res;
+
+    if (meta)
+        res = flow_decode_meta(ctx->flow_hash_table,
+                pkthdr, pktdata, meta, ctx->options->flow_expiry);
+    else
+        res = flow_decode(ctx->flow_hash_table,
+                pkthdr, pktdata, datalink, ctx->options->flow_expiry);
 
     switch (res) {
     case FLOW_ENTRY_NEW:
@@ -421,6 +373,12 @@ static inline void update_flow_stats(tcpreplay_t *ctx, sendpacket_t *sp,
             ++sp->flows_invalid_packets;
         break;
     }
+
+    /* idle flows are reclaimed by the flow table as time moves on */
+    if (ctx->options->flow_expiry) {
+        ctx->stats.flows_active = flow_hash_table_active(ctx->flow_hash_table);
+        ctx->stats.flows_reclaimed = flow_hash_table_reclaimed(ctx->flow_hash_table);
+    }
 }
 /**
  * \brief Preloads the memory cache for the given pcap file_idx 
@@ -429,16 +387,42 @@ static inline void update_flow_stats(tcpreplay_t *ctx, sendpacket_t *sp,
  */
 void
 preload_pcap_file(tcpreplay_t *ctx, int idx)
+{
+    char ebuf[PCAP_ERRBUF_SIZE];
+
+    if (preload_pcap_read(ctx, idx, ebuf) < 0)
+        errx(-1, "%s", ebuf);
+
+    preload_pcap_account(ctx, idx);
+}
+
+/**
+ * \brief Reads a pcap file into its memory cache and decodes each packet
+ *
+ * Only touches the cache of the given file, so several files can be read
+ * at the same time by different threads. The file is not usable until
+ * preload_pcap_account() has been called for it. Returns -1 with 'errbuf'
+ * (PCAP_ERRBUF_SIZE bytes) set if the file can't be opened, 0 otherwise.
+ */
+int
+preload_pcap_read(tcpreplay_t *ctx, int idx, char *errbuf)
 {
     tcpreplay_opt_t *options = ctx->options;
     char *path = options->sources[idx].filename;
-    pcap_t *pcap = NULL;
-    char ebuf[PCAP_ERRBUF_SIZE];
+    capfile_t *cf = NULL;
     const u_char *pktdata = NULL;
     struct pcap_pkthdr pkthdr;
-    packet_cache_t *cached_packet = NULL;
-    packet_cache_t **prev_packet = &cached_packet;
+    capfile_pkt_t info;
+    packet_meta_t *meta = NULL;
+    COUNTER meta_size = 0;
     COUNTER packetnum = 0;
+    COUNTER shared;
+    file_cache_t *fc = &options->file_cache[idx];
+    preload_dedup_t *dedup = NULL;
+    bool seekable = false;
+    uint32_t pktlen, stored;
+    off_t offset = 0;
+    struct stat st;
     int dlt;
 
     /* close stdin if reading from it (needed for some OS's) */
@@ -446,140 +430,258 @@ preload_pcap_file(tcpreplay_t *ctx, int idx)
         if (close(1) == -1)
             warnx("unable to close stdin: %s", strerror(errno));
 
-    if ((pcap = pcap_open_offline(path, ebuf)) == NULL)
-        errx(-1, "Error opening pcap file: %s", ebuf);
+    if ((cf = source_open_file(options, idx, 0, errbuf)) == NULL)
+        return -1;
+
+    /* size the cache from the file so that it rarely needs to grow */
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+        size_t size = preload_cache_estimate(st.st_size);
+
+        if (fc->cache_limit && size > fc->cache_limit)
+            size = fc->cache_limit;
+        preload_cache_reserve(fc, size);
+        seekable = true;
+    }
+
+    dlt = capfile_datalink(cf);
+    if (options->preload_dedup)
+        dedup = preload_dedup_init();
+
+    /*
+     * loop through the pcap, caching as many packets as we are allowed to.
+     * Decode each packet once here, so that we don't have to each time
+     * it is sent.
+     */
+    for (;;) {
+        if (fc->cache_limit && seekable)
+            offset = capfile_tell(cf);
+
+        if ((pktdata = capfile_next(cf, &pkthdr, &info)) == NULL)
+            break;
+
+        /* keep the original length if we are going to send it */
+        pktlen = pkthdr.caplen;
+        if (options->use_pkthdr_len && pkthdr.len > pktlen)
+            pktlen = pkthdr.len;
 
-    dlt = pcap_datalink(pcap);
-    /* loop through the pcap.  get_next_packet() builds the cache for us! */
-    while ((pktdata = get_next_packet(ctx, pcap, &pkthdr, idx, prev_packet)) != NULL) {
+        if (packetnum + 1 > meta_size) {
+            meta_size = meta_size ? meta_size * 2 : 1024;
+            meta = safe_realloc(meta, sizeof(packet_meta_t) * meta_size);
+        }
+
+        packet_meta_decode(&meta[packetnum], &pkthdr, pktdata, dlt);
+        meta[packetnum].intf_id = (uint8_t)info.intf_id;
+
+        stored = pktlen;
+        if (options->preload_headers)
+            stored = preload_headers_len(&meta[packetnum], &pkthdr, pktdata, pktlen);
+
+        /* out of budget, stream the rest of the file when sending */
+        if (fc->cache_limit && seekable &&
+                fc->cache_len + PACKET_CACHE_RECLEN(stored) +
+                (packetnum + 1) * sizeof(packet_meta_t) > fc->cache_limit) {
+            fc->partial = true;
+            fc->stream_offset = offset;
+            break;
+        }
+
+        if (stored < pktlen)
+            preload_cache_add_headers(fc, &pkthdr, pktdata, pktlen,
+                    &meta[packetnum], options->payload_fill);
+        else if (dedup != NULL)
+            preload_cache_add_dedup(fc, dedup, &pkthdr, pktdata, pktlen);
+        else
+            preload_cache_add(fc, &pkthdr, pktdata, pktlen);
         packetnum++;
-        if (options->flow_stats)
-            update_flow_stats(ctx, NULL, &pkthdr, pktdata, dlt);
     }
 
-    /* mark this file as cached */
-    options->file_cache[idx].cached = TRUE;
-    options->file_cache[idx].dlt = dlt;
-    pcap_close(pcap);
+    /* give back what we over-allocated */
+    preload_cache_trim(fc);
+    if (packetnum && packetnum < meta_size)
+        meta = safe_realloc(meta, sizeof(packet_meta_t) * packetnum);
+
+    shared = preload_dedup_free(dedup);
+    if (shared)
+        dbgx(1, "Preloaded " COUNTER_SPEC " packets of %s, " COUNTER_SPEC " share data",
+                fc->packet_count, path, shared);
+
+    if (fc->partial)
+        dbgx(1, "Preloaded " COUNTER_SPEC " packets of %s, streaming the rest from offset %lld",
+                fc->packet_count, path, (long long)fc->stream_offset);
+
+    if (capfile_geterr(cf) != NULL)
+        warnx("%s", capfile_geterr(cf));
+
+    fc->dlt = dlt;
+    fc->packet_meta = meta;
+    capfile_close(cf);
+    return 0;
 }
 
 /**
- * the main loop function for tcpreplay.  This is where we figure out
- * what to do with each packet
+ * \brief Finishes preloading a file read by preload_pcap_read()
+ *
+ * Looks up the tcpprep cache directions and gathers flow statistics,
+ * which depend on the order of the packets across all files, so this
+ * must be called for each file in order, from a single thread.
  */
 void
-send_packets(tcpreplay_t *ctx, pcap_t *pcap, int idx)
+preload_pcap_account(tcpreplay_t *ctx, int idx)
 {
-    struct timeval print_delta, now;
     tcpreplay_opt_t *options = ctx->options;
+    file_cache_t *fc = &options->file_cache[idx];
+    packet_cache_t *pc;
     COUNTER packetnum = 0;
-    COUNTER limit_send = options->limit_send;
-    struct pcap_pkthdr pkthdr;
-    u_char *pktdata = NULL;
-    sendpacket_t *sp = ctx->intf1;
-    COUNTER pktlen;
-    packet_cache_t *cached_packet = NULL;
-    packet_cache_t **prev_packet = NULL;
-#if defined TCPREPLAY && defined TCPREPLAY_EDIT
-    struct pcap_pkthdr *pkthdr_ptr;
-#endif
-    int datalink = options->file_cache[idx].dlt;
-    COUNTER skip_length = 0;
+
+    for (pc = packet_cache_first(fc); pc != NULL; pc = packet_cache_next(fc, pc)) {
+        packet_meta_t *meta = &fc->packet_meta[packetnum++];
+
+        if (options->cachedata != NULL)
+            meta->dir = cache_dir(ctx, options->cachedata, packetnum);
+
+        if (options->flow_stats) {
+            u_char *pktdata = packet_cache_direct(fc, pc);
+
+            /* the headers are always in the record if the packet isn't */
+            update_flow_stats(ctx, NULL, &pc->pkthdr,
+                    pktdata ? pktdata : packet_cache_data(pc), fc->dlt, meta);
+        }
+    }
+
+    /* mark this file as cached */
+    fc->cached = TRUE;
+}
+
+/*
+ * State of a replay loop carried from one packet to the next, see
+ * send_packet()
+ */
+typedef struct send_loop_s {
+    struct timeval now;         /* last time we read the clock */
+    bool now_is_now;            /* 'now' was read for the last packet */
+    COUNTER skip_length;        /* bytes to send before reading the clock again */
     COUNTER start_us;
-    COUNTER end_us;
-    COUNTER iteration = ctx->iteration;
-    bool unique_ip = options->unique_ip;
-    bool preload = options->file_cache[idx].cached;
-    bool top_speed = (options->speed.mode == speed_topspeed);
-    bool now_is_now = false;
+    COUNTER end_us;             /* when --duration is up, 0 for never */
+    bool intf_flow_stats;       /* count flows per interface too */
+} send_loop_t;
+
+/**
+ * sets up the state of a replay loop
+ */
+static void
+send_loop_init(tcpreplay_t *ctx, send_loop_t *loop, bool intf_flow_stats)
+{
+    tcpreplay_opt_t *options = ctx->options;
 
+    memset(loop, 0, sizeof(*loop));
+    loop->intf_flow_stats = intf_flow_stats;
     ctx->skip_packets = 0;
-    start_us = TIMEVAL_TO_MICROSEC(&ctx->stats.start_time);
 
+    loop->start_us = TIMEVAL_TO_MICROSEC(&ctx->stats.start_time);
     if (options->limit_time > 0)
-        end_us = start_us + SEC_TO_MICROSEC(options->limit_time);
-    else
-        end_us = 0;
-
-    if (options->preload_pcap) {
-        prev_packet = &cached_packet;
-    } else {
-        prev_packet = NULL;
-    }
+        loop->end_us = loop->start_us + SEC_TO_MICROSEC(options->limit_time);
+}
 
-    /* MAIN LOOP 
-     * Keep sending while we have packets or until
-     * we've sent enough packets
-     */
-    while (!ctx->abort &&
-            (pktdata = get_next_packet(ctx, pcap, &pkthdr, idx, prev_packet)) != NULL) {
+/**
+ * Sends a packet of file 'fc' out of 'sp' once it is due, or with
+ * --flow-multiplier several address shifted copies of it, and updates
+ * the statistics. 'meta' is the metadata decoded when the packet was
+ * preloaded, NULL if it wasn't, and 'cached' whether the packet data
+ * is in the cache. Sets ctx->abort once a limit has been reached.
+ */
+static void
+send_packet(tcpreplay_t *ctx, send_loop_t *loop, sendpacket_t *sp, file_cache_t *fc,
+        struct pcap_pkthdr *pkthdr, u_char *pktdata, const packet_meta_t *meta,
+        bool cached, COUNTER packetnum)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    struct timeval print_delta;
+    COUNTER limit_send = options->limit_send;
+    COUNTER iteration = ctx->iteration;
+    COUNTER pktlen;
+    bool unique_ip = options->unique_ip;
+    bool top_speed = (options->speed.mode == speed_topspeed);
+    uint32_t flow_multiplier = options->flow_multiplier;
+    int datalink = fc->dlt;
+    packet_meta_t decoded;
+    flow_addrs_t fa;
+    bool multiply;
+    uint32_t copy;
 
-        packetnum++;
 #if defined TCPREPLAY || defined TCPREPLAY_EDIT
-        /* do we use the snaplen (caplen) or the "actual" packet len? */
-        pktlen = options->use_pkthdr_len ? (COUNTER)pkthdr.len : (COUNTER)pkthdr.caplen;
+    /* do we use the snaplen (caplen) or the "actual" packet len? */
+    pktlen = options->use_pkthdr_len ? (COUNTER)pkthdr->len : (COUNTER)pkthdr->caplen;
 #elif TCPBRIDGE
-        pktlen = (COUNTER)pkthdr.caplen;
+    pktlen = (COUNTER)pkthdr->caplen;
 #else
 #error WTF???  We should not be here!
 #endif
 
-        dbgx(2, "packet " COUNTER_SPEC " caplen " COUNTER_SPEC, packetnum, pktlen);
-
-        /* Dual nic processing */
-        if (ctx->intf2 != NULL) {
-
-            sp = (sendpacket_t *) cache_mode(ctx, options->cachedata, packetnum);
-
-            /* sometimes we should not send the packet */
-            if (sp == TCPR_DIR_NOSEND)
-                continue;
-        }
+    dbgx(2, "packet " COUNTER_SPEC " caplen " COUNTER_SPEC, packetnum, pktlen);
 
 #if defined TCPREPLAY && defined TCPREPLAY_EDIT
-        pkthdr_ptr = &pkthdr;
-        if (tcpedit_packet(tcpedit, &pkthdr_ptr, &pktdata, sp->cache_dir) == -1) {
-            errx(-1, "Error editing packet #" COUNTER_SPEC ": %s", packetnum, tcpedit_geterr(tcpedit));
-        }
-        pktlen = options->use_pkthdr_len ? (COUNTER)pkthdr_ptr->len : (COUNTER)pkthdr_ptr->caplen;
+    if (tcpedit_packet(tcpedit, &pkthdr, &pktdata, sp->cache_dir) == -1) {
+        errx(-1, "Error editing packet #" COUNTER_SPEC ": %s", packetnum, tcpedit_geterr(tcpedit));
+    }
+    pktlen = options->use_pkthdr_len ? (COUNTER)pkthdr->len : (COUNTER)pkthdr->caplen;
+
+    /* tcpedit may have rewritten layer 2, so decode the packet again */
+    meta = NULL;
 #endif
 
-        /* do we need to print the packet via tcpdump? */
+    /* do we need to print the packet via tcpdump? */
 #ifdef ENABLE_VERBOSE
-        if (options->verbose)
-            tcpdump_print(options->tcpdump, &pkthdr, pktdata);
+    if (options->verbose)
+        tcpdump_print(options->tcpdump, pkthdr, pktdata);
 #endif
 
-        if (unique_ip && iteration)
+    /* send several address shifted copies of the packet? */
+    multiply = false;
+    if (flow_multiplier > 1) {
+        if (meta == NULL && packet_meta_decode(&decoded, pkthdr, pktdata, datalink) == 0)
+            meta = &decoded;
+
+        multiply = meta != NULL && flow_addrs_save(&fa, pkthdr, pktdata, meta);
+    }
+
+    copy = 0;
+    do {
+        if (multiply) {
+            /* each copy is edited from the original packet */
+            if (copy > 0 || (unique_ip && iteration))
+                fast_edit_packet(pkthdr, &pktdata, iteration * flow_multiplier + copy,
+                        false, datalink, meta);
+        } else if (unique_ip && iteration) {
             /* edit packet to ensure every pass has unique IP addresses */
-            fast_edit_packet(&pkthdr, &pktdata, iteration,
-                    preload, datalink);
+            fast_edit_packet(pkthdr, &pktdata, iteration,
+                    cached && pktdata != fc->scratch, datalink, meta);
+        }
 
-        /* update flow stats */
-        if (options->flow_stats && !preload)
-            update_flow_stats(ctx,
-                    options->cache_packets ? sp : NULL, &pkthdr, pktdata, datalink);
+        /* update flow stats, streamed packets of a preloaded file once */
+        if (options->flow_stats && !cached && !fc->stream_counted)
+            update_flow_stats(ctx, loop->intf_flow_stats ? sp : NULL,
+                    pkthdr, pktdata, datalink, NULL);
 
         /*
          * this accelerator improves performance by avoiding expensive
          * time stamps during periods where we have fallen behind in our
          * sending
          */
-        if (skip_length && pktlen < skip_length) {
-            skip_length -= pktlen;
-            now_is_now = false;
+        if (loop->skip_length && pktlen < loop->skip_length) {
+            loop->skip_length -= pktlen;
+            loop->now_is_now = false;
         } else if (ctx->skip_packets) {
             --ctx->skip_packets;
-            now_is_now = false;
+            loop->now_is_now = false;
         } else {
             /*
              * time stamping is expensive, but now is the
              * time to do it.
              */
-            skip_length = 0;
+            loop->skip_length = 0;
             ctx->skip_packets = 0;
-            now_is_now = true;
-            gettimeofday(&now, NULL);
+            loop->now_is_now = true;
+            gettimeofday(&loop->now, NULL);
 
             /*
              * Only sleep if we're not in top speed mode (-t)
@@ -587,20 +689,24 @@ send_packets(tcpreplay_t *ctx, pcap_t *pcap, int idx)
              * This also sets skip_length which will avoid timestamping for
              * a given number of packets.
              */
-            calc_sleep_time(ctx, &pkthdr.ts, &ctx->stats.last_time, pktlen, sp, packetnum,
-                    &ctx->stats.end_time, &start_us, &skip_length);
+            if (options->txtime_lead) {
+                txtime_schedule(ctx, sp, &pkthdr->ts, &loop->now);
+            } else {
+                calc_sleep_time(ctx, &pkthdr->ts, &ctx->stats.last_time, pktlen, sp, packetnum,
+                        &ctx->stats.end_time, &loop->start_us, &loop->skip_length);
 
-            /*
-             * we know how long to sleep between sends, now do it.
-             */
-            if (timesisset(&ctx->nap))
-                tcpr_sleep(ctx, sp, &ctx->nap, &now, options->accurate);
+                /*
+                 * we know how long to sleep between sends, now do it.
+                 */
+                if (timesisset(&ctx->nap))
+                    tcpr_sleep(ctx, sp, &ctx->nap, &loop->now, options->accurate);
+            }
         }
 
         dbgx(2, "Sending packet #" COUNTER_SPEC, packetnum);
 
         /* write packet out on network */
-        if (sendpacket(sp, pktdata, pktlen, &pkthdr) < (int)pktlen)
+        if (sendpacket(sp, pktdata, pktlen, pkthdr) < (int)pktlen)
             warnx("Unable to send packet: %s", sendpacket_geterr(sp));
 
         /*
@@ -609,10 +715,10 @@ send_packets(tcpreplay_t *ctx, pcap_t *pcap, int idx)
          * we have to cast the ts, since OpenBSD sucks
          * had to be special and use bpf_timeval.
          */
-        memcpy(&ctx->stats.end_time, &now, sizeof(ctx->stats.end_time));
+        memcpy(&ctx->stats.end_time, &loop->now, sizeof(ctx->stats.end_time));
 
 #ifdef TIMESTAMP_TRACE
-        add_timestamp_trace_entry(pktlen, &ctx->stats.end_time, skip_length);
+        add_timestamp_trace_entry(pktlen, &ctx->stats.end_time, loop->skip_length);
 #endif
         /*
          * track the time of the "last packet sent".  Again, because of OpenBSD
@@ -621,8 +727,8 @@ send_packets(tcpreplay_t *ctx, pcap_t *pcap, int idx)
          * A number of 3rd party tools generate bad timestamps which go backwards
          * in time.  Hence, don't update the "last" unless pkthdr.ts > last
          */
-        if (!top_speed && timercmp(&ctx->stats.last_time, &pkthdr.ts, <)) 
-            memcpy(&ctx->stats.last_time, &pkthdr.ts, sizeof(struct timeval));
+        if (!top_speed && timercmp(&ctx->stats.last_time, &pkthdr->ts, <))
+            memcpy(&ctx->stats.last_time, &pkthdr->ts, sizeof(struct timeval));
 
         ctx->stats.pkts_sent++;
         ctx->stats.bytes_sent += pktlen;
@@ -630,13 +736,16 @@ send_packets(tcpreplay_t *ctx, pcap_t *pcap, int idx)
         /* print stats during the run? */
         if (options->stats > 0) {
             if (! timerisset(&ctx->stats.last_print)) {
-                memcpy(&ctx->stats.last_print, &now, sizeof(ctx->stats.last_print));
+                memcpy(&ctx->stats.last_print, &loop->now, sizeof(ctx->stats.last_print));
             } else {
-                timersub(&now, &ctx->stats.last_print, &print_delta);
+                timersub(&loop->now, &ctx->stats.last_print, &print_delta);
                 if (print_delta.tv_sec >= options->stats) {
-                    memcpy(&ctx->stats.end_time, &now, sizeof(ctx->stats.end_time));
+                    memcpy(&ctx->stats.end_time, &loop->now, sizeof(ctx->stats.end_time));
                     packet_stats(&ctx->stats);
-                    memcpy(&ctx->stats.last_print, &now, sizeof(ctx->stats.last_print));
+                    if (options->flow_stats && options->flow_expiry)
+                        printf("Flows: " COUNTER_SPEC " active, " COUNTER_SPEC " reclaimed\n",
+                                ctx->stats.flows_active, ctx->stats.flows_reclaimed);
+                    memcpy(&ctx->stats.last_print, &loop->now, sizeof(ctx->stats.last_print));
                 }
             }
         }
@@ -648,285 +757,564 @@ send_packets(tcpreplay_t *ctx, pcap_t *pcap, int idx)
         }
 #endif
         /* stop sending based on the duration limit... */
-        if ((end_us > 0 && TIMEVAL_TO_MICROSEC(&now) > end_us) ||
+        if ((loop->end_us > 0 && TIMEVAL_TO_MICROSEC(&loop->now) > loop->end_us) ||
                 /* ... or stop sending based on the limit -L? */
                 (limit_send > 0 && ctx->stats.pkts_sent >= limit_send)) {
             ctx->abort = true;
         }
+
+        if (multiply)
+            flow_addrs_restore(&fa);
+    } while (multiply && ++copy < flow_multiplier && !ctx->abort);
+}
+
+/**
+ * finishes a replay loop, once the last packet has gone out
+ */
+static void
+send_loop_finish(tcpreplay_t *ctx, send_loop_t *loop)
+{
+#ifdef HAVE_NETMAP
+    tcpreplay_opt_t *options = ctx->options;
+    int i;
+
+    /* when completing test, wait until the last packet is sent */
+    if (options->netmap && (ctx->abort || options->loop == 1)) {
+        while (ctx->intf1 && !netmap_tx_queues_empty(ctx->intf1)) {
+            gettimeofday(&loop->now, NULL);
+            loop->now_is_now = true;
+        }
+
+        while (ctx->intf2 && !netmap_tx_queues_empty(ctx->intf2)) {
+            gettimeofday(&loop->now, NULL);
+            loop->now_is_now = true;
+        }
+
+        for (i = 0; i < options->merge_intf_cnt; i++) {
+            while (ctx->merge_intf[i] && !netmap_tx_queues_empty(ctx->merge_intf[i])) {
+                gettimeofday(&loop->now, NULL);
+                loop->now_is_now = true;
+            }
+        }
+    }
+#endif /* HAVE_NETMAP */
+
+    if (!loop->now_is_now)
+        gettimeofday(&loop->now, NULL);
+
+    memcpy(&ctx->stats.end_time, &loop->now, sizeof(ctx->stats.end_time));
+
+    ++ctx->iteration;
+}
+
+/**
+ * the main loop function for tcpreplay.  This is where we figure out
+ * what to do with each packet
+ */
+void
+send_packets(tcpreplay_t *ctx, capfile_t *cf, int idx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    send_loop_t loop;
+    COUNTER packetnum = 0;
+    struct pcap_pkthdr pkthdr;
+    capfile_pkt_t info;
+    u_char *pktdata = NULL;
+    sendpacket_t *sp = ctx->intf1;
+    packet_cache_t *cached_packet = NULL;
+    packet_cache_t **prev_packet = NULL;
+    const packet_meta_t *meta = NULL;
+    COUNTER idle_gap = 0;
+    COUNTER idle_shift_us = 0;
+    file_cache_t *fc = &options->file_cache[idx];
+    bool preload = fc->cached;
+    bool cached = false;
+    bool window = options->start_packet || options->start_time_us || options->end_time_us;
+    bool window_started = false;
+    COUNTER first_ts_us = 0;
+    COUNTER pkt_us, rel_us;
+
+    /* flows are only counted per interface when there is a choice of them */
+    send_loop_init(ctx, &loop, options->cache_packets != 0);
+
+    /* replay_file() may have seeked past the start of the file */
+    if (cf != NULL && !preload && fc->seek_packetnum) {
+        packetnum = fc->seek_packetnum;
+        first_ts_us = fc->first_ts_us;
+    }
+
+    if (options->preload_pcap) {
+        prev_packet = &cached_packet;
+    } else {
+        prev_packet = NULL;
+    }
+
+    /* MAIN LOOP 
+     * Keep sending while we have packets or until
+     * we've sent enough packets
+     */
+    while (!ctx->abort &&
+            (pktdata = get_next_packet(ctx, cf, &pkthdr, idx, prev_packet, &info)) != NULL) {
+
+        packetnum++;
+
+        /* only send the part of the file asked for */
+        if (window) {
+            pkt_us = (COUNTER)TIMEVAL_TO_MICROSEC(&pkthdr.ts);
+            if (packetnum == 1)
+                first_ts_us = pkt_us;
+            rel_us = pkt_us > first_ts_us ? pkt_us - first_ts_us : 0;
+
+            if (options->end_time_us && rel_us >= options->end_time_us)
+                break;
+
+            if (!window_started) {
+                if (packetnum < options->start_packet || rel_us < options->start_time_us)
+                    continue;
+                window_started = true;
+            }
+        }
+
+        /* metadata decoded when preloading, unless streamed past the cache */
+        cached = preload && packetnum <= fc->packet_count;
+        meta = cached ? &fc->packet_meta[packetnum - 1] : NULL;
+
+        /* squeeze out the periods where no flow is active */
+        if (fc->idle_gap_cnt) {
+            while (idle_gap < fc->idle_gap_cnt && fc->idle_gaps[idle_gap].packetnum <= packetnum)
+                idle_shift_us = fc->idle_gaps[idle_gap++].shift_us;
+
+            if (idle_shift_us) {
+                struct timeval shift;
+
+                shift.tv_sec = idle_shift_us / 1000000;
+                shift.tv_usec = idle_shift_us % 1000000;
+                timersub(&pkthdr.ts, &shift, &pkthdr.ts);
+            }
+        }
+
+        /* Dual nic processing */
+        if (options->route_by_intf) {
+            sp = capture_intf(ctx, meta ? meta->intf_id : info.intf_id);
+        } else if (ctx->intf2 != NULL) {
+
+            if (meta)
+                sp = dir_to_intf(ctx, meta->dir);
+            else
+                sp = (sendpacket_t *) cache_mode(ctx, options->cachedata, packetnum);
+
+            /* sometimes we should not send the packet */
+            if (sp == TCPR_DIR_NOSEND)
+                continue;
+        }
+
+        send_packet(ctx, &loop, sp, fc, &pkthdr, pktdata, meta, cached, packetnum);
     } /* while */
 
+    /* the streamed part of a partially preloaded file is only counted once */
+    if (preload && fc->partial)
+        fc->stream_counted = true;
+
+    send_loop_finish(ctx, &loop);
+}
+
+/* how much of the next file to read ahead while the current one is sent */
+#define SOURCE_PREFETCH_BYTES   (16 * 1024 * 1024)
+
+#ifdef HAVE_PTHREAD
+/* the next file, opened by a thread while the current one is sent */
+struct source_prefetch_s {
+    int idx;
+    const char *path;
+    int direct_io;
+    pthread_t thread;
+    capfile_t *cf;
+    char errbuf[PCAP_ERRBUF_SIZE];
+};
+
+static void *
+source_prefetch_thread(void *arg)
+{
+    struct source_prefetch_s *pf = arg;
+    char ebuf[PCAP_ERRBUF_SIZE];
+
+    tcpreplay_pin_helper();
+
+    if ((pf->cf = capfile_open(pf->path, pf->errbuf)) == NULL)
+        return NULL;
+
+    /*
+     * compressed files are decompressed ahead by their own thread, and
+     * direct I/O reads ahead into its buffers as soon as it is enabled;
+     * source_open() warns if it can't be
+     */
+    if (pf->direct_io && capfile_direct_io(pf->cf, pf->direct_io, ebuf) == 0)
+        return NULL;
+
+#ifdef HAVE_POSIX_FADVISE
+    if (capfile_fileno(pf->cf) >= 0)
+        posix_fadvise(capfile_fileno(pf->cf), 0, SOURCE_PREFETCH_BYTES, POSIX_FADV_WILLNEED);
+#endif
+
+    return NULL;
+}
+#endif /* HAVE_PTHREAD */
+
+/**
+ * \brief start opening the file of source 'idx' in the background
+ *
+ * source_open() picks the file up when its turn comes, so there is no
+ * gap between files while the next one is opened and its first
+ * megabytes are read. Only one file is opened ahead at a time. Does
+ * nothing for preloaded files, stdin or without thread support.
+ */
+void
+source_prefetch(tcpreplay_t *ctx, int idx)
+{
+#ifdef HAVE_PTHREAD
+    tcpreplay_opt_t *options = ctx->options;
+    struct source_prefetch_s *pf;
+
+    if (ctx->prefetch != NULL || options->preload_pcap ||
+            idx < 0 || idx >= options->source_cnt ||
+            options->sources[idx].type != source_filename ||
+            strcmp(options->sources[idx].filename, "-") == 0)
+        return;
+
+    pf = safe_malloc(sizeof(*pf));
+    pf->idx = idx;
+    pf->path = options->sources[idx].filename;
+    pf->direct_io = options->direct_io;
+
+    if (pthread_create(&pf->thread, NULL, source_prefetch_thread, pf) != 0) {
+        safe_free(pf);
+        return;
+    }
+
+    ctx->prefetch = pf;
+#else
+    (void)ctx;
+    (void)idx;
+#endif
+}
+
+/**
+ * waits for the file being opened ahead, and returns it if it is that
+ * of source 'idx'. Returns NULL otherwise, with 'errbuf' set if it is
+ * but it couldn't be opened.
+ */
+static capfile_t *
+source_prefetch_take(tcpreplay_t *ctx, int idx, char *errbuf)
+{
+    capfile_t *cf = NULL;
+#ifdef HAVE_PTHREAD
+    struct source_prefetch_s *pf = ctx->prefetch;
+
+    if (pf == NULL)
+        return NULL;
+
+    pthread_join(pf->thread, NULL);
+    ctx->prefetch = NULL;
+
+    if (pf->idx == idx) {
+        cf = pf->cf;
+        if (cf == NULL)
+            strlcpy(errbuf, pf->errbuf, PCAP_ERRBUF_SIZE);
+    } else {
+        capfile_close(pf->cf);
+    }
+
+    safe_free(pf);
+#else
+    (void)ctx;
+    (void)idx;
+    (void)errbuf;
+#endif
+    return cf;
+}
 
-#ifdef HAVE_NETMAP
-    /* when completing test, wait until the last packet is sent */
-    if (options->netmap && (ctx->abort || options->loop == 1)) {
-        while (ctx->intf1 && !netmap_tx_queues_empty(ctx->intf1)) {
-            gettimeofday(&now, NULL);
-            now_is_now = true;
-        }
+/**
+ * \brief close the file opened ahead, if any
+ */
+void
+source_prefetch_cancel(tcpreplay_t *ctx)
+{
+    char ebuf[PCAP_ERRBUF_SIZE];
 
-        while (ctx->intf2 && !netmap_tx_queues_empty(ctx->intf2)) {
-            gettimeofday(&now, NULL);
-            now_is_now = true;
-        }
+    capfile_close(source_prefetch_take(ctx, -1, ebuf));
+}
+
+/**
+ * Positions a source file opened by the caller at 'offset' and turns
+ * on direct I/O if asked to. Doesn't touch the context, so preload
+ * threads can use it. Closes the file and returns NULL with 'errbuf'
+ * set on error.
+ */
+static capfile_t *
+source_setup(const tcpreplay_opt_t *options, capfile_t *cf, off_t offset,
+        char *errbuf)
+{
+    char ebuf[PCAP_ERRBUF_SIZE];
+
+    if (offset > 0 && capfile_seek(cf, offset) < 0) {
+        strlcpy(errbuf, capfile_geterr(cf), PCAP_ERRBUF_SIZE);
+        capfile_close(cf);
+        return NULL;
     }
-#endif /* HAVE_NETMAP */
 
-    if (!now_is_now)
-        gettimeofday(&now, NULL);
+    if (options->direct_io && capfile_direct_io(cf, options->direct_io, ebuf) < 0)
+        warnx("%s, reading it through the page cache", ebuf);
 
-    memcpy(&ctx->stats.end_time, &now, sizeof(ctx->stats.end_time));
+    return cf;
+}
 
-    ++ctx->iteration;
+/**
+ * \brief open the file of a source without touching the context
+ *
+ * Like source_open(), but never takes a file opened ahead and reports
+ * errors in 'errbuf', which must be PCAP_ERRBUF_SIZE bytes, so that it
+ * can be called from preload threads. Returns NULL on error.
+ */
+capfile_t *
+source_open_file(const tcpreplay_opt_t *options, int idx, off_t offset, char *errbuf)
+{
+    char ebuf[PCAP_ERRBUF_SIZE];
+    capfile_t *cf;
+
+    if ((cf = capfile_open(options->sources[idx].filename, ebuf)) == NULL) {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "Error opening pcap file: %s", ebuf);
+        return NULL;
+    }
+
+    return source_setup(options, cf, offset, errbuf);
 }
 
 /**
- * the alternate main loop function for tcpreplay.  This is where we figure out
- * what to do with each packet when processing two files a the same time
+ * \brief open the file of a source, positioned at the given offset
+ *
+ * The offset must be 0 or one returned by capfile_tell(). Takes the
+ * file over from source_prefetch() if it was opened ahead. Reads the
+ * file with direct I/O if asked to, or through the page cache with a
+ * warning if the file doesn't allow it. Returns NULL on error.
  */
-void
-send_dual_packets(tcpreplay_t *ctx, pcap_t *pcap1, int cache_file_idx1, pcap_t *pcap2, int cache_file_idx2)
+capfile_t *
+source_open(tcpreplay_t *ctx, int idx, off_t offset)
 {
-    struct timeval print_delta, now;
-    tcpreplay_opt_t *options = ctx->options;
-    COUNTER packetnum = 0;
-    COUNTER limit_send = options->limit_send;
-    int cache_file_idx;
-    struct pcap_pkthdr pkthdr1, pkthdr2;
-    u_char *pktdata1 = NULL, *pktdata2 = NULL, *pktdata = NULL;
-    sendpacket_t *sp = ctx->intf1;
-    COUNTER pktlen;
-    COUNTER iteration = ctx->iteration;
-    bool unique_ip = options->unique_ip;
-    packet_cache_t *cached_packet1 = NULL, *cached_packet2 = NULL;
-    packet_cache_t **prev_packet1 = NULL, **prev_packet2 = NULL;
-    struct pcap_pkthdr *pkthdr_ptr;
-    int datalink = options->file_cache[cache_file_idx1].dlt;
-    COUNTER start_us;
-    COUNTER end_us;
-    COUNTER skip_length = 0;
-    bool top_speed = (options->speed.mode == speed_topspeed);
-    bool now_is_now = false;
+    char ebuf[PCAP_ERRBUF_SIZE];
+    capfile_t *cf;
 
-    ctx->skip_packets = 0;
-    start_us = TIMEVAL_TO_MICROSEC(&ctx->stats.start_time);
+    ebuf[0] = '\0';
+    cf = source_prefetch_take(ctx, idx, ebuf);
+    if (cf == NULL && ebuf[0] != '\0') {
+        tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
+        return NULL;
+    }
 
-    if (options->limit_time > 0)
-        end_us = start_us + SEC_TO_MICROSEC(options->limit_time);
+    if (cf == NULL)
+        cf = source_open_file(ctx->options, idx, offset, ebuf);
     else
-        end_us = 0;
+        cf = source_setup(ctx->options, cf, offset, ebuf);
 
-    if (options->preload_pcap) {
-        prev_packet1 = &cached_packet1;
-        prev_packet2 = &cached_packet2;
-    } else {
-        prev_packet1 = NULL;
-        prev_packet2 = NULL;
+    if (cf == NULL) {
+        tcpreplay_seterr(ctx, "%s", ebuf);
+        return NULL;
     }
 
+    return cf;
+}
 
-    pktdata1 = get_next_packet(ctx, pcap1, &pkthdr1, cache_file_idx1, prev_packet1);
-    pktdata2 = get_next_packet(ctx, pcap2, &pkthdr2, cache_file_idx2, prev_packet2);
-
-    /* MAIN LOOP 
-     * Keep sending while we have packets or until
-     * we've sent enough packets
-     */
-    while (!ctx->abort &&
-            !(pktdata1 == NULL && pktdata2 == NULL)) {
+/**
+ * \brief open a file replayed together with others, from the start
+ *
+ * Reads from the pcap file unless the file is fully cached, in which
+ * case src->cf is left NULL. Closes the file first if it was open,
+ * so it can be used to rewind a source.
+ */
+int
+merge_source_open(tcpreplay_t *ctx, merge_source_t *src)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    file_cache_t *fc = &options->file_cache[src->idx];
 
-        packetnum++;
+    if (src->cf != NULL) {
+        capfile_close(src->cf);
+        src->cf = NULL;
+    }
 
-        /* figure out which pcap file we need to process next 
-         * when get_next_packet() returns null for pktdata, the pkthdr 
-         * will still have the old values from the previous call.  This
-         * means we can't always trust the timestamps to tell us which
-         * file to process.
-         */
-        if (pktdata1 == NULL) {
-            /* file 2 is next */
-            sp = ctx->intf2;
-            datalink = options->file_cache[cache_file_idx2].dlt;
-            pkthdr_ptr = &pkthdr2;
-            cache_file_idx = cache_file_idx2;
-            pktdata = pktdata2;
-        } else if (pktdata2 == NULL) {
-            /* file 1 is next */
-            sp = ctx->intf1;
-            datalink = options->file_cache[cache_file_idx1].dlt;
-            pkthdr_ptr = &pkthdr1;
-            cache_file_idx = cache_file_idx1;
-            pktdata = pktdata1;
-        } else if (timercmp(&pkthdr1.ts, &pkthdr2.ts, <=)) {
-            /* file 1 is next */
-            sp = ctx->intf1;
-            datalink = options->file_cache[cache_file_idx1].dlt;
-            pkthdr_ptr = &pkthdr1;
-            cache_file_idx = cache_file_idx1;
-            pktdata = pktdata1;
-        } else {
-            /* file 2 is next */
-            sp = ctx->intf2;
-            datalink = options->file_cache[cache_file_idx2].dlt;
-            pkthdr_ptr = &pkthdr2;
-            cache_file_idx = cache_file_idx2;
-            pktdata = pktdata2;
-        }
+    if (!options->preload_pcap || !fc->cached) {
+        if ((src->cf = source_open(ctx, src->idx, 0)) == NULL)
+            return -1;
+        fc->dlt = capfile_datalink(src->cf);
+    } else if (fc->partial) {
+        /* stream what didn't fit in the cache */
+        if ((src->cf = preload_stream_open(ctx, src->idx)) == NULL)
+            return -1;
+    }
 
-#if defined TCPREPLAY || defined TCPREPLAY_EDIT
-        /* do we use the snaplen (caplen) or the "actual" packet len? */
-        pktlen = options->use_pkthdr_len ? (COUNTER)pkthdr_ptr->len : (COUNTER)pkthdr_ptr->caplen;
-#elif TCPBRIDGE
-        pktlen = (COUNTER)pkthdr_ptr->caplen;
-#else
-#error WTF???  We should not be here!
-#endif
+    return 0;
+}
 
-        dbgx(2, "packet " COUNTER_SPEC " caplen " COUNTER_SPEC, packetnum, pktlen);
+/**
+ * returns true if the next packet of source 'a' should be sent before
+ * that of 'b'. Ties go to the source listed first.
+ *
+ * In a traffic mix the sources are ordered by how much they have sent
+ * relative to their weight instead of by timestamp.
+ */
+static inline bool
+merge_before(const merge_source_t *a, const merge_source_t *b, bool mix)
+{
+    if (mix) {
+        if (a->vtime == b->vtime)
+            return a < b;
 
+        return a->vtime < b->vtime;
+    }
 
-#if defined TCPREPLAY && defined TCPREPLAY_EDIT
-        if (tcpedit_packet(tcpedit, &pkthdr_ptr, &pktdata, sp->cache_dir) == -1) {
-            errx(-1, "Error editing packet #" COUNTER_SPEC ": %s", packetnum, tcpedit_geterr(tcpedit));
-        }
-        pktlen = options->use_pkthdr_len ? (COUNTER)pkthdr_ptr->len : (COUNTER)pkthdr_ptr->caplen;
-#endif
+    if (timercmp(&a->pkthdr.ts, &b->pkthdr.ts, ==))
+        return a < b;
 
-        /* do we need to print the packet via tcpdump? */
-#ifdef ENABLE_VERBOSE
-        if (options->verbose)
-            tcpdump_print(options->tcpdump, pkthdr_ptr, pktdata);
-#endif
+    return timercmp(&a->pkthdr.ts, &b->pkthdr.ts, <);
+}
 
-        if (unique_ip && iteration)
-            /* edit packet to ensure every pass is unique */
-            fast_edit_packet(pkthdr_ptr, &pktdata, ctx->iteration,
-                    options->file_cache[cache_file_idx].cached, datalink);
+/**
+ * restore the heap order of 'heap' below element 'i'
+ */
+static void
+merge_sift_down(merge_source_t **heap, int cnt, int i, bool mix)
+{
+    merge_source_t *src = heap[i];
+    int child;
 
-        /* update flow stats */
-        if (options->flow_stats && !options->file_cache[cache_file_idx].cached)
-            update_flow_stats(ctx, sp, pkthdr_ptr, pktdata, datalink);
+    while ((child = 2 * i + 1) < cnt) {
+        if (child + 1 < cnt && merge_before(heap[child + 1], heap[child], mix))
+            ++child;
 
-        /*
-         * this accelerator improves performance by avoiding expensive
-         * time stamps during periods where we have fallen behind in our
-         * sending
-         */
-        if (skip_length && pktlen < skip_length) {
-            skip_length -= pktlen;
-            now_is_now = false;
-        } else if (ctx->skip_packets) {
-            --ctx->skip_packets;
-            now_is_now = false;
-        } else {
-            /*
-             * time stamping is expensive, but now is the
-             * time to do it.
-             */
-            skip_length = 0;
-            ctx->skip_packets = 0;
-            now_is_now = true;
-            gettimeofday(&now, NULL);
+        if (!merge_before(heap[child], src, mix))
+            break;
 
-            /*
-             * Only sleep if we're not in top speed mode (-t)
-             *
-             * This also sets skip_length which will avoid timestamping for
-             * a given number of packets.
-             */
-            calc_sleep_time(ctx, &pkthdr_ptr->ts, &ctx->stats.last_time, pktlen, sp, packetnum,
-                    &ctx->stats.end_time, &start_us, &skip_length);
+        heap[i] = heap[child];
+        i = child;
+    }
 
-            /*
-             * we know how long to sleep between sends, now do it.
-             */
-            if (timesisset(&ctx->nap))
-                tcpr_sleep(ctx, sp, &ctx->nap, &now, options->accurate);
-        }
+    heap[i] = src;
+}
 
-        dbgx(2, "Sending packet #" COUNTER_SPEC, packetnum);
+/**
+ * the alternate main loop function for tcpreplay.  This is where we figure out
+ * what to do with each packet when processing several files at the same time,
+ * each going out of its own interface. The sources are kept in a min-heap on
+ * the timestamp of their next packet, so packets are sent in timestamp order
+ * across all of them.
+ *
+ * With --mix, the sources are instead kept in order of bytes (with --mbps)
+ * or packets sent divided by their weight, so each gets its share of the
+ * aggregate rate. Sources which run dry start over until all of them have
+ * been sent once.
+ */
+void
+send_merged_packets(tcpreplay_t *ctx, merge_source_t *sources, int source_cnt)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    send_loop_t loop;
+    COUNTER packetnum = 0;
+    COUNTER pkts_sent, bytes_sent;
+    merge_source_t **heap;
+    merge_source_t *src;
+    int heap_cnt = 0;
+    file_cache_t *fc;
+    bool cached;
+    const packet_meta_t *meta;
+    bool mix = options->mix;
+    bool by_bytes = (options->speed.mode == speed_mbpsrate);
+    int unwrapped = source_cnt;
+    int i;
+
+    send_loop_init(ctx, &loop, true);
+
+    /* prime each source with its first packet */
+    heap = safe_malloc(sizeof(merge_source_t *) * source_cnt);
+    for (i = 0; i < source_cnt; i++) {
+        src = &sources[i];
+        src->cached_packet = NULL;
+        src->packetnum = 0;
+        src->vtime = 0;
+        src->wrapped = false;
+        src->pktdata = get_next_packet(ctx, src->cf, &src->pkthdr, src->idx,
+                options->preload_pcap ? &src->cached_packet : NULL, NULL);
+        if (src->pktdata != NULL)
+            heap[heap_cnt++] = src;
+        else
+            --unwrapped;
+    }
 
-        /* write packet out on network */
-        if (sendpacket(sp, pktdata, pktlen, pkthdr_ptr) < (int)pktlen)
-            warnx("Unable to send packet: %s", sendpacket_geterr(sp));
+    for (i = heap_cnt / 2 - 1; i >= 0; i--)
+        merge_sift_down(heap, heap_cnt, i, mix);
 
-        /*
-         * mark the time when we sent the last packet
-         *
-         * we have to cast the ts, since OpenBSD sucks
-         * had to be special and use bpf_timeval.
-         */
-        memcpy(&ctx->stats.end_time, &now, sizeof(ctx->stats.end_time));
+    /* MAIN LOOP 
+     * Keep sending while we have packets or until
+     * we've sent enough packets
+     */
+    while (!ctx->abort && heap_cnt > 0) {
 
-        /*
-         * track the time of the "last packet sent".  Again, because of OpenBSD
-         * we have to do a memcpy rather then assignment.
-         *
-         * A number of 3rd party tools generate bad timestamps which go backwards
-         * in time.  Hence, don't update the "last" unless pkthdr.ts > last
-         */
-        if (!top_speed && timercmp(&ctx->stats.last_time, &pkthdr_ptr->ts, <))
-            memcpy(&ctx->stats.last_time, &pkthdr_ptr->ts, sizeof(struct timeval));
+        packetnum++;
 
-        ctx->stats.pkts_sent++;
-        ctx->stats.bytes_sent += pktlen;
+        /* the source with the earliest packet is next */
+        src = heap[0];
+        src->packetnum++;
+
+        /* metadata decoded when preloading, unless streamed past the cache */
+        fc = &options->file_cache[src->idx];
+        cached = fc->cached && src->packetnum <= fc->packet_count;
+        meta = cached ? &fc->packet_meta[src->packetnum - 1] : NULL;
+
+        pkts_sent = ctx->stats.pkts_sent;
+        bytes_sent = ctx->stats.bytes_sent;
+        send_packet(ctx, &loop, src->sp, fc, &src->pkthdr, src->pktdata, meta, cached,
+                packetnum);
+
+        if (mix)
+            src->vtime += (double)(by_bytes ? ctx->stats.bytes_sent - bytes_sent :
+                    ctx->stats.pkts_sent - pkts_sent) / options->sources[src->idx].weight;
+
+        /* get the next packet of this source, and drop it once it runs dry */
+        src->pktdata = get_next_packet(ctx, src->cf, &src->pkthdr, src->idx,
+                options->preload_pcap ? &src->cached_packet : NULL, NULL);
+        if (src->pktdata == NULL && mix) {
+            /* in a mix, start over until every source has been sent once */
+            if (!src->wrapped) {
+                src->wrapped = true;
+                --unwrapped;
+                if (fc->cached && fc->partial)
+                    fc->stream_counted = true;
+            }
 
-        /* print stats during the run? */
-        if (options->stats > 0) {
-            if (! timerisset(&ctx->stats.last_print)) {
-                memcpy(&ctx->stats.last_print, &now, sizeof(ctx->stats.last_print));
+            if (unwrapped > 0) {
+                src->cached_packet = NULL;
+                src->packetnum = 0;
+                if (merge_source_open(ctx, src) < 0)
+                    errx(-1, "Unable to rewind pcap file: %s", tcpreplay_geterr(ctx));
+                src->pktdata = get_next_packet(ctx, src->cf, &src->pkthdr, src->idx,
+                        options->preload_pcap ? &src->cached_packet : NULL, NULL);
             } else {
-                timersub(&now, &ctx->stats.last_print, &print_delta);
-                if (print_delta.tv_sec >= options->stats) {
-                    memcpy(&ctx->stats.end_time, &now, sizeof(ctx->stats.end_time));
-                    packet_stats(&ctx->stats);
-                    memcpy(&ctx->stats.last_print, &now, sizeof(ctx->stats.last_print));
-                }
+                heap_cnt = 0;
             }
         }
-
-#if defined HAVE_QUICK_TX || defined HAVE_NETMAP
-        if (sp->first_packet) {
-            wake_send_queues(sp, options);
-            sp->first_packet = false;
-        }
-#endif
-
-        /* get the next packet for this file handle depending on which we last used */
-        if (sp == ctx->intf2) {
-            pktdata2 = get_next_packet(ctx, pcap2, &pkthdr2, cache_file_idx2, prev_packet2);
-        } else {
-            pktdata1 = get_next_packet(ctx, pcap1, &pkthdr1, cache_file_idx1, prev_packet1);
-        }
-
-        /* stop sending based on the duration limit... */
-        if ((end_us > 0 && TIMEVAL_TO_MICROSEC(&now) > end_us) ||
-                /* ... or stop sending based on the limit -L? */
-                (limit_send > 0 && ctx->stats.pkts_sent >= limit_send)) {
-            ctx->abort = true;
-        }
+        if (src->pktdata == NULL && heap_cnt > 0)
+            heap[0] = heap[--heap_cnt];
+        merge_sift_down(heap, heap_cnt, 0, mix);
     } /* while */
 
-#ifdef HAVE_NETMAP
-    /* when completing test, wait until the last packet is sent */
-    if (options->netmap && (ctx->abort || options->loop == 1)) {
-        while (ctx->intf1 && !netmap_tx_queues_empty(ctx->intf1)) {
-            gettimeofday(&now, NULL);
-            now_is_now = true;
-        }
+    safe_free(heap);
 
-        while (ctx->intf2 && !netmap_tx_queues_empty(ctx->intf2)) {
-            gettimeofday(&now, NULL);
-            now_is_now = true;
-        }
+    /* the streamed part of a partially preloaded file is only counted once */
+    for (i = 0; i < source_cnt; i++) {
+        fc = &options->file_cache[sources[i].idx];
+        if (fc->cached && fc->partial)
+            fc->stream_counted = true;
     }
-#endif /* HAVE_NETMAP */
 
-    if (!now_is_now)
-        gettimeofday(&now, NULL);
-
-    memcpy(&ctx->stats.end_time, &now, sizeof(ctx->stats.end_time));
-
-    ++ctx->iteration;
+    send_loop_finish(ctx, &loop);
 }
 
 
@@ -935,81 +1323,68 @@ send_dual_packets(tcpreplay_t *ctx, pcap_t *pcap1, int cache_file_idx1, pcap_t *
  * Gets the next packet to be sent out. This will either read from the pcap file
  * or will retrieve the packet from the internal cache.
  *
- * The parameter prev_packet is used as the parent of the new entry in the cache list.
- * This should be NULL on the first call to this function for each file and
- * will be updated as new entries are added (or retrieved) from the cache list.
+ * The parameter prev_packet is used to walk the cache. It should point to NULL
+ * on the first call to this function for each file and will be updated as
+ * packets are retrieved from the cache. Once the cache of a partially preloaded
+ * file is exhausted, the rest of the packets are read from pcap.
+ *
+ * If info isn't NULL, it is filled in for packets read from the file. The
+ * capture interface of cached packets is in their packet_meta_t instead.
  */
 u_char *
-get_next_packet(tcpreplay_t *ctx, pcap_t *pcap, struct pcap_pkthdr *pkthdr, int idx, 
-    packet_cache_t **prev_packet)
+get_next_packet(tcpreplay_t *ctx, capfile_t *cf, struct pcap_pkthdr *pkthdr, int idx, 
+    packet_cache_t **prev_packet, capfile_pkt_t *info)
 {
     tcpreplay_opt_t *options = ctx->options;
+    file_cache_t *fc = &options->file_cache[idx];
+    packet_cache_t *next;
     u_char *pktdata = NULL;
-    uint32_t pktlen;
 
-    /* pcap may be null in cache mode! */
+    /* cf may be null in cache mode! */
     /* packet_cache_t may be null in file read mode! */
     assert(pkthdr);
 
     /*
-     * Check if we're caching files
+     * Check if we're reading from the cache
      */
-    if (options->preload_pcap && (prev_packet != NULL)) {
-        /*
-         * Yes we are caching files - has this one been cached?
-         */
-        if (options->file_cache[idx].cached) {
-            if (*prev_packet == NULL) {
-                /*
-                 * Get the first packet in the cache list directly from the file
-                 */
-                *prev_packet = options->file_cache[idx].packet_cache;
-            } else {
-                /*
-                 * Get the next packet in the cache list
-                 */
-                *prev_packet = (*prev_packet)->next;
-            }
-
-            if (*prev_packet != NULL) {
-                pktdata = (*prev_packet)->pktdata;
-                memcpy(pkthdr, &((*prev_packet)->pkthdr), sizeof(struct pcap_pkthdr));
-            }
+    if (options->preload_pcap && prev_packet != NULL && fc->cached) {
+        if (*prev_packet == NULL) {
+            /*
+             * Get the first packet in the cache directly from the file
+             */
+            next = packet_cache_first(fc);
         } else {
             /*
-             * We should read the pcap file, and cache the results
+             * Get the next packet in the cache
              */
-            pktdata = (u_char *)pcap_next(pcap, pkthdr);
-            if (pktdata != NULL) {
-                if (*prev_packet == NULL) {
-                    /*
-                     * Create the first packet in the list
-                     */
-                    *prev_packet = safe_malloc(sizeof(packet_cache_t));
-                    options->file_cache[idx].packet_cache = *prev_packet;
-                } else {
-                    /*
-                     * Add a packet to the end of the list
-                     */
-                    (*prev_packet)->next = safe_malloc(sizeof(packet_cache_t));
-                    *prev_packet = (*prev_packet)->next;
-                }
+            next = packet_cache_next(fc, *prev_packet);
+        }
 
-                if (*prev_packet != NULL) {
-                    (*prev_packet)->next = NULL;
-                    pktlen = pkthdr->len;
+        if (next != NULL) {
+            *prev_packet = next;
+            memcpy(pkthdr, &next->pkthdr, sizeof(struct pcap_pkthdr));
 
-                    (*prev_packet)->pktdata = safe_malloc(pktlen);
-                    memcpy((*prev_packet)->pktdata, pktdata, pktlen);
-                    memcpy(&((*prev_packet)->pkthdr), pkthdr, sizeof(struct pcap_pkthdr));
-                }
-            }
+            /*
+             * rebuild packets which weren't preloaded in one piece, and
+             * edit a copy of packets in shared caches or sharing data
+             * with other packets
+             */
+            pktdata = packet_cache_direct(fc, next);
+            if (pktdata == NULL ||
+                    ((fc->readonly || fc->deduped) && packets_edited(options)))
+                pktdata = preload_cache_copy(fc, next, options->payload_fill,
+                        packets_edited(options));
+        } else if (fc->partial && cf != NULL) {
+            /*
+             * Stream the packets which didn't fit in the cache
+             */
+            pktdata = capfile_next(cf, pkthdr, info);
         }
     } else {
         /*
          * Read pcap file as normal
          */
-        pktdata = (u_char *)pcap_next(pcap, pkthdr);
+        pktdata = capfile_next(cf, pkthdr, info);
     }
 
     /* this get's casted to a const on the way out */
@@ -1017,42 +1392,83 @@ get_next_packet(tcpreplay_t *ctx, pcap_t *pcap, struct pcap_pkthdr *pkthdr, int
 }
 
 /**
- * determines based upon the cachedata which interface the given packet 
- * should go out.  Also rewrites any layer 2 data we might need to adjust.
- * Returns a void cased pointer to the ctx->intfX of the corresponding 
- * interface or NULL on error
+ * determines based upon the cachedata which direction the given packet
+ * should go.  Returns TCPR_DIR_NOSEND on error
  */
-void *
-cache_mode(tcpreplay_t *ctx, char *cachedata, COUNTER packet_num)
+static tcpr_dir_t
+cache_dir(tcpreplay_t *ctx, char *cachedata, COUNTER packet_num)
 {
     tcpreplay_opt_t *options = ctx->options;
-    void *sp = NULL;
-    int result;
+    tcpr_dir_t result;
 
     if (packet_num > options->cache_packets) {
         tcpreplay_seterr(ctx, "%s", "Exceeded number of packets in cache file.");
-        return NULL;
+        return TCPR_DIR_NOSEND;
     }
 
     result = check_cache(cachedata, packet_num);
     if (result == TCPR_DIR_NOSEND) {
         dbgx(2, "Cache: Not sending packet " COUNTER_SPEC ".", packet_num);
-        return NULL;
     }
     else if (result == TCPR_DIR_C2S) {
         dbgx(2, "Cache: Sending packet " COUNTER_SPEC " out primary interface.", packet_num);
-        sp = ctx->intf1;
     }
     else if (result == TCPR_DIR_S2C) {
         dbgx(2, "Cache: Sending packet " COUNTER_SPEC " out secondary interface.", packet_num);
-        sp = ctx->intf2;
     }
     else {
         tcpreplay_seterr(ctx, "Invalid cache value: %i", result);
-        return NULL;
+        result = TCPR_DIR_NOSEND;
     }
 
-    return sp;
+    return result;
+}
+
+/**
+ * Returns the interface for the given direction or NULL if
+ * the packet should not be sent
+ */
+static inline sendpacket_t *
+dir_to_intf(tcpreplay_t *ctx, int dir)
+{
+    if (dir == TCPR_DIR_C2S)
+        return ctx->intf1;
+    else if (dir == TCPR_DIR_S2C)
+        return ctx->intf2;
+
+    return NULL;
+}
+
+/**
+ * Returns the interface to send a packet captured on the given pcapng
+ * interface out of with --route-by-intf: the first capture interface
+ * goes to intf1, the second to intf2 and so on through the merge
+ * interfaces, wrapping around if there are more capture interfaces.
+ */
+static inline sendpacket_t *
+capture_intf(tcpreplay_t *ctx, uint32_t intf_id)
+{
+    int cnt = ctx->intf2 != NULL ? 2 + ctx->options->merge_intf_cnt : 1;
+    int i = (int)(intf_id % (uint32_t)cnt);
+
+    if (i == 0)
+        return ctx->intf1;
+    else if (i == 1)
+        return ctx->intf2;
+
+    return ctx->merge_intf[i - 2];
+}
+
+/**
+ * determines based upon the cachedata which interface the given packet 
+ * should go out.  Also rewrites any layer 2 data we might need to adjust.
+ * Returns a void cased pointer to the ctx->intfX of the corresponding 
+ * interface or NULL on error
+ */
+void *
+cache_mode(tcpreplay_t *ctx, char *cachedata, COUNTER packet_num)
+{
+    return dir_to_intf(ctx, cache_dir(ctx, cachedata, packet_num));
 }
 
 
@@ -1198,6 +1614,9 @@ static void tcpr_sleep(tcpreplay_t *ctx, sendpacket_t *sp,
     if (!timesisset(nap_this_time))
         return;
 
+    /* packets queued in io_uring shouldn't wait out the nap */
+    flush_send_queues(ctx, false);
+
     /* do we need to limit the total time we sleep? */
     if (timesisset(&(options->maxsleep)) && (timescmp(nap_this_time, &(options->maxsleep), >))) {
         dbgx(2, "Was going to sleep for " TIMESPEC_FORMAT " but maxsleeping for " TIMESPEC_FORMAT,
@@ -1235,6 +1654,73 @@ static void tcpr_sleep(tcpreplay_t *ctx, sendpacket_t *sp,
     }
 }
 
+/**
+ * With --txtime, works out when the packet should leave from the first
+ * packet's send time and the speed mode, and gives it to the interface
+ * for SO_TXTIME. Only sleeps while that is more than the lead away, so
+ * packets closer together are sent in one go and spaced by the kernel.
+ */
+static void
+txtime_schedule(tcpreplay_t *ctx, sendpacket_t *sp, struct timeval *pkt_time,
+        struct timeval *now)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    struct timespec ts;
+    struct timeval delta;
+    uint64_t now_ns, lead_ns, delta_ns;
+    double rate;
+
+    lead_ns = (uint64_t)options->txtime_lead * 1000;
+    clock_gettime(options->txtime_clock, &ts);
+    now_ns = TIMESPEC_TO_NANOSEC(&ts);
+
+    if (ctx->txtime_start == 0) {
+        /* give the first packet the whole lead */
+        ctx->txtime_start = ctx->txtime_last = now_ns + lead_ns;
+    } else {
+        switch (options->speed.mode) {
+        case speed_multiplier:
+            /* capture timestamps which go backwards don't move the time back */
+            if (timerisset(&ctx->stats.last_time) && timercmp(pkt_time, &ctx->stats.last_time, >)) {
+                timersub(pkt_time, &ctx->stats.last_time, &delta);
+                delta_ns = (uint64_t)(TIMEVAL_TO_NANOSEC(&delta) / options->speed.multiplier);
+                if (timesisset(&options->maxsleep) &&
+                        delta_ns > TIMESPEC_TO_NANOSEC(&options->maxsleep))
+                    delta_ns = TIMESPEC_TO_NANOSEC(&options->maxsleep);
+                ctx->txtime_last += delta_ns;
+            }
+            break;
+
+        case speed_mbpsrate:
+            /* bits per ns */
+            rate = (double)options->speed.speed / 1000000000.0;
+            ctx->txtime_last = ctx->txtime_start +
+                    (uint64_t)((double)ctx->stats.bytes_sent * 8 / rate);
+            break;
+
+        case speed_packetrate:
+            /* packets per ns, the --pps-multi bursts are evened out */
+            rate = (double)options->speed.speed *
+                    (options->speed.pps_multi > 0 ? options->speed.pps_multi : 1) / 1000000000.0;
+            ctx->txtime_last = ctx->txtime_start +
+                    (uint64_t)((double)ctx->stats.pkts_sent / rate);
+            break;
+
+        default:
+            /* not timed, leave now */
+            ctx->txtime_last = now_ns;
+            break;
+        }
+    }
+
+    sp->txtime = ctx->txtime_last;
+
+    if (ctx->txtime_last > now_ns + lead_ns) {
+        NANOSEC_TO_TIMESPEC(ctx->txtime_last - lead_ns - now_ns, &ctx->nap);
+        tcpr_sleep(ctx, sp, &ctx->nap, now, options->accurate);
+    }
+}
+
 /**
  * Ask the user how many packets they want to send.
  */
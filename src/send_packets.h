@@ -24,9 +24,32 @@
 #ifndef __SEND_PACKETS_H__
 #define __SEND_PACKETS_H__
 
-void send_packets(tcpreplay_t *ctx, pcap_t *pcap, int idx);
-void send_dual_packets(tcpreplay_t *ctx, pcap_t *pcap1, int idx1, pcap_t *pcap2, int idx2);
+void send_packets(tcpreplay_t *ctx, capfile_t *cf, int idx);
+/* a file being replayed at the same time as others */
+typedef struct merge_source_s {
+    capfile_t *cf;                  /* NULL if fully preloaded */
+    int idx;                        /* index of the source */
+    sendpacket_t *sp;               /* interface to send it out of */
+    /* private to send_merged_packets() */
+    struct pcap_pkthdr pkthdr;      /* next packet */
+    u_char *pktdata;
+    packet_cache_t *cached_packet;
+    COUNTER packetnum;
+    double vtime;                   /* weighted amount sent in a mix */
+    bool wrapped;                   /* has looped at least once in a mix */
+} merge_source_t;
+
+capfile_t *source_open(tcpreplay_t *ctx, int idx, off_t offset);
+capfile_t *source_open_file(const tcpreplay_opt_t *options, int idx, off_t offset,
+        char *errbuf);
+void source_prefetch(tcpreplay_t *ctx, int idx);
+void source_prefetch_cancel(tcpreplay_t *ctx);
+void flush_send_queues(tcpreplay_t *ctx, bool wait);
+int merge_source_open(tcpreplay_t *ctx, merge_source_t *src);
+void send_merged_packets(tcpreplay_t *ctx, merge_source_t *sources, int source_cnt);
 void *cache_mode(tcpreplay_t *ctx, char *cachedata, COUNTER packet_num);
 void preload_pcap_file(tcpreplay_t *ctx, int idx);
+int preload_pcap_read(tcpreplay_t *ctx, int idx, char *errbuf);
+void preload_pcap_account(tcpreplay_t *ctx, int idx);
 
 #endif
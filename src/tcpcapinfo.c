@@ -39,6 +39,8 @@
 #include "tcpcapinfo_opts.h"
 
 static int do_checksum_math(u_int16_t *data, int len);
+static void print_pcapng(const char *fname);
+static void write_index(const char *fname, COUNTER interval);
 
 #ifdef DEBUG
 int debug = 0;
@@ -94,6 +96,11 @@ struct pcap_sf_patched_pkthdr {
  */
 #define NSEC_TCPDUMP_MAGIC      0xa1b23c4d
 
+/*
+ * pcapng Section Header Block, which is the same in either byte order
+ */
+#define PCAPNG_MAGIC            0x0a0d0d0a
+
 
 int
 main(int argc, char *argv[])
@@ -119,6 +126,11 @@ main(int argc, char *argv[])
 
     for (i = 0; i < argc; i++) {
         dbgx(1, "processing:  %s\n", argv[i]);
+        if (HAVE_OPT(INDEX)) {
+            write_index(argv[i], OPT_VALUE_INDEX_INTERVAL);
+            continue;
+        }
+
         if ((fd = open(argv[i], O_RDONLY)) < 0)
             errx(-1, "Error opening file %s: %s", argv[i], strerror(errno));
 
@@ -186,6 +198,12 @@ main(int argc, char *argv[])
             swapped = 1;
             break;
 
+            case PCAPNG_MAGIC:
+            printf("magic       = 0x%08"PRIx32" (pcapng)\n", pcap_fh.magic);
+            close(fd);
+            print_pcapng(argv[i]);
+            continue;
+
             default:
             printf("magic       = 0x%08"PRIx32" (unknown)\n", pcap_fh.magic);
         }
@@ -331,6 +349,82 @@ main(int argc, char *argv[])
 
 }
 
+/**
+ * prints the packets of a pcapng file, with the interface each one was
+ * captured on and its timestamp in nanoseconds
+ */
+static void
+print_pcapng(const char *fname)
+{
+    capfile_t *cf;
+    char ebuf[PCAP_ERRBUF_SIZE];
+    struct pcap_pkthdr pkthdr;
+    capfile_pkt_t info;
+    u_char *pktdata;
+    uint64_t pktcnt = 0;
+    uint64_t last_ns = 0;
+    int backwards, caplentoobig;
+
+    if ((cf = capfile_open(fname, ebuf)) == NULL) {
+        printf("Error reading file: %s\n", ebuf);
+        return;
+    }
+
+    printf("snaplen     = %d\n", capfile_snapshot(cf));
+    printf("linktype    = 0x%08x\n", capfile_datalink(cf));
+    printf("Packet\tOrigLen\t\tCaplen\t\tTimestamp\t\t\tIntf\tCsum\tNote\n");
+
+    while ((pktdata = capfile_next(cf, &pkthdr, &info)) != NULL) {
+        pktcnt++;
+        backwards = info.ts_ns < last_ns;
+        caplentoobig = pkthdr.caplen > (uint32_t)capfile_snapshot(cf);
+        last_ns = info.ts_ns;
+
+        printf("%"PRIu64"\t%4"PRIu32"\t\t%4"PRIu32"\t\t%"PRIu64".%09"PRIu64"\t%4"PRIu32"\t%x\t",
+                pktcnt, pkthdr.len, pkthdr.caplen,
+                info.ts_ns / 1000000000, info.ts_ns % 1000000000, info.intf_id,
+                do_checksum_math((u_int16_t *)pktdata, pkthdr.caplen));
+
+        if (!backwards && !caplentoobig)
+            printf("OK\n");
+        else if (backwards && !caplentoobig)
+            printf("BAD_TS\n");
+        else if (caplentoobig && !backwards)
+            printf("TOOBIG\n");
+        else
+            printf("BAD_TS|TOOBIG\n");
+    }
+
+    if (capfile_geterr(cf) != NULL)
+        printf("%s\n", capfile_geterr(cf));
+
+    capfile_close(cf);
+}
+
+/**
+ * indexes a capture file for tcpreplay --start-time/--start-packet
+ */
+static void
+write_index(const char *fname, COUNTER interval)
+{
+    capindex_t *ci;
+    char ebuf[PCAP_ERRBUF_SIZE];
+    char *path;
+
+    if ((ci = capindex_build(fname, interval, ebuf)) == NULL)
+        errx(-1, "Error indexing %s: %s", fname, ebuf);
+
+    path = capindex_path(fname);
+    if (capindex_write(ci, path, ebuf) < 0)
+        errx(-1, "%s", ebuf);
+
+    printf("%s: " COUNTER_SPEC " packets, " COUNTER_SPEC " index entries written to %s\n",
+            fname, ci->packets, ci->entry_cnt, path);
+
+    safe_free(path);
+    capindex_free(ci);
+}
+
 /**
  * code to do a ones-compliment checksum
  */
@@ -44,6 +44,48 @@ static void randomize_ipv6_addr(tcpedit_t *tcpedit, struct tcpr_in6_addr *addr);
 static int remap_ipv6(tcpedit_t *tcpedit, tcpr_cidr_t *cidr, struct tcpr_in6_addr *addr);
 static int is_multicast_ipv6(tcpedit_t *tcpedit, struct tcpr_in6_addr *addr);
 
+/**
+ * will the sender fill in the L4 checksum? Only whole TCP and UDP
+ * packets with sane headers are, as checked by vnet_hdr_fill(), the
+ * others keep the checksum calculated here. 'l4_len' is the length of
+ * the L4 header and data.
+ */
+static bool
+l4_csum_offloaded(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr, int l2len, uint32_t l3len,
+        uint8_t proto, const u_char *l4, uint32_t l4_len, bool ipv4)
+{
+    uint32_t hdr_len, l4_hdr_len;
+
+    if (!tcpedit->csum_offload || l2len < 0)
+        return false;
+
+    hdr_len = (uint32_t)l2len + l3len;
+    if (hdr_len + l4_len > pkthdr->caplen)
+        return false;
+
+    switch (proto) {
+    case IPPROTO_TCP:
+        if (l4_len < TCPR_TCP_H)
+            return false;
+        l4_hdr_len = ((const tcp_hdr_t *)l4)->th_off << 2;
+        if (l4_hdr_len < TCPR_TCP_H || l4_hdr_len > l4_len)
+            return false;
+        break;
+
+    case IPPROTO_UDP:
+        /* a zero UDP checksum over IPv4 is left alone */
+        if (l4_len < TCPR_UDP_H || (ipv4 && ((const udp_hdr_t *)l4)->uh_sum == 0))
+            return false;
+        l4_hdr_len = TCPR_UDP_H;
+        break;
+
+    default:
+        return false;
+    }
+
+    return hdr_len + l4_hdr_len <= VNET_MAX_HDR_LEN;
+}
+
 /**
  * this code re-calcs the IP and Layer 4 checksums
  * the IMPORTANT THING is that the Layer 4 header 
@@ -54,16 +96,27 @@ static int is_multicast_ipv6(tcpedit_t *tcpedit, struct tcpr_in6_addr *addr);
  * Returns 0 on sucess, -1 on error
  */
 int
-fix_ipv4_checksums(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr, ipv4_hdr_t *ip_hdr)
+fix_ipv4_checksums(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr, int l2len,
+        ipv4_hdr_t *ip_hdr)
 {
     int ret1 = 0, ret2 = 0;
+    uint32_t l3len, ip_len;
+    bool offloaded;
     assert(tcpedit);
     assert(pkthdr);
     assert(ip_hdr);
     
+    /* the sender only does unfragmented packets with a sane IP header */
+    l3len = ip_hdr->ip_hl << 2;
+    ip_len = ntohs(ip_hdr->ip_len);
+    offloaded = ip_hdr->ip_v == 4 && l3len >= TCPR_IPV4_H && ip_len >= l3len &&
+            (ntohs(ip_hdr->ip_off) & (IP_MF | IP_OFFMASK)) == 0 &&
+            l4_csum_offloaded(tcpedit, pkthdr, l2len, l3len, ip_hdr->ip_p,
+                    (const u_char *)ip_hdr + l3len, ip_len - l3len, true);
 
     /* calc the L4 checksum if we have the whole packet && not a frag or first frag */
-    if (pkthdr->caplen == pkthdr->len && (htons(ip_hdr->ip_off) & IP_OFFMASK) == 0) {
+    if (pkthdr->caplen == pkthdr->len && (htons(ip_hdr->ip_off) & IP_OFFMASK) == 0 &&
+            !offloaded) {
         ret1 = do_checksum(tcpedit, (u_char *) ip_hdr, 
                 ip_hdr->ip_p, ntohs(ip_hdr->ip_len) - (ip_hdr->ip_hl << 2));
         if (ret1 < 0)
@@ -83,7 +136,8 @@ fix_ipv4_checksums(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr, ipv4_hdr_t *i
 }
 
 int
-fix_ipv6_checksums(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr, ipv6_hdr_t *ip6_hdr)
+fix_ipv6_checksums(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr, int l2len,
+        ipv6_hdr_t *ip6_hdr)
 {
     int ret = 0;
     assert(tcpedit);
@@ -92,7 +146,9 @@ fix_ipv6_checksums(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr, ipv6_hdr_t *i
 
 
     /* calc the L4 checksum if we have the whole packet && not a frag or first frag */
-    if (pkthdr->caplen == pkthdr->len) {
+    if (pkthdr->caplen == pkthdr->len &&
+            !l4_csum_offloaded(tcpedit, pkthdr, l2len, TCPR_IPV6_H, ip6_hdr->ip_nh,
+                    (const u_char *)ip6_hdr + TCPR_IPV6_H, ntohs(ip6_hdr->ip_len), false)) {
         ret = do_checksum(tcpedit, (u_char *) ip6_hdr, ip6_hdr->ip_nh,
             htons(ip6_hdr->ip_len));
         if (ret < 0)
@@ -140,6 +140,21 @@ tcpedit_set_fixcsum(tcpedit_t *tcpedit, bool value)
     return TCPEDIT_OK;
 }
 
+/**
+ * \brief leave TCP/UDP checksums to the sender's checksum offload?
+ *
+ * Only IP header checksums are then recalculated, for packets the
+ * sender marks for offload: unfragmented IPv4, or IPv6 without
+ * extension headers, carrying TCP or UDP
+ */
+int
+tcpedit_set_csum_offload(tcpedit_t *tcpedit, bool value)
+{
+    assert(tcpedit);
+    tcpedit->csum_offload = value;
+    return TCPEDIT_OK;
+}
+
 /**
  * \brief should we remove the EFCS from the frame?
  */
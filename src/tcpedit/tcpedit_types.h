@@ -123,6 +123,9 @@ typedef struct {
     /* fix IP/TCP/UDP checksums */
     bool fixcsum;
 
+    /* TCP/UDP checksums are filled in when the packet is sent */
+    bool csum_offload;
+
     /* remove ethernet FCS */
     bool efcs;
 
@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
 
@@ -43,6 +44,7 @@ tcpedit_t *tcpedit;
 #endif
 
 #include "send_packets.h"
+#include "preload.h"
 #include "replay.h"
 #include "signal_handler.h"
 
@@ -99,30 +101,52 @@ main(int argc, char *argv[])
         errx(-1, "Unable to edit packets given options:\n%s",
                tcpedit_geterr(tcpedit));
     }
+
+    /* the kernel fills in the TCP/UDP checksums, don't sum every payload */
+    if (ctx->options->offload & VNET_OFFLOAD_CSUM)
+        tcpedit_set_csum_offload(tcpedit, true);
 #endif
 
+    /* before preloading, so the cache is allocated near the NIC */
+    if (tcpreplay_apply_affinity(ctx) < 0)
+        errx(-1, "%s", tcpreplay_geterr(ctx));
+
     if (ctx->options->preload_pcap && ! HAVE_OPT(QUIET)) {
         notice("File Cache is enabled");
     }
 
-    /*
-     * Setup up the file cache, if required
-     */
-    if (ctx->options->preload_pcap) {
-        /* Initialise each of the file cache structures */
-        for (i = 0; i < argc; i++) {
-            ctx->options->file_cache[i].index = i;
-            ctx->options->file_cache[i].cached = FALSE;
-            ctx->options->file_cache[i].packet_cache = NULL;
+    /* directories are expanded to the capture files in them */
+    for (i = 0; i < argc; i++) {
+        struct stat st;
+
+        if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+            if (HAVE_OPT(MIX))
+                errx(-1, "--mix needs a weight for each file, not directory %s", argv[i]);
+            rcode = tcpreplay_add_pcapdir(ctx, argv[i]);
+        } else {
+            rcode = tcpreplay_add_pcapfile(ctx, argv[i]);
         }
+
+        if (rcode < 0)
+            errx(-1, "%s", tcpreplay_geterr(ctx));
     }
 
-    for (i = 0; i < argc; i++) {
-        tcpreplay_add_pcapfile(ctx, argv[i]);
+    if (HAVE_OPT(MANIFEST) && tcpreplay_add_manifest(ctx, OPT_ARG(MANIFEST)) < 0)
+        errx(-1, "%s", tcpreplay_geterr(ctx));
 
-        /* preload our pcap file? */
-        if (ctx->options->preload_pcap) {
-            preload_pcap_file(ctx, i);
+    /* preload our pcap files, or map them from a shared cache or replay image */
+    if (ctx->options->preload_pcap) {
+        switch (preload_sources(ctx)) {
+        case preload_from_shared:
+            if (! HAVE_OPT(QUIET))
+                notice("Using shared preload cache %s", ctx->options->preload_shared);
+            break;
+        case preload_from_image:
+            if (! HAVE_OPT(QUIET))
+                notice("Loaded replay image %s", ctx->options->preload_image);
+            break;
+        default:
+            break;
         }
     }
 
@@ -153,6 +177,10 @@ main(int argc, char *argv[])
             sendpacket_getstat(ctx->intf2, buf, sizeof(buf));
             printf("%s", buf);
         }
+        for (i = 0; i < ctx->options->merge_intf_cnt; i++) {
+            sendpacket_getstat(ctx->merge_intf[i], buf, sizeof(buf));
+            printf("%s", buf);
+        }
     }
     tcpreplay_close(ctx);
     return 0;
@@ -197,6 +225,14 @@ flow_stats(const tcpreplay_t *ctx, bool unique_ip)
     flow_packets  = stats->flow_packets * ctx->iteration;
     flow_non_flow_packets = stats->flow_non_flow_packets * ctx->iteration;
 
+    /* preloaded flows were counted before being multiplied */
+    if (ctx->options->preload_pcap && ctx->options->flow_multiplier > 1) {
+        flows_total *= ctx->options->flow_multiplier;
+        flows_unique *= ctx->options->flow_multiplier;
+        flows_expired *= ctx->options->flow_multiplier;
+        flow_packets *= ctx->options->flow_multiplier;
+    }
+
     if (diff_us) {
         COUNTER flows_sec_X100;
 
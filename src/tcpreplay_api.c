@@ -18,6 +18,10 @@
  *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* sched_setaffinity() */
+#endif
+
 #include "config.h"
 #include "defines.h"
 #include "common.h"
@@ -31,9 +35,19 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef HAVE_GETRUSAGE
+#include <sys/resource.h>
+#endif
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
 
 #include "tcpreplay_api.h"
 #include "send_packets.h"
+#include "preload.h"
 #include "replay.h"
 
 #ifdef TCPREPLAY_EDIT
@@ -42,6 +56,7 @@
 #include "tcpreplay_opts.h"
 #endif
 
+static void sources_reserve(tcpreplay_t *ctx, int cnt);
 
 
 /**
@@ -86,6 +101,7 @@ tcpreplay_init()
 
     /* replay packets only once */
     ctx->options->loop = 1;
+    ctx->options->flow_multiplier = 1;
 
     /* Default mode is to replay pcap once in real-time */
     ctx->options->speed.mode = speed_multiplier;
@@ -94,6 +110,7 @@ tcpreplay_init()
 
     /* Set the default timing method */
     ctx->options->accurate = accurate_gtod;
+    ctx->options->txtime_clock = CLOCK_MONOTONIC;
 
     /* set the default MTU size */
     ctx->options->mtu = DEFAULT_MTU;
@@ -131,6 +148,43 @@ tcpreplay_init()
     return ctx;
 }
 
+/**
+ * Opens the --merge-intf interfaces which aren't open yet. They must
+ * have the same DLT as intf1. Returns 0 on success, -1 on error
+ */
+static int
+open_merge_intfs(tcpreplay_t *ctx, char *ebuf)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    char *intname;
+    int i, dlt;
+
+    for (i = 0; i < options->merge_intf_cnt; i++) {
+        if (ctx->merge_intf[i] != NULL)
+            continue;
+
+        if ((intname = get_interface(ctx->intlist, options->merge_intf_names[i])) == NULL) {
+            tcpreplay_seterr(ctx, "Invalid interface name/alias: %s", options->merge_intf_names[i]);
+            return -1;
+        }
+
+        if ((ctx->merge_intf[i] = sendpacket_open(intname, ebuf, TCPR_DIR_S2C, ctx->sp_type, ctx)) == NULL) {
+            tcpreplay_seterr(ctx, "Can't open %s: %s", intname, ebuf);
+            return -1;
+        }
+
+        dlt = sendpacket_get_dlt(ctx->merge_intf[i]);
+        if (dlt != sendpacket_get_dlt(ctx->intf1)) {
+            tcpreplay_seterr(ctx, "DLT type mismatch for %s (%s) and %s (%s)",
+                options->intf1_name, pcap_datalink_val_to_name(sendpacket_get_dlt(ctx->intf1)),
+                intname, pcap_datalink_val_to_name(dlt));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 /**
  * \brief Parses the GNU AutoOpts options for tcpreplay
  *
@@ -146,6 +200,7 @@ tcpreplay_post_args(tcpreplay_t *ctx, int argc)
     tcpreplay_opt_t *options;
     int warn = 0;
     float n;
+    double secs;
     int ret = 0;
 
     options = ctx->options;
@@ -171,6 +226,29 @@ tcpreplay_post_args(tcpreplay_t *ctx, int argc)
     if (HAVE_OPT(DURATION))
         options->limit_time = OPT_VALUE_DURATION;
 
+    if (HAVE_OPT(START_PACKET))
+        options->start_packet = OPT_VALUE_START_PACKET;
+
+    if (HAVE_OPT(START_TIME)) {
+        secs = atof(OPT_ARG(START_TIME));
+        if (secs < 0) {
+            tcpreplay_seterr(ctx, "invalid start time: %s", OPT_ARG(START_TIME));
+            ret = -1;
+            goto out;
+        }
+        options->start_time_us = (COUNTER)(secs * 1000000.0);
+    }
+
+    if (HAVE_OPT(END_TIME)) {
+        secs = atof(OPT_ARG(END_TIME));
+        if (secs <= 0 || (COUNTER)(secs * 1000000.0) <= options->start_time_us) {
+            tcpreplay_seterr(ctx, "invalid end time: %s", OPT_ARG(END_TIME));
+            ret = -1;
+            goto out;
+        }
+        options->end_time_us = (COUNTER)(secs * 1000000.0);
+    }
+
     if (HAVE_OPT(TOPSPEED)) {
         options->speed.mode = speed_topspeed;
         options->speed.speed = 0;
@@ -219,21 +297,112 @@ tcpreplay_post_args(tcpreplay_t *ctx, int argc)
         options->preload_pcap = true;
     }
 
+    if (HAVE_OPT(PRELOAD_IMAGE)) {
+        options->preload_pcap = true;
+        options->preload_image = safe_strdup(OPT_ARG(PRELOAD_IMAGE));
+    }
+
+    if (HAVE_OPT(PRELOAD_SHARED)) {
+        options->preload_pcap = true;
+        options->preload_shared = safe_strdup(OPT_ARG(PRELOAD_SHARED));
+    }
+
+    if (HAVE_OPT(PRELOAD_THREADS))
+        options->preload_threads = OPT_VALUE_PRELOAD_THREADS;
+
+    if (HAVE_OPT(PRELOAD_LIMIT)) {
+        options->preload_pcap = true;
+        options->preload_limit = (size_t)OPT_VALUE_PRELOAD_LIMIT * 1024 * 1024;
+    }
+
+    if (HAVE_OPT(DIRECT_IO))
+        options->direct_io = OPT_VALUE_DIRECT_IO;
+
+    if (HAVE_OPT(PRELOAD_HEADERS)) {
+        options->preload_pcap = true;
+        options->preload_headers = true;
+        options->payload_fill = (u_char)OPT_VALUE_PRELOAD_HEADERS;
+    }
+
+    if (HAVE_OPT(PRELOAD_DEDUP)) {
+        options->preload_pcap = true;
+        options->preload_dedup = true;
+    }
+
+    if (HAVE_OPT(PRELOAD_HUGEPAGES)) {
+        options->preload_pcap = true;
+        if (strcmp(OPT_ARG(PRELOAD_HUGEPAGES), "2M") == 0) {
+            options->preload_hugepages = 2 * 1024 * 1024;
+        } else if (strcmp(OPT_ARG(PRELOAD_HUGEPAGES), "1G") == 0) {
+            options->preload_hugepages = 1024 * 1024 * 1024;
+        } else {
+            tcpreplay_seterr(ctx, "Unsupported huge page size: %s",
+                    OPT_ARG(PRELOAD_HUGEPAGES));
+            ret = -1;
+            goto out;
+        }
+    }
+
+    if (HAVE_OPT(PRELOAD_MLOCK)) {
+        options->preload_pcap = true;
+        options->preload_mlock = true;
+    }
+
+    if (HAVE_OPT(CPU_AFFINITY))
+        options->cpu_affinity = safe_strdup(OPT_ARG(CPU_AFFINITY));
+
+    if (HAVE_OPT(NUMA_NODE)) {
+        options->numa_bind = true;
+        options->numa_node = OPT_VALUE_NUMA_NODE;
+    }
+
     /* Dual file mode */
-    if (HAVE_OPT(DUALFILE)) {
+    /* the number of files is checked once directories and manifests are read */
+    if (HAVE_OPT(DUALFILE))
         options->dualfile = true;
-        if (argc < 2) {
-            tcpreplay_seterr(ctx, "%s", "--dualfile mode requires at least two pcap files");
+
+    /* Weighted mix of files */
+    if (HAVE_OPT(MIX)) {
+        char *list = safe_strdup(OPT_ARG(MIX));
+        char *tok, *end, *save = NULL;
+        int i = 0;
+
+        options->mix = true;
+        options->mergefile = true;
+        for (tok = strtok_r(list, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+            unsigned long weight = strtoul(tok, &end, 10);
+
+            if (*end != '\0' || weight == 0 || weight > UINT32_MAX) {
+                i = -1;
+                break;
+            }
+            sources_reserve(ctx, i + 1);
+            options->sources[i++].weight = (uint32_t)weight;
+        }
+        safe_free(list);
+
+        if (i != argc) {
+            tcpreplay_seterr(ctx, "--mix needs a positive weight for each of the %d pcap files", argc);
             ret = -1;
             goto out;
         }
-        if (argc % 2 != 0) {
-            tcpreplay_seterr(ctx, "%s", "--dualfile mode requires an even number of pcap files");
+
+        if (options->speed.mode != speed_mbpsrate &&
+                options->speed.mode != speed_packetrate &&
+                options->speed.mode != speed_topspeed) {
+            tcpreplay_seterr(ctx, "%s", "--mix requires --mbps, --pps or --topspeed");
             ret = -1;
             goto out;
         }
     }
 
+    /* Merged file mode */
+    if (HAVE_OPT(MERGEFILE))
+        options->mergefile = true;
+
+    if (HAVE_OPT(ROUTE_BY_INTF))
+        options->route_by_intf = true;
+
     if (HAVE_OPT(QUICK_TX)) {
 #ifdef HAVE_QUICK_TX
         if (HAVE_OPT(NETMAP)) {
@@ -272,9 +441,80 @@ tcpreplay_post_args(tcpreplay_t *ctx, int argc)
 #endif
     }
 
+    if (HAVE_OPT(TUNTAP_QUEUES))
+        options->tuntap_queues = OPT_VALUE_TUNTAP_QUEUES;
+
+    if (HAVE_OPT(OFFLOAD)) {
+        if ((options->offload = vnet_parse_offload(OPT_ARG(OFFLOAD))) < 0) {
+            tcpreplay_seterr(ctx, "Invalid offload list, expected csum and/or gso: %s",
+                    OPT_ARG(OFFLOAD));
+            ret = -1;
+            goto out;
+        }
+    }
+
+#ifdef HAVE_IO_URING
+    if (HAVE_OPT(IO_URING)) {
+        options->io_uring = OPT_VALUE_IO_URING;
+        options->io_uring_sqpoll = HAVE_OPT(IO_URING_SQPOLL);
+    }
+#endif
+
+#ifdef HAVE_SO_TXTIME
+    if (HAVE_OPT(TXTIME)) {
+        if (options->speed.mode != speed_multiplier &&
+                options->speed.mode != speed_mbpsrate &&
+                options->speed.mode != speed_packetrate) {
+            tcpreplay_seterr(ctx, "%s", "--txtime requires --multiplier, --mbps or --pps");
+            ret = -1;
+            goto out;
+        }
+
+        if (options->io_uring) {
+            tcpreplay_seterr(ctx, "%s", "--txtime can't be used with --io-uring");
+            ret = -1;
+            goto out;
+        }
+        options->txtime_lead = OPT_VALUE_TXTIME;
+
+        if (HAVE_OPT(TXTIME_CLOCK)) {
+            if (strcmp(OPT_ARG(TXTIME_CLOCK), "monotonic") == 0) {
+                options->txtime_clock = CLOCK_MONOTONIC;
+            } else if (strcmp(OPT_ARG(TXTIME_CLOCK), "tai") == 0) {
+                options->txtime_clock = CLOCK_TAI;
+            } else {
+                tcpreplay_seterr(ctx, "Invalid --txtime-clock, expected monotonic or tai: %s",
+                        OPT_ARG(TXTIME_CLOCK));
+                ret = -1;
+                goto out;
+            }
+        }
+    }
+#endif
+
+#ifdef HAVE_TX_TIMESTAMPING
+    if (HAVE_OPT(TXSTAMP)) {
+        if (options->io_uring) {
+            tcpreplay_seterr(ctx, "%s", "--txstamp can't be used with --io-uring");
+            ret = -1;
+            goto out;
+        }
+        options->txstamp = true;
+        options->txstamp_hw = HAVE_OPT(TXSTAMP_HW);
+    }
+#endif
+
     if (HAVE_OPT(UNIQUE_IP))
         options->unique_ip = 1;
 
+    if (HAVE_OPT(FLOW_MULTIPLIER))
+        options->flow_multiplier = OPT_VALUE_FLOW_MULTIPLIER;
+
+    if (HAVE_OPT(IDLE_COMPRESS)) {
+        options->idle_compress = true;
+        options->idle_compress_us = (COUNTER)OPT_VALUE_IDLE_COMPRESS * 1000;
+    }
+
     /* flow statistics */
     if (HAVE_OPT(NO_FLOW_STATS))
         options->flow_stats = 0;
@@ -386,8 +626,9 @@ tcpreplay_post_args(tcpreplay_t *ctx, int argc)
     ctx->intf1dlt = sendpacket_get_dlt(ctx->intf1);
 
     if (HAVE_OPT(INTF2)) {
-        if (!HAVE_OPT(CACHEFILE) && !HAVE_OPT(DUALFILE)) {
-            tcpreplay_seterr(ctx, "--intf2=%s requires either --cachefile or --dualfile", OPT_ARG(INTF2));
+        if (!HAVE_OPT(CACHEFILE) && !HAVE_OPT(DUALFILE) && !options->mergefile &&
+                !options->route_by_intf) {
+            tcpreplay_seterr(ctx, "--intf2=%s requires either --cachefile, --dualfile, --mergefile, --mix or --route-by-intf", OPT_ARG(INTF2));
             ret = -1;
             goto out;
         }
@@ -422,6 +663,31 @@ tcpreplay_post_args(tcpreplay_t *ctx, int argc)
         }
     }
 
+    if (HAVE_OPT(MERGE_INTF)) {
+        int ct = STACKCT_OPT(MERGE_INTF);
+        char **list = (char **)STACKLST_OPT(MERGE_INTF);
+
+        if (!options->mergefile && !options->route_by_intf) {
+            tcpreplay_seterr(ctx, "%s", "--merge-intf requires either --mergefile, --mix or --route-by-intf");
+            ret = -1;
+            goto out;
+        }
+
+        if (ct > MAX_MERGE_INTF) {
+            tcpreplay_seterr(ctx, "--merge-intf may only be used %d times", MAX_MERGE_INTF);
+            ret = -1;
+            goto out;
+        }
+
+        while (ct-- > 0)
+            options->merge_intf_names[options->merge_intf_cnt++] = safe_strdup(*list++);
+
+        if (open_merge_intfs(ctx, ebuf) < 0) {
+            ret = -1;
+            goto out;
+        }
+    }
+
     if (HAVE_OPT(CACHEFILE)) {
         temp = safe_strdup(OPT_ARG(CACHEFILE));
         options->cache_packets = read_cache(&options->cachedata, temp,
@@ -447,7 +713,7 @@ tcpreplay_close(tcpreplay_t *ctx)
 {
     tcpreplay_opt_t *options;
     interface_list_t *intlist, *intlistnext;
-    packet_cache_t *packet_cache, *next;
+    int i;
 
     assert(ctx);
     assert(ctx->options);
@@ -458,6 +724,11 @@ tcpreplay_close(tcpreplay_t *ctx)
     sendpacket_close(ctx->intf1);
     if (ctx->intf2 != NULL)
         sendpacket_close(ctx->intf2);
+    for (i = 0; i < options->merge_intf_cnt; i++) {
+        safe_free(options->merge_intf_names[i]);
+        if (ctx->merge_intf[i] != NULL)
+            sendpacket_close(ctx->merge_intf[i]);
+    }
     safe_free(options->cachedata);
     safe_free(options->comment);
 
@@ -469,14 +740,23 @@ tcpreplay_close(tcpreplay_t *ctx)
     /* free the flow hash table */
     flow_hash_table_release(ctx->flow_hash_table);
 
-    /* free the file cache */
-    packet_cache = options->file_cache->packet_cache;
-    while (packet_cache != NULL) {
-    	next = packet_cache->next;
-    	safe_free(packet_cache->pktdata);
-    	safe_free(packet_cache);
-    	packet_cache = next;
+    /* a file may still be opening for the next turn */
+    source_prefetch_cancel(ctx);
+
+    /* free the file cache and the sources */
+    for (i = 0; i < options->source_cnt; i++) {
+        preload_cache_free(&options->file_cache[i]);
+        safe_free(options->sources[i].filename);
     }
+    safe_free(options->file_cache);
+    safe_free(options->sources);
+    options->source_cnt = options->source_alloc = 0;
+
+    preload_image_close(ctx);
+    safe_free(options->preload_image);
+    safe_free(options->preload_shared);
+    safe_free(options->cpu_affinity);
+    safe_free(ctx->send_cpus);
 
     /* free our interface list */
     if (ctx->intlist != NULL) {
@@ -618,6 +898,65 @@ tcpreplay_set_loop(tcpreplay_t *ctx, u_int32_t value)
     return 0;
 }
 
+/**
+ * Set the number of address shifted copies of each packet to send
+ */
+int
+tcpreplay_set_flow_multiplier(tcpreplay_t *ctx, uint32_t value)
+{
+    assert(ctx);
+
+    if (value < 1 || value > 65535) {
+        tcpreplay_seterr(ctx, "invalid flow multiplier: %u", value);
+        return -1;
+    }
+
+    ctx->options->flow_multiplier = value;
+    return 0;
+}
+
+/**
+ * Only send part of each file: from packet number 'start_packet' or
+ * from 'start_us' microseconds after the first packet, up to 'end_us'
+ * microseconds after the first packet. 0 leaves a bound open. Files
+ * indexed with tcpcapinfo --index are seeked rather than read up to
+ * the start.
+ */
+int
+tcpreplay_set_window(tcpreplay_t *ctx, COUNTER start_packet, COUNTER start_us, COUNTER end_us)
+{
+    assert(ctx);
+
+    if (start_packet && start_us) {
+        tcpreplay_seterr(ctx, "%s", "can't start at both a packet number and a time");
+        return -1;
+    }
+
+    if (end_us && end_us <= start_us) {
+        tcpreplay_seterr(ctx, "%s", "end time must come after the start time");
+        return -1;
+    }
+
+    ctx->options->start_packet = start_packet;
+    ctx->options->start_time_us = start_us;
+    ctx->options->end_time_us = end_us;
+    return 0;
+}
+
+/**
+ * Shorten the periods where no flow is active to 'usec' microseconds
+ *
+ * Requires the pcap files to be preloaded.
+ */
+int
+tcpreplay_set_idle_compress(tcpreplay_t *ctx, bool value, COUNTER usec)
+{
+    assert(ctx);
+    ctx->options->idle_compress = value;
+    ctx->options->idle_compress_us = usec;
+    return 0;
+}
+
 /**
  * Set the unique IP address flag
  */
@@ -661,6 +1000,105 @@ tcpreplay_set_netmap(tcpreplay_t *ctx, bool value)
 #endif
 }
 
+/**
+ * \brief Spread packets over several queues of tuntap devices
+ *
+ * Takes effect in tcpreplay_replay()
+ */
+int
+tcpreplay_set_tuntap_queues(tcpreplay_t *ctx, int queues)
+{
+    assert(ctx);
+
+    if (queues < 0 || queues > SENDPACKET_MAX_QUEUES) {
+        tcpreplay_seterr(ctx, "tuntap queues must be 1 to %d", SENDPACKET_MAX_QUEUES);
+        return -1;
+    }
+
+    ctx->options->tuntap_queues = queues;
+    return 0;
+}
+
+/**
+ * \brief Have the kernel do the given VNET_OFFLOAD_* offloads
+ *
+ * 0 turns them off. Takes effect in tcpreplay_replay()
+ */
+int
+tcpreplay_set_offload(tcpreplay_t *ctx, int offload)
+{
+    assert(ctx);
+
+    if (offload & ~(VNET_OFFLOAD_CSUM | VNET_OFFLOAD_GSO)) {
+        tcpreplay_seterr(ctx, "invalid offload mask: 0x%x", offload);
+        return -1;
+    }
+
+    ctx->options->offload = offload;
+    return 0;
+}
+
+/**
+ * \brief Send packets through io_uring with 'depth' buffers
+ *
+ * 0 makes a syscall per packet. With 'sqpoll' a kernel thread submits
+ * the packets. Takes effect in tcpreplay_replay()
+ */
+int
+tcpreplay_set_io_uring(tcpreplay_t *ctx, unsigned int depth, bool sqpoll)
+{
+    assert(ctx);
+
+    if (depth != 0 && (depth < URING_MIN_DEPTH || depth > URING_MAX_DEPTH)) {
+        tcpreplay_seterr(ctx, "io_uring depth must be %d to %d", URING_MIN_DEPTH,
+                URING_MAX_DEPTH);
+        return -1;
+    }
+
+    ctx->options->io_uring = depth;
+    ctx->options->io_uring_sqpoll = sqpoll;
+    return 0;
+}
+
+/**
+ * \brief Have the kernel send packets at their time with SO_TXTIME
+ *
+ * Packets are handed over up to 'lead_us' early, with their send time
+ * in 'clock'. 0 sleeps between packets instead. Takes effect in
+ * tcpreplay_replay()
+ */
+int
+tcpreplay_set_txtime(tcpreplay_t *ctx, uint32_t lead_us, clockid_t clock)
+{
+    assert(ctx);
+
+    if (clock != CLOCK_MONOTONIC && clock != CLOCK_TAI) {
+        tcpreplay_seterr(ctx, "invalid SO_TXTIME clock: %d", (int)clock);
+        return -1;
+    }
+
+    ctx->options->txtime_lead = lead_us;
+    ctx->options->txtime_clock = clock;
+    return 0;
+}
+
+/**
+ * \brief Measure when packets leave with transmit timestamps
+ *
+ * Uses the NIC's timestamps with 'hw', otherwise the kernel's. The
+ * results are printed by sendpacket_getstat(). Takes effect in
+ * tcpreplay_replay()
+ */
+int
+tcpreplay_set_txstamp(tcpreplay_t *ctx, bool value, bool hw)
+{
+    assert(ctx);
+
+    ctx->options->txstamp = value;
+    ctx->options->txstamp_hw = hw;
+    return 0;
+}
+
 /**
  * Tell tcpreplay to ignore the snaplen (default) and use the "actual"
  * packet len instead
@@ -722,79 +1160,556 @@ tcpreplay_set_dualfile(tcpreplay_t *ctx, bool value)
 }
 
 /**
- * \brief Enable or disable preloading the file cache 
+ * \brief Enable or disable merged file mode
  *
- * Note: This is a global option and forces all pcaps
- * to be preloaded for this context.  If you turn this
- * on, then it forces set_file_cache(true)
+ * In merged file mode, all the files are read at the same time and
+ * their packets sent in timestamp order, each file out of one of the
+ * interfaces in turn: intf1, intf2, then any added by
+ * tcpreplay_add_merge_intf()
  */
 int
-tcpreplay_set_preload_pcap(tcpreplay_t *ctx, bool value)
+tcpreplay_set_mergefile(tcpreplay_t *ctx, bool value)
 {
     assert(ctx);
-    ctx->options->preload_pcap = value;
+    ctx->options->mergefile = value;
     return 0;
 }
 
 /**
- * \brief Add a pcap file to be sent via tcpreplay
+ * \brief Set the weight of a source in a traffic mix
  *
- * One or more pcap files can be added.  Each file will be replayed
- * in order
+ * Enables merged file mode, mixing sources by weight rather than by
+ * timestamp. Every source needs a weight, and the speed mode must
+ * be speed_mbpsrate, speed_packetrate or speed_topspeed.
  */
 int
-tcpreplay_add_pcapfile(tcpreplay_t *ctx, char *pcap_file)
+tcpreplay_set_mix_weight(tcpreplay_t *ctx, int idx, uint32_t weight)
 {
     assert(ctx);
-    assert(pcap_file);
 
-    if (ctx->options->source_cnt < MAX_FILES) {
-        ctx->options->sources[ctx->options->source_cnt].filename = safe_strdup(pcap_file);
-        ctx->options->sources[ctx->options->source_cnt].type = source_filename;
-
-        /*
-         * prepare the cache info data struct.  This doesn't actually enable
-         * file caching for this pcap (that is controlled globally via
-         * tcpreplay_set_file_cache())
-         */
-        ctx->options->file_cache[ctx->options->source_cnt].index = ctx->options->source_cnt;
-        ctx->options->file_cache[ctx->options->source_cnt].cached = false;
-        ctx->options->file_cache[ctx->options->source_cnt].packet_cache = NULL;
+    if (idx < 0 || weight == 0) {
+        tcpreplay_seterr(ctx, "invalid mix weight %u for source %d", weight, idx);
+        return -1;
+    }
 
-        ctx->options->source_cnt += 1;
+    sources_reserve(ctx, idx + 1);
+    ctx->options->sources[idx].weight = weight;
+    ctx->options->mix = true;
+    ctx->options->mergefile = true;
+    return 0;
+}
 
+/**
+ * \brief Add an interface to send merged files out of
+ *
+ * Interfaces are opened by tcpreplay_prepare()
+ */
+int
+tcpreplay_add_merge_intf(tcpreplay_t *ctx, char *value)
+{
+    assert(ctx);
+    assert(value);
 
-    } else {
-        tcpreplay_seterr(ctx, "Unable to add more then %u files", MAX_FILES);
+    if (ctx->options->merge_intf_cnt >= MAX_MERGE_INTF) {
+        tcpreplay_seterr(ctx, "Too many merge interfaces, max is %d", MAX_MERGE_INTF);
         return -1;
     }
+
+    ctx->options->merge_intf_names[ctx->options->merge_intf_cnt++] = safe_strdup(value);
     return 0;
 }
 
 /**
- * Limit the total number of packets to send
+ * \brief Send packets out of the interface matching their pcapng capture interface
+ *
+ * The first capture interface maps to intf1, the second to intf2 and
+ * the rest to the interfaces added by tcpreplay_add_merge_intf()
  */
 int
-tcpreplay_set_limit_send(tcpreplay_t *ctx, COUNTER value)
+tcpreplay_set_route_by_intf(tcpreplay_t *ctx, bool value)
 {
     assert(ctx);
-    ctx->options->limit_send = value;
+    ctx->options->route_by_intf = value;
     return 0;
 }
 
 /**
- * \brief Specify the tcpprep cache file to use for replaying with two NICs
+ * \brief Enable or disable preloading the file cache 
  *
- * Note: this only works if you have a single pcap file
- * returns -1 on error
+ * Note: This is a global option and forces all pcaps
+ * to be preloaded for this context.  If you turn this
+ * on, then it forces set_file_cache(true)
  */
 int
-tcpreplay_set_tcpprep_cache(tcpreplay_t *ctx, char *file)
+tcpreplay_set_preload_pcap(tcpreplay_t *ctx, bool value)
 {
     assert(ctx);
-    char *tcpprep_file;
+    ctx->options->preload_pcap = value;
+    return 0;
+}
 
-    if (ctx->options->source_cnt > 1) {
+/**
+ * \brief Save and load the preloaded pcaps to/from a replay image
+ *
+ * If the image exists and matches the pcap files, it is mapped instead
+ * of preloading the pcaps, otherwise the pcaps are preloaded and saved
+ * to it. A shared cache, see tcpreplay_set_preload_shared(), is tried
+ * first. Forces set_preload_pcap(true)
+ */
+int
+tcpreplay_set_preload_image(tcpreplay_t *ctx, char *value)
+{
+    assert(ctx);
+    assert(value);
+
+    safe_free(ctx->options->preload_image);
+    ctx->options->preload_image = safe_strdup(value);
+    ctx->options->preload_pcap = true;
+    return 0;
+}
+
+/**
+ * \brief Share the preloaded pcaps with other processes
+ *
+ * 'value' names a POSIX shared memory object, or is the path of a file
+ * on tmpfs or hugetlbfs. The first process to use it preloads the pcaps
+ * into it, later ones map it read-only. Forces set_preload_pcap(true)
+ */
+int
+tcpreplay_set_preload_shared(tcpreplay_t *ctx, char *value)
+{
+    assert(ctx);
+    assert(value);
+
+    safe_free(ctx->options->preload_shared);
+    ctx->options->preload_shared = safe_strdup(value);
+    ctx->options->preload_pcap = true;
+    return 0;
+}
+
+/**
+ * \brief Set the number of threads used to preload pcap files
+ *
+ * 0 uses one thread per CPU, 1 preloads the files one at a time
+ */
+int
+tcpreplay_set_preload_threads(tcpreplay_t *ctx, int value)
+{
+    assert(ctx);
+
+    if (value < 0) {
+        tcpreplay_seterr(ctx, "invalid number of preload threads: %d", value);
+        return -1;
+    }
+
+    ctx->options->preload_threads = value;
+    return 0;
+}
+
+/**
+ * \brief Read pcap files with O_DIRECT through 'value' read ahead buffers
+ *
+ * 0 reads files through the page cache
+ */
+int
+tcpreplay_set_direct_io(tcpreplay_t *ctx, int value)
+{
+    assert(ctx);
+
+    if (value != 0 && (value < DIRECTIO_MIN_DEPTH || value > DIRECTIO_MAX_DEPTH)) {
+        tcpreplay_seterr(ctx, "direct I/O buffers must be %d to %d", DIRECTIO_MIN_DEPTH,
+                DIRECTIO_MAX_DEPTH);
+        return -1;
+    }
+
+    ctx->options->direct_io = value;
+    return 0;
+}
+
+/**
+ * \brief Limit the memory used to preload pcap files
+ *
+ * Files are cached in order until the limit (in bytes) is reached, the
+ * rest of each file is streamed from disk. 0 disables the limit.
+ * Forces set_preload_pcap(true) when enabled
+ */
+int
+tcpreplay_set_preload_limit(tcpreplay_t *ctx, size_t value)
+{
+    assert(ctx);
+
+    ctx->options->preload_limit = value;
+    if (value)
+        ctx->options->preload_pcap = true;
+
+    return 0;
+}
+
+/**
+ * \brief Preload only the headers of TCP, UDP and ICMP packets
+ *
+ * Payloads are replaced by the payload fill byte when sent, and the
+ * L4 checksums updated to match. Forces set_preload_pcap(true) when enabled
+ */
+int
+tcpreplay_set_preload_headers(tcpreplay_t *ctx, bool value)
+{
+    assert(ctx);
+
+    ctx->options->preload_headers = value;
+    if (value)
+        ctx->options->preload_pcap = true;
+
+    return 0;
+}
+
+/**
+ * \brief Share the data of identical packets in the preload cache
+ *
+ * Forces set_preload_pcap(true) when enabled
+ */
+int
+tcpreplay_set_preload_dedup(tcpreplay_t *ctx, bool value)
+{
+    assert(ctx);
+
+    ctx->options->preload_dedup = value;
+    if (value)
+        ctx->options->preload_pcap = true;
+
+    return 0;
+}
+
+/**
+ * \brief Set the byte sent in place of payloads not preloaded
+ */
+int
+tcpreplay_set_payload_fill(tcpreplay_t *ctx, u_char value)
+{
+    assert(ctx);
+
+    ctx->options->payload_fill = value;
+    return 0;
+}
+
+/**
+ * \brief Allocate preloaded packets from huge pages
+ *
+ * 'size' is the huge page size in bytes, usually 2MB or 1GB, or 0 to
+ * use regular memory. Forces set_preload_pcap(true) when enabled
+ */
+int
+tcpreplay_set_preload_hugepages(tcpreplay_t *ctx, size_t size)
+{
+    assert(ctx);
+
+    if (size & (size - 1)) {
+        tcpreplay_seterr(ctx, "huge page size must be a power of two: %zu", size);
+        return -1;
+    }
+
+    ctx->options->preload_hugepages = size;
+    if (size)
+        ctx->options->preload_pcap = true;
+    return 0;
+}
+
+/**
+ * \brief Pin tcpreplay to a list of CPUs, e.g. "2,4-6"
+ *
+ * The sending thread is pinned to the first CPU of the list and helper
+ * threads to the rest. Takes effect in tcpreplay_apply_affinity()
+ */
+int
+tcpreplay_set_cpu_affinity(tcpreplay_t *ctx, char *value)
+{
+    assert(ctx);
+    assert(value);
+
+    safe_free(ctx->options->cpu_affinity);
+    ctx->options->cpu_affinity = safe_strdup(value);
+    return 0;
+}
+
+/**
+ * \brief Bind memory to a NUMA node
+ *
+ * 'node' is the node number, or -1 for the node of intf1.
+ * Takes effect in tcpreplay_apply_affinity()
+ */
+int
+tcpreplay_set_numa_node(tcpreplay_t *ctx, int node)
+{
+    assert(ctx);
+
+    if (node < -1) {
+        tcpreplay_seterr(ctx, "invalid NUMA node: %d", node);
+        return -1;
+    }
+
+    ctx->options->numa_bind = true;
+    ctx->options->numa_node = node;
+    return 0;
+}
+
+/**
+ * \brief Lock preloaded packets in memory before replaying
+ *
+ * Forces set_preload_pcap(true) when enabled
+ */
+int
+tcpreplay_set_preload_mlock(tcpreplay_t *ctx, bool value)
+{
+    assert(ctx);
+    ctx->options->preload_mlock = value;
+    if (value)
+        ctx->options->preload_pcap = true;
+    return 0;
+}
+
+/**
+ * grows the source and file cache lists to hold at least 'cnt' entries,
+ * zeroing the new ones
+ */
+static void
+sources_reserve(tcpreplay_t *ctx, int cnt)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    int alloc = options->source_alloc;
+
+    if (cnt <= alloc)
+        return;
+
+    while (alloc < cnt)
+        alloc = alloc ? alloc * 2 : 16;
+
+    options->sources = safe_realloc(options->sources, sizeof(tcpreplay_source_t) * alloc);
+    options->file_cache = safe_realloc(options->file_cache, sizeof(file_cache_t) * alloc);
+    memset(&options->sources[options->source_alloc], 0,
+            sizeof(tcpreplay_source_t) * (alloc - options->source_alloc));
+    memset(&options->file_cache[options->source_alloc], 0,
+            sizeof(file_cache_t) * (alloc - options->source_alloc));
+    options->source_alloc = alloc;
+}
+
+/**
+ * \brief Add a pcap file to be sent via tcpreplay
+ *
+ * One or more pcap files can be added.  Each file will be replayed
+ * in order
+ */
+int
+tcpreplay_add_pcapfile(tcpreplay_t *ctx, char *pcap_file)
+{
+    int idx;
+
+    assert(ctx);
+    assert(pcap_file);
+
+    idx = ctx->options->source_cnt;
+    sources_reserve(ctx, idx + 1);
+
+    ctx->options->sources[idx].filename = safe_strdup(pcap_file);
+    ctx->options->sources[idx].type = source_filename;
+
+    /*
+     * prepare the cache info data struct.  This doesn't actually enable
+     * file caching for this pcap (that is controlled globally via
+     * tcpreplay_set_file_cache())
+     */
+    memset(&ctx->options->file_cache[idx], 0, sizeof(file_cache_t));
+    ctx->options->file_cache[idx].index = idx;
+
+    ctx->options->source_cnt += 1;
+    return 0;
+}
+
+/**
+ * orders file names the way rotated captures are numbered, comparing
+ * runs of digits by value so that "x.pcap9" comes before "x.pcap10"
+ */
+static int
+pcapname_cmp(const void *a, const void *b)
+{
+    const char *p = *(const char * const *)a;
+    const char *q = *(const char * const *)b;
+    const char *ep, *eq;
+    size_t lp, lq;
+    int c;
+
+    while (*p && *q) {
+        if (isdigit((u_char)*p) && isdigit((u_char)*q)) {
+            while (*p == '0' && isdigit((u_char)p[1]))
+                p++;
+            while (*q == '0' && isdigit((u_char)q[1]))
+                q++;
+            for (ep = p; isdigit((u_char)*ep); ep++);
+            for (eq = q; isdigit((u_char)*eq); eq++);
+
+            lp = ep - p;
+            lq = eq - q;
+            if (lp != lq)
+                return lp < lq ? -1 : 1;
+            if ((c = strncmp(p, q, lp)) != 0)
+                return c;
+            p = ep;
+            q = eq;
+            continue;
+        }
+
+        if (*p != *q)
+            return (u_char)*p - (u_char)*q;
+        p++;
+        q++;
+    }
+
+    return (u_char)*p - (u_char)*q;
+}
+
+/**
+ * \brief Add every capture file in a directory
+ *
+ * Files are added in name order, with numbers compared by value so
+ * rotated captures are replayed in sequence. Hidden files and capture
+ * indexes are left out.
+ */
+int
+tcpreplay_add_pcapdir(tcpreplay_t *ctx, const char *dir)
+{
+    DIR *dp;
+    struct dirent *de;
+    struct stat st;
+    char **names = NULL;
+    size_t cnt = 0, alloc = 0, i, len;
+    size_t suffix = strlen(CAPINDEX_SUFFIX);
+    char *path;
+    int ret = 0;
+
+    assert(ctx);
+    assert(dir);
+
+    if ((dp = opendir(dir)) == NULL) {
+        tcpreplay_seterr(ctx, "Unable to open directory %s: %s", dir, strerror(errno));
+        return -1;
+    }
+
+    while ((de = readdir(dp)) != NULL) {
+        len = strlen(de->d_name);
+        if (de->d_name[0] == '.' ||
+                (len > suffix && strcmp(de->d_name + len - suffix, CAPINDEX_SUFFIX) == 0))
+            continue;
+
+        path = safe_malloc(strlen(dir) + len + 2);
+        sprintf(path, "%s/%s", dir, de->d_name);
+        if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+            safe_free(path);
+            continue;
+        }
+
+        if (cnt == alloc) {
+            alloc = alloc ? alloc * 2 : 64;
+            names = safe_realloc(names, sizeof(char *) * alloc);
+        }
+        names[cnt++] = path;
+    }
+    closedir(dp);
+
+    if (cnt == 0) {
+        tcpreplay_seterr(ctx, "No capture files in directory %s", dir);
+        ret = -1;
+    }
+
+    qsort(names, cnt, sizeof(char *), pcapname_cmp);
+    for (i = 0; i < cnt; i++) {
+        if (ret == 0)
+            ret = tcpreplay_add_pcapfile(ctx, names[i]);
+        safe_free(names[i]);
+    }
+    safe_free(names);
+
+    return ret;
+}
+
+/**
+ * \brief Add the capture files listed in a manifest, one per line
+ *
+ * Blank lines and lines starting with '#' are skipped. Relative paths
+ * are taken from the directory of the manifest.
+ */
+int
+tcpreplay_add_manifest(tcpreplay_t *ctx, const char *manifest)
+{
+    FILE *fp;
+    char *line = NULL, *p, *path;
+    const char *slash;
+    size_t line_size = 0, dirlen, len;
+    int ret = 0;
+
+    assert(ctx);
+    assert(manifest);
+
+    if ((fp = fopen(manifest, "r")) == NULL) {
+        tcpreplay_seterr(ctx, "Unable to open manifest %s: %s", manifest, strerror(errno));
+        return -1;
+    }
+
+    slash = strrchr(manifest, '/');
+    dirlen = slash ? (size_t)(slash - manifest) + 1 : 0;
+
+    while (ret == 0 && getline(&line, &line_size, fp) != -1) {
+        for (p = line; isspace((u_char)*p); p++);
+        len = strlen(p);
+        while (len > 0 && isspace((u_char)p[len - 1]))
+            p[--len] = '\0';
+
+        if (len == 0 || *p == '#')
+            continue;
+
+        if (*p == '/' || dirlen == 0) {
+            ret = tcpreplay_add_pcapfile(ctx, p);
+        } else {
+            path = safe_malloc(dirlen + len + 1);
+            memcpy(path, manifest, dirlen);
+            memcpy(path + dirlen, p, len + 1);
+            ret = tcpreplay_add_pcapfile(ctx, path);
+            safe_free(path);
+        }
+    }
+
+    if (ret == 0 && ferror(fp)) {
+        tcpreplay_seterr(ctx, "Unable to read manifest %s: %s", manifest, strerror(errno));
+        ret = -1;
+    }
+
+    free(line);
+    fclose(fp);
+    return ret;
+}
+
+/**
+ * Limit the total number of packets to send
+ */
+int
+tcpreplay_set_limit_send(tcpreplay_t *ctx, COUNTER value)
+{
+    assert(ctx);
+    ctx->options->limit_send = value;
+    return 0;
+}
+
+/**
+ * \brief Specify the tcpprep cache file to use for replaying with two NICs
+ *
+ * Note: this only works if you have a single pcap file
+ * returns -1 on error
+ */
+int
+tcpreplay_set_tcpprep_cache(tcpreplay_t *ctx, char *file)
+{
+    assert(ctx);
+    char *tcpprep_file;
+
+    if (ctx->options->source_cnt > 1) {
         tcpreplay_seterr(ctx, "%s", "Unable to use tcpprep cache file with a single pcap file");
         return -1;
     }
@@ -1007,6 +1922,208 @@ tcpreplay_setwarn(tcpreplay_t *ctx, const char *fmt, ...)
 }
 
 
+#ifdef HAVE_SCHED_SETAFFINITY
+/**
+ * parse a list of CPUs like "0,2-3" into a cpu_set_t
+ */
+static int
+cpu_list_to_set(const char *cpus, cpu_set_t *set)
+{
+    tcpr_list_t *list = NULL, *l;
+    char *copy = safe_strdup(cpus);
+    COUNTER cpu;
+    int ret = -1;
+
+    CPU_ZERO(set);
+    if (parse_list(&list, copy)) {
+        ret = 0;
+        for (l = list; l != NULL; l = l->next) {
+            if (l->max < l->min || l->max >= CPU_SETSIZE) {
+                ret = -1;
+                break;
+            }
+            for (cpu = l->min; cpu <= l->max; cpu++)
+                CPU_SET((int)cpu, set);
+        }
+    }
+
+    free_list(list);
+    safe_free(copy);
+    return CPU_COUNT(set) ? ret : -1;
+}
+
+/**
+ * get the CPUs local to a NUMA node from sysfs
+ */
+static int
+numa_node_cpus(int node, cpu_set_t *set)
+{
+    char path[128], buf[1024];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    if ((f = fopen(path, "r")) == NULL)
+        return -1;
+
+    if (fgets(buf, sizeof(buf), f) == NULL) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    buf[strcspn(buf, "\n")] = '\0';
+    return cpu_list_to_set(buf, set);
+}
+
+/**
+ * prefer allocating memory from the given NUMA node
+ */
+static int
+numa_set_preferred(int node)
+{
+#ifdef SYS_set_mempolicy
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED  1
+#endif
+    unsigned long mask[16];
+    const size_t bits = sizeof(unsigned long) * 8;
+
+    if (node < 0 || (size_t)node >= sizeof(mask) * 8) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(mask, 0, sizeof(mask));
+    mask[node / bits] = 1UL << (node % bits);
+
+    /* the kernel expects one more than the number of bits */
+    return syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8 + 1);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+#endif /* HAVE_SCHED_SETAFFINITY */
+
+/**
+ * \brief Pin tcpreplay to CPUs and bind memory to a NUMA node
+ *
+ * Applies tcpreplay_set_cpu_affinity() and tcpreplay_set_numa_node().
+ * Must be called from the thread which will call tcpreplay_replay(),
+ * after the interfaces are opened and before the pcaps are preloaded
+ * so that the packet cache is allocated on the right node.
+ * Until tcpreplay_replay() moves it to the sending CPU, this thread
+ * runs on the helper CPUs like the threads it starts, which pin
+ * themselves with tcpreplay_pin_helper().
+ * tcpreplay_prepare() calls it. Returns 0 on success, -1 on error.
+ */
+int
+tcpreplay_apply_affinity(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options;
+#ifdef HAVE_SCHED_SETAFFINITY
+    cpu_set_t send_cpus, helper_cpus;
+    int node = -1;
+    int cpu, i;
+#endif
+
+    assert(ctx);
+    options = ctx->options;
+
+#ifdef HAVE_SCHED_SETAFFINITY
+    if (options->numa_bind) {
+        node = options->numa_node;
+        if (node < 0 && ctx->intf1 != NULL)
+            node = sendpacket_get_numa_node(ctx->intf1);
+
+        if (node < 0) {
+            warnx("Unable to find the NUMA node of %s, not binding memory",
+                    options->intf1_name);
+        } else if (numa_set_preferred(node) < 0) {
+            warnx("Unable to bind memory to NUMA node %d: %s", node, strerror(errno));
+        } else {
+            dbgx(1, "Binding memory to NUMA node %d", node);
+        }
+    }
+
+    if (options->cpu_affinity != NULL) {
+        if (cpu_list_to_set(options->cpu_affinity, &helper_cpus) < 0) {
+            tcpreplay_seterr(ctx, "Invalid CPU list: %s", options->cpu_affinity);
+            return -1;
+        }
+
+        /* send on the first CPU, leave the rest to helper threads */
+        for (cpu = 0; !CPU_ISSET(cpu, &helper_cpus); cpu++)
+            ;
+        CPU_ZERO(&send_cpus);
+        CPU_SET(cpu, &send_cpus);
+        if (CPU_COUNT(&helper_cpus) > 1)
+            CPU_CLR(cpu, &helper_cpus);
+    } else if (node >= 0 && numa_node_cpus(node, &send_cpus) == 0) {
+        memcpy(&helper_cpus, &send_cpus, sizeof(helper_cpus));
+    } else {
+        return 0;
+    }
+
+    if (sched_setaffinity(0, sizeof(helper_cpus), &helper_cpus) < 0) {
+        tcpreplay_seterr(ctx, "Unable to set CPU affinity: %s", strerror(errno));
+        return -1;
+    }
+
+    tcpreplay_set_helper_cpus(sizeof(helper_cpus), &helper_cpus);
+
+    /* the sender moves to its own CPU once everything else is ready */
+    safe_free(ctx->send_cpus);
+    ctx->send_cpus = safe_malloc(sizeof(send_cpus));
+    memcpy(ctx->send_cpus, &send_cpus, sizeof(send_cpus));
+
+    if (ctx->intf1 != NULL &&
+            sendpacket_set_affinity(ctx->intf1, sizeof(helper_cpus), &helper_cpus) < 0)
+        warnx("%s", sendpacket_geterr(ctx->intf1));
+
+    if (ctx->intf2 != NULL &&
+            sendpacket_set_affinity(ctx->intf2, sizeof(helper_cpus), &helper_cpus) < 0)
+        warnx("%s", sendpacket_geterr(ctx->intf2));
+
+    for (i = 0; i < options->merge_intf_cnt; i++) {
+        if (ctx->merge_intf[i] != NULL &&
+                sendpacket_set_affinity(ctx->merge_intf[i], sizeof(helper_cpus), &helper_cpus) < 0)
+            warnx("%s", sendpacket_geterr(ctx->merge_intf[i]));
+    }
+
+    return 0;
+#else
+    if (options->cpu_affinity != NULL || options->numa_bind) {
+        tcpreplay_seterr(ctx, "%s", "CPU affinity is not supported on this platform");
+        return -1;
+    }
+
+    return 0;
+#endif
+}
+
+/**
+ * pins the calling thread to the CPUs chosen by tcpreplay_apply_affinity(),
+ * once the helper threads and the packet cache are set up
+ */
+static int
+pin_sender(tcpreplay_t *ctx)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+    if (ctx->send_cpus == NULL)
+        return 0;
+
+    if (sched_setaffinity(0, sizeof(cpu_set_t), ctx->send_cpus) < 0) {
+        tcpreplay_seterr(ctx, "Unable to set CPU affinity: %s", strerror(errno));
+        return -1;
+    }
+#else
+    (void)ctx;
+#endif
+
+    return 0;
+}
+
 /**
  * \brief Does all the prep work before calling tcpreplay_replay()
  *
@@ -1055,6 +2172,57 @@ tcpreplay_prepare(tcpreplay_t *ctx)
         }
     }
 
+    if (ctx->options->mergefile && (ctx->options->dualfile || ctx->options->cachedata != NULL)) {
+        tcpreplay_seterr(ctx, "%s", "Can't use merged file mode with dual file mode or a tcpprep cache file");
+        ret = -1;
+        goto out;
+    }
+
+    if (ctx->options->route_by_intf &&
+            (ctx->options->mergefile || ctx->options->dualfile || ctx->options->cachedata != NULL)) {
+        tcpreplay_seterr(ctx, "%s", "Routing by capture interface can't be used with merged or dual files or a tcpprep cache file");
+        ret = -1;
+        goto out;
+    }
+
+    if ((ctx->options->start_packet || ctx->options->start_time_us || ctx->options->end_time_us) &&
+            (ctx->options->mergefile || ctx->options->dualfile)) {
+        tcpreplay_seterr(ctx, "%s", "Replaying part of each file can't be used with merged or dual files");
+        ret = -1;
+        goto out;
+    }
+
+    if (ctx->options->idle_compress &&
+            (!ctx->options->preload_pcap || ctx->options->mergefile || ctx->options->dualfile)) {
+        tcpreplay_seterr(ctx, "%s", "Compressing idle periods requires preloading, and can't be used with merged or dual files");
+        ret = -1;
+        goto out;
+    }
+
+    if (ctx->options->mix) {
+        for (i = 0; i < ctx->options->source_cnt; i++) {
+            if (ctx->options->sources[i].weight == 0) {
+                tcpreplay_seterr(ctx, "No mix weight for source %d", i);
+                ret = -1;
+                goto out;
+            }
+        }
+
+        if (ctx->options->speed.mode != speed_mbpsrate &&
+                ctx->options->speed.mode != speed_packetrate &&
+                ctx->options->speed.mode != speed_topspeed) {
+            tcpreplay_seterr(ctx, "%s", "Mixing files requires a speed mode of Mbps, pps or top speed");
+            ret = -1;
+            goto out;
+        }
+    }
+
+    if (ctx->options->merge_intf_cnt && ctx->options->intf2_name == NULL) {
+        tcpreplay_seterr(ctx, "%s", "merge interfaces require a second interface");
+        ret = -1;
+        goto out;
+    }
+
     if (ctx->options->dualfile && ctx->options->cachedata != NULL) {
         tcpreplay_seterr(ctx, "%s", "Can't use dual file mode and tcpprep cache file together");
         ret = -1;
@@ -1122,23 +2290,51 @@ tcpreplay_prepare(tcpreplay_t *ctx)
         }
     }
 
-    /*
-     * Setup up the file cache, if required
-     */
-    if (ctx->options->preload_pcap) {
-        /* Initialise each of the file cache structures */
-        for (i = 0; i < ctx->options->source_cnt; i++) {
-            ctx->options->file_cache[i].index = i;
-            ctx->options->file_cache[i].cached = FALSE;
-            ctx->options->file_cache[i].packet_cache = NULL;
-        }
+    if (open_merge_intfs(ctx, ebuf) < 0) {
+        ret = -1;
+        goto out;
     }
 
+    if (tcpreplay_apply_affinity(ctx) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    /* load the file cache now, so the first replay isn't slowed by it */
+    if (ctx->options->preload_pcap)
+        preload_sources(ctx);
+
 out:
     safe_free(ebuf);
     return ret;
 }
 
+/**
+ * applies the tuntap queue, offload, SO_TXTIME, io_uring and transmit
+ * timestamp options to an interface
+ */
+static int
+setup_intf(tcpreplay_t *ctx, sendpacket_t *sp)
+{
+    tcpreplay_opt_t *options = ctx->options;
+
+    if (sp == NULL)
+        return 0;
+
+    if ((options->tuntap_queues > 1 && sendpacket_set_queues(sp, options->tuntap_queues) < 0) ||
+            (options->offload && sendpacket_set_offload(sp, options->offload) < 0) ||
+            (options->txtime_lead &&
+             sendpacket_set_txtime(sp, options->txtime_clock) < 0) ||
+            (options->io_uring &&
+             sendpacket_set_uring(sp, options->io_uring, options->io_uring_sqpoll) < 0) ||
+            (options->txstamp && sendpacket_set_txstamp(sp, options->txstamp_hw) < 0)) {
+        tcpreplay_seterr(ctx, "%s", sendpacket_geterr(sp));
+        return -1;
+    }
+
+    return 0;
+}
+
 /**
  * \brief sends the traffic out the interfaces
  *
@@ -1148,7 +2344,10 @@ out:
 int
 tcpreplay_replay(tcpreplay_t *ctx)
 {
-    int rcode;
+    int rcode, i;
+#ifdef HAVE_GETRUSAGE
+    struct rusage ru_start, ru_end;
+#endif
 
     assert(ctx);
 
@@ -1157,32 +2356,68 @@ tcpreplay_replay(tcpreplay_t *ctx)
         return -1;
     }
 
-    if (ctx->options->dualfile && ctx->options->source_cnt < 2) {
-        tcpreplay_seterr(ctx, "invalid dualfile source count: %d", ctx->options->source_cnt);
+    if (ctx->options->dualfile &&
+            (ctx->options->source_cnt < 2 || ctx->options->source_cnt % 2 != 0)) {
+        tcpreplay_seterr(ctx, "dual file mode requires an even number of pcap files, not %d",
+                ctx->options->source_cnt);
+        return -1;
+    }
+
+    if (ctx->options->mergefile && !ctx->options->mix && ctx->options->source_cnt < 2) {
+        tcpreplay_seterr(ctx, "%s", "merged file mode requires at least two pcap files");
+        return -1;
+    }
+
+    if (setup_intf(ctx, ctx->intf1) < 0 || setup_intf(ctx, ctx->intf2) < 0)
         return -1;
+
+    for (i = 0; i < ctx->options->merge_intf_cnt; i++) {
+        if (setup_intf(ctx, ctx->merge_intf[i]) < 0)
+            return -1;
+    }
+
+    /* take any page faults on preloaded packets before the clock starts */
+    if (ctx->options->preload_pcap)
+        preload_cache_prefault(ctx);
+
+    /* and find the idle periods to squeeze out */
+    if (ctx->options->idle_compress) {
+        for (i = 0; i < ctx->options->source_cnt; i++) {
+            if (!ctx->options->file_cache[i].idle_scanned)
+                preload_idle_scan(ctx, i);
+        }
     }
 
+    if (pin_sender(ctx) < 0)
+        return -1;
+
     init_timestamp(&ctx->stats.last_time);
     init_timestamp(&ctx->stats.last_print);
     init_timestamp(&ctx->stats.end_time);
+    ctx->txtime_start = 0;
+
+#ifdef HAVE_GETRUSAGE
+    getrusage(RUSAGE_SELF, &ru_start);
+#endif
 
     if (gettimeofday(&ctx->stats.start_time, NULL) < 0) {
         tcpreplay_seterr(ctx, "gettimeofday() failed: %s",  strerror(errno));
         return -1;
     }
 
-
     ctx->running = true;
 
     /* main loop, when not looping forever (or until abort) */
     if (ctx->options->loop > 0) {
         while (ctx->options->loop-- && !ctx->abort) {  /* limited loop */
+            ctx->more_loops = ctx->options->loop > 0;
             if ((rcode = tcpr_replay_index(ctx)) < 0)
                 return rcode;
             if (ctx->options->loop > 0 && !ctx->abort && ctx->options->loopdelay_ms > 0)
             	usleep(ctx->options->loopdelay_ms * 1000);
         }
     } else {
+        ctx->more_loops = true;
         while (!ctx->abort) { /* loop forever unless user aborts */
             if ((rcode = tcpr_replay_index(ctx)) < 0)
                 return rcode;
@@ -1190,6 +2425,10 @@ tcpreplay_replay(tcpreplay_t *ctx)
     }
 
     ctx->running = false;
+    source_prefetch_cancel(ctx);
+
+    /* wait for packets still queued in io_uring */
+    flush_send_queues(ctx, true);
 
 #ifdef HAVE_QUICK_TX
     /* flush any remaining netmap packets */
@@ -1201,6 +2440,13 @@ tcpreplay_replay(tcpreplay_t *ctx)
            if (gettimeofday(&ctx->stats.end_time, NULL) < 0)
                errx(-1, "gettimeofday() failed: %s",  strerror(errno));
     }
+
+#ifdef HAVE_GETRUSAGE
+    if (getrusage(RUSAGE_SELF, &ru_end) == 0) {
+        ctx->stats.minor_faults = ru_end.ru_minflt - ru_start.ru_minflt;
+        ctx->stats.major_faults = ru_end.ru_majflt - ru_start.ru_majflt;
+    }
+#endif
     return 0;
 }
 
@@ -1214,6 +2460,8 @@ tcpreplay_replay(tcpreplay_t *ctx)
 int
 tcpreplay_abort(tcpreplay_t *ctx)
 {
+    int i;
+
     assert(ctx);
     ctx->abort = true;
 
@@ -1225,6 +2473,11 @@ tcpreplay_abort(tcpreplay_t *ctx)
     if (ctx->intf2 != NULL)
         sendpacket_abort(ctx->intf2);
 
+    for (i = 0; i < ctx->options->merge_intf_cnt; i++) {
+        if (ctx->merge_intf[i] != NULL)
+            sendpacket_abort(ctx->merge_intf[i]);
+    }
+
     return 0;
 }
 
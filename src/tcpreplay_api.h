@@ -42,19 +42,48 @@ extern "C" {
 
 struct tcpreplay_s; /* forward declare */
 
-/* in memory packet cache struct */
+/* in memory packet cache record, followed by the packet data */
 typedef struct packet_cache_s {
     struct pcap_pkthdr pkthdr;
-    u_char *pktdata;
-    struct packet_cache_s *next;
+    uint32_t data_len;              /* bytes of packet data */
+    uint32_t stored_len;            /* bytes stored, less if the payload was elided */
 } packet_cache_t;
 
+/* an idle period of a preloaded file, squeezed out by --idle-compress */
+typedef struct idle_gap_s {
+    COUNTER packetnum;              /* first packet after the gap */
+    COUNTER shift_us;               /* time removed up to this packet */
+} idle_gap_t;
+
 /* packet cache header */
 typedef struct file_cache_s {
     int index;
     int cached;
     int dlt;
-    packet_cache_t *packet_cache;
+    packet_cache_t *packet_cache;   /* packet records, see preload.h */
+    size_t cache_len;               /* bytes of packet records */
+    size_t cache_size;              /* bytes allocated */
+    COUNTER packet_count;
+    packet_meta_t *packet_meta;     /* indexed by packet number - 1 */
+    bool mapped;                    /* cache is part of a replay image */
+    bool readonly;                  /* cache is shared, copy before editing */
+    bool huge;                      /* packet_cache is an anonymous mapping */
+    bool locked;                    /* cache is mlock()ed */
+    size_t huge_page_size;          /* allocate from huge pages, 0 for heap */
+    size_t cache_limit;             /* memory budget, 0 for unlimited */
+    bool partial;                   /* only the head of the file is cached */
+    bool deduped;                   /* packets share data, copy before editing */
+    bool stream_counted;            /* flows of the streamed part counted */
+    off_t stream_offset;            /* file offset of the first packet not cached */
+    COUNTER seek_packetnum;         /* packets passed over by seeking with the index */
+    COUNTER first_ts_us;            /* of the first packet, if seeked past it */
+    bool index_warned;              /* told that the index can't be used */
+    u_char *scratch;                /* copy of the current packet if readonly or elided */
+    uint32_t scratch_len;
+    uint32_t scratch_dirty;         /* bytes of scratch not holding payload fill */
+    idle_gap_t *idle_gaps;          /* idle periods found by preload_idle_scan() */
+    COUNTER idle_gap_cnt;
+    bool idle_scanned;
 } file_cache_t;
 
 /* speed mode selector */
@@ -93,13 +122,19 @@ typedef struct {
     tcpreplay_source_type type;
     int fd;
     char *filename;
+    uint32_t weight;                /* share of a traffic mix */
 } tcpreplay_source_t;
 
+/* interfaces after intf1 and intf2 when merging files */
+#define MAX_MERGE_INTF 14
+
 /* run-time options */
 typedef struct tcpreplay_opt_s {
     /* input/output */
     char *intf1_name;
     char *intf2_name;
+    char *merge_intf_names[MAX_MERGE_INTF];
+    int merge_intf_cnt;
 
     tcpreplay_speed_t speed;
     u_int32_t loop;
@@ -123,16 +158,37 @@ typedef struct tcpreplay_opt_s {
     COUNTER limit_send;
     COUNTER limit_time;
 
+    /* part of each file to send, 0 for the whole file */
+    COUNTER start_packet;
+    COUNTER start_time_us;          /* after the first packet of the file */
+    COUNTER end_time_us;
+
     /* maximum sleep time between packets */
     struct timespec maxsleep;
 
-    /* pcap file caching */
-    file_cache_t file_cache[MAX_FILES];
+    /* pcap file caching, one per source */
+    file_cache_t *file_cache;
     bool preload_pcap;
+    char *preload_image;
+    char *preload_shared;
+    int preload_threads;            /* 0 for one per CPU */
+    size_t preload_limit;           /* bytes, 0 for unlimited */
+    int direct_io;                  /* O_DIRECT buffers, 0 for page cache */
+    bool preload_headers;           /* store headers only */
+    bool preload_dedup;             /* share data between packets */
+    u_char payload_fill;            /* byte sent in place of elided payloads */
+    size_t preload_hugepages;       /* huge page size, 0 for none */
+    bool preload_mlock;
+
+    /* CPU and NUMA placement */
+    char *cpu_affinity;             /* list of CPUs, first one sends */
+    bool numa_bind;
+    int numa_node;                  /* -1 for the node of intf1 */
 
     /* pcap files/sources to replay */
     int source_cnt;
-    tcpreplay_source_t sources[MAX_FILES];
+    int source_alloc;
+    tcpreplay_source_t *sources;
 
 #ifdef ENABLE_VERBOSE
     /* tcpdump verbose printing */
@@ -144,6 +200,15 @@ typedef struct tcpreplay_opt_s {
     /* dual file mode */
     bool dualfile;
 
+    /* replay all files at once, merged by timestamp */
+    bool mergefile;
+
+    /* merge files by weight rather than timestamp, looping each one */
+    bool mix;
+
+    /* send packets out of the interface matching their pcapng interface */
+    bool route_by_intf;
+
 #ifdef HAVE_NETMAP
     int netmap;
     int netmap_delay;
@@ -153,11 +218,34 @@ typedef struct tcpreplay_opt_s {
     int quick_tx;
 #endif
 
+    /* tuntap queues and kernel offloads */
+    int tuntap_queues;              /* 0 for a single queue */
+    int offload;                    /* VNET_OFFLOAD_* */
+
+    /* io_uring buffers, 0 for a syscall per packet */
+    unsigned int io_uring;
+    bool io_uring_sqpoll;
+
+    /* usec packets are handed to SO_TXTIME early, 0 to sleep instead */
+    uint32_t txtime_lead;
+    clockid_t txtime_clock;
+
+    /* measure departure times with transmit timestamps */
+    bool txstamp;
+    bool txstamp_hw;
+
     /* print flow statistic */
     bool flow_stats;
     int flow_expiry;
 
     int unique_ip;
+
+    /* number of address shifted copies of each packet to send */
+    uint32_t flow_multiplier;
+
+    /* shorten gaps with no active flow to this many microseconds */
+    bool idle_compress;
+    COUNTER idle_compress_us;
 } tcpreplay_opt_t;
 
 
@@ -176,6 +264,7 @@ typedef struct tcpreplay_s {
     sendpacket_t *intf2;
     int intf1dlt;
     int intf2dlt;
+    sendpacket_t *merge_intf[MAX_MERGE_INTF];
     COUNTER iteration;
     sendpacket_type_t sp_type;
     char errstr[TCPREPLAY_ERRSTR_LEN];
@@ -190,6 +279,10 @@ typedef struct tcpreplay_s {
     uint32_t skip_packets;
     bool first_time;
 
+    /* SO_TXTIME send times, in ns of options->txtime_clock */
+    uint64_t txtime_start;
+    uint64_t txtime_last;
+
     /* counter stats */
     tcpreplay_stats_t stats;
     tcpreplay_stats_t static_stats; /* stats returned by tcpreplay_get_stats() */
@@ -197,6 +290,17 @@ typedef struct tcpreplay_s {
     /* flow statistics */
     flow_hash_table_t *flow_hash_table;
 
+    /* mapped replay image */
+    void *image;
+    size_t image_len;
+
+    /* next file being opened while this one is sent, see send_packets.c */
+    struct source_prefetch_s *prefetch;
+    bool more_loops;                /* the sources are replayed again after this pass */
+
+    /* cpu_set_t of the sending thread, see tcpreplay_apply_affinity() */
+    void *send_cpus;
+
     /* abort, suspend & running flags */
     volatile bool abort;
     volatile bool suspend;
@@ -234,16 +338,43 @@ int tcpreplay_set_speed_speed(tcpreplay_t *, COUNTER);
 int tcpreplay_set_speed_pps_multi(tcpreplay_t *, int);
 int tcpreplay_set_loop(tcpreplay_t *, u_int32_t);
 int tcpreplay_set_unique_ip(tcpreplay_t *, int);
+int tcpreplay_set_flow_multiplier(tcpreplay_t *, uint32_t);
+int tcpreplay_set_idle_compress(tcpreplay_t *, bool, COUNTER);
 int tcpreplay_set_quick_tx(tcpreplay_t *, bool);
 int tcpreplay_set_netmap(tcpreplay_t *, bool);
+int tcpreplay_set_tuntap_queues(tcpreplay_t *, int);
+int tcpreplay_set_offload(tcpreplay_t *, int);
+int tcpreplay_set_io_uring(tcpreplay_t *, unsigned int, bool);
+int tcpreplay_set_txtime(tcpreplay_t *, uint32_t, clockid_t);
+int tcpreplay_set_txstamp(tcpreplay_t *, bool, bool);
 int tcpreplay_set_use_pkthdr_len(tcpreplay_t *, bool);
 int tcpreplay_set_mtu(tcpreplay_t *, int);
 int tcpreplay_set_accurate(tcpreplay_t *, tcpreplay_accurate);
 int tcpreplay_set_limit_send(tcpreplay_t *, COUNTER);
+int tcpreplay_set_window(tcpreplay_t *, COUNTER, COUNTER, COUNTER);
 int tcpreplay_set_dualfile(tcpreplay_t *, bool);
+int tcpreplay_set_mergefile(tcpreplay_t *, bool);
+int tcpreplay_add_merge_intf(tcpreplay_t *, char *);
+int tcpreplay_set_route_by_intf(tcpreplay_t *, bool);
+int tcpreplay_set_mix_weight(tcpreplay_t *, int, uint32_t);
 int tcpreplay_set_tcpprep_cache(tcpreplay_t *, char *);
 int tcpreplay_add_pcapfile(tcpreplay_t *, char *);
+int tcpreplay_add_pcapdir(tcpreplay_t *, const char *);
+int tcpreplay_add_manifest(tcpreplay_t *, const char *);
 int tcpreplay_set_preload_pcap(tcpreplay_t *, bool);
+int tcpreplay_set_preload_image(tcpreplay_t *, char *);
+int tcpreplay_set_preload_shared(tcpreplay_t *, char *);
+int tcpreplay_set_preload_threads(tcpreplay_t *, int);
+int tcpreplay_set_direct_io(tcpreplay_t *, int);
+int tcpreplay_set_preload_limit(tcpreplay_t *, size_t);
+int tcpreplay_set_preload_headers(tcpreplay_t *, bool);
+int tcpreplay_set_preload_dedup(tcpreplay_t *, bool);
+int tcpreplay_set_payload_fill(tcpreplay_t *, u_char);
+int tcpreplay_set_preload_hugepages(tcpreplay_t *, size_t);
+int tcpreplay_set_preload_mlock(tcpreplay_t *, bool);
+int tcpreplay_set_cpu_affinity(tcpreplay_t *, char *);
+int tcpreplay_set_numa_node(tcpreplay_t *, int);
+int tcpreplay_apply_affinity(tcpreplay_t *);
 
 /* information */
 int tcpreplay_get_source_count(tcpreplay_t *);